@@ -198,7 +198,16 @@ class uLCD_4DGL : public Stream
 {
 
 public:
-    uLCD_4DGL(PinName tx, PinName rx, PinName rst);
+    /** Create the screen object
+    *
+    * @param tx, rx serial pins of the screen
+    * @param rst reset pin of the screen
+    * @param start reset and set up the screen now, otherwise call begin() later
+    */
+    uLCD_4DGL(PinName tx, PinName rx, PinName rst, bool start = true);
+
+    /** Reset the screen and set the initial font and cursor (blocks over 3s) */
+    void begin();
 
     // General Commands *******************************************************************************
 
@@ -25,7 +25,7 @@
 //Serial pc(USBTX,USBRX);
 
 //******************************************************************************************************
-uLCD_4DGL ::uLCD_4DGL(PinName tx, PinName rx, PinName rst) : _cmd(tx, rx),
+uLCD_4DGL ::uLCD_4DGL(PinName tx, PinName rx, PinName rst, bool start) : _cmd(tx, rx),
                                                              _rst(rst)
 #if DEBUGMODE
                                                              ,
@@ -44,6 +44,13 @@ uLCD_4DGL ::uLCD_4DGL(PinName tx, PinName rx, PinName rst) : _cmd(tx, rx),
 #endif
 
     _rst = 1; // put RESET pin to high to start TFT screen
+    if (start)
+        begin();
+}
+
+//******************************************************************************************************
+void uLCD_4DGL ::begin() // reset and set up the screen, takes over 3s
+{
     reset();
     cls();                             // clear screen
     current_col = 0;                   // initial cursor col
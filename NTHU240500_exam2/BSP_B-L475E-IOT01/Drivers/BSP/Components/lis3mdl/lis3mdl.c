@@ -181,6 +181,26 @@ void LIS3MDL_MagReadXYZ(int16_t* pData)
   }
 }
 
+/**
+  * @brief  Read raw X, Y & Z magnetic field values in a single burst.
+  *         Unlike LIS3MDL_MagReadXYZ, CTRL_REG2 is not re-read, so the caller
+  *         applies the sensitivity of the full scale it configured.
+  * @param  pData: Data out pointer, 3 raw LSB values
+  */
+void LIS3MDL_MagReadRaw(int16_t* pData)
+{
+  uint8_t buffer[6];
+  uint8_t i = 0;
+  
+  /* Read output register X, Y & Z magnetic field */
+  SENSOR_IO_ReadMultiple(LIS3MDL_MAG_I2C_ADDRESS_HIGH, (LIS3MDL_MAG_OUTX_L | 0x80), buffer, 6);
+  
+  for(i=0; i<3; i++)
+  {
+    pData[i]=( int16_t )((((uint16_t)buffer[2*i+1]) << 8) + (uint16_t)buffer[2*i]);
+  }
+}
+
 
 /**
   * @}
@@ -164,6 +164,7 @@ void LIS3MDL_MagDeInit(void);
 uint8_t LIS3MDL_MagReadID(void);
 void LIS3MDL_MagLowPower(uint16_t status);
 void LIS3MDL_MagReadXYZ(int16_t* pData);
+void LIS3MDL_MagReadRaw(int16_t* pData);
 
 /**
   * @}
@@ -356,6 +356,156 @@ void LSM6DSL_GyroReadXYZAngRate(float *pfData)
   }
 }
 
+/**
+  * @}
+  */ 
+
+/** @defgroup LSM6DSL_AccGyro_Private_Functions LSM6DSL ACC GYRO Private Functions
+  * @{
+  */
+
+/**
+  * @brief  Read raw gyro and accelerometer outputs in a single burst.
+  *         OUTX_L_G..OUTZ_H_XL are contiguous, so with IF_INC set (done by
+  *         LSM6DSL_AccInit/LSM6DSL_GyroInit) one transaction fetches both.
+  * @param  pData: Data out pointer, 6 raw LSB values
+  *         pData[0..2] = gyro X, Y, Z  pData[3..5] = accelero X, Y, Z
+  */
+void LSM6DSL_AccGyroReadRaw(int16_t* pData)
+{
+  uint8_t buffer[12];
+  uint8_t i = 0;
+
+  /* Read output register X, Y & Z angular rate then X, Y & Z acceleration */
+  SENSOR_IO_ReadMultiple(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_OUTX_L_G, buffer, 12);
+
+  for(i=0; i<6; i++)
+  {
+    pData[i]=( int16_t )((((uint16_t)buffer[2*i+1]) << 8) + (uint16_t)buffer[2*i]);
+  }
+}
+
+/**
+  * @brief  Set the same output data rate for accelerometer and gyroscope,
+  *         so burst reads return samples taken at the same instant.
+  * @param  odr: one of LSM6DSL_ODR_xxx, LSM6DSL_ODR_POWER_DOWN stops both
+  */
+void LSM6DSL_AccGyroSetOdr(uint8_t odr)
+{
+  uint8_t ctrl = 0x00;
+
+  /* Accelerometer: keep full scale and filter bandwidth */
+  ctrl = SENSOR_IO_Read(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_CTRL1_XL);
+  ctrl &= ~(LSM6DSL_ODR_BITPOSITION);
+  ctrl |= (odr & LSM6DSL_ODR_BITPOSITION);
+  SENSOR_IO_Write(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_CTRL1_XL, ctrl);
+
+  /* Gyroscope: keep full scale */
+  ctrl = SENSOR_IO_Read(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_CTRL2_G);
+  ctrl &= ~(LSM6DSL_ODR_BITPOSITION);
+  ctrl |= (odr & LSM6DSL_ODR_BITPOSITION);
+  SENSOR_IO_Write(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_CTRL2_G, ctrl);
+}
+
+/**
+  * @brief  Route embedded event detection to INT1 (latched until read).
+  *         The accelerometer must run at 26 Hz or more for the tilt function.
+  * @param  events: mask of LSM6DSL_EVENT_WAKE_UP, LSM6DSL_EVENT_6D, LSM6DSL_EVENT_TILT
+  * @param  wake_ths: wake-up threshold in 1/64 of the full scale (31.25 mg at 2 g)
+  * @param  sixd_ths: one of LSM6DSL_6D_THS_xxDEG
+  */
+void LSM6DSL_AccEnableEvents(uint8_t events, uint8_t wake_ths, uint8_t sixd_ths)
+{
+  uint8_t ctrl = 0x00;
+  uint8_t route = 0x00;
+
+  /* Wake-up on the slope of any axis, after one sample above threshold */
+  if(events & LSM6DSL_EVENT_WAKE_UP)
+  {
+    ctrl = SENSOR_IO_Read(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_WAKE_UP_THS);
+    ctrl &= ~(LSM6DSL_WAKE_UP_THS_MASK);
+    ctrl |= (wake_ths & LSM6DSL_WAKE_UP_THS_MASK);
+    SENSOR_IO_Write(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_WAKE_UP_THS, ctrl);
+    SENSOR_IO_Write(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_WAKE_UP_DUR, 0x00);
+    route |= LSM6DSL_MD1_CFG_INT1_WU;
+  }
+
+  /* 6D orientation */
+  if(events & LSM6DSL_EVENT_6D)
+  {
+    ctrl = SENSOR_IO_Read(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_TAP_THS_6D);
+    ctrl &= ~(LSM6DSL_6D_THS_MASK);
+    ctrl |= (sixd_ths & LSM6DSL_6D_THS_MASK);
+    SENSOR_IO_Write(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_TAP_THS_6D, ctrl);
+    route |= LSM6DSL_MD1_CFG_INT1_6D;
+  }
+
+  /* Embedded tilt function */
+  if(events & LSM6DSL_EVENT_TILT)
+  {
+    ctrl = SENSOR_IO_Read(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_CTRL10_C);
+    ctrl |= (LSM6DSL_CTRL10_C_FUNC_EN | LSM6DSL_CTRL10_C_TILT_EN);
+    SENSOR_IO_Write(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_CTRL10_C, ctrl);
+    route |= LSM6DSL_MD1_CFG_INT1_TILT;
+  }
+
+  /* Enable the basic interrupts with latched sources */
+  ctrl = SENSOR_IO_Read(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_TAP_CFG1);
+  ctrl |= (LSM6DSL_TAP_CFG_INTERRUPTS_ENABLE | LSM6DSL_TAP_CFG_LIR);
+  SENSOR_IO_Write(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_TAP_CFG1, ctrl);
+
+  /* Clear stale sources, then route to INT1 */
+  LSM6DSL_AccReadEvents();
+  ctrl = SENSOR_IO_Read(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_MD1_CFG);
+  ctrl |= route;
+  SENSOR_IO_Write(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_MD1_CFG, ctrl);
+}
+
+/**
+  * @brief  Stop routing the embedded events to INT1 and disable them.
+  */
+void LSM6DSL_AccDisableEvents(void)
+{
+  uint8_t ctrl = 0x00;
+
+  ctrl = SENSOR_IO_Read(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_MD1_CFG);
+  ctrl &= ~(LSM6DSL_MD1_CFG_INT1_WU | LSM6DSL_MD1_CFG_INT1_6D | LSM6DSL_MD1_CFG_INT1_TILT);
+  SENSOR_IO_Write(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_MD1_CFG, ctrl);
+
+  ctrl = SENSOR_IO_Read(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_CTRL10_C);
+  ctrl &= ~(LSM6DSL_CTRL10_C_TILT_EN);
+  SENSOR_IO_Write(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_CTRL10_C, ctrl);
+
+  ctrl = SENSOR_IO_Read(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_TAP_CFG1);
+  ctrl &= ~(LSM6DSL_TAP_CFG_INTERRUPTS_ENABLE | LSM6DSL_TAP_CFG_LIR);
+  SENSOR_IO_Write(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_TAP_CFG1, ctrl);
+
+  LSM6DSL_AccReadEvents();
+}
+
+/**
+  * @brief  Read (and so clear) the latched event sources.
+  * @retval Mask of LSM6DSL_EVENT_WAKE_UP, LSM6DSL_EVENT_6D, LSM6DSL_EVENT_TILT
+  */
+uint8_t LSM6DSL_AccReadEvents(void)
+{
+  uint8_t events = 0x00;
+
+  if(SENSOR_IO_Read(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_WAKE_UP_SRC) & LSM6DSL_WAKE_UP_SRC_WU_IA)
+  {
+    events |= LSM6DSL_EVENT_WAKE_UP;
+  }
+  if(SENSOR_IO_Read(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_D6D_SRC) & LSM6DSL_D6D_SRC_D6D_IA)
+  {
+    events |= LSM6DSL_EVENT_6D;
+  }
+  if(SENSOR_IO_Read(LSM6DSL_ACC_GYRO_I2C_ADDRESS_LOW, LSM6DSL_ACC_GYRO_FUNC_SRC) & LSM6DSL_FUNC_SRC_TILT_IA)
+  {
+    events |= LSM6DSL_EVENT_TILT;
+  }
+  return events;
+}
+
 /**
   * @}
   */ 
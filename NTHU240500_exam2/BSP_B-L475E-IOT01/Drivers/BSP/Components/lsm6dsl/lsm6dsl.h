@@ -246,6 +246,33 @@ extern "C" {
 /* Auto-increment */
 #define LSM6DSL_ACC_GYRO_IF_INC_DISABLED    ((uint8_t)0x00)
 #define LSM6DSL_ACC_GYRO_IF_INC_ENABLED     ((uint8_t)0x04)
+
+/* Embedded event detection, LSM6DSL_AccEnableEvents/LSM6DSL_AccReadEvents */
+#define LSM6DSL_EVENT_WAKE_UP               ((uint8_t)0x01) /* slope above the wake-up threshold */
+#define LSM6DSL_EVENT_6D                    ((uint8_t)0x02) /* 6D orientation change */
+#define LSM6DSL_EVENT_TILT                  ((uint8_t)0x04) /* embedded tilt, 35 deg from the start position */
+
+/* Wake-up threshold, WK_THS[5:0] in 1/64 of the full scale */
+#define LSM6DSL_WAKE_UP_THS_MASK            ((uint8_t)0x3F)
+
+/* 6D threshold, SIXD_THS[6:5] of TAP_THS_6D */
+#define LSM6DSL_6D_THS_80DEG                ((uint8_t)0x00)
+#define LSM6DSL_6D_THS_70DEG                ((uint8_t)0x20)
+#define LSM6DSL_6D_THS_60DEG                ((uint8_t)0x40)
+#define LSM6DSL_6D_THS_50DEG                ((uint8_t)0x60)
+#define LSM6DSL_6D_THS_MASK                 ((uint8_t)0x60)
+
+/* Event routing and source bits */
+#define LSM6DSL_TAP_CFG_INTERRUPTS_ENABLE   ((uint8_t)0x80)
+#define LSM6DSL_TAP_CFG_LIR                 ((uint8_t)0x01)
+#define LSM6DSL_MD1_CFG_INT1_TILT           ((uint8_t)0x02)
+#define LSM6DSL_MD1_CFG_INT1_6D             ((uint8_t)0x04)
+#define LSM6DSL_MD1_CFG_INT1_WU             ((uint8_t)0x20)
+#define LSM6DSL_CTRL10_C_FUNC_EN            ((uint8_t)0x04)
+#define LSM6DSL_CTRL10_C_TILT_EN            ((uint8_t)0x08)
+#define LSM6DSL_WAKE_UP_SRC_WU_IA           ((uint8_t)0x08)
+#define LSM6DSL_D6D_SRC_D6D_IA              ((uint8_t)0x40)
+#define LSM6DSL_FUNC_SRC_TILT_IA            ((uint8_t)0x20)
   
 /**
   * @}
@@ -290,6 +317,18 @@ void    LSM6DSL_GyroReadXYZAngRate(float *pfData);
 /* Gyroscope driver structure */
 extern GYRO_DrvTypeDef Lsm6dslGyroDrv;
 
+/**
+  * @}
+  */
+
+/** @defgroup LSM6DSL_AccGyroExported_Functions ACCELEROMETER GYROSCOPE Exported functions
+  * @{
+  */
+void    LSM6DSL_AccGyroReadRaw(int16_t* pData);
+void    LSM6DSL_AccGyroSetOdr(uint8_t odr);
+void    LSM6DSL_AccEnableEvents(uint8_t events, uint8_t wake_ths, uint8_t sixd_ths);
+void    LSM6DSL_AccDisableEvents(void);
+uint8_t LSM6DSL_AccReadEvents(void);
 /**
   * @}
   */
@@ -1,14 +1,20 @@
 #include "accelerometer_handler.h"
 #include "mbed.h"
 #include "stm32l475e_iot01_accelero.h"
+#include "stm32l475e_iot01_gyro.h"
+#include "stm32l475e_iot01_magneto.h"
 
 // Store x, y, z data
 int16_t pDataXYZ[3] = {0};
 
-// A buffer holding the last 200 sets of 3-channel values
-static float save_data[600] = {0.0};
+// The number of frames the ring buffer holds
+constexpr int kRingFrames = 200;
+// A buffer holding the last 200 frames of up to 9-channel values
+static float save_data[kRingFrames * kMaxChannelNumber] = {0.0};
 // Most recent position in the save_data buffer
 int begin_index = 0;
+// Values per frame, one of SensorChannels
+int channel_number = kAccelChannels;
 // True if there is not yet enough data to run inference
 bool pending_initial_data = true;
 // How often we should save a measurement during downsampling
@@ -16,58 +22,254 @@ int sample_every_n = 1;
 // The number of measurements since we last saved one
 int sample_skip_counter = 1;
 
+// Motion segmentation: a segment starts when the smoothed energy of the
+// acceleration minus gravity rises above segment_on_energy [mg^2] and ends
+// after segment_quiet_frames frames below segment_off_energy
+float segment_on_energy = 150.0f * 150.0f;
+float segment_off_energy = 80.0f * 80.0f;
+int segment_quiet_frames = 8;
+int segment_min_frames = 16;
+int segment_max_frames = 150;
+// Frames kept from before the onset
+int segment_preroll_frames = 4;
+
+// Slow estimate of gravity, only tracked while there is no motion
+static float gravity[3] = {0};
+static bool gravity_valid = false;
+// Smoothed motion energy
+static float energy = 0;
+// Frames in the current segment (0 while idle) and quiet frames at its end
+static int segment_frames = 0;
+static int quiet_frames = 0;
+
+// Sensitivities of the full scales set by BSP_ACCELERO_Init (2 g),
+// BSP_GYRO_Init (2000 dps) and BSP_MAGNETO_Init (4 gauss)
+constexpr float kAccelSensitivity = LSM6DSL_ACC_SENSITIVITY_2G;
+constexpr float kGyroSensitivity = LSM6DSL_GYRO_SENSITIVITY_2000DPS / 1000.0f;
+constexpr float kMagSensitivity = LIS3MDL_MAG_SENSITIVITY_FOR_FS_4GA;
+
 TfLiteStatus SetupAccelerometer(tflite::ErrorReporter* error_reporter) {
-  // Init accelerometer
+  return SetupSensors(error_reporter, kAccelChannels);
+}
+
+TfLiteStatus SetupSensors(tflite::ErrorReporter* error_reporter,
+                          int channels) {
+  if (channels != kAccelChannels && channels != kAccelGyroChannels &&
+      channels != kAccelGyroMagChannels) {
+    error_reporter->Report("Unsupported channel number: %d\n", channels);
+    return kTfLiteError;
+  }
+
+  // Init accelerometer, and the gyro/magnetometer when they are sampled
   BSP_ACCELERO_Init();
+  if (channels >= kAccelGyroChannels && BSP_GYRO_Init() != GYRO_OK) {
+    error_reporter->Report("Gyro init failed\n");
+    return kTfLiteError;
+  }
+  if (channels >= kAccelGyroMagChannels && BSP_MAGNETO_Init() != MAGNETO_OK) {
+    error_reporter->Report("Magnetometer init failed\n");
+    return kTfLiteError;
+  }
+
+  // The ring layout changes with the channel number, start over
+  channel_number = channels;
+  memset(save_data, 0, sizeof(save_data));
+  begin_index = 0;
+  pending_initial_data = true;
   return kTfLiteOk;
 }
 
-bool ReadAccelerometer(tflite::ErrorReporter* error_reporter, float* input,
-                       int length, bool reset_buffer) {
+void ReadSensorFrame(float* frame) {
+  if (channel_number == kAccelChannels) {
+    BSP_ACCELERO_AccGetXYZ(pDataXYZ);
+    frame[0] = (float)pDataXYZ[0];
+    frame[1] = (float)pDataXYZ[1];
+    frame[2] = (float)pDataXYZ[2];
+    return;
+  }
+
+  // Gyro and accelerometer share the LSM6DSL, one burst reads both
+  int16_t raw[6];
+  LSM6DSL_AccGyroReadRaw(raw);
+  for (int i = 0; i < 3; ++i) {
+    // Truncate to whole mg the way BSP_ACCELERO_AccGetXYZ does
+    pDataXYZ[i] = (int16_t)(raw[3 + i] * kAccelSensitivity);
+    frame[i] = (float)pDataXYZ[i];
+    frame[3 + i] = raw[i] * kGyroSensitivity;
+  }
+
+  if (channel_number == kAccelGyroMagChannels) {
+    LIS3MDL_MagReadRaw(raw);
+    for (int i = 0; i < 3; ++i) {
+      frame[6 + i] = raw[i] * kMagSensitivity;
+    }
+  }
+}
+
+// Sample one frame into the ring buffer, returns true once there is enough
+// data to run inference
+static bool SampleFrame(bool reset_buffer) {
+  const int ring_length = kRingFrames * channel_number;
+
   // Clear the buffer if required, e.g. after a successful prediction
   if (reset_buffer) {
-    memset(save_data, 0, 600 * sizeof(float));
+    memset(save_data, 0, ring_length * sizeof(float));
     begin_index = 0;
     pending_initial_data = true;
   }
 
   // Obtain a sample
   while(sample_skip_counter <= sample_every_n) {
-     BSP_ACCELERO_AccGetXYZ(pDataXYZ);
+     ReadSensorFrame(&save_data[begin_index]);
      sample_skip_counter += 1;
   }
-
-  // Write samples to our buffer, converting to milli-Gs
-  save_data[begin_index++] = (float)pDataXYZ[0];
-  save_data[begin_index++] = (float)pDataXYZ[1];
-  save_data[begin_index++] = (float)pDataXYZ[2];
+  begin_index += channel_number;
 
   // Since we took a sample, reset the skip counter
   sample_skip_counter = 1;
 
   // If we reached the end of the circle buffer, reset
-  if (begin_index >= 600) {
+  if (begin_index >= ring_length) {
     begin_index = 0;
   }
 
   // Check if we are ready for prediction or still pending more initial data
-  if (pending_initial_data && begin_index >= 200) {
+  if (pending_initial_data &&
+      begin_index >= 200 * channel_number / kChannelNumber) {
     pending_initial_data = false;
   }
 
   // Return if we don't have enough data
-  if (pending_initial_data) {
+  return !pending_initial_data;
+}
+
+bool ReadAccelerometer(tflite::ErrorReporter* error_reporter, float* input,
+                       int length, bool reset_buffer) {
+  if (!SampleFrame(reset_buffer)) {
+    return false;
+  }
+
+  // Copy the accelerometer channels of the last length / 3 frames to the
+  // provided input tensor
+  const int ring_length = kRingFrames * channel_number;
+  const int frames = length / kChannelNumber;
+  for (int f = 0; f < frames; ++f) {
+    int ring_array_index = begin_index + (f - frames) * channel_number;
+    if (ring_array_index < 0) {
+      ring_array_index += ring_length;
+    }
+    for (int c = 0; c < kChannelNumber; ++c) {
+      input[f * kChannelNumber + c] = save_data[ring_array_index + c];
+    }
+  }
+
+  return true;
+}
+
+bool ReadSensors(tflite::ErrorReporter* error_reporter, float* input,
+                 int length, bool reset_buffer) {
+  if (!SampleFrame(reset_buffer)) {
     return false;
   }
 
-  // Copy the requested number of bytes to the provided input tensor
+  // Copy the requested number of interleaved values to the provided input
+  // tensor, length should be a multiple of channel_number
+  const int ring_length = kRingFrames * channel_number;
   for (int i = 0; i < length; ++i) {
     int ring_array_index = begin_index + i - length;
     if (ring_array_index < 0) {
-      ring_array_index += 600;
+      ring_array_index += ring_length;
     }
     input[i] = save_data[ring_array_index];
   }
 
+  return true;
+}
+
+// Resample the frames frames of the ring ending before end_index to
+// length / 3 frames of the accelerometer channels, interpolating linearly
+static void ResampleSegment(float* input, int length, int end_index,
+                            int frames) {
+  const int ring_length = kRingFrames * channel_number;
+  const int out_frames = length / kChannelNumber;
+  for (int f = 0; f < out_frames; ++f) {
+    float position = (out_frames > 1)
+                         ? (float)f * (frames - 1) / (out_frames - 1)
+                         : 0.0f;
+    int before = (int)position;
+    int after = (before + 1 < frames) ? before + 1 : before;
+    float weight = position - before;
+
+    int before_index = end_index + (before - frames) * channel_number;
+    int after_index = end_index + (after - frames) * channel_number;
+    if (before_index < 0) before_index += ring_length;
+    if (after_index < 0) after_index += ring_length;
+    for (int c = 0; c < kChannelNumber; ++c) {
+      input[f * kChannelNumber + c] =
+          save_data[before_index + c] * (1.0f - weight) +
+          save_data[after_index + c] * weight;
+    }
+  }
+}
+
+// Sample one frame and track motion, returns true only when a segment just
+// ended; input then holds the whole segment stretched to length values
+bool ReadAccelerometerSegment(tflite::ErrorReporter* error_reporter,
+                              float* input, int length, bool reset_buffer) {
+  if (reset_buffer) {
+    gravity_valid = false;
+    energy = 0;
+    segment_frames = 0;
+    quiet_frames = 0;
+  }
+  SampleFrame(reset_buffer);
+
+  // The frame just written
+  int index = begin_index - channel_number;
+  if (index < 0) index += kRingFrames * channel_number;
+  const float* frame = &save_data[index];
+
+  if (!gravity_valid) {
+    for (int i = 0; i < 3; ++i) gravity[i] = frame[i];
+    gravity_valid = true;
+  }
+  float frame_energy = 0;
+  for (int i = 0; i < 3; ++i) {
+    float dynamic = frame[i] - gravity[i];
+    frame_energy += dynamic * dynamic;
+  }
+  energy += 0.25f * (frame_energy - energy);
+
+  if (segment_frames == 0) {
+    if (energy < segment_on_energy) {
+      // Idle: follow slow changes of orientation
+      for (int i = 0; i < 3; ++i) gravity[i] += (frame[i] - gravity[i]) / 32;
+      return false;
+    }
+    // Onset
+    segment_frames = segment_preroll_frames + 1;
+    quiet_frames = 0;
+    return false;
+  }
+
+  ++segment_frames;
+  quiet_frames = (energy < segment_off_energy) ? quiet_frames + 1 : 0;
+  if (quiet_frames < segment_quiet_frames &&
+      segment_frames < segment_max_frames) {
+    return false;
+  }
+
+  // Offset, or the gesture is getting too long for the ring: resample the
+  // segment without its quiet tail
+  int frames = segment_frames - quiet_frames;
+  int end_index = begin_index - quiet_frames * channel_number;
+  if (end_index < 0) end_index += kRingFrames * channel_number;
+  segment_frames = 0;
+  quiet_frames = 0;
+  if (frames < segment_min_frames) {
+    return false;
+  }
+
+  ResampleSegment(input, length, end_index, frames);
   return true;
 }
\ No newline at end of file
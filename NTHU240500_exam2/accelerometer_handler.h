@@ -2,13 +2,37 @@
 #define ACCELEROMETER_HANDLER_H_
 
 #define kChannelNumber 3
+#define kMaxChannelNumber 9
 
 #include "tensorflow/lite/c/common.h"
 #include "tensorflow/lite/micro/micro_error_reporter.h"
 
+// Layouts of the interleaved frames kept in the ring buffer. The accelerometer
+// always comes first, so 3-channel consumers see the same data in every mode.
+enum SensorChannels {
+  kAccelChannels = 3,         // ax, ay, az [mg]
+  kAccelGyroChannels = 6,     // + gx, gy, gz [dps]
+  kAccelGyroMagChannels = 9,  // + mx, my, mz [mgauss]
+};
+
+extern int16_t pDataXYZ[3];
 extern int begin_index;
+extern int channel_number;
+extern float segment_on_energy;
+extern float segment_off_energy;
+extern int segment_quiet_frames;
+extern int segment_min_frames;
+extern int segment_max_frames;
 extern TfLiteStatus SetupAccelerometer(tflite::ErrorReporter* error_reporter);
+extern TfLiteStatus SetupSensors(tflite::ErrorReporter* error_reporter,
+                                 int channels);
+extern void ReadSensorFrame(float* frame);
 extern bool ReadAccelerometer(tflite::ErrorReporter* error_reporter,
                               float* input, int length, bool reset_buffer);
+extern bool ReadSensors(tflite::ErrorReporter* error_reporter, float* input,
+                        int length, bool reset_buffer);
+extern bool ReadAccelerometerSegment(tflite::ErrorReporter* error_reporter,
+                                     float* input, int length,
+                                     bool reset_buffer);
 
 #endif  // ACCELEROMETER_HANDLER_H_
\ No newline at end of file
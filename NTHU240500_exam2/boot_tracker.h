@@ -0,0 +1,73 @@
+#ifndef BOOT_TRACKER_H_
+#define BOOT_TRACKER_H_
+
+// Readiness of the subsystems that come up concurrently at boot.
+//
+// Every stage is brought up by one task, which calls ready() or failed()
+// once with the time since boot. Other threads check is_ready() or block in
+// wait() on the stages they depend on, so a consumer starts as soon as its
+// own dependencies are up instead of after the whole boot.
+//
+// Flags is any type with the rtos::EventFlags set/get/wait_any signatures,
+// as for ModeController.
+
+#include <stdint.h>
+
+enum BootStage {
+  kBootSensors = 0,  // LSM6DSL, QSPI flash, stored calibration
+  kBootDisplay = 1,  // uLCD reset and the static layout
+  kBootModel = 2,    // TF Lite Micro interpreter with tensors allocated
+  kBootWifi = 3,     // WiFi associated with an address
+  kBootBroker = 4,   // TCP connection and MQTT CONNECT
+  kBootStageCount = 5,
+};
+
+template <typename Flags>
+class BootTracker {
+ public:
+  BootTracker() {
+    for (int i = 0; i < kBootStageCount; ++i) time_ms_[i] = -1;
+  }
+
+  void ready(int stage, uint32_t time_ms) { finish(stage, time_ms, true); }
+  void failed(int stage, uint32_t time_ms) { finish(stage, time_ms, false); }
+
+  bool is_ready(int stage) const {
+    return (flags_.get() & ReadyBit(stage)) != 0;
+  }
+  bool is_failed(int stage) const {
+    return (flags_.get() & FailedBit(stage)) != 0;
+  }
+
+  // Time from boot to ready or failed [ms], -1 while the stage is pending
+  int32_t time_ms(int stage) const { return time_ms_[stage]; }
+
+  // Block until stage is ready or failed, true if it is ready. timeout_ms
+  // of 0xFFFFFFFF waits forever.
+  bool wait(int stage, uint32_t timeout_ms = kWaitForever) {
+    // Either bit ends the wait, so a failed stage does not block forever
+    flags_.wait_any(DoneBit(stage), timeout_ms, false);
+    return is_ready(stage);
+  }
+
+ private:
+  // osWaitForever
+  static constexpr uint32_t kWaitForever = 0xFFFFFFFFu;
+
+  static uint32_t ReadyBit(int stage) { return 1u << stage; }
+  static uint32_t FailedBit(int stage) { return 1u << (16 + stage); }
+  static uint32_t DoneBit(int stage) {
+    return ReadyBit(stage) | FailedBit(stage);
+  }
+
+  void finish(int stage, uint32_t time_ms, bool ok) {
+    if (stage < 0 || stage >= kBootStageCount) return;
+    time_ms_[stage] = (int32_t)time_ms;
+    flags_.set(ok ? ReadyBit(stage) : FailedBit(stage));
+  }
+
+  Flags flags_;
+  volatile int32_t time_ms_[kBootStageCount];
+};
+
+#endif  // BOOT_TRACKER_H_
@@ -0,0 +1,221 @@
+#include "connection_manager.h"
+
+#include <string.h>
+
+WifiConnectStats wifi_stats = {kWifiFailed, -1,    -1,    -1,
+                               -1,          -1,    false, false,
+                               false,       false, 0,     0};
+
+// Access points looked at by the scan fallback
+constexpr int kScanAccessPoints = 8;
+
+static uint32_t NowMs() {
+  using namespace std::chrono;
+  return duration_cast<milliseconds>(Kernel::Clock::now().time_since_epoch())
+      .count();
+}
+
+static bool HasAddress(const uint8_t* ip) {
+  return ip[0] | ip[1] | ip[2] | ip[3];
+}
+
+static SocketAddress ToAddress(const uint8_t* ip) {
+  SocketAddress address;
+  address.set_ip_bytes(ip, NSAPI_IPv4);
+  return address;
+}
+
+static void FromAddress(const SocketAddress& address, uint8_t* ip) {
+  if (address.get_ip_version() == NSAPI_IPv4) {
+    memcpy(ip, address.get_ip_bytes(), 4);
+  } else {
+    memset(ip, 0, 4);
+  }
+}
+
+void ResetWifiLease(WifiLease* lease) { memset(lease, 0, sizeof(*lease)); }
+
+// Remember the network we are on now
+static void UpdateLease(WiFiInterface* wifi, const char* ssid,
+                        nsapi_security_t security, const uint8_t* bssid,
+                        uint8_t channel, WifiLease* lease) {
+  strncpy(lease->ssid, ssid, sizeof(lease->ssid) - 1);
+  lease->ssid[sizeof(lease->ssid) - 1] = '\0';
+  if (bssid) {
+    memcpy(lease->bssid, bssid, sizeof(lease->bssid));
+  } else if (channel == 0) {
+    memset(lease->bssid, 0, sizeof(lease->bssid));
+  }
+  lease->channel = channel;
+  lease->security = security;
+
+  SocketAddress address;
+  if (wifi->get_ip_address(&address) == NSAPI_ERROR_OK) {
+    FromAddress(address, lease->ip);
+  }
+  if (wifi->get_netmask(&address) == NSAPI_ERROR_OK) {
+    FromAddress(address, lease->netmask);
+  }
+  if (wifi->get_gateway(&address) == NSAPI_ERROR_OK) {
+    FromAddress(address, lease->gateway);
+  }
+}
+
+// Whether the driver joins on a given channel, asked once. The ISM43362
+// takes only channel 0 and scans inside connect, so a scan of our own would
+// only add its time.
+static bool DirectedJoin(WiFiInterface* wifi) {
+  static int supported = -1;
+  if (supported < 0) {
+    supported = wifi->set_channel(1) == NSAPI_ERROR_OK;
+    wifi->set_channel(0);
+  }
+  return supported;
+}
+
+// Drop a static configuration an earlier join left behind
+static void UseDhcp(WiFiInterface* wifi) {
+  wifi->set_network(SocketAddress(), SocketAddress(), SocketAddress());
+  wifi->set_dhcp(true);
+}
+
+// Connect on channel (0: any), with the lease address as static
+// configuration if there is one and the driver takes it. The lease may have
+// been handed to someone else meanwhile, then DHCP gets a second try.
+// Without one the interface goes back to DHCP, whatever an earlier join set.
+static int Join(WiFiInterface* wifi, const char* ssid, const char* password,
+                nsapi_security_t security, uint8_t channel,
+                const WifiLease* lease) {
+  wifi_stats.static_ip =
+      lease && HasAddress(lease->ip) && HasAddress(lease->netmask) &&
+      wifi->set_network(ToAddress(lease->ip), ToAddress(lease->netmask),
+                        ToAddress(lease->gateway)) == NSAPI_ERROR_OK &&
+      wifi->set_dhcp(false) == NSAPI_ERROR_OK;
+  if (!wifi_stats.static_ip) UseDhcp(wifi);
+
+  int ret = wifi->connect(ssid, password, security, channel);
+  if (ret != NSAPI_ERROR_OK && wifi_stats.static_ip) {
+    wifi->disconnect();
+    UseDhcp(wifi);
+    wifi_stats.static_ip = false;
+    ret = wifi->connect(ssid, password, security, channel);
+  }
+  return ret;
+}
+
+// Only for a driver that joins on a given channel: the channel found here
+// is what the next directed join uses
+static int ConnectScan(WiFiInterface* wifi, const char* ssid,
+                       const char* password, nsapi_security_t security,
+                       WifiLease* lease) {
+  static WiFiAccessPoint access_points[kScanAccessPoints];
+
+  uint32_t start = NowMs();
+  int count = wifi->scan(access_points, kScanAccessPoints);
+  wifi_stats.scan_ms = NowMs() - start;
+
+  int best = -1;
+  for (int i = 0; i < count; ++i) {
+    if (strcmp(access_points[i].get_ssid(), ssid) != 0) continue;
+    if (best < 0 ||
+        access_points[i].get_rssi() > access_points[best].get_rssi()) {
+      best = i;
+    }
+  }
+
+  start = NowMs();
+  int ret;
+  if (best < 0) {
+    // Hidden SSID: let the driver search on its own
+    ret = Join(wifi, ssid, password, security, 0, nullptr);
+    if (ret == NSAPI_ERROR_OK) {
+      UpdateLease(wifi, ssid, security, nullptr, 0, lease);
+    }
+  } else {
+    const WiFiAccessPoint& ap = access_points[best];
+    ret = Join(wifi, ssid, password, security, ap.get_channel(), nullptr);
+    if (ret == NSAPI_ERROR_OK) {
+      UpdateLease(wifi, ssid, security, ap.get_bssid(), ap.get_channel(),
+                  lease);
+    }
+  }
+  wifi_stats.scan_join_ms = NowMs() - start;
+  return ret;
+}
+
+int ConnectWifi(WiFiInterface* wifi, const char* ssid, const char* password,
+                nsapi_security_t security, WifiLease* lease) {
+  uint32_t start = NowMs();
+  wifi_stats.path = kWifiFailed;
+  wifi_stats.directed_ms = -1;
+  wifi_stats.scan_ms = -1;
+  wifi_stats.scan_join_ms = -1;
+  wifi_stats.static_ip = false;
+  wifi_stats.directed_join = DirectedJoin(wifi);
+
+  bool same_network = strncmp(lease->ssid, ssid, sizeof(lease->ssid)) == 0 &&
+                      lease->security == security;
+  int ret = NSAPI_ERROR_NO_CONNECTION;
+  if (!wifi_stats.directed_join) {
+    // As before the lease: the module picks the access point
+    ret = Join(wifi, ssid, password, security, 0,
+               same_network ? lease : nullptr);
+    wifi_stats.scan_join_ms = NowMs() - start;
+    if (ret == NSAPI_ERROR_OK) {
+      wifi_stats.path = kWifiConnect;
+      UpdateLease(wifi, ssid, security, nullptr, 0, lease);
+    }
+    wifi_stats.total_ms = NowMs() - start;
+    return ret;
+  }
+
+  if (same_network && lease->channel != 0) {
+    ret = Join(wifi, ssid, password, security, lease->channel, lease);
+    wifi_stats.directed_ms = NowMs() - start;
+    if (ret == NSAPI_ERROR_OK) {
+      wifi_stats.path = kWifiDirected;
+      ++wifi_stats.directed_ok;
+      // Keep the channel and BSSID, refresh the address
+      UpdateLease(wifi, ssid, security, nullptr, lease->channel, lease);
+    } else {
+      ++wifi_stats.scan_fallbacks;
+    }
+  }
+
+  if (ret != NSAPI_ERROR_OK) {
+    ret = ConnectScan(wifi, ssid, password, security, lease);
+    if (ret == NSAPI_ERROR_OK) wifi_stats.path = kWifiScan;
+  }
+  wifi_stats.total_ms = NowMs() - start;
+  return ret;
+}
+
+int ResolveBroker(NetworkInterface* net, const char* host, uint16_t port,
+                  WifiLease* lease, SocketAddress* address) {
+  uint32_t start = NowMs();
+  wifi_stats.literal_broker = false;
+  wifi_stats.cached_broker = false;
+  int ret = NSAPI_ERROR_OK;
+  if (address->set_ip_address(host)) {
+    // Nothing to look up, and nothing worth caching
+    wifi_stats.literal_broker = true;
+    lease->broker_host[0] = '\0';
+    memset(lease->broker_ip, 0, sizeof(lease->broker_ip));
+  } else if (strncmp(lease->broker_host, host, sizeof(lease->broker_host)) ==
+                 0 &&
+             HasAddress(lease->broker_ip)) {
+    *address = ToAddress(lease->broker_ip);
+    wifi_stats.cached_broker = true;
+  } else {
+    ret = net->gethostbyname(host, address);
+    if (ret == NSAPI_ERROR_OK) {
+      strncpy(lease->broker_host, host, sizeof(lease->broker_host) - 1);
+      lease->broker_host[sizeof(lease->broker_host) - 1] = '\0';
+      FromAddress(*address, lease->broker_ip);
+    }
+  }
+  address->set_port(port);
+  lease->broker_port = port;
+  wifi_stats.broker_ms = NowMs() - start;
+  return ret;
+}
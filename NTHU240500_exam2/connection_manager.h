@@ -0,0 +1,74 @@
+#ifndef CONNECTION_MANAGER_H_
+#define CONNECTION_MANAGER_H_
+
+#include <stdint.h>
+
+#include "mbed.h"
+
+// The last successful connection, kept in a PersistentRecord so the next
+// boot can join on the known channel and address and connect to the broker
+// without a DNS query, as far as the driver allows. Addresses are IPv4 in
+// network order.
+struct WifiLease {
+  char ssid[33];
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint8_t security;  // nsapi_security_t
+  uint8_t ip[4];
+  uint8_t netmask[4];
+  uint8_t gateway[4];
+  char broker_host[40];
+  uint8_t broker_ip[4];
+  uint16_t broker_port;
+};
+
+enum WifiConnectPath {
+  kWifiFailed = -1,
+  kWifiDirected = 0,  // lease reused: joined on its channel
+  kWifiScan = 1,      // scanned for the strongest access point, joined on its
+                      // channel
+  kWifiConnect = 2,   // the driver's own connect, it finds the access point
+};
+
+// Timing of the last ConnectWifi/ResolveBroker [ms], -1 for a step that did
+// not run, plus counters since boot
+struct WifiConnectStats {
+  int path;             // WifiConnectPath
+  int directed_ms;      // directed association attempt
+  int scan_ms;          // the scan alone
+  int scan_join_ms;     // association after the scan, or the plain connect
+  int total_ms;         // ConnectWifi from start to associated
+  int broker_ms;        // ResolveBroker
+  bool directed_join;   // the driver joins on a given channel
+  bool static_ip;       // the lease was applied as static address
+  bool literal_broker;  // the broker host is an IP address, nothing to look up
+  bool cached_broker;
+  uint32_t directed_ok;
+  uint32_t scan_fallbacks;  // directed attempts that ended in a scan
+};
+
+extern WifiConnectStats wifi_stats;
+
+// Clear a lease so nothing is reused
+extern void ResetWifiLease(WifiLease* lease);
+
+// Associate with ssid. A driver that joins on a given channel first tries
+// the channel of a lease for the same ssid; without one, or if that fails,
+// it scans, picks the strongest access point of ssid and joins on its
+// channel, which the lease keeps for the next time. A driver that does not
+// (the ISM43362) gets a plain connect, it scans on its own. The lease
+// address is tried as static configuration where the driver takes one. On
+// success the lease is updated with what was joined, returns the nsapi
+// error.
+extern int ConnectWifi(WiFiInterface* wifi, const char* ssid,
+                       const char* password, nsapi_security_t security,
+                       WifiLease* lease);
+
+// Broker address for host:port: an IP address as it is, otherwise the
+// cached address when the lease has one for the same host (skipping DNS),
+// resolved and cached when not
+extern int ResolveBroker(NetworkInterface* net, const char* host,
+                         uint16_t port, WifiLease* lease,
+                         SocketAddress* address);
+
+#endif  // CONNECTION_MANAGER_H_
@@ -0,0 +1,209 @@
+#include "gesture_handler.h"
+
+#include "accelerometer_handler.h"
+#include "magic_wand_model_data.h"
+
+#include "tensorflow/lite/c/common.h"
+#include "tensorflow/lite/micro/kernels/micro_ops.h"
+#include "tensorflow/lite/micro/micro_mutable_op_resolver.h"
+#include "tensorflow/lite/schema/schema_generated.h"
+#include "tensorflow/lite/version.h"
+
+Config config;
+
+constexpr int kTensorArenaSize = 60 * 1024;
+uint8_t tensor_arena[kTensorArenaSize];
+
+static ConsecutiveDecider consecutive_decider;
+static EmaDecider ema_decider(config.emaAlpha, config.emaThreshold);
+static HysteresisDecider hysteresis_decider(config.hysteresisThresholds,
+                                            config.hysteresisPenalty);
+static SegmentDecider segment_decider(config.segmentThreshold);
+// The decision stage PredictGesture runs, the original rule until replays
+// of labelled traces show another one does better
+static GestureDecider* decider = &consecutive_decider;
+static int decision_mode = kDecisionConsecutive;
+
+tflite::MicroInterpreter* SetupGestureModel(
+    tflite::ErrorReporter* error_reporter) {
+  // Map the model into a usable data structure. This doesn't involve any
+  // copying or parsing, it's a very lightweight operation.
+  const tflite::Model* model = tflite::GetModel(g_magic_wand_model_data);
+  if (model->version() != TFLITE_SCHEMA_VERSION) {
+    error_reporter->Report(
+        "Model provided is schema version %d not equal "
+        "to supported version %d.",
+        model->version(), TFLITE_SCHEMA_VERSION);
+    return nullptr;
+  }
+
+  // Pull in only the operation implementations we need.
+  // This relies on a complete list of all the ops needed by this graph.
+  // An easier approach is to just use the AllOpsResolver, but this will
+  // incur some penalty in code space for op implementations that are not
+  // needed by this graph.
+  static tflite::MicroOpResolver<6> micro_op_resolver;
+  micro_op_resolver.AddBuiltin(
+      tflite::BuiltinOperator_DEPTHWISE_CONV_2D,
+      tflite::ops::micro::Register_DEPTHWISE_CONV_2D());
+  micro_op_resolver.AddBuiltin(tflite::BuiltinOperator_MAX_POOL_2D,
+                               tflite::ops::micro::Register_MAX_POOL_2D());
+  micro_op_resolver.AddBuiltin(tflite::BuiltinOperator_CONV_2D,
+                               tflite::ops::micro::Register_CONV_2D());
+  micro_op_resolver.AddBuiltin(tflite::BuiltinOperator_FULLY_CONNECTED,
+                               tflite::ops::micro::Register_FULLY_CONNECTED());
+  micro_op_resolver.AddBuiltin(tflite::BuiltinOperator_SOFTMAX,
+                               tflite::ops::micro::Register_SOFTMAX());
+  micro_op_resolver.AddBuiltin(tflite::BuiltinOperator_RESHAPE,
+                               tflite::ops::micro::Register_RESHAPE(), 1);
+
+  // Build an interpreter to run the model with
+  static tflite::MicroInterpreter static_interpreter(
+      model, micro_op_resolver, tensor_arena, kTensorArenaSize, error_reporter);
+  tflite::MicroInterpreter* interpreter = &static_interpreter;
+
+  // Allocate memory from the tensor_arena for the model's tensors
+  interpreter->AllocateTensors();
+
+  // Obtain pointer to the model's input tensor
+  TfLiteTensor* model_input = interpreter->input(0);
+  if ((model_input->dims->size != 4) || (model_input->dims->data[0] != 1) ||
+      (model_input->dims->data[1] != config.seq_length) ||
+      (model_input->dims->data[2] != kChannelNumber) ||
+      (model_input->type != kTfLiteFloat32)) {
+    error_reporter->Report("Bad input tensor parameters in model");
+    return nullptr;
+  }
+
+  return interpreter;
+}
+
+int PredictGesture(float* output) { return decider->Update(output); }
+
+void ResetGesturePrediction() { decider->Reset(); }
+
+bool SetGestureDecision(int decision) {
+  switch (decision) {
+    case kDecisionConsecutive:
+      SetGestureDecider(&consecutive_decider);
+      break;
+    case kDecisionEma:
+      SetGestureDecider(&ema_decider);
+      break;
+    case kDecisionHysteresis:
+      SetGestureDecider(&hysteresis_decider);
+      break;
+    case kDecisionSegment:
+      SetGestureDecider(&segment_decider);
+      break;
+    default:
+      return false;
+  }
+  decision_mode = decision;
+  return true;
+}
+
+int GetGestureDecision() { return decision_mode; }
+
+void SetGestureDecider(GestureDecider* new_decider) {
+  new_decider->Reset();
+  decider = new_decider;
+  decision_mode = -1;
+}
+
+int ConsecutiveDecider::Update(const float* output) {
+  // Find whichever output has a probability > 0.8 (they sum to 1)
+  int this_predict = -1;
+  for (int i = 0; i < label_num; i++) {
+    if (output[i] > 0.8) this_predict = i;
+  }
+
+  // No gesture was detected above the threshold
+  if (this_predict == -1) {
+    continuous_count_ = 0;
+    last_predict_ = label_num;
+    return label_num;
+  }
+
+  if (last_predict_ == this_predict) {
+    continuous_count_ += 1;
+  } else {
+    continuous_count_ = 0;
+  }
+  last_predict_ = this_predict;
+
+  // If we haven't yet had enough consecutive matches for this gesture,
+  // report a negative result
+  if (continuous_count_ <
+      config.consecutiveInferenceThresholds[this_predict]) {
+    return label_num;
+  }
+  // Otherwise, we've seen a positive result, so clear all our variables
+  // and report it
+  Reset();
+
+  return this_predict;
+}
+
+void ConsecutiveDecider::Reset() {
+  continuous_count_ = 0;
+  last_predict_ = -1;
+}
+
+int EmaDecider::Update(const float* output) {
+  int best = label_num;
+  for (int i = 0; i < label_num; i++) {
+    smoothed_[i] += alpha_ * (output[i] - smoothed_[i]);
+    if (smoothed_[i] >= threshold_ &&
+        (best == label_num || smoothed_[i] > smoothed_[best])) {
+      best = i;
+    }
+  }
+
+  // The ring buffer is cleared after a detection, start from scratch too
+  if (best < label_num) Reset();
+  return best;
+}
+
+void EmaDecider::Reset() {
+  for (int i = 0; i < label_num; i++) smoothed_[i] = 0;
+}
+
+int HysteresisDecider::Update(const float* output) {
+  int this_predict = -1;
+  for (int i = 0; i < label_num; i++) {
+    if (output[i] > 0.8) this_predict = i;
+  }
+
+  for (int i = 0; i < label_num; i++) {
+    if (i == this_predict) {
+      evidence_[i] += 1;
+    } else {
+      evidence_[i] = (evidence_[i] > penalty_) ? evidence_[i] - penalty_ : 0;
+    }
+  }
+
+  // Counting starts at 0 like continuous_count, so the same threshold
+  // needs threshold + 1 inferences in a clean run
+  if (this_predict == -1 ||
+      evidence_[this_predict] <= thresholds_[this_predict]) {
+    return label_num;
+  }
+  Reset();
+  return this_predict;
+}
+
+void HysteresisDecider::Reset() {
+  for (int i = 0; i < label_num; i++) evidence_[i] = 0;
+}
+
+int SegmentDecider::Update(const float* output) {
+  int best = label_num;
+  for (int i = 0; i < label_num; i++) {
+    if (output[i] >= threshold_ &&
+        (best == label_num || output[i] > output[best])) {
+      best = i;
+    }
+  }
+  return best;
+}
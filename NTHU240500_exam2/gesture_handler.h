@@ -0,0 +1,115 @@
+#ifndef GESTURE_HANDLER_H_
+#define GESTURE_HANDLER_H_
+
+#include "tensorflow/lite/micro/micro_error_reporter.h"
+#include "tensorflow/lite/micro/micro_interpreter.h"
+
+#define label_num 3
+
+struct Config {
+
+  // This must be the same as seq_length in the src/model_train/config.py
+  const int seq_length = 64;
+
+  // The number of expected consecutive inferences for each gesture type.
+  const int consecutiveInferenceThresholds[label_num] = {20, 10, 15};
+
+  // Parameters of the EMA and hysteresis decision stages
+  const float emaAlpha = 0.3;
+  const float emaThreshold = 0.85;
+  const int hysteresisThresholds[label_num] = {20, 10, 15};
+  const int hysteresisPenalty = 2;
+
+  // Probability a single segment inference needs in segmentation mode
+  const float segmentThreshold = 0.6;
+
+  const char* output_message[label_num] = {
+        "RING:\n\r",
+        "SLOPE:\n\r",
+        "LEFT TO RIGHT:\n\r",
+        };
+};
+extern Config config;
+
+// Turns the per-window model outputs into gesture events
+class GestureDecider {
+ public:
+  virtual ~GestureDecider() {}
+  // Returns the detected gesture index, or label_num if there is none yet
+  virtual int Update(const float* output) = 0;
+  virtual void Reset() = 0;
+};
+
+// The original rule: a gesture needs consecutiveInferenceThresholds
+// inferences above 0.8 in a row, any dip starts over
+class ConsecutiveDecider : public GestureDecider {
+ public:
+  int Update(const float* output) override;
+  void Reset() override;
+
+ private:
+  int continuous_count_ = 0;
+  int last_predict_ = -1;
+};
+
+// Exponential moving average of the outputs, a gesture fires once its
+// smoothed probability reaches threshold
+class EmaDecider : public GestureDecider {
+ public:
+  EmaDecider(float alpha, float threshold)
+      : alpha_(alpha), threshold_(threshold) {}
+  int Update(const float* output) override;
+  void Reset() override;
+
+ private:
+  float alpha_;
+  float threshold_;
+  float smoothed_[label_num] = {0};
+};
+
+// Leaky evidence counters: an inference above 0.8 adds one to its gesture,
+// every other inference takes penalty away, so a single dip no longer
+// throws away the run
+class HysteresisDecider : public GestureDecider {
+ public:
+  HysteresisDecider(const int* thresholds, int penalty)
+      : thresholds_(thresholds), penalty_(penalty) {}
+  int Update(const float* output) override;
+  void Reset() override;
+
+ private:
+  const int* thresholds_;
+  int penalty_;
+  int evidence_[label_num] = {0};
+};
+
+// One inference per motion segment from ReadAccelerometerSegment, so there
+// is nothing to accumulate: the best output above threshold wins
+class SegmentDecider : public GestureDecider {
+ public:
+  explicit SegmentDecider(float threshold) : threshold_(threshold) {}
+  int Update(const float* output) override;
+  void Reset() override {}
+
+ private:
+  float threshold_;
+};
+
+enum GestureDecision {
+  kDecisionConsecutive = 0,
+  kDecisionEma = 1,
+  kDecisionHysteresis = 2,
+  // Feed the model with ReadAccelerometerSegment instead of every window
+  kDecisionSegment = 3,
+};
+
+extern tflite::MicroInterpreter* SetupGestureModel(
+    tflite::ErrorReporter* error_reporter);
+extern int PredictGesture(float* output);
+extern void ResetGesturePrediction();
+extern bool SetGestureDecision(int decision);
+// The GestureDecision last selected, -1 after SetGestureDecider
+extern int GetGestureDecision();
+extern void SetGestureDecider(GestureDecider* decider);
+
+#endif  // GESTURE_HANDLER_H_
\ No newline at end of file
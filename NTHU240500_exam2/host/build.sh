@@ -0,0 +1,71 @@
+#!/bin/sh
+# Build the host tools into host/build: trace_tool, tilt_bench, mode_check,
+# publish_queue_check, telemetry_check, outbox_check, mqtt_latency_bench,
+# mqtt_window_bench, mqtt_async_bench, topic_match_bench, packet_decoder_bench
+# and replay.
+# replay links the app's gesture pipeline and TF Lite Micro, compiled for
+# the host with the stand-in headers from host/stub.
+set -e
+
+cd "$(dirname "$0")/.."
+OUT=host/build
+mkdir -p "$OUT/tflite"
+
+CXX=${CXX:-g++}
+CC=${CC:-gcc}
+FLAGS="-O2 -DNDEBUG"
+INCLUDES="-Ihost/stub -I. -Itensorflowlite_mbed \
+  -Itensorflowlite_mbed/third_party/flatbuffers/include \
+  -Itensorflowlite_mbed/third_party/gemmlowp"
+
+# TF Lite Micro without the mbed debug log and the unused audio frontend
+TFLITE_OBJS=""
+for src in $(find tensorflowlite_mbed/tensorflow -name '*.cc' -o -name '*.c' |
+             grep -v -e '_test' -e 'microfrontend' -e 'micro/mbed/' \
+                     -e 'test_helpers' -e 'testing' -e 'kissfft'); do
+  obj="$OUT/tflite/$(echo "$src" | tr '/' '_').o"
+  if [ ! -f "$obj" ] || [ "$src" -nt "$obj" ]; then
+    case "$src" in
+      *.c) $CC -std=gnu11 $FLAGS $INCLUDES -c "$src" -o "$obj" ;;
+      *) $CXX -std=gnu++14 $FLAGS $INCLUDES -c "$src" -o "$obj" ;;
+    esac
+  fi
+  TFLITE_OBJS="$TFLITE_OBJS $obj"
+done
+
+$CXX -std=gnu++14 $FLAGS -Wall -o "$OUT/trace_tool" host/trace_tool.cpp
+$CXX -std=gnu++14 $FLAGS -Wall -I. -o "$OUT/tilt_bench" host/tilt_bench.cpp
+$CXX -std=gnu++14 $FLAGS -Wall -I. -pthread -o "$OUT/mode_check" \
+  host/mode_check.cpp
+$CXX -std=gnu++14 $FLAGS -Wall -I. -pthread -o "$OUT/publish_queue_check" \
+  host/publish_queue_check.cpp
+$CXX -std=gnu++14 $FLAGS -Wall -I. -o "$OUT/telemetry_check" \
+  host/telemetry_check.cpp
+$CXX -std=gnu++14 $FLAGS -Wall -I. -o "$OUT/outbox_check" host/outbox_check.cpp
+
+# MQTTNetwork and MQTT::Client over the socket stand-ins from host/net
+MQTT_INCLUDES="-Ihost/net -Iwifi_mqtt -Iwifi_mqtt/MQTT -Iwifi_mqtt/MQTT/FP \
+  -Iwifi_mqtt/MQTT/MQTTPacket"
+MQTT_OBJS=""
+mkdir -p "$OUT/mqtt"
+for name in MQTTPacket MQTTConnectClient MQTTDeserializePublish \
+            MQTTSerializePublish MQTTSubscribeClient MQTTUnsubscribeClient; do
+  obj="$OUT/mqtt/$name.o"
+  $CC -std=gnu11 $FLAGS $MQTT_INCLUDES -c "wifi_mqtt/MQTT/MQTTPacket/$name.c" \
+    -o "$obj"
+  MQTT_OBJS="$MQTT_OBJS $obj"
+done
+$CXX -std=gnu++14 $FLAGS -I. $MQTT_INCLUDES -pthread \
+  -o "$OUT/mqtt_latency_bench" host/mqtt_latency_bench.cpp $MQTT_OBJS
+$CXX -std=gnu++14 $FLAGS -I. $MQTT_INCLUDES -pthread \
+  -o "$OUT/mqtt_window_bench" host/mqtt_window_bench.cpp $MQTT_OBJS
+$CXX -std=gnu++14 $FLAGS -I. $MQTT_INCLUDES -pthread \
+  -o "$OUT/mqtt_async_bench" host/mqtt_async_bench.cpp $MQTT_OBJS
+$CXX -std=gnu++14 $FLAGS -Wall $MQTT_INCLUDES -o "$OUT/topic_match_bench" \
+  host/topic_match_bench.cpp $MQTT_OBJS
+$CXX -std=gnu++14 $FLAGS -Wall $MQTT_INCLUDES -o "$OUT/packet_decoder_bench" \
+  host/packet_decoder_bench.cpp $MQTT_OBJS
+
+$CXX -std=gnu++14 $FLAGS $INCLUDES -o "$OUT/replay" host/replay.cpp \
+  accelerometer_handler.cpp gesture_handler.cpp magic_wand_model_data.cpp \
+  $TFLITE_OBJS
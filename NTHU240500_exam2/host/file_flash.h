@@ -0,0 +1,69 @@
+#ifndef HOST_FILE_FLASH_H_
+#define HOST_FILE_FLASH_H_
+
+// File-backed stand-in for the QSPI NOR flash, with the subset of the mbed
+// BlockDevice interface the recorders use. It follows NOR semantics: erase
+// sets bytes to 0xFF and program can only clear bits.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+class FileFlash {
+ public:
+  // Open an existing image or create an erased one of the given size
+  FileFlash(const char* path, uint32_t size) : size_(size), data_(size, 0xFF) {
+    file_ = fopen(path, "r+b");
+    if (file_) {
+      size_t n = fread(data_.data(), 1, size_, file_);
+      (void)n;
+    } else {
+      file_ = fopen(path, "w+b");
+      if (file_) fwrite(data_.data(), 1, size_, file_);
+    }
+  }
+
+  ~FileFlash() {
+    if (file_) fclose(file_);
+  }
+
+  bool is_open() const { return file_ != nullptr; }
+
+  int read(void* buffer, uint64_t addr, uint64_t size) {
+    if (addr + size > size_) return -1;
+    memcpy(buffer, &data_[addr], size);
+    return 0;
+  }
+
+  int program(const void* buffer, uint64_t addr, uint64_t size) {
+    if (addr + size > size_) return -1;
+    const uint8_t* src = static_cast<const uint8_t*>(buffer);
+    for (uint64_t i = 0; i < size; ++i) data_[addr + i] &= src[i];
+    return store(addr, size);
+  }
+
+  int erase(uint64_t addr, uint64_t size) {
+    if (addr + size > size_) return -1;
+    memset(&data_[addr], 0xFF, size);
+    return store(addr, size);
+  }
+
+  uint64_t size() const { return size_; }
+  uint64_t get_program_size() const { return 1; }
+  uint64_t get_erase_size() const { return 4096; }
+
+ private:
+  int store(uint64_t addr, uint64_t size) {
+    if (!file_ || fseek(file_, addr, SEEK_SET) != 0) return -1;
+    if (fwrite(&data_[addr], 1, size, file_) != size) return -1;
+    return fflush(file_) == 0 ? 0 : -1;
+  }
+
+  uint32_t size_;
+  std::vector<uint8_t> data_;
+  FILE* file_ = nullptr;
+};
+
+#endif  // HOST_FILE_FLASH_H_
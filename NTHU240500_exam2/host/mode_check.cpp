@@ -0,0 +1,128 @@
+// Check the mode state machine under concurrent requests.
+//
+//   mode_check [requests]
+//
+// Several threads request random modes while one worker per mode blocks in
+// wait_for() and runs "iterations" like the GUI and DETECTION threads. The
+// hooks record the sequence of enter/exit calls. Fails (exit 1) when a mode
+// is entered before the previous one exited, when two modes are entered at
+// once, or when a worker keeps iterating while its mode is inactive.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "host/rtos_host.h"
+#include "mode_controller.h"
+
+static std::atomic<int> entered(-1);  // mode whose enter ran last, -1 = none
+static std::atomic<int> errors(0);
+static std::atomic<int> enters[kModeCount];
+
+static void Enter(int mode) {
+  int expected = -1;
+  if (!entered.compare_exchange_strong(expected, mode)) {
+    if (errors++ < 10) printf("enter %d while %d active\n", mode, expected);
+  }
+  ++enters[mode];
+}
+
+static void Exit(int mode) {
+  int expected = mode;
+  if (!entered.compare_exchange_strong(expected, -1)) {
+    if (errors++ < 10) printf("exit %d while %d active\n", mode, expected);
+  }
+}
+
+static void EnterSafe() { Enter(kModeSafe); }
+static void ExitSafe() { Exit(kModeSafe); }
+static void EnterGesture() { Enter(kModeGesture); }
+static void ExitGesture() { Exit(kModeGesture); }
+static void EnterTilt() { Enter(kModeTilt); }
+static void ExitTilt() { Exit(kModeTilt); }
+
+static const ModeHooks hooks[kModeCount] = {
+    {EnterSafe, ExitSafe},
+    {EnterGesture, ExitGesture},
+    {EnterTilt, ExitTilt},
+};
+
+int main(int argc, char** argv) {
+  int requests = (argc > 1) ? atoi(argv[1]) : 20000;
+  const int kRequesters = 4;
+
+  // The constructor only sets the safe flag, the hooks start with it active
+  entered = kModeSafe;
+  ModeController<HostEventFlags, HostMutex> modes(hooks);
+
+  std::atomic<bool> done(false);
+  std::atomic<int> iterations[kModeCount];
+  std::vector<std::thread> workers;
+  for (int mode = kModeGesture; mode < kModeCount; ++mode) {
+    iterations[mode] = 0;
+    workers.emplace_back([&, mode] {
+      while (!done) {
+        modes.wait_for(mode);
+        if (done) break;
+        ++iterations[mode];
+        std::this_thread::yield();
+      }
+    });
+  }
+
+  std::vector<std::thread> requesters;
+  for (int r = 0; r < kRequesters; ++r) {
+    requesters.emplace_back([&, r] {
+      uint32_t state = 12345 + r;
+      for (int i = 0; i < requests / kRequesters; ++i) {
+        state = state * 1664525u + 1013904223u;
+        // Mostly valid modes, some out of range
+        int mode = (int)((state >> 16) % (kModeCount + 1)) - (r == 0 ? 1 : 0);
+        bool ok = modes.request(mode);
+        if (ok != (mode >= 0 && mode < kModeCount) && errors++ < 10) {
+          printf("request(%d) returned %d\n", mode, ok);
+        }
+        // Let the workers run in between
+        std::this_thread::sleep_for(std::chrono::microseconds(20));
+      }
+    });
+  }
+  for (std::thread& t : requesters) t.join();
+
+  // In safe mode the workers must be blocked, not spinning
+  modes.request(kModeSafe);
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  int blocked[kModeCount];
+  for (int mode = kModeGesture; mode < kModeCount; ++mode) {
+    blocked[mode] = iterations[mode];
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  int stale_iterations = 0;
+  for (int mode = kModeGesture; mode < kModeCount; ++mode) {
+    stale_iterations += iterations[mode] - blocked[mode];
+  }
+  if (stale_iterations != 0) ++errors;
+
+  // Release the workers
+  done = true;
+  for (int mode = kModeGesture; mode < kModeCount; ++mode) {
+    modes.request(mode);
+  }
+  for (std::thread& t : workers) t.join();
+
+  if (entered != modes.mode()) {
+    ++errors;
+    printf("mode %d but last entered %d\n", modes.mode(), entered.load());
+  }
+  printf("%u transitions, enters safe %d gesture %d tilt %d\n",
+         modes.transitions(), enters[kModeSafe].load(),
+         enters[kModeGesture].load(), enters[kModeTilt].load());
+  printf("worker iterations gesture %d tilt %d, %d in safe mode\n",
+         iterations[kModeGesture].load(), iterations[kModeTilt].load(),
+         stale_iterations);
+  printf("%d errors\n", errors.load());
+  return errors == 0 ? 0 : 1;
+}
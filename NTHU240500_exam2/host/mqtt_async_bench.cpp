@@ -0,0 +1,397 @@
+// Pipelined operations of MQTT::Async against one at a time with
+// MQTT::Client.
+//
+//   mqtt_async_bench [publishes]
+//
+// A broker stand-in on the loopback interface answers every SUBSCRIBE,
+// UNSUBSCRIBE and QoS 1 or 2 PUBLISH after an injected round trip time,
+// runs the QoS 2 exchange both ways and sends every message published to
+// "echo/..." back at the QoS it came with. Both clients subscribe to 4
+// topics, publish the given number of QoS 1 messages and unsubscribe
+// again; MQTT::Client waits a round trip for each, MQTT::Async keeps up to
+// its operation table (8) of them in flight. Prints the operations per
+// second of both.
+//
+// Then checks MQTT::Async's receive thread: the echoed messages at QoS 0, 1
+// and 2 reach the subscription handler once each, a refused subscription
+// fails, and when the broker drops the connection the operations in flight
+// fail and the connection lost handler runs. A CONNECT the broker never
+// answers fails after the command timeout and ends the connection. Exits
+// with 1 on a failure.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// in main.cpp's order, MQTTClient.h relies on mbed.h before it
+#include "MQTTNetwork.h"
+#include "MQTTmbed.h"
+#include "MQTTAsync.h"
+
+typedef MQTT::Async<MQTTNetwork, Countdown, HostThread, HostMutex> AsyncClient;
+
+constexpr int kRttMs = 20;
+constexpr int kTopics = 4;
+
+static double NowS() {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static bool failed = false;
+
+static void Check(bool condition, const char* what) {
+  if (!condition) {
+    printf("FAILED: %s\n", what);
+    failed = true;
+  }
+}
+
+// Read one MQTT packet, returns the first header byte or -1
+static int ReadPacket(int fd, std::vector<uint8_t>* body) {
+  uint8_t header;
+  if (recv(fd, &header, 1, MSG_WAITALL) != 1) return -1;
+  int length = 0, shift = 0;
+  uint8_t c;
+  do {
+    if (recv(fd, &c, 1, MSG_WAITALL) != 1) return -1;
+    length |= (c & 127) << shift;
+    shift += 7;
+  } while (c & 128);
+  body->resize(length);
+  if (length > 0 && recv(fd, body->data(), length, MSG_WAITALL) != length) {
+    return -1;
+  }
+  return header;
+}
+
+struct Broker {
+  int listener = -1;
+  int port = 0;
+  int drop_after = 0;  // close after this many PUBLISH, 0 never
+  bool silent = false;  // never answer the CONNECT
+  std::thread thread;
+
+  // packets that leave at their time
+  std::mutex mutex;
+  std::deque<std::pair<double, std::vector<uint8_t>>> outgoing;
+
+  void Start() {
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in local = {};
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(local);
+    bind(listener, (sockaddr*)&local, sizeof(local));
+    listen(listener, 1);
+    getsockname(listener, (sockaddr*)&local, &length);
+    port = ntohs(local.sin_port);
+    thread = std::thread(&Broker::Serve, this);
+  }
+
+  void Stop() {
+    thread.join();
+    close(listener);
+  }
+
+  void Send(double delay_s, std::vector<uint8_t> packet) {
+    std::lock_guard<std::mutex> guard(mutex);
+    outgoing.push_back(std::make_pair(NowS() + delay_s, packet));
+  }
+
+  void Ack(uint8_t type, int delay_ms, uint8_t id_high, uint8_t id_low) {
+    Send(delay_ms / 1000.0, {type, 0x02, id_high, id_low});
+  }
+
+  void Serve() {
+    int fd = accept(listener, nullptr, nullptr);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    std::atomic<bool> open{true};
+    std::thread sender([&] {
+      while (open) {
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+        std::lock_guard<std::mutex> guard(mutex);
+        // in order, an ack is never overtaken by a later one
+        while (!outgoing.empty() && outgoing.front().first <= NowS()) {
+          std::vector<uint8_t>& packet = outgoing.front().second;
+          send(fd, packet.data(), packet.size(), MSG_NOSIGNAL);
+          outgoing.pop_front();
+        }
+      }
+    });
+
+    int publishes = 0;
+    std::vector<uint8_t> body;
+    for (;;) {
+      int header = ReadPacket(fd, &body);
+      if (header < 0 || (header >> 4) == DISCONNECT) break;
+      switch (header >> 4) {
+        case CONNECT:
+          if (!silent) Send(0, {0x20, 0x02, 0x00, 0x00});
+          break;
+        case PINGREQ:
+          Send(0, {0xD0, 0x00});
+          break;
+        case SUBSCRIBE: {
+          // granted as requested, refused for "denied"
+          int topic = (body[2] << 8) | body[3];
+          bool denied = topic == 6 && memcmp(&body[4], "denied", 6) == 0;
+          uint8_t granted = denied ? 0x80 : body[4 + topic];
+          Send(kRttMs / 1000.0, {0x90, 0x03, body[0], body[1], granted});
+          break;
+        }
+        case UNSUBSCRIBE:
+          Ack(0xB0, kRttMs, body[0], body[1]);
+          break;
+        case PUBLISH: {
+          int qos = (header >> 1) & 3;
+          int topic = (body[0] << 8) | body[1];
+          int id_at = 2 + topic;
+          if (drop_after > 0 && ++publishes >= drop_after) {
+            // the connection fails with operations in flight
+            shutdown(fd, SHUT_RDWR);
+            break;
+          }
+          if (qos == 1) Ack(0x40, kRttMs, body[id_at], body[id_at + 1]);
+          if (qos == 2) Ack(0x50, kRttMs, body[id_at], body[id_at + 1]);
+          if (topic > 5 && memcmp(&body[2], "echo/", 5) == 0) {
+            // the same message back, the broker's packet id is the client's
+            std::vector<uint8_t> echo = {(uint8_t)(header & 0x36),
+                                         (uint8_t)body.size()};
+            echo.insert(echo.end(), body.begin(), body.end());
+            Send(0, echo);
+          }
+          break;
+        }
+        case PUBREC:  // of an echoed QoS 2 message
+          Ack(0x62, 0, body[0], body[1]);
+          break;
+        case PUBREL:
+          Ack(0x70, kRttMs, body[0], body[1]);
+          break;
+      }
+    }
+    open = false;
+    sender.join();
+    close(fd);
+  }
+};
+
+static const char* kTopicNames[kTopics] = {"dev/a", "dev/b", "dev/c", "dev/d"};
+
+static void Ignore(MQTT::MessageData&) {}
+
+static double RunClient(int publishes) {
+  Broker broker;
+  broker.Start();
+  NetworkInterface net;
+  MQTTNetwork network(&net);
+  MQTT::Client<MQTTNetwork, Countdown> client(network);
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.clientID.cstring = (char*)"client";
+  network.connect(SocketAddress("127.0.0.1", broker.port));
+  Check(client.connect(data) == 0, "Client connects");
+
+  double start = NowS();
+  int done = 0;
+  for (const char* topic : kTopicNames) {
+    done += client.subscribe(topic, MQTT::QOS1, Ignore) == 0;
+  }
+  for (int i = 0; i < publishes; ++i) {
+    uint32_t sequence = i;
+    MQTT::Message message = {MQTT::QOS1, false, false, 0, &sequence,
+                             sizeof(sequence)};
+    done += client.publish(kTopicNames[i % kTopics], message) == 0;
+  }
+  for (const char* topic : kTopicNames) {
+    done += client.unsubscribe(topic) == 0;
+  }
+  double elapsed = NowS() - start;
+  Check(done == publishes + 2 * kTopics, "Client operations succeed");
+  client.disconnect();
+  network.disconnect();
+  broker.Stop();
+  return (publishes + 2 * kTopics) / elapsed;
+}
+
+static std::atomic<int> completed, succeeded, delivered, lost;
+
+static void Done(AsyncClient::Result& result) {
+  succeeded += result.rc == MQTT::SUCCESS;
+  ++completed;
+}
+
+static void Arrived(MQTT::MessageData&) { ++delivered; }
+
+static void Lost(AsyncClient&) { ++lost; }
+
+// Start an operation, waiting for a free slot of the operation table
+template <typename Start>
+static bool Issue(Start start) {
+  double deadline = NowS() + 5;
+  while (start() != MQTT::SUCCESS) {
+    if (NowS() > deadline) return false;
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+  }
+  return true;
+}
+
+static bool WaitFor(std::atomic<int>& counter, int value) {
+  double deadline = NowS() + 5;
+  while (counter < value && NowS() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return counter >= value;
+}
+
+static bool Connect(AsyncClient& client, MQTTNetwork& network, int port) {
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.clientID.cstring = (char*)"async";
+  data.keepAliveInterval = 10;
+  completed = succeeded = 0;
+  return network.connect(SocketAddress("127.0.0.1", port)) == 0 &&
+         client.connect(Done, &data) == MQTT::SUCCESS &&
+         WaitFor(completed, 1) && succeeded == 1 && client.isConnected();
+}
+
+static double RunAsync(int publishes) {
+  Broker broker;
+  broker.Start();
+  NetworkInterface net;
+  MQTTNetwork network(&net);
+  AsyncClient client(network);
+  Check(Connect(client, network, broker.port), "Async connects");
+  completed = succeeded = 0;
+
+  double start = NowS();
+  bool issued = true;
+  std::vector<uint32_t> sequences(publishes);
+  std::vector<MQTT::Message> messages(publishes);
+  for (const char* topic : kTopicNames) {
+    issued &= Issue([&] {
+      return client.subscribe(Done, topic, MQTT::QOS1, Arrived);
+    });
+  }
+  for (int i = 0; i < publishes; ++i) {
+    sequences[i] = i;
+    messages[i] = {MQTT::QOS1, false, false, 0, &sequences[i],
+                   sizeof(uint32_t)};
+    issued &= Issue([&] {
+      return client.publish(Done, kTopicNames[i % kTopics], &messages[i]);
+    });
+  }
+  for (const char* topic : kTopicNames) {
+    issued &= Issue([&] { return client.unsubscribe(Done, topic); });
+  }
+  int operations = publishes + 2 * kTopics;
+  Check(issued && WaitFor(completed, operations), "Async operations complete");
+  double elapsed = NowS() - start;
+  Check(succeeded == operations, "Async operations succeed");
+  Check(client.pending() == 0, "Async operation table empty");
+  client.disconnect();
+  network.disconnect();
+  broker.Stop();
+  return operations / elapsed;
+}
+
+static void CheckReceive() {
+  Broker broker;
+  broker.Start();
+  NetworkInterface net;
+  MQTTNetwork network(&net);
+  AsyncClient client(network);
+  Check(Connect(client, network, broker.port), "Async connects");
+
+  completed = succeeded = delivered = 0;
+  client.subscribe(Done, "echo/#", MQTT::QOS2, Arrived);
+  client.subscribe(Done, "denied", MQTT::QOS1, Arrived);
+  Check(WaitFor(completed, 2) && succeeded == 1,
+        "one subscription granted, one refused");
+
+  uint8_t payload = 1;
+  MQTT::Message messages[3] = {{MQTT::QOS0, false, false, 0, &payload, 1},
+                               {MQTT::QOS1, false, false, 0, &payload, 1},
+                               {MQTT::QOS2, false, false, 0, &payload, 1}};
+  completed = succeeded = 0;
+  for (MQTT::Message& message : messages) {
+    client.publish(Done, "echo/x", &message);
+  }
+  Check(WaitFor(completed, 3) && succeeded == 3, "QoS 0, 1 and 2 publishes");
+  Check(WaitFor(delivered, 3), "echoed messages delivered");
+  std::this_thread::sleep_for(std::chrono::milliseconds(3 * kRttMs));
+  Check(delivered == 3, "each delivered once");
+  client.disconnect();
+  network.disconnect();
+  broker.Stop();
+
+  // the connection drops with operations in flight
+  Broker dropping;
+  dropping.drop_after = 5;
+  dropping.Start();
+  MQTTNetwork network2(&net);
+  AsyncClient client2(network2);
+  client2.setConnectionLostHandler(Lost);
+  lost = 0;
+  Check(Connect(client2, network2, dropping.port), "Async connects");
+  completed = succeeded = 0;
+  int started = 0;
+  MQTT::Message message = {MQTT::QOS1, false, false, 0, &payload, 1};
+  for (int i = 0; i < 8; ++i) {
+    started += client2.publish(Done, "dev/a", &message) == MQTT::SUCCESS;
+  }
+  Check(WaitFor(completed, started) && succeeded == 0,
+        "operations in flight fail with the connection");
+  Check(WaitFor(lost, 1) && !client2.isConnected(), "connection lost handler");
+  Check(client2.pending() == 0, "operation table empty after the loss");
+  network2.disconnect();
+  dropping.Stop();
+
+  // the broker never answers the CONNECT
+  Broker silent;
+  silent.silent = true;
+  silent.Start();
+  MQTTNetwork network3(&net);
+  AsyncClient client3(network3, 200);
+  client3.setConnectionLostHandler(Lost);
+  lost = 0;
+  completed = succeeded = 0;
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  Check(network3.connect(SocketAddress("127.0.0.1", silent.port)) == 0 &&
+            client3.connect(Done, &data) == MQTT::SUCCESS,
+        "CONNECT sent");
+  Check(WaitFor(completed, 1) && succeeded == 0 && !client3.isConnected(),
+        "connect fails without a CONNACK");
+  // the receive thread ends with it, so connect may be called again
+  double deadline = NowS() + 5;
+  int rc;
+  while ((rc = client3.connect(0, &data)) != MQTT::SUCCESS &&
+         NowS() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  Check(rc == MQTT::SUCCESS && lost == 0,
+        "connection ended when the CONNACK timed out");
+  client3.disconnect();
+  network3.disconnect();
+  silent.Stop();
+}
+
+int main(int argc, char** argv) {
+  int publishes = (argc > 1) ? atoi(argv[1]) : 40;
+  double sync = RunClient(publishes);
+  double async = RunAsync(publishes);
+  printf("rtt %d ms, %d operations: Client %.0f ops/s, Async %.0f ops/s "
+         "(%.1fx)\n",
+         kRttMs, publishes + 2 * kTopics, sync, async, async / sync);
+  CheckReceive();
+  if (!failed) printf("receive thread: delivery, refusal and loss OK\n");
+  return failed ? 1 : 0;
+}
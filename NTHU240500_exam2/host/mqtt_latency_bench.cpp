@@ -0,0 +1,250 @@
+// Time broker-to-handler delivery through MQTTNetwork and MQTT::Client.
+//
+//   mqtt_latency_bench [messages]
+//
+// A broker stand-in on the loopback interface accepts the CONNECT and the
+// SUBSCRIBE, then publishes messages carrying their send time at random
+// intervals of 20 to 60 ms. The client runs the real transport and client
+// in two loop shapes:
+//
+//   polled: yield(100) then sleep 400 ms, the supervisor loop before the
+//           socket events
+//   event:  yield(mqtt_cycle_ms) then sleep until the socket or a publish
+//           wakes the thread, as WIFI_MQTT_thread does now
+//
+// and prints the delivery latency for each. Two more runs give the handler
+// kWorkMs of work per message, on the event loop:
+//
+//   inline: the handler runs inside yield(), as messageArrived did
+//   worker: the client's handler copies the message into a MessageInbox and
+//           posts it to a worker thread, as messageArrived does now
+//
+// and print the longest yield() besides the latency: how long the network
+// loop could not send, ack or ping. Exits with 1 if messages are lost
+// (dropped by a full inbox does not count as lost).
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// in main.cpp's order, MQTTClient.h relies on mbed.h before it
+#include "MQTTNetwork.h"
+#include "MQTTmbed.h"
+#include "MQTTClient.h"
+#include "message_inbox.h"
+
+constexpr uint32_t kPublishWake = 1;
+constexpr int kCycleMs = 5;  // mqtt_cycle_ms
+constexpr int kWorkMs = 30;
+constexpr int kInboxSlots = 4;  // as in main.cpp
+
+static uint64_t NowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Read one MQTT packet, returns its type or -1
+static int ReadPacket(int fd, uint8_t* body, int size) {
+  uint8_t header;
+  if (recv(fd, &header, 1, MSG_WAITALL) != 1) return -1;
+  int length = 0, shift = 0;
+  uint8_t c;
+  do {
+    if (recv(fd, &c, 1, MSG_WAITALL) != 1) return -1;
+    length |= (c & 127) << shift;
+    shift += 7;
+  } while (c & 128);
+  if (length > size) return -1;
+  if (length > 0 && recv(fd, body, length, MSG_WAITALL) != length) return -1;
+  return header >> 4;
+}
+
+// Accept one client and publish messages timestamped payloads to it
+static void Broker(int listener, int messages) {
+  int fd = accept(listener, nullptr, nullptr);
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  uint8_t body[256];
+  if (ReadPacket(fd, body, sizeof(body)) != CONNECT) return;
+  const uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+  send(fd, connack, sizeof(connack), MSG_NOSIGNAL);
+  if (ReadPacket(fd, body, sizeof(body)) != SUBSCRIBE) return;
+  const uint8_t suback[] = {0x90, 0x03, body[0], body[1], 0x00};
+  send(fd, suback, sizeof(suback), MSG_NOSIGNAL);
+
+  // PINGREQ and DISCONNECT from the client
+  std::thread reader([fd] {
+    uint8_t packet[256];
+    for (;;) {
+      int type = ReadPacket(fd, packet, sizeof(packet));
+      if (type < 0 || type == DISCONNECT) break;
+      if (type == PINGREQ) {
+        const uint8_t pingresp[] = {0xD0, 0x00};
+        send(fd, pingresp, sizeof(pingresp), MSG_NOSIGNAL);
+      }
+    }
+  });
+
+  srand(1);
+  for (int i = 0; i < messages; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20 + rand() % 41));
+    uint8_t publish[2 + 6 + 8] = {0x30, 6 + 8, 0x00, 0x04, 'M', 'b', 'e', 'd'};
+    uint64_t now = NowUs();
+    memcpy(publish + 8, &now, sizeof(now));
+    send(fd, publish, sizeof(publish), MSG_NOSIGNAL);
+  }
+  reader.join();
+  close(fd);
+}
+
+enum Loop { kPolled, kEvent, kInline, kWorker };
+
+static std::mutex latencies_mutex;
+static std::vector<uint64_t> latencies;
+static MessageInbox<kInboxSlots>* inbox;
+static HostEventQueue* worker_queue;
+
+static int Handled() {
+  std::lock_guard<std::mutex> guard(latencies_mutex);
+  return (int)latencies.size();
+}
+
+// The application handler, work_ms of work after noting the latency
+static void Handle(const void* payload, int length, int work_ms) {
+  uint64_t sent;
+  if (length != sizeof(sent)) return;
+  memcpy(&sent, payload, sizeof(sent));
+  {
+    std::lock_guard<std::mutex> guard(latencies_mutex);
+    latencies.push_back(NowUs() - sent);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(work_ms));
+}
+
+static void Handler(MQTT::MessageData& md) {
+  Handle(md.message.payload, md.message.payloadlen, 0);
+}
+
+static void SlowHandler(MQTT::MessageData& md) {
+  Handle(md.message.payload, md.message.payloadlen, kWorkMs);
+}
+
+static uint32_t NowMs() { return (uint32_t)(NowUs() / 1000); }
+
+static void HandleInbound(InboundMessage* message) {
+  uint32_t started_ms = NowMs();
+  Handle(message->payload, message->length, kWorkMs);
+  inbox->finish(message, started_ms, NowMs());
+}
+
+static void PostHandler(MQTT::MessageData& md) {
+  MQTTString& name = md.topicName;
+  InboundMessage* copy = inbox->store(name.lenstring.data, name.lenstring.len,
+                                      md.message.payload,
+                                      md.message.payloadlen, NowMs());
+  if (copy != nullptr && worker_queue->call(HandleInbound, copy) == 0) {
+    inbox->discard(copy);
+  }
+}
+
+static bool Run(const char* name, Loop loop, int messages) {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in local = {};
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t length = sizeof(local);
+  if (bind(listener, (sockaddr*)&local, sizeof(local)) != 0 ||
+      listen(listener, 1) != 0 ||
+      getsockname(listener, (sockaddr*)&local, &length) != 0) {
+    printf("%s: no loopback socket\n", name);
+    return false;
+  }
+  std::thread broker(Broker, listener, messages);
+
+  NetworkInterface net;
+  EventFlags wake;
+  MQTTNetwork network(&net, &wake);
+  MQTT::Client<MQTTNetwork, Countdown> client(network);
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = 3;
+  data.clientID.cstring = (char*)"bench";
+  data.keepAliveInterval = 10;
+  latencies.clear();
+  MessageInbox<kInboxSlots> slots;
+  HostEventQueue queue(kInboxSlots + 1);
+  inbox = &slots;
+  worker_queue = &queue;
+  std::thread worker(&HostEventQueue::dispatch_forever, &queue);
+  void (*handler)(MQTT::MessageData&) =
+      loop == kInline ? SlowHandler : loop == kWorker ? PostHandler : Handler;
+  if (network.connect(SocketAddress("127.0.0.1", ntohs(local.sin_port))) != 0 ||
+      client.connect(data) != 0 ||
+      client.subscribe("Mbed", MQTT::QOS0, handler) != 0) {
+    printf("%s: cannot connect to the broker stand-in\n", name);
+    return false;
+  }
+
+  uint64_t deadline = NowUs() + (uint64_t)messages * 100000 + 2000000;
+  uint64_t longest_yield = 0;
+  while (Handled() + (int)(slots.stats().dropped + slots.stats().too_long) <
+             messages &&
+         NowUs() < deadline) {
+    if (loop == kPolled) {
+      client.yield(100);
+      std::this_thread::sleep_for(std::chrono::milliseconds(400));
+      continue;
+    }
+    uint64_t start = NowUs();
+    client.yield(kCycleMs);
+    longest_yield = std::max(longest_yield, NowUs() - start);
+    wake.wait_any(kPublishWake | MQTTNetwork::kSocketEvent, 400);
+  }
+  while (slots.waiting() > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  queue.break_dispatch();
+  worker.join();
+  client.disconnect();
+  network.disconnect();
+  broker.join();
+  close(listener);
+
+  std::vector<uint64_t> sorted = latencies;
+  std::sort(sorted.begin(), sorted.end());
+  uint64_t sum = 0;
+  for (uint64_t us : sorted) sum += us;
+  int n = (int)sorted.size();
+  if (n > 0) {
+    printf("%-7s %d/%d messages, latency mean %.2f ms, p50 %.2f ms, "
+           "p95 %.2f ms, max %.2f ms\n",
+           name, n, messages, sum / 1000.0 / n, sorted[n / 2] / 1000.0,
+           sorted[n * 95 / 100] / 1000.0, sorted[n - 1] / 1000.0);
+  }
+  if (loop == kInline || loop == kWorker) {
+    printf("        longest yield %.2f ms", longest_yield / 1000.0);
+    if (loop == kWorker) {
+      const InboxStats& stats = slots.stats();
+      printf(", inbox peak %u of %d, dropped %u", stats.peak, kInboxSlots,
+             stats.dropped);
+    }
+    printf("\n");
+  }
+  // the inbox drops rather than stall the loop, those are counted
+  return n + (int)slots.stats().dropped == messages;
+}
+
+int main(int argc, char** argv) {
+  int messages = (argc > 1) ? atoi(argv[1]) : 50;
+  bool ok = Run("polled", kPolled, messages);
+  ok = Run("event", kEvent, messages) && ok;
+  ok = Run("inline", kInline, messages) && ok;
+  ok = Run("worker", kWorker, messages) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,286 @@
+// Throughput of QoS 1 publishes with a window of publishes in flight.
+//
+//   mqtt_window_bench [messages]
+//
+// A broker stand-in on the loopback interface answers every PUBLISH with a
+// PUBACK after an injected round trip time. The client side is the network
+// thread's path from main.cpp: messages go through a PublishQueue, up to
+// `window` of them are sent with publishNoWait and tracked in an
+// InflightWindow, and a slot is freed once its PUBACK arrived. Prints the
+// messages per second for windows of 1 to 8 at two round trip times.
+//
+// A last run drops the connection halfway without acknowledging what is in
+// flight; the client reconnects and sends the window again. Every run
+// checks that the broker saw every message, first time in order. Exits
+// with 1 otherwise.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// in main.cpp's order, MQTTClient.h relies on mbed.h before it
+#include "MQTTNetwork.h"
+#include "MQTTmbed.h"
+#include "MQTTClient.h"
+#include "inflight_window.h"
+#include "publish_queue.h"
+
+constexpr uint32_t kPublishWake = 1;
+constexpr int kCycleMs = 5;  // mqtt_cycle_ms
+
+struct Message {
+  uint32_t sequence;
+};
+
+static double NowS() {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Read one MQTT packet into body, returns the first header byte or -1
+static int ReadPacket(int fd, uint8_t* body, int size, int* length) {
+  uint8_t header;
+  if (recv(fd, &header, 1, MSG_WAITALL) != 1) return -1;
+  int shift = 0;
+  uint8_t c;
+  *length = 0;
+  do {
+    if (recv(fd, &c, 1, MSG_WAITALL) != 1) return -1;
+    *length |= (c & 127) << shift;
+    shift += 7;
+  } while (c & 128);
+  if (*length > size) return -1;
+  if (*length > 0 && recv(fd, body, *length, MSG_WAITALL) != *length) {
+    return -1;
+  }
+  return header;
+}
+
+struct Broker {
+  int listener;
+  int rtt_ms;
+  int drop_after;  // close the first connection after this many, 0 never
+  std::vector<uint32_t> first_seen;
+  std::vector<bool> seen;
+  int duplicates = 0;
+  std::thread thread;
+
+  void Serve(int messages) {
+    seen.assign(messages, false);
+    int received = 0;
+    bool dropped = false;
+    while ((int)first_seen.size() < messages) {
+      int fd = accept(listener, nullptr, nullptr);
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+      // PUBACKs leave rtt_ms after their PUBLISH arrived
+      std::mutex mutex;
+      std::deque<std::pair<double, uint16_t>> acks;
+      bool open = true;
+      std::thread acker([&] {
+        for (;;) {
+          std::this_thread::sleep_for(std::chrono::microseconds(200));
+          std::lock_guard<std::mutex> guard(mutex);
+          while (!acks.empty() && acks.front().first <= NowS()) {
+            uint16_t id = acks.front().second;
+            uint8_t puback[] = {0x40, 0x02, (uint8_t)(id >> 8), (uint8_t)id};
+            send(fd, puback, sizeof(puback), MSG_NOSIGNAL);
+            acks.pop_front();
+          }
+          if (!open) break;
+        }
+      });
+
+      uint8_t body[256];
+      int length;
+      for (;;) {
+        int header = ReadPacket(fd, body, sizeof(body), &length);
+        if (header < 0 || (header >> 4) == DISCONNECT) break;
+        int type = header >> 4;
+        if (type == CONNECT) {
+          const uint8_t connack[] = {0x20, 0x02, 0x01, 0x00};
+          send(fd, connack, sizeof(connack), MSG_NOSIGNAL);
+        } else if (type == PINGREQ) {
+          const uint8_t pingresp[] = {0xD0, 0x00};
+          send(fd, pingresp, sizeof(pingresp), MSG_NOSIGNAL);
+        } else if (type == PUBLISH) {
+          int topic = (body[0] << 8) | body[1];
+          uint16_t id = (body[2 + topic] << 8) | body[3 + topic];
+          uint32_t sequence;
+          memcpy(&sequence, body + 4 + topic, sizeof(sequence));
+          if (sequence < seen.size() && !seen[sequence]) {
+            seen[sequence] = true;
+            first_seen.push_back(sequence);
+          } else {
+            ++duplicates;
+          }
+          if (drop_after > 0 && !dropped && ++received >= drop_after) {
+            // the connection fails before the acks
+            dropped = true;
+            break;
+          }
+          std::lock_guard<std::mutex> guard(mutex);
+          acks.push_back(std::make_pair(NowS() + rtt_ms / 1000.0, id));
+        }
+      }
+      {
+        std::lock_guard<std::mutex> guard(mutex);
+        open = false;
+        acks.clear();
+      }
+      acker.join();
+      shutdown(fd, SHUT_RDWR);
+      close(fd);
+    }
+  }
+};
+
+static PublishQueue<Message, 8> queue;
+static InflightWindow<8> inflight;
+static int unmatched = 0;
+
+static EventFlags* wake_flags;
+
+// As publish_acked: a free window slot is more to send
+static void Acked(MQTT::pubackData& ack) {
+  if (inflight.ack(ack.type, ack.id)) {
+    wake_flags->set(kPublishWake);
+  } else {
+    ++unmatched;
+  }
+}
+
+static void ReleaseAcked() {
+  for (int n = inflight.release(); n > 0; n--) queue.pop();
+}
+
+static void SendQueued(MQTT::Client<MQTTNetwork, Countdown>& client,
+                       int window) {
+  ReleaseAcked();
+  Message* queued;
+  while (client.isConnected() && inflight.size() < window &&
+         (queued = queue.peek(inflight.size())) != nullptr) {
+    unsigned short id = 0;
+    if (client.publishNoWait("Mbed", queued, sizeof(*queued), id,
+                             MQTT::QOS1) != 0) {
+      break;
+    }
+    inflight.push(id, MQTT::QOS1);
+  }
+}
+
+static int ResendInflight(MQTT::Client<MQTTNetwork, Countdown>& client) {
+  int resent = 0;
+  for (int i = 0; i < inflight.size() && client.isConnected(); i++) {
+    if (inflight.state(i) != kInflightSent) continue;
+    unsigned short id = inflight.id(i);
+    client.publishNoWait("Mbed", queue.peek(i), sizeof(Message), id,
+                         MQTT::QOS1, false, true);
+    ++resent;
+  }
+  return resent;
+}
+
+static bool Run(int window, int rtt_ms, int messages, int drop_after) {
+  Broker broker;
+  broker.listener = socket(AF_INET, SOCK_STREAM, 0);
+  broker.rtt_ms = rtt_ms;
+  broker.drop_after = drop_after;
+  sockaddr_in local = {};
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t length = sizeof(local);
+  if (bind(broker.listener, (sockaddr*)&local, sizeof(local)) != 0 ||
+      listen(broker.listener, 1) != 0 ||
+      getsockname(broker.listener, (sockaddr*)&local, &length) != 0) {
+    printf("no loopback socket\n");
+    return false;
+  }
+  broker.thread = std::thread(&Broker::Serve, &broker, messages);
+
+  NetworkInterface net;
+  EventFlags wake;
+  wake_flags = &wake;
+  MQTTNetwork network(&net, &wake);
+  MQTT::Client<MQTTNetwork, Countdown> client(network);
+  client.setAckHandler(Acked);
+  MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+  data.MQTTVersion = 3;
+  data.clientID.cstring = (char*)"bench";
+  data.cleansession = 0;
+  data.keepAliveInterval = 10;
+  SocketAddress address("127.0.0.1", ntohs(local.sin_port));
+  inflight.clear();
+  unmatched = 0;
+  if (network.connect(address) != 0 || client.connect(data) != 0) {
+    printf("cannot connect to the broker stand-in\n");
+    return false;
+  }
+
+  std::thread producer([&] {
+    for (uint32_t i = 0; i < (uint32_t)messages; ++i) {
+      Message message = {i};
+      while (!queue.push(message)) {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+      }
+      wake.set(kPublishWake);
+    }
+  });
+
+  double start = NowS();
+  int resent = 0, reconnects = 0;
+  while (NowS() - start < 60 &&
+         (queue.size() > 0 || (int)broker.first_seen.size() < messages)) {
+    if (!client.isConnected()) {
+      network.disconnect();
+      if (network.connect(address) != 0 || client.connect(data) != 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        continue;
+      }
+      ++reconnects;
+      resent += ResendInflight(client);
+    }
+    SendQueued(client, window);
+    client.yield(kCycleMs);
+    wake.wait_any(kPublishWake | MQTTNetwork::kSocketEvent, 400);
+  }
+  double seconds = NowS() - start;
+  producer.join();
+  client.disconnect();
+  network.disconnect();
+  broker.thread.join();
+  close(broker.listener);
+
+  bool ordered = (int)broker.first_seen.size() == messages;
+  for (int i = 0; ordered && i < messages; ++i) {
+    ordered = broker.first_seen[i] == (uint32_t)i;
+  }
+  printf("window %d, rtt %2d ms: %4.0f msgs/s", window, rtt_ms,
+         messages / seconds);
+  if (drop_after > 0) {
+    printf(", %d reconnect, %d resent, %d duplicates", reconnects, resent,
+           broker.duplicates);
+  }
+  printf(", %s\n", ordered ? "in order" : "LOST OR REORDERED");
+  return ordered && (drop_after == 0 || reconnects > 0);
+}
+
+int main(int argc, char** argv) {
+  int messages = (argc > 1) ? atoi(argv[1]) : 100;
+  bool ok = true;
+  for (int rtt_ms : {10, 40}) {
+    for (int window : {1, 2, 4, 8}) {
+      ok = Run(window, rtt_ms, messages, 0) && ok;
+    }
+  }
+  ok = Run(4, 10, messages, messages / 2) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,2 @@
+// MQTTNetwork.h includes this for the socket API on the board
+#include "mbed.h"
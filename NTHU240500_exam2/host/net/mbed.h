@@ -0,0 +1,166 @@
+#ifndef HOST_NET_MBED_H_
+#define HOST_NET_MBED_H_
+
+// Host stand-ins for the mbed timer and socket API that MQTTNetwork and
+// MQTT::Client use, so the unchanged transport and client run against a
+// broker on the loopback interface.
+//
+// TCPSocket wraps a POSIX socket. A watcher thread calls the sigio callback
+// when the socket is readable, at most once per recv() call, like a driver
+// that signals new data.
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+
+#include "host/rtos_host.h"
+
+typedef HostEventFlags EventFlags;
+
+constexpr int NSAPI_ERROR_OK = 0;
+constexpr int NSAPI_ERROR_WOULD_BLOCK = -3001;
+constexpr int NSAPI_ERROR_NO_SOCKET = -3005;
+constexpr int NSAPI_ERROR_NO_CONNECTION = -3004;
+
+class Timer {
+ public:
+  void start() {
+    if (!running_) {
+      started_ = std::chrono::steady_clock::now();
+      running_ = true;
+    }
+  }
+  void stop() {
+    if (running_) {
+      elapsed_ += std::chrono::steady_clock::now() - started_;
+      running_ = false;
+    }
+  }
+  void reset() {
+    elapsed_ = std::chrono::steady_clock::duration::zero();
+    started_ = std::chrono::steady_clock::now();
+  }
+  int read_ms() const {
+    auto total = elapsed_;
+    if (running_) total += std::chrono::steady_clock::now() - started_;
+    return (int)std::chrono::duration_cast<std::chrono::milliseconds>(total)
+        .count();
+  }
+
+ private:
+  bool running_ = false;
+  std::chrono::steady_clock::time_point started_;
+  std::chrono::steady_clock::duration elapsed_{};
+};
+
+template <typename T>
+std::function<void()> callback(T* object, void (T::*method)()) {
+  return [object, method] { (object->*method)(); };
+}
+
+class NetworkInterface {};
+
+class SocketAddress {
+ public:
+  SocketAddress(const char* ip = "127.0.0.1", uint16_t port = 0)
+      : port_(port) {
+    inet_pton(AF_INET, ip, &ip_);
+  }
+  uint16_t get_port() const { return port_; }
+  in_addr ip() const { return ip_; }
+
+ private:
+  in_addr ip_;
+  uint16_t port_;
+};
+
+class TCPSocket {
+ public:
+  ~TCPSocket() { close(); }
+
+  int open(NetworkInterface*) {
+    close();
+    fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd_ < 0 ? NSAPI_ERROR_NO_SOCKET : NSAPI_ERROR_OK;
+  }
+
+  void sigio(std::function<void()> handler) { sigio_ = handler; }
+  // ms, -1 blocks, 0 never waits
+  void set_timeout(int timeout) { timeout_ = timeout; }
+  void set_blocking(bool blocking) { timeout_ = blocking ? -1 : 0; }
+
+  int connect(const SocketAddress& address) {
+    sockaddr_in peer = {};
+    peer.sin_family = AF_INET;
+    peer.sin_port = htons(address.get_port());
+    peer.sin_addr = address.ip();
+    if (::connect(fd_, (sockaddr*)&peer, sizeof(peer)) != 0) {
+      return NSAPI_ERROR_NO_CONNECTION;
+    }
+    watching_ = true;
+    watcher_ = std::thread(&TCPSocket::watch, this);
+    return NSAPI_ERROR_OK;
+  }
+
+  int recv(void* data, int size) {
+    armed_ = true;
+    if (!ready(POLLIN)) return NSAPI_ERROR_WOULD_BLOCK;
+    return Result((int)::recv(fd_, data, size, MSG_DONTWAIT));
+  }
+
+  int send(const void* data, int size) {
+    if (!ready(POLLOUT)) return NSAPI_ERROR_WOULD_BLOCK;
+    return Result((int)::send(fd_, data, size, MSG_DONTWAIT | MSG_NOSIGNAL));
+  }
+
+  int close() {
+    watching_ = false;
+    if (watcher_.joinable()) watcher_.join();
+    if (fd_ >= 0) ::close(fd_);
+    fd_ = -1;
+    return NSAPI_ERROR_OK;
+  }
+
+ private:
+  bool ready(short events) {
+    if (fd_ < 0) return false;
+    pollfd p = {fd_, events, 0};
+    return poll(&p, 1, timeout_) > 0;
+  }
+
+  static int Result(int rc) {
+    if (rc >= 0) return rc;
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? NSAPI_ERROR_WOULD_BLOCK
+                                                     : NSAPI_ERROR_NO_CONNECTION;
+  }
+
+  void watch() {
+    while (watching_) {
+      pollfd p = {fd_, POLLIN, 0};
+      if (poll(&p, 1, 5) > 0 && armed_.exchange(false) && sigio_) sigio_();
+    }
+  }
+
+  int fd_ = -1;
+  int timeout_ = -1;
+  std::function<void()> sigio_;
+  std::atomic<bool> armed_{true};
+  std::atomic<bool> watching_{false};
+  std::thread watcher_;
+};
+
+#endif  // HOST_NET_MBED_H_
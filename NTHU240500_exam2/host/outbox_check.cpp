@@ -0,0 +1,237 @@
+// Check the flash outbox against a file-backed flash.
+//
+//   outbox_check [messages]
+//
+// Stores numbered messages of varying length and reopens the outbox on the
+// same image after every step, like a reboot. Checks that flushed messages
+// survive and come out oldest first until consumed, that staged ones are
+// lost, that a full ring drops its oldest messages, that a slot with a bad
+// CRC or one torn behind the newest is skipped, streams the given number of
+// messages through the ring many times over, and that a batch the ring
+// overwrote while it was out marks none of the messages now in its slots.
+// Exits with 1 on the first failure.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <memory>
+
+#include "host/file_flash.h"
+#include "message_outbox.h"
+
+constexpr uint32_t kSectors = 3;
+constexpr uint32_t kSize = kSectors * kOutboxSectorSize;
+constexpr int kStaging = 4;
+
+typedef MessageOutbox<FileFlash, kStaging> Outbox;
+
+static const char* image = "outbox_check.img";
+static std::unique_ptr<FileFlash> flash;
+static std::unique_ptr<Outbox> outbox;
+
+static void Fail(const char* what, int line) {
+  printf("FAILED line %d: %s\n", line, what);
+  remove(image);
+  exit(1);
+}
+
+#define CHECK(condition)                          \
+  do {                                            \
+    if (!(condition)) Fail(#condition, __LINE__); \
+  } while (0)
+
+// Message n: its number, then filler up to a length that depends on n
+static int Make(uint32_t n, uint8_t* payload) {
+  int length = 4 + n % (kOutboxMaxPayload - 3);
+  memcpy(payload, &n, 4);
+  for (int i = 4; i < length; ++i) payload[i] = (uint8_t)(n + i);
+  return length;
+}
+
+// Number of a message, -1 if its filler is wrong
+static int64_t Number(const uint8_t* payload, int length) {
+  uint32_t n;
+  memcpy(&n, payload, 4);
+  uint8_t expected[kOutboxMaxPayload];
+  if (Make(n, expected) != length || memcmp(payload, expected, length) != 0) {
+    return -1;
+  }
+  return n;
+}
+
+static void Reboot() {
+  outbox.reset();
+  flash.reset(new FileFlash(image, kSize));
+  outbox.reset(new Outbox(flash.get(), 0, kSize));
+  CHECK(outbox->init() == 0);
+}
+
+static void Append(uint32_t n) {
+  uint8_t payload[kOutboxMaxPayload];
+  CHECK(outbox->append(payload, Make(n, payload)));
+}
+
+// The oldest pending messages must be first, first + 1, ... (count of them)
+static void Expect(uint32_t first, int count) {
+  uint32_t next = first;
+  int visited = outbox->peek(count, [&](const uint8_t* payload, int length) {
+    CHECK(Number(payload, length) == next);
+    ++next;
+    return true;
+  });
+  CHECK(visited == count);
+}
+
+// Mark the count oldest pending messages as sent, as a replay does
+static void Consume(int count) {
+  uint32_t first = 0, last = 0;
+  int visited = outbox->peek(
+      count, [](const uint8_t*, int) { return true; }, &first, &last);
+  CHECK(visited == count);
+  CHECK(outbox->consume(first, last) == 0);
+}
+
+int main(int argc, char** argv) {
+  uint32_t messages = (argc > 1) ? atoi(argv[1]) : 20000;
+  const int capacity = kSize / kOutboxSlotSize;
+  remove(image);
+
+  // flushed messages survive a reboot, oldest first until consumed
+  Reboot();
+  for (uint32_t n = 0; n < 10; ++n) Append(n);
+  CHECK(outbox->pending() == 10 && outbox->staged() == 2);
+  CHECK(outbox->flush() == 0);
+  Reboot();
+  CHECK(outbox->pending() == 10);
+  Expect(0, 5);
+  Consume(5);
+  Reboot();
+  CHECK(outbox->pending() == 5);
+  Expect(5, 5);
+
+  // staged messages are lost on a reset
+  Append(10);
+  Append(11);
+  Reboot();
+  CHECK(outbox->pending() == 5);
+
+  // the sequence continues after the reboot, the ring drops its oldest
+  // messages when it is full
+  uint32_t n = 12;
+  for (int i = 0; i < 2 * capacity; ++i) Append(n++);
+  CHECK(outbox->flush() == 0);
+  Reboot();
+  int pending = outbox->pending();
+  CHECK(pending > capacity - kOutboxSectorSize / kOutboxSlotSize);
+  CHECK(pending <= capacity);
+  Expect(n - pending, pending);
+
+  // a torn slot is skipped
+  uint32_t oldest = n - pending;
+  uint8_t zero = 0;
+  int found = -1;
+  for (uint32_t offset = 0; offset < kSize; offset += kOutboxSlotSize) {
+    uint8_t slot[kOutboxSlotSize];
+    CHECK(flash->read(slot, offset, sizeof(slot)) == 0);
+    uint32_t number;
+    memcpy(&number, slot + kOutboxHeaderSize, 4);
+    if (number == oldest + 1) {
+      CHECK(flash->program(&zero, offset + kOutboxHeaderSize + 6, 1) == 0);
+      found = offset;
+      break;
+    }
+  }
+  CHECK(found >= 0);
+  Reboot();
+  CHECK(outbox->pending() == pending - 1);
+  CHECK(outbox->stats().corrupt == 1);
+  Expect(oldest, 1);
+  Consume(1);
+  Expect(oldest + 2, pending - 2);
+
+  // half a slot behind the newest one, as a reset in the middle of a
+  // program leaves it: the next message goes behind it
+  Consume(pending - 2);
+  CHECK(outbox->pending() == 0);
+  Append(n);
+  CHECK(outbox->flush() == 0);
+  for (uint32_t offset = 0; offset < kSize; offset += kOutboxSlotSize) {
+    uint8_t slot[kOutboxSlotSize];
+    CHECK(flash->read(slot, offset, sizeof(slot)) == 0);
+    uint32_t number;
+    memcpy(&number, slot + kOutboxHeaderSize, 4);
+    if (number == n) {
+      uint32_t next = (offset + kOutboxSlotSize) % kSize;
+      if (next % kOutboxSectorSize == 0) break;  // a new sector is erased
+      uint8_t torn[kOutboxSlotSize / 2];
+      memset(torn, 0x5A, sizeof(torn));
+      CHECK(flash->program(torn, next, sizeof(torn)) == 0);
+      break;
+    }
+  }
+  Reboot();
+  Append(n + 1);
+  CHECK(outbox->flush() == 0);
+  Reboot();
+  Expect(n, 2);
+  Consume(2);
+  n += 2;
+
+  // stream through the ring with a backlog of up to half of it, replayed in
+  // batches of up to 16 as the app does, and reboot now and then
+  srand(1);
+  uint32_t next = n;
+  for (uint32_t end = n + messages; n < end;) {
+    int burst = 1 + rand() % 20;
+    for (int i = 0; i < burst && outbox->pending() < capacity / 2; ++i) {
+      Append(n++);
+    }
+    CHECK(outbox->flush() == 0);
+    int batch = 1 + rand() % 16;
+    uint32_t expected = next;
+    uint32_t first = 0, last = 0;
+    int visited = outbox->peek(
+        batch,
+        [&](const uint8_t* payload, int length) {
+          CHECK(Number(payload, length) == expected++);
+          return true;
+        },
+        &first, &last);
+    CHECK(visited > 0);
+    // all of them went out, or the connection dropped before the ack
+    if (rand() % 8 != 0) {
+      CHECK(outbox->consume(first, last) == 0);
+      next += visited;
+    }
+    if (rand() % 50 == 0) Reboot();
+  }
+  CHECK(outbox->stats().dropped == 0);
+
+  // a batch waits for its ack while the ring overwrites it: the newer
+  // messages in its slots stay pending
+  CHECK(outbox->flush() == 0);
+  Consume(outbox->pending());
+  for (int i = 0; i < 5; ++i) Append(n++);
+  CHECK(outbox->flush() == 0);
+  uint32_t first = 0, last = 0;
+  CHECK(outbox->peek(
+            5, [](const uint8_t*, int) { return true; }, &first, &last) == 5);
+  uint32_t overwritten = outbox->stats().overwritten;
+  for (int i = 0; i < capacity; ++i) Append(n++);
+  CHECK(outbox->flush() == 0);
+  pending = outbox->pending();
+  CHECK(outbox->stats().overwritten > overwritten);
+  CHECK(n - pending > last);
+  uint32_t sent = outbox->stats().sent;
+  CHECK(outbox->consume(first, last) == 0);
+  CHECK(outbox->stats().sent == sent);
+  CHECK(outbox->pending() == pending);
+  Expect(n - pending, pending);
+
+  printf("outbox: %u messages through %d slots, %d pending\n", n, capacity,
+         outbox->pending());
+  remove(image);
+  return 0;
+}
@@ -0,0 +1,235 @@
+// Fuzz MQTT::StreamDecoder and time it against MQTTPacket_read.
+//
+//   packet_decoder_bench [packets]
+//
+// Builds a stream of random packets: acks, pings and publishes whose
+// remaining length takes 1 to 3 bytes, a few of them longer than the
+// client's 100 byte read buffer. The fuzz part feeds the stream to the
+// decoder in pieces of random size, by space()/commit() and by feed(), and
+// checks that it hands out exactly the packets of the stream, reports each
+// long one and stays in step behind it. It also checks that a malformed
+// remaining length breaks the stream until reset() and that random bytes
+// never make it write past the buffer.
+//
+// The bench part decodes a stream of publishes and acks the way
+// MQTT::Client used to read one (MQTTPacket_read: the header byte, the
+// remaining length a byte at a time, then the rest) and with the decoder
+// taking socket sized pieces. It prints the time and the reads per packet.
+// Exits with 1 on the first mismatch.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "MQTTPacket.h"
+#include "MQTTStreamDecoder.h"
+
+constexpr int kBufferSize = 100;  // MQTT::Client's readbuf
+typedef MQTT::StreamDecoder<2 * kBufferSize> Decoder;
+
+typedef std::vector<uint8_t> Bytes;
+
+static void Fail(const char* what, int line) {
+  printf("FAILED line %d: %s\n", line, what);
+  exit(1);
+}
+
+#define CHECK(condition)                          \
+  do {                                            \
+    if (!(condition)) Fail(#condition, __LINE__); \
+  } while (0)
+
+static Bytes Packet(uint8_t header, int remaining, std::mt19937& random) {
+  Bytes packet(1, header);
+  uint8_t length[4];
+  int n = MQTTPacket_encode(length, remaining);
+  packet.insert(packet.end(), length, length + n);
+  for (int i = 0; i < remaining; ++i) packet.push_back((uint8_t)random());
+  return packet;
+}
+
+static Bytes RandomPacket(std::mt19937& random) {
+  switch (random() % 8) {
+    case 0:
+      return Packet(0xD0, 0, random);  // PINGRESP
+    case 1:
+    case 2:
+      return Packet(0x40, 2, random);  // PUBACK
+    case 3:  // a publish with a 2 or 3 byte length, too long for the buffer
+      return Packet(0x30, 128 + random() % 20000, random);
+    default:
+      return Packet(0x30 | (random() % 2) << 1, random() % 98, random);
+  }
+}
+
+// Decode stream in random pieces, the packets must come out as expected
+static void Fuzz(const Bytes& stream, const std::vector<Bytes>& packets,
+                 std::mt19937& random) {
+  Decoder decoder;
+  uint8_t buffer[kBufferSize + 1];
+  size_t offset = 0, next = 0;
+  bool by_feed = random() % 2;
+  int max_piece = 1 + random() % 300;
+  while (next < packets.size()) {
+    int len = decoder.next(buffer, kBufferSize);
+    if (len == 0) {
+      CHECK(offset < stream.size());
+      int piece = 1 + random() % max_piece;
+      piece = std::min<int>(piece, stream.size() - offset);
+      if (by_feed) {
+        offset += decoder.feed(stream.data() + offset, piece);
+      } else {
+        int room;
+        uint8_t* to = decoder.space(&room);
+        piece = std::min(piece, room);
+        CHECK(room > 0);
+        memcpy(to, stream.data() + offset, piece);
+        decoder.commit(piece);
+        offset += piece;
+      }
+      continue;
+    }
+    const Bytes& expected = packets[next++];
+    if (expected.size() > kBufferSize) {
+      CHECK(len == MQTTPACKET_BUFFER_TOO_SHORT);
+    } else {
+      CHECK(len == (int)expected.size());
+      CHECK(memcmp(buffer, expected.data(), len) == 0);
+    }
+  }
+  CHECK(!decoder.ready());
+}
+
+// Random bytes: whatever comes out fits the buffer, and a malformed length
+// sticks
+static void Garbage(std::mt19937& random) {
+  Decoder decoder;
+  uint8_t buffer[kBufferSize + 16];
+  memset(buffer, 0xAA, sizeof(buffer));
+  for (int round = 0; round < 200; ++round) {
+    uint8_t bytes[64];
+    int n = 1 + random() % sizeof(bytes);
+    for (int i = 0; i < n; ++i) bytes[i] = (uint8_t)random();
+    decoder.feed(bytes, n);
+    int len;
+    while ((len = decoder.next(buffer, kBufferSize)) > 0) {
+      CHECK(len <= kBufferSize);
+    }
+    for (int i = kBufferSize; i < (int)sizeof(buffer); ++i) {
+      CHECK(buffer[i] == 0xAA);
+    }
+    if (len == MQTTPACKET_READ_ERROR) {
+      CHECK(decoder.next(buffer, kBufferSize) == MQTTPACKET_READ_ERROR);
+      CHECK(decoder.ready());
+      decoder.reset();
+      CHECK(decoder.buffered() == 0);
+    }
+  }
+  const uint8_t malformed[] = {0x30, 0xFF, 0xFF, 0xFF, 0xFF, 0x01};
+  decoder.reset();
+  decoder.feed(malformed, sizeof(malformed));
+  CHECK(decoder.next(buffer, kBufferSize) == MQTTPACKET_READ_ERROR);
+}
+
+// MQTTPacket_read's source, one call per read as MQTTNetwork::read
+static const Bytes* source;
+static size_t source_offset;
+static long reads;
+
+static int Get(unsigned char* buffer, int len) {
+  ++reads;
+  len = std::min<int>(len, source->size() - source_offset);
+  memcpy(buffer, source->data() + source_offset, len);
+  source_offset += len;
+  return len;
+}
+
+static double NsPerPacket(std::chrono::steady_clock::time_point start,
+                          long packets) {
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::nano>(elapsed).count() / packets;
+}
+
+static void Bench(int count) {
+  std::mt19937 random(7);
+  Bytes stream;
+  for (int i = 0; i < count; ++i) {
+    Bytes packet = (i % 3 == 2) ? Packet(0x40, 2, random)
+                                : Packet(0x30, 8 + random() % 60, random);
+    stream.insert(stream.end(), packet.begin(), packet.end());
+  }
+
+  uint8_t buffer[kBufferSize];
+  int read_packets = 0;
+  long checksum = 0;
+  source = &stream;
+  source_offset = 0;
+  reads = 0;
+  auto start = std::chrono::steady_clock::now();
+  while (source_offset < stream.size() &&
+         MQTTPacket_read(buffer, kBufferSize, Get) > 0) {
+    checksum += buffer[0];
+    ++read_packets;
+  }
+  double read_ns = NsPerPacket(start, read_packets);
+  double read_calls = (double)reads / read_packets;
+
+  // pieces of up to 536 bytes, a small TCP segment
+  Decoder decoder;
+  int decoded = 0;
+  long pieces = 0;
+  size_t offset = 0;
+  start = std::chrono::steady_clock::now();
+  for (;;) {
+    int len = decoder.next(buffer, kBufferSize);
+    if (len > 0) {
+      checksum -= buffer[0];
+      ++decoded;
+      continue;
+    }
+    if (offset == stream.size()) break;
+    int room;
+    uint8_t* to = decoder.space(&room);
+    int piece = std::min<int>(std::min(room, 536), stream.size() - offset);
+    memcpy(to, stream.data() + offset, piece);
+    decoder.commit(piece);
+    offset += piece;
+    ++pieces;
+  }
+  double decode_ns = NsPerPacket(start, decoded);
+
+  CHECK(read_packets == count && decoded == count && checksum == 0);
+  printf("%d packets: MQTTPacket_read %.0f ns, %.2f reads/packet; "
+         "StreamDecoder %.0f ns, %.2f reads/packet\n",
+         count, read_ns, read_calls, decode_ns, (double)pieces / decoded);
+}
+
+int main(int argc, char** argv) {
+  int count = (argc > 1) ? atoi(argv[1]) : 200000;
+
+  int streams = 0, packets_checked = 0;
+  for (unsigned seed = 1; seed <= 300; ++seed) {
+    std::mt19937 random(seed);
+    std::vector<Bytes> packets;
+    Bytes stream;
+    for (int i = 0; i < 50; ++i) {
+      packets.push_back(RandomPacket(random));
+      stream.insert(stream.end(), packets.back().begin(), packets.back().end());
+    }
+    Fuzz(stream, packets, random);
+    Garbage(random);
+    ++streams;
+    packets_checked += packets.size();
+  }
+  printf("fuzz: %d streams, %d packets decoded in random pieces\n", streams,
+         packets_checked);
+
+  Bench(count);
+  return 0;
+}
@@ -0,0 +1,116 @@
+// Check the lock-free publish queue under concurrent producers.
+//
+//   publish_queue_check [messages per producer]
+//
+// Several producers push numbered messages as fast as they can, retrying
+// when the queue is full, while one consumer pops, alternately by copy and
+// in place with front(). Every message must come
+// out exactly once and in push order per producer, with an intact payload.
+// Prints the throughput and how often producers found the queue full.
+// Exits with 1 on any loss, duplicate, reordering or torn message.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "publish_queue.h"
+
+constexpr int kProducers = 4;
+
+struct Message {
+  int producer;
+  uint32_t sequence;
+  char payload[96];  // about an MQTT packet, filled from the sequence
+};
+
+static void Fill(Message* message) {
+  for (size_t i = 0; i < sizeof(message->payload); ++i) {
+    message->payload[i] = (char)(message->sequence * 31 + i);
+  }
+}
+
+static bool Intact(const Message& message) {
+  for (size_t i = 0; i < sizeof(message.payload); ++i) {
+    if (message.payload[i] != (char)(message.sequence * 31 + i)) return false;
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  uint32_t messages = (argc > 1) ? atoi(argv[1]) : 200000;
+
+  static PublishQueue<Message, 8> queue;
+  std::atomic<uint64_t> full(0);
+  std::atomic<int> running(kProducers);
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> producers;
+  for (int p = 0; p < kProducers; ++p) {
+    producers.emplace_back([&, p] {
+      Message message;
+      message.producer = p;
+      for (uint32_t i = 0; i < messages; ++i) {
+        message.sequence = i;
+        Fill(&message);
+        while (!queue.push(message)) {
+          ++full;
+          std::this_thread::yield();
+        }
+      }
+      --running;
+    });
+  }
+
+  std::vector<uint32_t> next(kProducers, 0);
+  uint64_t received = 0, errors = 0;
+  Message message;
+  while (running > 0 || queue.size() > 0) {
+    if (received % 2 == 0) {
+      if (!queue.pop(&message)) {
+        std::this_thread::yield();
+        continue;
+      }
+    } else {
+      Message* oldest = queue.front();
+      if (oldest == nullptr) {
+        std::this_thread::yield();
+        continue;
+      }
+      message = *oldest;
+      queue.pop();
+    }
+    ++received;
+    if (message.producer < 0 || message.producer >= kProducers ||
+        message.sequence != next[message.producer] || !Intact(message)) {
+      if (errors++ < 10) {
+        printf("producer %d: got %u, expected %u\n", message.producer,
+               message.sequence,
+               next[message.producer < 0 ? 0 : message.producer % kProducers]);
+      }
+    }
+    if (message.producer >= 0 && message.producer < kProducers) {
+      next[message.producer] = message.sequence + 1;
+    }
+  }
+  for (std::thread& t : producers) t.join();
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start).count();
+
+  for (int p = 0; p < kProducers; ++p) {
+    if (next[p] != messages) {
+      ++errors;
+      printf("producer %d: %u of %u messages arrived\n", p, next[p], messages);
+    }
+  }
+  printf("%llu messages from %d producers in %.3f s (%.0f msgs/s), "
+         "queue full %llu times, %llu errors\n",
+         (unsigned long long)received, kProducers, seconds, received / seconds,
+         (unsigned long long)full.load(), (unsigned long long)errors);
+  return errors == 0 ? 0 : 1;
+}
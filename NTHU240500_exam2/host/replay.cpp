@@ -0,0 +1,408 @@
+// Replay recorded traces through the gesture pipeline on the host.
+//
+//   replay [-j jobs] [-d decision] [-v] <manifest>
+//
+// Every manifest line is "<label> <trace>": the expected gesture index
+// (0 RING, 1 SLOPE, 2 LEFT TO RIGHT, or "none") followed by a trace image or
+// CSV from trace_tool, relative to the manifest. The accelerometer records of
+// the trace stand in for BSP_ACCELERO_AccGetXYZ, everything downstream is the
+// app code: ReadAccelerometer, the TFLM interpreter with
+// g_magic_wand_model_data and PredictGesture.
+//
+// -d picks the PredictGesture decision stage: 0 consecutive (the default,
+// as on the board), 1 EMA, 2 hysteresis, 3 segmentation, which reads
+// through ReadAccelerometerSegment and invokes the model once per motion
+// segment instead of once per sample.
+//
+// Traces are spread over one worker process per core. The app keeps its state
+// in globals, so processes rather than threads keep the replays independent.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "../accelerometer_handler.h"
+#include "../gesture_handler.h"
+#include "stm32l475e_iot01_accelero.h"
+#include "stm32l475e_iot01_gyro.h"
+#include "stm32l475e_iot01_magneto.h"
+#include "trace_file.h"
+
+// Window latencies are kept in 1 us buckets, the last one collects the rest
+constexpr int kLatencyBuckets = 20000;
+// Detection latencies from the first inference are kept in 10 ms buckets
+constexpr int kDetectionBuckets = 1000;
+constexpr int kDetectionBucketMs = 10;
+
+struct ReplayStats {
+  uint64_t traces;
+  uint64_t failed;
+  uint64_t samples;
+  uint64_t windows;
+  uint64_t detections;
+  uint64_t recorded_ms;
+  uint64_t busy_ns;
+  // Rows are labels, columns the first gesture detected in the trace, with
+  // label_num meaning none
+  uint64_t confusion[label_num + 1][label_num + 1];
+  uint32_t latency_us[kLatencyBuckets];
+  // Time and inferences from the first inference of a gesture trace to its
+  // first detection, plus false detections in traces labelled none
+  uint64_t detected;
+  uint64_t detection_windows;
+  uint64_t none_ms;
+  uint64_t false_detections;
+  uint32_t detection_ms[kDetectionBuckets];
+};
+
+static bool verbose = false;
+static int decision = kDecisionConsecutive;
+
+// The accelerometer frames of the trace being replayed
+static std::vector<TraceRecord> frames;
+static size_t next_frame = 0;
+
+extern "C" void DebugLog(const char* s) {
+  if (verbose) fprintf(stderr, "%s", s);
+}
+
+ACCELERO_StatusTypeDef BSP_ACCELERO_Init(void) { return ACCELERO_OK; }
+void BSP_ACCELERO_DeInit(void) {}
+void BSP_ACCELERO_LowPower(uint16_t status) {}
+
+void BSP_ACCELERO_AccGetXYZ(int16_t* pDataXYZ) {
+  if (next_frame >= frames.size()) {
+    pDataXYZ[0] = pDataXYZ[1] = pDataXYZ[2] = 0;
+    return;
+  }
+  for (int i = 0; i < 3; ++i) pDataXYZ[i] = TraceAccel(frames[next_frame], i);
+  ++next_frame;
+}
+
+// Traces only hold the accelerometer, the other sensors are unavailable
+void LSM6DSL_AccGyroReadRaw(int16_t* pData) { memset(pData, 0, 12); }
+uint8_t BSP_GYRO_Init(void) { return GYRO_ERROR; }
+void BSP_GYRO_DeInit(void) {}
+void BSP_GYRO_LowPower(uint16_t status) {}
+MAGNETO_StatusTypeDef BSP_MAGNETO_Init(void) { return MAGNETO_ERROR; }
+void BSP_MAGNETO_DeInit(void) {}
+void BSP_MAGNETO_LowPower(uint16_t status) {}
+void LIS3MDL_MagReadRaw(int16_t* pData) { memset(pData, 0, 6); }
+
+static uint64_t NowNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct ManifestEntry {
+  int label;
+  std::string path;
+};
+
+static bool ReadManifest(const char* path, std::vector<ManifestEntry>* entries) {
+  FILE* file = fopen(path, "r");
+  if (!file) return false;
+
+  std::string dir(path);
+  size_t slash = dir.rfind('/');
+  dir = (slash == std::string::npos) ? "" : dir.substr(0, slash + 1);
+
+  char line[512];
+  char label[16];
+  char trace[480];
+  while (fgets(line, sizeof(line), file)) {
+    if (line[0] == '#' || sscanf(line, "%15s %479s", label, trace) != 2) {
+      continue;
+    }
+    ManifestEntry entry;
+    entry.label = (strcmp(label, "none") == 0) ? label_num : atoi(label);
+    if (entry.label < 0 || entry.label > label_num) entry.label = label_num;
+    entry.path = (trace[0] == '/') ? trace : dir + trace;
+    entries->push_back(entry);
+  }
+  fclose(file);
+  return true;
+}
+
+static void ReplayTrace(tflite::ErrorReporter* error_reporter,
+                        tflite::MicroInterpreter* interpreter,
+                        const ManifestEntry& entry, ReplayStats* stats) {
+  std::vector<TraceRecord> records;
+  if (!LoadTraceFile(entry.path.c_str(), &records)) {
+    fprintf(stderr, "cannot read %s\n", entry.path.c_str());
+    ++stats->failed;
+    return;
+  }
+  frames.clear();
+  for (const TraceRecord& record : records) {
+    if (record.type == kTraceAccel) frames.push_back(record);
+  }
+  next_frame = 0;
+  if (frames.empty()) {
+    ++stats->failed;
+    return;
+  }
+
+  TfLiteTensor* model_input = interpreter->input(0);
+  int input_length = model_input->bytes / sizeof(float);
+  ResetGesturePrediction();
+
+  // Start from an empty ring buffer like a fresh entry into gesture mode
+  bool should_clear_buffer = true;
+  int first_gesture = label_num;
+  int windows = 0;
+  uint32_t first_window_ms = 0;
+  while (next_frame < frames.size()) {
+    bool got_data =
+        (decision == kDecisionSegment)
+            ? ReadAccelerometerSegment(error_reporter, model_input->data.f,
+                                       input_length, should_clear_buffer)
+            : ReadAccelerometer(error_reporter, model_input->data.f,
+                                input_length, should_clear_buffer);
+    ++stats->samples;
+    if (!got_data) {
+      should_clear_buffer = false;
+      continue;
+    }
+
+    uint64_t start = NowNs();
+    if (interpreter->Invoke() != kTfLiteOk) {
+      ++stats->failed;
+      return;
+    }
+    int gesture_index = PredictGesture(interpreter->output(0)->data.f);
+    uint64_t elapsed = NowNs() - start;
+
+    if (windows++ == 0) first_window_ms = frames[next_frame - 1].time_ms;
+    ++stats->windows;
+    stats->busy_ns += elapsed;
+    uint64_t bucket = elapsed / 1000;
+    if (bucket >= kLatencyBuckets) bucket = kLatencyBuckets - 1;
+    ++stats->latency_us[bucket];
+
+    should_clear_buffer =
+        decision != kDecisionSegment && gesture_index < label_num;
+    if (gesture_index < label_num) {
+      ++stats->detections;
+      if (entry.label == label_num) ++stats->false_detections;
+      if (first_gesture == label_num && entry.label < label_num) {
+        uint32_t ms = frames[next_frame - 1].time_ms - first_window_ms;
+        uint32_t bucket = ms / kDetectionBucketMs;
+        if (bucket >= kDetectionBuckets) bucket = kDetectionBuckets - 1;
+        ++stats->detected;
+        stats->detection_windows += windows;
+        ++stats->detection_ms[bucket];
+      }
+      if (first_gesture == label_num) first_gesture = gesture_index;
+    }
+  }
+
+  ++stats->traces;
+  stats->recorded_ms += frames.back().time_ms - frames.front().time_ms;
+  if (entry.label == label_num) {
+    stats->none_ms += frames.back().time_ms - frames.front().time_ms;
+  }
+  ++stats->confusion[entry.label][first_gesture];
+}
+
+// Replay every jobs-th trace starting at worker, then send the stats back
+static void RunWorker(const std::vector<ManifestEntry>& entries, int worker,
+                      int jobs, int fd) {
+  static ReplayStats stats;
+  memset(&stats, 0, sizeof(stats));
+
+  static tflite::MicroErrorReporter micro_error_reporter;
+  tflite::ErrorReporter* error_reporter = &micro_error_reporter;
+  tflite::MicroInterpreter* interpreter = SetupGestureModel(error_reporter);
+  SetGestureDecision(decision);
+  if (interpreter != nullptr &&
+      SetupAccelerometer(error_reporter) == kTfLiteOk) {
+    for (size_t i = worker; i < entries.size(); i += jobs) {
+      ReplayTrace(error_reporter, interpreter, entries[i], &stats);
+    }
+  } else {
+    stats.failed = entries.size();
+  }
+
+  const char* p = reinterpret_cast<const char*>(&stats);
+  size_t left = sizeof(stats);
+  while (left > 0) {
+    ssize_t n = write(fd, p, left);
+    if (n <= 0) break;
+    p += n;
+    left -= n;
+  }
+}
+
+static void Merge(const ReplayStats& from, ReplayStats* to) {
+  to->traces += from.traces;
+  to->failed += from.failed;
+  to->samples += from.samples;
+  to->windows += from.windows;
+  to->detections += from.detections;
+  to->recorded_ms += from.recorded_ms;
+  to->busy_ns += from.busy_ns;
+  for (int i = 0; i <= label_num; ++i) {
+    for (int j = 0; j <= label_num; ++j) {
+      to->confusion[i][j] += from.confusion[i][j];
+    }
+  }
+  for (int i = 0; i < kLatencyBuckets; ++i) {
+    to->latency_us[i] += from.latency_us[i];
+  }
+  to->detected += from.detected;
+  to->detection_windows += from.detection_windows;
+  to->none_ms += from.none_ms;
+  to->false_detections += from.false_detections;
+  for (int i = 0; i < kDetectionBuckets; ++i) {
+    to->detection_ms[i] += from.detection_ms[i];
+  }
+}
+
+// Bucket holding the given fraction of count samples
+static int Percentile(const uint32_t* buckets, int size, uint64_t count,
+                      double fraction) {
+  uint64_t target = (uint64_t)(count * fraction);
+  if (target >= count) target = count - 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < size; ++i) {
+    seen += buckets[i];
+    if (seen > target) return i;
+  }
+  return size - 1;
+}
+
+static void Report(const ReplayStats& stats, double wall_s, int jobs) {
+  static const char* names[label_num + 1] = {"RING", "SLOPE", "LR", "NONE"};
+  static const char* decisions[] = {"consecutive", "ema", "hysteresis",
+                                     "segment"};
+
+  printf("traces %llu (failed %llu), %d jobs, %s decision\n",
+         (unsigned long long)stats.traces, (unsigned long long)stats.failed,
+         jobs, decisions[decision]);
+  printf("samples %llu, windows %llu, detections %llu\n",
+         (unsigned long long)stats.samples, (unsigned long long)stats.windows,
+         (unsigned long long)stats.detections);
+  printf("wall %.2f s: %.0f windows/s, %.0f samples/s, %.1fx recorded time\n",
+         wall_s, stats.windows / wall_s, stats.samples / wall_s,
+         stats.recorded_ms / 1000.0 / wall_s);
+  if (stats.windows > 0) {
+    const uint32_t* us = stats.latency_us;
+    printf("window latency us: mean %.1f p50 %d p90 %d p99 %d max %d\n",
+           stats.busy_ns / 1000.0 / stats.windows,
+           Percentile(us, kLatencyBuckets, stats.windows, 0.5),
+           Percentile(us, kLatencyBuckets, stats.windows, 0.9),
+           Percentile(us, kLatencyBuckets, stats.windows, 0.99),
+           Percentile(us, kLatencyBuckets, stats.windows, 1.0));
+  }
+  if (stats.detected > 0) {
+    const uint32_t* ms = stats.detection_ms;
+    printf("detection latency ms: p10 %d p50 %d p90 %d max %d, "
+           "mean %.1f inferences\n",
+           Percentile(ms, kDetectionBuckets, stats.detected, 0.1) *
+               kDetectionBucketMs,
+           Percentile(ms, kDetectionBuckets, stats.detected, 0.5) *
+               kDetectionBucketMs,
+           Percentile(ms, kDetectionBuckets, stats.detected, 0.9) *
+               kDetectionBucketMs,
+           Percentile(ms, kDetectionBuckets, stats.detected, 1.0) *
+               kDetectionBucketMs,
+           (double)stats.detection_windows / stats.detected);
+  }
+  if (stats.none_ms > 0) {
+    printf("false detections %llu in %.1f s of none traces (%.2f per min)\n",
+           (unsigned long long)stats.false_detections, stats.none_ms / 1000.0,
+           stats.false_detections * 60000.0 / stats.none_ms);
+  }
+
+  printf("\nconfusion (rows label, columns first detection)\n%8s", "");
+  for (int j = 0; j <= label_num; ++j) printf("%8s", names[j]);
+  printf("\n");
+  for (int i = 0; i <= label_num; ++i) {
+    printf("%8s", names[i]);
+    for (int j = 0; j <= label_num; ++j) {
+      printf("%8llu", (unsigned long long)stats.confusion[i][j]);
+    }
+    printf("\n");
+  }
+}
+
+int main(int argc, char* argv[]) {
+  int jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+  while ((opt = getopt(argc, argv, "j:d:v")) != -1) {
+    switch (opt) {
+      case 'j':
+        jobs = atoi(optarg);
+        break;
+      case 'd':
+        decision = atoi(optarg);
+        if (decision < kDecisionConsecutive || decision > kDecisionSegment) {
+          fprintf(stderr, "unknown decision %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-j jobs] [-d decision] [-v] <manifest>\n", argv[0]);
+        return 1;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s [-j jobs] [-d decision] [-v] <manifest>\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<ManifestEntry> entries;
+  if (!ReadManifest(argv[optind], &entries)) {
+    fprintf(stderr, "cannot read %s\n", argv[optind]);
+    return 1;
+  }
+  if (jobs < 1) jobs = 1;
+  if (jobs > (int)entries.size()) jobs = entries.empty() ? 1 : entries.size();
+
+  uint64_t start = NowNs();
+  std::vector<int> fds;
+  for (int worker = 0; worker < jobs; ++worker) {
+    int fd[2];
+    if (pipe(fd) != 0) return 1;
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(fd[0]);
+      RunWorker(entries, worker, jobs, fd[1]);
+      _exit(0);
+    }
+    close(fd[1]);
+    fds.push_back(fd[0]);
+  }
+
+  static ReplayStats total;
+  static ReplayStats part;
+  for (int fd : fds) {
+    memset(&part, 0, sizeof(part));
+    char* p = reinterpret_cast<char*>(&part);
+    size_t left = sizeof(part);
+    while (left > 0) {
+      ssize_t n = read(fd, p, left);
+      if (n <= 0) break;
+      p += n;
+      left -= n;
+    }
+    close(fd);
+    Merge(part, &total);
+  }
+  while (wait(nullptr) > 0) {
+  }
+
+  Report(total, (NowNs() - start) / 1e9, jobs);
+  return total.failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,126 @@
+#ifndef HOST_RTOS_HOST_H_
+#define HOST_RTOS_HOST_H_
+
+// std::thread based stand-ins for the rtos primitives the app's templates
+// take as parameters, with the subset of the mbed OS 6 signatures they use.
+
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+class HostMutex {
+ public:
+  void lock() { mutex_.lock(); }
+  void unlock() { mutex_.unlock(); }
+
+ private:
+  std::recursive_mutex mutex_;
+};
+
+class HostEventFlags {
+ public:
+  uint32_t set(uint32_t flags) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    flags_ |= flags;
+    changed_.notify_all();
+    return flags_;
+  }
+
+  uint32_t clear(uint32_t flags = 0x7fffffff) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    uint32_t old = flags_;
+    flags_ &= ~flags;
+    return old;
+  }
+
+  uint32_t get() const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return flags_;
+  }
+
+  // timeout in ms, 0xFFFFFFFF waits forever; returns 0x80000000 (osFlagsError)
+  // on timeout
+  uint32_t wait_any(uint32_t flags, uint32_t timeout = 0xFFFFFFFFu,
+                    bool clear = true) {
+    std::unique_lock<std::mutex> guard(mutex_);
+    auto ready = [&] { return (flags_ & flags) != 0; };
+    if (timeout == 0xFFFFFFFFu) {
+      changed_.wait(guard, ready);
+    } else if (!changed_.wait_for(guard, std::chrono::milliseconds(timeout),
+                                  ready)) {
+      return 0x80000000u;
+    }
+    uint32_t result = flags_;
+    if (clear) flags_ &= ~flags;
+    return result;
+  }
+
+ private:
+  mutable std::mutex mutex_;
+  std::condition_variable changed_;
+  uint32_t flags_ = 0;
+};
+
+class HostThread {
+ public:
+  void start(std::function<void()> task) { thread_ = std::thread(task); }
+  void join() {
+    if (thread_.joinable()) thread_.join();
+  }
+
+ private:
+  std::thread thread_;
+};
+
+// A bounded queue of calls, run by whoever calls dispatch_forever()
+class HostEventQueue {
+ public:
+  explicit HostEventQueue(int capacity) : capacity_(capacity) {}
+
+  // 0 when the queue is full, like EventQueue::call
+  template <typename F, typename... Args>
+  int call(F f, Args... args) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if ((int)calls_.size() >= capacity_) return 0;
+    calls_.push_back([=] { f(args...); });
+    changed_.notify_all();
+    return ++id_;
+  }
+
+  void dispatch_forever() {
+    std::unique_lock<std::mutex> guard(mutex_);
+    while (!stop_) {
+      if (calls_.empty()) {
+        changed_.wait(guard);
+        continue;
+      }
+      std::function<void()> next = calls_.front();
+      calls_.pop_front();
+      guard.unlock();
+      next();
+      guard.lock();
+    }
+    stop_ = false;
+  }
+
+  void break_dispatch() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stop_ = true;
+    changed_.notify_all();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::deque<std::function<void()>> calls_;
+  int capacity_;
+  int id_ = 0;
+  bool stop_ = false;
+};
+
+#endif  // HOST_RTOS_HOST_H_
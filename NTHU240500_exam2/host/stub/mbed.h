@@ -0,0 +1,10 @@
+#ifndef HOST_STUB_MBED_H_
+#define HOST_STUB_MBED_H_
+
+// Host builds of the app sources only need the C library parts of mbed.h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#endif  // HOST_STUB_MBED_H_
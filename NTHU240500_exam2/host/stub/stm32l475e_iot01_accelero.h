@@ -0,0 +1,39 @@
+#ifndef HOST_STUB_STM32L475E_IOT01_ACCELERO_H_
+#define HOST_STUB_STM32L475E_IOT01_ACCELERO_H_
+
+// Host stand-in for the BSP accelerometer, implemented by the host tool that
+// feeds recorded traces to the app sources
+
+#include <stdint.h>
+
+#define LSM6DSL_ACC_SENSITIVITY_2G ((float)0.061f)
+#define LSM6DSL_GYRO_SENSITIVITY_2000DPS ((float)70.00f)
+#define LSM6DSL_ODR_POWER_DOWN ((uint8_t)0x00)
+#define LSM6DSL_ODR_26Hz ((uint8_t)0x20)
+#define LSM6DSL_ODR_52Hz ((uint8_t)0x30)
+#define LSM6DSL_ODR_104Hz ((uint8_t)0x40)
+
+typedef enum {
+  ACCELERO_OK = 0,
+  ACCELERO_ERROR = 1,
+  ACCELERO_TIMEOUT = 2
+} ACCELERO_StatusTypeDef;
+
+ACCELERO_StatusTypeDef BSP_ACCELERO_Init(void);
+void BSP_ACCELERO_DeInit(void);
+void BSP_ACCELERO_LowPower(uint16_t status);
+void BSP_ACCELERO_AccGetXYZ(int16_t* pDataXYZ);
+void LSM6DSL_AccGyroReadRaw(int16_t* pData);
+void LSM6DSL_AccGyroSetOdr(uint8_t odr);
+
+#define LSM6DSL_EVENT_WAKE_UP ((uint8_t)0x01)
+#define LSM6DSL_EVENT_6D ((uint8_t)0x02)
+#define LSM6DSL_EVENT_TILT ((uint8_t)0x04)
+#define LSM6DSL_6D_THS_60DEG ((uint8_t)0x40)
+
+void LSM6DSL_GyroDeInit(void);
+void LSM6DSL_AccEnableEvents(uint8_t events, uint8_t wake_ths, uint8_t sixd_ths);
+void LSM6DSL_AccDisableEvents(void);
+uint8_t LSM6DSL_AccReadEvents(void);
+
+#endif  // HOST_STUB_STM32L475E_IOT01_ACCELERO_H_
@@ -0,0 +1,12 @@
+#ifndef HOST_STUB_STM32L475E_IOT01_GYRO_H_
+#define HOST_STUB_STM32L475E_IOT01_GYRO_H_
+
+#include "stm32l475e_iot01_accelero.h"
+
+typedef enum { GYRO_OK = 0, GYRO_ERROR = 1, GYRO_TIMEOUT = 2 } GYRO_StatusTypeDef;
+
+uint8_t BSP_GYRO_Init(void);
+void BSP_GYRO_DeInit(void);
+void BSP_GYRO_LowPower(uint16_t status);
+
+#endif  // HOST_STUB_STM32L475E_IOT01_GYRO_H_
@@ -0,0 +1,19 @@
+#ifndef HOST_STUB_STM32L475E_IOT01_MAGNETO_H_
+#define HOST_STUB_STM32L475E_IOT01_MAGNETO_H_
+
+#include <stdint.h>
+
+#define LIS3MDL_MAG_SENSITIVITY_FOR_FS_4GA ((float)0.14f)
+
+typedef enum {
+  MAGNETO_OK = 0,
+  MAGNETO_ERROR = 1,
+  MAGNETO_TIMEOUT = 2
+} MAGNETO_StatusTypeDef;
+
+MAGNETO_StatusTypeDef BSP_MAGNETO_Init(void);
+void BSP_MAGNETO_DeInit(void);
+void BSP_MAGNETO_LowPower(uint16_t status);
+void LIS3MDL_MagReadRaw(int16_t* pData);
+
+#endif  // HOST_STUB_STM32L475E_IOT01_MAGNETO_H_
@@ -0,0 +1,210 @@
+// Cross-check the telemetry encoder with the Python decoder.
+//
+//   telemetry_check [random messages] | python3 telemetry_codec.py --check
+//
+// Encodes edge cases (sequence and time wrap, negative and extreme angles,
+// dropped events, 32 bit fields, a full batch) and random messages of every
+// type and
+// prints each as "<hex>\t<expected decoding>". The decoder must decode every
+// line to the expected text and reject every truncation. On stderr it
+// compares the sizes of the threshold and tilt messages with the old text
+// messages. Exits with 1 if the encoder itself misbehaves: a message that
+// does not fit must encode to 0, and the largest tilt batch main.cpp allows
+// must fit a queue slot.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <random>
+
+#include "telemetry_codec.h"
+
+// OutboundMessage::payload and kTiltMaxBatch in main.cpp
+constexpr int kSlotSize = 100;
+constexpr int kTiltMaxBatch = 8;
+
+static int failures = 0;
+static long binary_bytes = 0;
+static long text_bytes = 0;
+
+// While set, messages go into the batch instead of standing alone
+static TelemetryBatch* batch = nullptr;
+static char batch_expected[8192];
+
+static void Emit(const uint8_t* buffer, int length, const char* expected) {
+  if (batch) {
+    if (!batch->add(buffer, length)) {
+      fprintf(stderr, "message did not fit the batch\n");
+      ++failures;
+      return;
+    }
+    size_t n = strlen(batch_expected);
+    snprintf(batch_expected + n, sizeof(batch_expected) - n, "%s%s",
+             batch->count() > 1 ? ", " : "", expected);
+    return;
+  }
+  for (int i = 0; i < length; ++i) printf("%02x", buffer[i]);
+  printf("\t%s\n", expected);
+}
+
+static void BeginBatch(TelemetryBatch* b) {
+  batch = b;
+  strcpy(batch_expected, "batch [");
+}
+
+static void EndBatch(const uint8_t* buffer) {
+  TelemetryBatch* b = batch;
+  batch = nullptr;
+  strcat(batch_expected, "]");
+  if (b->length() > 0) Emit(buffer, b->length(), batch_expected);
+}
+
+static void Threshold(int threshold, uint32_t count) {
+  uint8_t buffer[kSlotSize];
+  int length = EncodeThreshold(buffer, sizeof(buffer), threshold, count);
+  char expected[64];
+  snprintf(expected, sizeof(expected), "threshold %d %u", threshold, count);
+  Emit(buffer, length, expected);
+  binary_bytes += length;
+  text_bytes += snprintf(nullptr, 0, "Angle threshold is %d", threshold) + 1;
+}
+
+static void Gesture(int gesture, int threshold, uint32_t time_ms) {
+  uint8_t buffer[kSlotSize];
+  int length = EncodeGesture(buffer, sizeof(buffer), gesture, threshold,
+                             time_ms);
+  char expected[64];
+  snprintf(expected, sizeof(expected), "gesture %d %d %u", gesture, threshold,
+           time_ms);
+  Emit(buffer, length, expected);
+}
+
+static void Tilt(const TiltEvent* events, int count) {
+  uint8_t buffer[kSlotSize];
+  int length = EncodeTiltBatch(buffer, sizeof(buffer), events, count);
+  if (length == 0) {
+    fprintf(stderr, "tilt batch of %d events did not fit\n", count);
+    ++failures;
+    return;
+  }
+  char expected[512];
+  int n = snprintf(expected, sizeof(expected), "tilt");
+  for (int i = 0; i < count; ++i) {
+    n += snprintf(expected + n, sizeof(expected) - n, " %u@%u:%.1f",
+                  events[i].sequence, events[i].time_ms,
+                  events[i].angle / 10.0);
+  }
+  Emit(buffer, length, expected);
+
+  // the text format of the same batch, "Tilt 3-5 @120345: 32.1 35.0+100"
+  binary_bytes += length;
+  text_bytes += snprintf(nullptr, 0, "Tilt %u-%u @%u:", events[0].sequence,
+                         events[count - 1].sequence, events[0].time_ms) + 1;
+  for (int i = 0; i < count; ++i) {
+    int angle = events[i].angle;
+    text_bytes += snprintf(nullptr, 0, " %d.%d", angle / 10, abs(angle % 10));
+    if (i > 0) {
+      text_bytes += snprintf(nullptr, 0, "+%u",
+                             events[i].time_ms - events[0].time_ms);
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  int random_messages = (argc > 1) ? atoi(argv[1]) : 1000;
+
+  Threshold(30, 1);
+  Threshold(90, 0xFFFFFFFFu);
+  Gesture(0, 30, 0);
+  Gesture(2, 35, 0xFFFFFFFFu);
+
+  const TiltEvent wrap[] = {{0xFFFFFF00u, 1800, 0xFFFE},
+                            {0xFFFFFFF0u, -1800, 0xFFFF},
+                            {0x00000010u, 0, 0},
+                            {0x00000020u, 32767, 5}};
+  Tilt(wrap, 4);
+  const TiltEvent extremes[] = {{1000, -32768, 1}, {1000, 32767, 2}};
+  Tilt(extremes, 2);
+
+  // the worst case: every field as long as it gets
+  TiltEvent worst[kTiltMaxBatch];
+  for (int i = 0; i < kTiltMaxBatch; ++i) {
+    worst[i].time_ms = (i % 2) ? 0xF0000000u : 0xFFFFFFFFu;
+    worst[i].angle = (i % 2) ? 32767 : -32768;
+    worst[i].sequence = (uint16_t)(i * 0x8001);
+  }
+  Tilt(worst, kTiltMaxBatch);
+
+  // a batch as large as the outbox replays them, and one that is full
+  static uint8_t batch_buffer[1024];
+  TelemetryBatch replay(batch_buffer, sizeof(batch_buffer));
+  BeginBatch(&replay);
+  Threshold(35, 2);
+  Tilt(wrap, 4);
+  Gesture(1, 40, 123456);
+  EndBatch(batch_buffer);
+  uint8_t tiny[14];
+  TelemetryBatch full(tiny, sizeof(tiny));
+  BeginBatch(&full);
+  Threshold(35, 3);
+  Gesture(1, 40, 123456);
+  EndBatch(tiny);
+  uint8_t message[] = {0x11, 0x1e, 0x01};
+  if (full.add(message, sizeof(message)) || full.count() != 2) {
+    fprintf(stderr, "full batch not reported\n");
+    ++failures;
+  }
+
+  // too small a buffer encodes to nothing
+  uint8_t small[3];
+  if (EncodeTiltBatch(small, sizeof(small), wrap, 4) != 0 ||
+      EncodeGesture(small, 2, 1, 30, 1000) != 0 ||
+      EncodeThreshold(small, 1, 30, 1) != 0) {
+    fprintf(stderr, "overflow not reported\n");
+    ++failures;
+  }
+
+  // what the device sends: events 100 ms apart with small angle changes
+  std::mt19937 random(1);
+  uint16_t sequence = 0;
+  uint32_t time_ms = 5000;
+  int angle = 300;
+  for (int n = 0; n < random_messages; ++n) {
+    switch (random() % 4) {
+      case 0:
+        Threshold(30 + 5 * (random() % 13), random() % 100);
+        break;
+      case 1:
+        Gesture(random() % 3, 30 + 5 * (random() % 13), time_ms);
+        break;
+      case 2: {
+        // what a replay sends: stored threshold messages in one publish
+        TelemetryBatch replayed(batch_buffer, sizeof(batch_buffer));
+        BeginBatch(&replayed);
+        for (int i = 1 + random() % 16; i > 0; --i) {
+          Threshold(30 + 5 * (random() % 13), random() % 1000);
+        }
+        EndBatch(batch_buffer);
+        break;
+      }
+      default: {
+        TiltEvent events[kTiltMaxBatch];
+        int count = 1 + random() % kTiltMaxBatch;
+        for (int i = 0; i < count; ++i) {
+          sequence += (random() % 8 == 0) ? 1 + random() % 20 : 1;
+          time_ms += 100 + random() % 5;
+          angle += (int)(random() % 41) - 20;
+          if (angle < 0 || angle > 1800) angle = 300;
+          events[i] = {time_ms, (int16_t)angle, sequence};
+        }
+        Tilt(events, count);
+      }
+    }
+  }
+
+  fprintf(stderr, "%ld bytes binary, %ld bytes as text\n", binary_bytes,
+          text_bytes);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,161 @@
+// Check and time the integer tilt comparator against the acos computation.
+//
+//   tilt_bench [samples]
+//
+// The equivalence pass compares TiltComparator::at_least with a long double
+// acos reference for every threshold from 0 to 180 degrees: each axis of the
+// sample sweeps the whole int16 range against a set of edge references, and
+// random samples and references cover the rest of the int16 cube. Decisions
+// may only differ where the exact angle is within kTolerance of the
+// threshold. Exits with 1 on any other mismatch.
+//
+// The benchmark then times the per-sample decision of the old tilt_angle()
+// loop (two sqrt, divide, acos, degrees) and the integer comparator on the
+// same samples.
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <vector>
+
+#include "tilt_comparator.h"
+
+// Angles closer than this to the threshold may be decided either way [deg]
+constexpr long double kTolerance = 1e-3L;
+
+static uint64_t NowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t random_state = 12345;
+
+static int16_t RandomInt16() {
+  random_state = random_state * 1664525u + 1013904223u;
+  return (int16_t)(random_state >> 16);
+}
+
+// Exact angle in degrees, negative for a zero vector
+static long double ReferenceAngle(const int16_t* a, const int16_t* g) {
+  long double d = 0, na = 0, ng = 0;
+  for (int i = 0; i < 3; ++i) {
+    d += (long double)a[i] * g[i];
+    na += (long double)a[i] * a[i];
+    ng += (long double)g[i] * g[i];
+  }
+  if (na == 0 || ng == 0) return -1;
+  long double c = d / sqrtl(na * ng);
+  if (c > 1) c = 1;
+  if (c < -1) c = -1;
+  return acosl(c) * 180 / 3.14159265358979323846L;
+}
+
+struct Check {
+  uint64_t pairs = 0;
+  uint64_t decisions = 0;
+  uint64_t boundary = 0;
+  uint64_t mismatches = 0;
+};
+
+static void CheckPair(const int16_t* a, const int16_t* g,
+                      const std::vector<TiltLimit>& limits, Check* check) {
+  TiltComparator comparator;
+  comparator.set_reference(g);
+  long double angle = ReferenceAngle(a, g);
+  ++check->pairs;
+  for (const TiltLimit& limit : limits) {
+    bool expected = angle >= 0 && angle >= limit.degrees;
+    bool actual = comparator.at_least(a, limit);
+    ++check->decisions;
+    if (expected == actual) continue;
+    if (angle >= 0 && fabsl(angle - limit.degrees) < kTolerance) {
+      ++check->boundary;
+      continue;
+    }
+    if (check->mismatches++ < 10) {
+      printf("mismatch: a (%d, %d, %d) g (%d, %d, %d) angle %.6Lf limit %d\n",
+             a[0], a[1], a[2], g[0], g[1], g[2], angle, limit.degrees);
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  int samples = (argc > 1) ? atoi(argv[1]) : 1000000;
+
+  std::vector<TiltLimit> limits;
+  for (int degrees = 0; degrees <= 180; ++degrees) {
+    limits.push_back(MakeTiltLimit(degrees));
+  }
+
+  // Equivalence
+  static const int16_t edges[][3] = {
+      {0, 0, 1000},     {0, 0, -1000},    {32767, 0, 0},
+      {-32768, 0, 0},   {-32768, -32768, -32768},
+      {32767, 32767, 32767}, {1, 0, 0},  {12, -985, 31},
+      {-32768, 32767, 1},
+  };
+  Check check;
+  for (const int16_t* g : edges) {
+    for (int axis = 0; axis < 3; ++axis) {
+      for (int v = -32768; v <= 32767; ++v) {
+        int16_t a[3] = {(int16_t)(v / 3), -700, 250};
+        a[axis] = (int16_t)v;
+        CheckPair(a, g, limits, &check);
+      }
+    }
+  }
+  for (int i = 0; i < samples; ++i) {
+    int16_t a[3] = {RandomInt16(), RandomInt16(), RandomInt16()};
+    int16_t g[3] = {RandomInt16(), RandomInt16(), RandomInt16()};
+    CheckPair(a, g, limits, &check);
+  }
+  printf("equivalence: %llu pairs, %llu decisions, %llu within %.0Le deg of "
+         "the threshold, %llu mismatches\n",
+         (unsigned long long)check.pairs, (unsigned long long)check.decisions,
+         (unsigned long long)check.boundary, kTolerance,
+         (unsigned long long)check.mismatches);
+
+  // Benchmark on board-like data: gravity of about 1000 mg tilted randomly
+  std::vector<int16_t> data(3 * samples);
+  for (int i = 0; i < 3 * samples; ++i) data[i] = RandomInt16() / 32;
+  const int16_t g[3] = {12, -985, 31};
+  const int threshold = 30;
+
+  uint64_t start = NowNs();
+  int exceeded = 0;
+  for (int i = 0; i < samples; ++i) {
+    const int16_t* a = &data[3 * i];
+    long int dotproduct = 0;
+    long int normA = 0;
+    long int normg = 0;
+    for (int j = 0; j < 3; j++) {
+      dotproduct += a[j] * g[j];
+      normA += g[j] * g[j];
+      normg += a[j] * a[j];
+    }
+    float cosvalue = dotproduct / sqrt(normg) / sqrt(normA);
+    float angle = acos(cosvalue) * 180 / 3.1415926;
+    exceeded += angle >= threshold;
+  }
+  uint64_t acos_ns = NowNs() - start;
+
+  TiltComparator comparator;
+  comparator.set_reference(g);
+  TiltLimit limit = MakeTiltLimit(threshold);
+  start = NowNs();
+  int exceeded_int = 0;
+  for (int i = 0; i < samples; ++i) {
+    exceeded_int += comparator.at_least(&data[3 * i], limit);
+  }
+  uint64_t int_ns = NowNs() - start;
+
+  printf("acos:    %.2f ns/sample (%d exceeded)\n",
+         (double)acos_ns / samples, exceeded);
+  printf("integer: %.2f ns/sample (%d exceeded)\n",
+         (double)int_ns / samples, exceeded_int);
+  return check.mismatches == 0 ? 0 : 1;
+}
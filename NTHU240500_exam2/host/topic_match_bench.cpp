@@ -0,0 +1,183 @@
+// Compare the topic trie of MQTT::Client with the linear scan it replaced.
+//
+//   topic_match_bench [topics]
+//
+// Builds 5, 16, 32 and 64 subscriptions of command and config topics, some
+// with '+' and '#', and matches random topic names against them: with the
+// old scan (MQTTPacket_equals and isTopicMatched on every handler, copied
+// from the client before the trie) and with MQTT::TopicTrie. Every trie
+// result is checked against a plain reference matcher of the MQTT 3.1.1
+// rules and prints the ns per topic of both. Where the old scan disagrees
+// with the rules (it never let "a/#" match "a") is counted, not failed.
+// Exits with 1 if the trie misses or invents a match.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "MQTTPacket.h"
+#include "MQTTTopicTrie.h"
+
+// MQTT::Client::isTopicMatched before the trie
+static bool OldIsTopicMatched(char* topicFilter, MQTTString& topicName) {
+  char* curf = topicFilter;
+  char* curn = topicName.lenstring.data;
+  char* curn_end = curn + topicName.lenstring.len;
+
+  while (*curf && curn < curn_end) {
+    if (*curn == '/' && *curf != '/') break;
+    if (*curf != '+' && *curf != '#' && *curf != *curn) break;
+    if (*curf == '+') {  // skip until we meet the next separator, or end of string
+      char* nextpos = curn + 1;
+      while (nextpos < curn_end && *nextpos != '/') nextpos = ++curn + 1;
+    } else if (*curf == '#') {
+      curn = curn_end - 1;  // skip until end of string
+    }
+    curf++;
+    curn++;
+  }
+
+  return (curn == curn_end) && (*curf == '\0');
+}
+
+static std::vector<std::string> Levels(const std::string& s) {
+  std::vector<std::string> levels;
+  size_t start = 0;
+  while (true) {
+    size_t slash = s.find('/', start);
+    levels.push_back(s.substr(start, slash - start));
+    if (slash == std::string::npos) return levels;
+    start = slash + 1;
+  }
+}
+
+// The MQTT 3.1.1 rules, level by level
+static bool Reference(const std::string& filter, const std::string& topic) {
+  std::vector<std::string> f = Levels(filter), t = Levels(topic);
+  if (topic[0] == '$' && (f[0] == "+" || f[0] == "#")) return false;
+  for (size_t i = 0; i < f.size(); ++i) {
+    if (f[i] == "#") return true;  // this level and everything below, or none
+    if (i >= t.size()) return false;
+    if (f[i] != "+" && f[i] != t[i]) return false;
+  }
+  return f.size() == t.size();
+}
+
+static const char* kCommands[] = {
+    "reboot", "mode",  "threshold", "calibrate", "trace", "window",
+    "rate",   "batch", "sleep",     "wake",      "led",   "display",
+    "sample", "dump",  "gesture",   "tilt"};
+
+static std::vector<std::string> Filters(int count) {
+  std::vector<std::string> filters = {"Mbed", "dev/mbed/cmd/+",
+                                      "dev/+/config/#", "+/mbed/status",
+                                      "$SYS/broker/#"};
+  for (int i = 0; (int)filters.size() < count; ++i) {
+    const char* name = kCommands[i % 16];
+    std::string group = (i / 16) % 2 ? "config" : "cmd";
+    std::string device = i < 32 ? "mbed" : "node" + std::to_string(i / 32);
+    filters.push_back("dev/" + device + "/" + group + "/" + name);
+  }
+  filters.resize(count);
+  return filters;
+}
+
+static std::string RandomTopic(std::mt19937& random) {
+  static const char* kDevices[] = {"mbed", "node1", "pc"};
+  static const char* kGroups[] = {"cmd", "config", "status", "log"};
+  switch (random() % 8) {
+    case 0:
+      return "Mbed";
+    case 1:
+      return "$SYS/broker/load";
+    case 2:
+      return std::string(kDevices[random() % 3]) + "/mbed/status";
+    case 3:
+      return "dev/mbed/config";
+    default: {
+      std::string topic = std::string("dev/") + kDevices[random() % 3] + "/" +
+                          kGroups[random() % 4] + "/" + kCommands[random() % 16];
+      if (random() % 4 == 0) topic += "/extra";
+      return topic;
+    }
+  }
+}
+
+static double NsPerTopic(std::chrono::steady_clock::time_point start,
+                         int topics) {
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::nano>(elapsed).count() / topics;
+}
+
+template <int HANDLERS>
+static int Run(int topic_count) {
+  std::vector<std::string> filters = Filters(HANDLERS);
+  MQTT::TopicTrie<HANDLERS * 8 + 1, HANDLERS> trie;
+  for (int i = 0; i < HANDLERS; ++i) {
+    if (!trie.insert(filters[i].c_str(), i)) {
+      printf("insert %s failed\n", filters[i].c_str());
+      return 1;
+    }
+  }
+
+  std::mt19937 random(HANDLERS);
+  std::vector<std::string> topics;
+  for (int i = 0; i < topic_count; ++i) topics.push_back(RandomTopic(random));
+
+  int errors = 0, old_differs = 0, matches = 0;
+  for (const std::string& topic : topics) {
+    bool matched[HANDLERS] = {};
+    trie.match(topic.data(), topic.size(), matched);
+    MQTTString name = {0, {(int)topic.size(), (char*)topic.data()}};
+    for (int i = 0; i < HANDLERS; ++i) {
+      bool expected = Reference(filters[i], topic);
+      matches += expected;
+      if (matched[i] != expected && errors++ < 10) {
+        printf("trie: %s on %s is %d\n", filters[i].c_str(), topic.c_str(),
+               matched[i]);
+      }
+      bool old = MQTTPacket_equals(&name, (char*)filters[i].c_str()) ||
+                 OldIsTopicMatched((char*)filters[i].c_str(), name);
+      old_differs += old != expected;
+    }
+  }
+
+  // timing: the same topics, every handler hit counted so nothing is
+  // optimized away
+  long hits = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (const std::string& topic : topics) {
+    MQTTString name = {0, {(int)topic.size(), (char*)topic.data()}};
+    for (int i = 0; i < HANDLERS; ++i) {
+      if (MQTTPacket_equals(&name, (char*)filters[i].c_str()) ||
+          OldIsTopicMatched((char*)filters[i].c_str(), name)) {
+        ++hits;
+      }
+    }
+  }
+  double scan_ns = NsPerTopic(start, topic_count);
+  start = std::chrono::steady_clock::now();
+  for (const std::string& topic : topics) {
+    bool matched[HANDLERS] = {};
+    hits += trie.match(topic.data(), topic.size(), matched);
+  }
+  double trie_ns = NsPerTopic(start, topic_count);
+
+  printf("%2d handlers, %3d nodes: scan %6.0f ns  trie %5.0f ns  (%4.1fx)  "
+         "%.2f matches/topic, old scan off by the rules %d times  [%ld]\n",
+         HANDLERS, trie.size(), scan_ns, trie_ns, scan_ns / trie_ns,
+         (double)matches / topic_count, old_differs, hits);
+  return errors ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+  int topics = (argc > 1) ? atoi(argv[1]) : 200000;
+  int failed = Run<5>(topics) | Run<16>(topics) | Run<32>(topics) |
+               Run<64>(topics);
+  return failed;
+}
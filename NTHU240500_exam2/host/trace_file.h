@@ -0,0 +1,94 @@
+#ifndef HOST_TRACE_FILE_H_
+#define HOST_TRACE_FILE_H_
+
+// Host side reader for trace images, either a raw copy of the flash log
+// region or the pages streamed by the TraceDump RPC.
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "../trace_recorder.h"
+
+// Load every record of a trace image in recording order
+inline bool LoadTrace(const char* path, std::vector<TraceRecord>* records) {
+  FILE* file = fopen(path, "rb");
+  if (!file) return false;
+
+  // Pages are ordered by sequence, not by position: the log wraps and the
+  // dump skips erased sectors
+  std::vector<std::pair<uint32_t, std::vector<uint8_t>>> pages;
+  std::vector<uint8_t> page(kTracePageSize);
+  while (fread(page.data(), 1, kTracePageSize, file) == kTracePageSize) {
+    uint32_t sequence = TracePageSequence(page.data());
+    if (sequence != kTraceErasedSequence) pages.emplace_back(sequence, page);
+  }
+  fclose(file);
+
+  std::sort(pages.begin(), pages.end(),
+            [](const std::pair<uint32_t, std::vector<uint8_t>>& a,
+               const std::pair<uint32_t, std::vector<uint8_t>>& b) {
+              return a.first < b.first;
+            });
+  for (const auto& p : pages) {
+    TraceParsePage(p.second.data(), [records](const TraceRecord& record) {
+      records->push_back(record);
+    });
+  }
+  return true;
+}
+
+// Load a CSV trace as printed by "trace_tool dump"
+inline bool LoadTraceCsv(const char* path, std::vector<TraceRecord>* records) {
+  FILE* file = fopen(path, "r");
+  if (!file) return false;
+
+  char line[128];
+  char type[16];
+  while (fgets(line, sizeof(line), file)) {
+    unsigned time_ms;
+    float a, b, c = 0;
+    if (sscanf(line, "%u,%15[a-z],%f,%f,%f", &time_ms, type, &a, &b, &c) < 4) {
+      continue;
+    }
+    TraceRecord record;
+    record.time_ms = time_ms;
+    if (strcmp(type, "accel") == 0) {
+      record.type = kTraceAccel;
+      TracePut16(record.payload, (uint16_t)(int16_t)a);
+      TracePut16(record.payload + 2, (uint16_t)(int16_t)b);
+      TracePut16(record.payload + 4, (uint16_t)(int16_t)c);
+    } else if (strcmp(type, "gesture") == 0) {
+      record.type = kTraceGesture;
+      record.payload[0] = (uint8_t)a;
+      record.payload[1] = (uint8_t)b;
+    } else if (strcmp(type, "tilt") == 0) {
+      record.type = kTraceTilt;
+      TracePut16(record.payload, (uint16_t)(int16_t)(a * 10));
+      record.payload[2] = (uint8_t)b;
+    } else {
+      continue;
+    }
+    records->push_back(record);
+  }
+  fclose(file);
+  return true;
+}
+
+// Load an image or, for a .csv path, a CSV trace
+inline bool LoadTraceFile(const char* path, std::vector<TraceRecord>* records) {
+  size_t length = strlen(path);
+  if (length > 4 && strcmp(path + length - 4, ".csv") == 0) {
+    return LoadTraceCsv(path, records);
+  }
+  return LoadTrace(path, records);
+}
+
+inline int16_t TraceAccel(const TraceRecord& record, int axis) {
+  return (int16_t)TraceGet16(record.payload + 2 * axis);
+}
+
+#endif  // HOST_TRACE_FILE_H_
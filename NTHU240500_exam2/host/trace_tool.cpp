@@ -0,0 +1,98 @@
+// Convert between trace images and CSV on the host.
+//
+//   trace_tool dump <image>                  print the records as CSV
+//   trace_tool import <image> <csv> [size]   append CSV records to an image
+//
+// CSV lines are "time_ms,accel,x,y,z", "time_ms,gesture,index,threshold" or
+// "time_ms,tilt,angle,threshold". import goes through TraceRecorder and the
+// file-backed flash, i.e. the exact code path used on the board.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file_flash.h"
+#include "trace_file.h"
+
+static int Dump(const char* image) {
+  std::vector<TraceRecord> records;
+  if (!LoadTrace(image, &records)) {
+    fprintf(stderr, "cannot open %s\n", image);
+    return 1;
+  }
+  for (const TraceRecord& record : records) {
+    switch (record.type) {
+      case kTraceAccel:
+        printf("%u,accel,%d,%d,%d\n", record.time_ms, TraceAccel(record, 0),
+               TraceAccel(record, 1), TraceAccel(record, 2));
+        break;
+      case kTraceGesture:
+        printf("%u,gesture,%d,%d\n", record.time_ms, record.payload[0],
+               record.payload[1]);
+        break;
+      case kTraceTilt:
+        printf("%u,tilt,%.1f,%d\n", record.time_ms,
+               (int16_t)TraceGet16(record.payload) / 10.0, record.payload[2]);
+        break;
+    }
+  }
+  return 0;
+}
+
+static int Import(const char* image, const char* csv, uint32_t size) {
+  FileFlash flash(image, size);
+  FILE* in = fopen(csv, "r");
+  if (!flash.is_open() || !in) {
+    fprintf(stderr, "cannot open %s or %s\n", image, csv);
+    return 1;
+  }
+
+  TraceRecorder<FileFlash> recorder(&flash, 0, size);
+  if (recorder.init() != 0) {
+    fprintf(stderr, "cannot read %s\n", image);
+    return 1;
+  }
+
+  char line[128];
+  char type[16];
+  while (fgets(line, sizeof(line), in)) {
+    unsigned time_ms;
+    float a, b, c = 0;
+    if (sscanf(line, "%u,%15[a-z],%f,%f,%f", &time_ms, type, &a, &b, &c) < 4) {
+      continue;
+    }
+    bool sealed = false;
+    if (strcmp(type, "accel") == 0) {
+      int16_t xyz[3] = {(int16_t)a, (int16_t)b, (int16_t)c};
+      sealed = recorder.append_accel(time_ms, xyz);
+    } else if (strcmp(type, "gesture") == 0) {
+      sealed = recorder.append_gesture(time_ms, (int)a, (int)b);
+    } else if (strcmp(type, "tilt") == 0) {
+      sealed = recorder.append_tilt(time_ms, a, (int)b);
+    }
+    if (sealed && recorder.flush() != 0) {
+      fprintf(stderr, "flash write failed\n");
+      return 1;
+    }
+  }
+  fclose(in);
+
+  if (recorder.sync()) recorder.flush();
+  printf("%u records, %u pages\n", recorder.records(), recorder.pages_written());
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc >= 3 && strcmp(argv[1], "dump") == 0) {
+    return Dump(argv[2]);
+  }
+  if (argc >= 4 && strcmp(argv[1], "import") == 0) {
+    uint32_t size = argc >= 5 ? strtoul(argv[4], nullptr, 0) : 1 << 20;
+    return Import(argv[2], argv[3], size);
+  }
+  fprintf(stderr,
+          "usage: %s dump <image>\n"
+          "       %s import <image> <csv> [size]\n",
+          argv[0], argv[0]);
+  return 1;
+}
@@ -0,0 +1,99 @@
+#ifndef INFLIGHT_WINDOW_H_
+#define INFLIGHT_WINDOW_H_
+
+// Packet ids of the QoS 1 and 2 publishes in flight, oldest first.
+//
+// The network thread sends up to N publishes without waiting and records
+// each one here. Acknowledgements are matched by id anywhere in the window,
+// but entries only leave from the front, in send order, so the caller can
+// keep the payloads in a FIFO and free them in the same order. After a
+// reconnect every entry that is not complete is sent again front to back,
+// which keeps the order the broker sees (MQTT 3.1.1, 4.6).
+
+#include <stdint.h>
+
+// MQTT packet types of the acknowledgements, as in MQTTPacket.h
+constexpr int kInflightPuback = 4;
+constexpr int kInflightPubrec = 5;
+constexpr int kInflightPubcomp = 7;
+
+enum InflightState : uint8_t {
+  kInflightSent,      // waiting for PUBACK (QoS 1) or PUBREC (QoS 2)
+  kInflightReleased,  // QoS 2, PUBREL sent, waiting for PUBCOMP
+  kInflightDone,      // acknowledged, or QoS 0
+};
+
+template <int N>
+class InflightWindow {
+ public:
+  int size() const { return count_; }
+  bool full() const { return count_ == N; }
+  static constexpr int capacity() { return N; }
+
+  // i-th oldest entry
+  uint16_t id(int i) const { return entries_[Slot(i)].id; }
+  InflightState state(int i) const { return entries_[Slot(i)].state; }
+
+  // Record the next publish, false if the window is full. A QoS 0 publish
+  // (or one the client refused) is complete at once but keeps its place.
+  bool push(uint16_t id, int qos) {
+    if (full()) return false;
+    Entry& entry = entries_[Slot(count_)];
+    entry.id = id;
+    entry.state = (qos == 0) ? kInflightDone : kInflightSent;
+    ++count_;
+    return true;
+  }
+
+  // PUBACK and PUBCOMP complete a publish, PUBREC moves a QoS 2 publish on
+  // to the PUBCOMP. False if no entry waits for this acknowledgement.
+  bool ack(int type, uint16_t id) {
+    for (int i = 0; i < count_; ++i) {
+      Entry& entry = entries_[Slot(i)];
+      if (entry.id != id || entry.state == kInflightDone) continue;
+      if (type == kInflightPuback && entry.state == kInflightSent) {
+        entry.state = kInflightDone;
+        return true;
+      }
+      if (type == kInflightPubrec && entry.state == kInflightSent) {
+        entry.state = kInflightReleased;
+        return true;
+      }
+      if (type == kInflightPubcomp && entry.state == kInflightReleased) {
+        entry.state = kInflightDone;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Drop the completed entries at the front, returns how many
+  int release() {
+    int released = 0;
+    while (count_ > 0 && entries_[head_].state == kInflightDone) {
+      head_ = (head_ + 1) % N;
+      --count_;
+      ++released;
+    }
+    return released;
+  }
+
+  void clear() {
+    head_ = 0;
+    count_ = 0;
+  }
+
+ private:
+  struct Entry {
+    uint16_t id;
+    InflightState state;
+  };
+
+  int Slot(int i) const { return (head_ + i) % N; }
+
+  Entry entries_[N];
+  int head_ = 0;
+  int count_ = 0;
+};
+
+#endif  // INFLIGHT_WINDOW_H_
@@ -7,60 +7,56 @@
 
  // for gesture
  #include "accelerometer_handler.h"
- #include "magic_wand_model_data.h"
+ #include "gesture_handler.h"
 
  #include "tensorflow/lite/c/common.h"
- #include "tensorflow/lite/micro/kernels/micro_ops.h"
  #include "tensorflow/lite/micro/micro_error_reporter.h"
  #include "tensorflow/lite/micro/micro_interpreter.h"
- #include "tensorflow/lite/micro/micro_mutable_op_resolver.h"
- #include "tensorflow/lite/schema/schema_generated.h"
- #include "tensorflow/lite/version.h"
 
  // for uLCD
  #include "uLCD_4DGL.h"
 
  // for WIFI & MQTT
+ #include "connection_manager.h"
  #include "MQTTNetwork.h"
  #include "MQTTmbed.h"
  #include "MQTTClient.h"
+ #include "publish_queue.h"
+ #include "inflight_window.h"
+ #include "telemetry_codec.h"
+ #include "message_outbox.h"
+ #include "message_inbox.h"
 
  // for RPC
  #include "mbed_rpc.h"
+ #include "muted_console.h"
 
  // for tilt angle
  #include "stm32l475e_iot01_accelero.h"
+ #include "tilt_comparator.h"
+ #include "orientation_handler.h"
+ #include "persistent_record.h"
 
+ // for mode control
+ #include "mode_controller.h"
 
- /* ---- NAMESPACE ---- */
- using namespace std::chrono;
-
-
- /* ---- DEFINE ---- */
- #define label_num 3
+ // for sensor power and the per-mode current estimate
+ #include "power_manager.h"
 
- /* ---- STRUCT ---- */
- struct Config {
+ // for the concurrent boot
+ #include "boot_tracker.h"
 
-   // This must be the same as seq_length in the src/model_train/config.py
-   const int seq_length = 64;
+ // for trace recording
+ #include "BlockDevice.h"
+ #include "trace_recorder.h"
 
-   // The number of expected consecutive inferences for each gesture type.
-   const int consecutiveInferenceThresholds[label_num] = {20, 10, 15};
 
-   const char* output_message[label_num] = {
-         "RING:\n\r",
-         "SLOPE:\n\r",
-         "LEFT TO RIGHT:\n\r",
-         };
- };
- Config config;
+ /* ---- NAMESPACE ---- */
+ using namespace std::chrono;
 
 
  /* ---- GLOBAL VARIABLE ---- */
 
- // type of MODE: 0 -> NONE | 1 -> GUI | 2 -> DETECTION
- int MODE = 0;
  int threshold = 30;
  float angle = 0;
  bool mqtt_flag = true;
@@ -68,19 +64,35 @@
  int16_t gDataXYZ[3] = {0};
  int num = 0; // event number
 
- // for gesture
- constexpr int kTensorArenaSize = 60 * 1024;
- uint8_t tensor_arena[kTensorArenaSize];
-
 
  /* ---- uLCD ---- */
- uLCD_4DGL uLCD(D1, D0, D2);
+ // reset on the display thread, the 3 s restart must not hold up the boot
+ uLCD_4DGL uLCD(D1, D0, D2, false);
+
+ /* ---- BOOT ---- */
+ // each stage reports when it is up, see boot_display/GUI/WIFI_MQTT/main
+ BootTracker<EventFlags> boot;
+ const char *const boot_stage_names[kBootStageCount] = {"SENSORS", "DISPLAY", "MODEL", "WIFI", "BROKER"};
 
  /* ---- LED ---- */
  DigitalOut led1(LED1); // GUI MODE
  DigitalOut led2(LED2); // DETECTION MODE
  DigitalOut led3(LED3);
 
+ /* ---- MODE ---- */
+ // 0 -> NONE | 1 -> GUI | 2 -> DETECTION, see AppMode
+ void enter_safe();
+ void enter_gesture();
+ void exit_gesture();
+ void enter_tilt();
+ void exit_tilt();
+ const ModeHooks mode_hooks[kModeCount] = {
+   {enter_safe, nullptr},
+   {enter_gesture, exit_gesture},
+   {enter_tilt, exit_tilt},
+ };
+ ModeController<EventFlags, Mutex> modes(mode_hooks);
+
  /* ---- INTERRUPT ---- */
  InterruptIn btn(USER_BUTTON);
 
@@ -91,12 +103,180 @@
  volatile bool closed = false;
  const char* topic = "Mbed";
 
+ /* ---- PUBLISH QUEUE ---- */
+ // any thread formats its message into a slot, only WIFI_MQTT_thread
+ // touches the client: it sends the slots in order and runs the keepalive
+ struct OutboundMessage
+ {
+   const char *topic; // static string
+   MQTT::QoS qos;
+   uint16_t len;
+   char payload[100];
+ };
+ constexpr int kPublishQueueCapacity = 8;
+ PublishQueue<OutboundMessage, kPublishQueueCapacity> publish_queue;
+ // wakes the network thread: kPublishWake on every enqueue, and
+ // MQTTNetwork::kSocketEvent from the socket's sigio
+ EventFlags publish_wake;
+ constexpr uint32_t kPublishWake = 1;
+ // longest yield after a wake-up [ms], what arrived is handled at once and
+ // a packet that started arriving is read to the end regardless
+ int mqtt_cycle_ms = 5;
+ struct PublishStats
+ {
+   uint32_t queued;   // accepted by enqueue_publish
+   uint32_t sent;     // handed to the broker
+   uint32_t failed;   // publish returned an error
+   uint32_t dropped;  // queue full, message discarded
+   uint32_t deferred; // queue full, tilt events left waiting
+   uint32_t too_long; // longer than a queue slot, message discarded
+   uint32_t peak;     // most messages waiting at once
+   uint32_t resent;   // unacknowledged publishes sent again after a reconnect
+   uint32_t unmatched; // acks for no publish in flight
+ };
+ PublishStats publish_stats = {0};
+ // QoS 1 publishes sent without waiting for their PUBACK, at most
+ // mqtt_window; their slots stay in publish_queue until acknowledged
+ InflightWindow<kPublishQueueCapacity> inflight;
+ int mqtt_window = 4;
+
+ /* ---- MQTT SUPERVISOR ---- */
+ // keepalive [s] and the reconnect backoff range [ms]
+ int mqtt_keepalive_s = 10;
+ int mqtt_backoff_min_ms = 500;
+ int mqtt_backoff_max_ms = 30000;
+ struct MqttOutageStats
+ {
+   uint32_t outages;       // connection losses
+   uint32_t attempts;      // reconnect attempts
+   uint32_t sessions_lost; // reconnects where the broker had no session
+   uint32_t last_ms;       // duration of the last outage
+   uint32_t longest_ms;
+   uint32_t total_ms;
+   uint32_t down_since_ms; // start of the current outage
+   bool down;
+ };
+ // down until the first CONNACK, so what comes before goes to the outbox
+ MqttOutageStats mqtt_stats = {0, 0, 0, 0, 0, 0, 0, true};
+
+ /* ---- INBOX ---- */
+ // messageArrived runs inside client.yield() on WIFI_MQTT_thread: it copies
+ // the message into an inbox slot and posts it to HANDLER_thread, which
+ // runs the handler, so the network loop never waits on it. The slots bound
+ // the messages posted and not yet handled, a message that finds none taken
+ // is dropped.
+ constexpr int kInboxSlots = 4;
+ MessageInbox<kInboxSlots> inbox;
+
+ /* ---- TILT EVENTS ---- */
+ // over-threshold samples (TiltEvent in telemetry_codec.h) wait here until
+ // the publisher coalesces them
+ constexpr int kTiltEventCapacity = 32;
+ CircularBuffer<TiltEvent, kTiltEventCapacity> tilt_events;
+ // one message per tilt_max_batch events, or after tilt_max_latency_ms
+ int tilt_max_latency_ms = 500;
+ int tilt_max_batch = 5;
+ // the longest encoded batch that still fits a publish queue slot
+ constexpr int kTiltMaxBatch = 8;
+ volatile bool tilt_publish_pending = false;
+ uint16_t tilt_sequence = 0;
+ volatile uint32_t tilt_events_dropped = 0;
+
+ /* ---- TRACE ---- */
+ // the trace log takes the first 6 MB of the 8 MB QSPI flash
+ constexpr uint32_t kTraceLogStart = 0;
+ constexpr uint32_t kTraceLogSize = 6 * 1024 * 1024;
+ BlockDevice *trace_bd = BlockDevice::get_default_instance();
+ TraceRecorder<BlockDevice> recorder(trace_bd, kTraceLogStart, kTraceLogSize);
+ volatile bool trace_ready = false;
+ volatile bool trace_enabled = false;
+ Mutex trace_mutex; // between the sensing threads appending records
+ Mutex flush_mutex; // between the writer thread and the dump
+ volatile bool flash_ready = false;
+
+ /* ---- CALIBRATION ---- */
+ // small persistent records follow the trace log, two sectors each
+ constexpr uint32_t kCalibrationStart = kTraceLogStart + kTraceLogSize;
+ PersistentRecord<BlockDevice, OrientationCalibration> calibration_record(trace_bd, kCalibrationStart, kTraceSectorSize);
+ OrientationCalibration calibration; // guarded by tilt_mutex
+ volatile uint32_t calibration_version = 0; // bumped on every new calibration
+
+ /* ---- WIFI LEASE ---- */
+ // last joined network and broker address, right after the calibration
+ constexpr uint32_t kWifiLeaseStart = kCalibrationStart + 2 * kTraceSectorSize;
+ PersistentRecord<BlockDevice, WifiLease> wifi_record(trace_bd, kWifiLeaseStart, kTraceSectorSize);
+ WifiLease wifi_lease; // only touched by WIFI_MQTT_thread
+ WifiLease stored_lease; // what the flash holds
+ volatile bool wifi_forget = false;
+
+ /* ---- OUTBOX ---- */
+ // tilt and threshold messages that came up while the broker was away, in
+ // 16 sectors (512 messages) behind the WiFi lease; kOutboxStaging of them
+ // are collected in RAM and programmed together
+ constexpr uint32_t kOutboxStart = kWifiLeaseStart + 2 * kTraceSectorSize;
+ constexpr uint32_t kOutboxSize = 16 * kTraceSectorSize;
+ constexpr int kOutboxStaging = 4;
+ MessageOutbox<BlockDevice, kOutboxStaging> outbox(trace_bd, kOutboxStart, kOutboxSize);
+ Mutex outbox_mutex; // between mqtt_thread storing and WIFI_MQTT_thread replaying
+ volatile bool outbox_ready = false;
+ volatile bool outbox_flush_pending = false;
+ // staged messages reach the flash after at most this long [ms]
+ int outbox_flush_ms = 1000;
+ // replay after a reconnect: messages per second, and per publish
+ int outbox_replay_rate = 20;
+ int outbox_replay_batch = 16;
+ // one replayed batch is in flight at a time, only touched by WIFI_MQTT_thread
+ // (replay_acked by the ack handler, which runs there too)
+ uint8_t replay_buffer[1024];
+ unsigned short replay_id = 0; // packet id of the batch in flight, 0 for none
+ int replay_count = 0;
+ uint32_t replay_first = 0; // sequences of its oldest and newest message
+ uint32_t replay_last = 0;
+ bool replay_acked = false;
+ int replay_tokens = 0; // [1/1000 message]
+ uint32_t replay_refill_ms = 0;
+ struct ReplayStats
+ {
+   uint32_t batches;  // replay publishes acknowledged
+   uint32_t messages; // messages in them
+   uint32_t resent;   // batches read again after a reconnect
+ };
+ ReplayStats replay_stats = {0};
+
  /* ---- RPC ---- */
  // insert function define
  void MODESelect(Arguments *in, Reply *out);
+ void TraceRecord(Arguments *in, Reply *out);
+ void TraceDump(Arguments *in, Reply *out);
+ void GestureDecision(Arguments *in, Reply *out);
+ void TiltSleep(Arguments *in, Reply *out);
+ void Calibrate(Arguments *in, Reply *out);
+ void TiltPublish(Arguments *in, Reply *out);
+ void Power(Arguments *in, Reply *out);
+ void Boot(Arguments *in, Reply *out);
+ void Wifi(Arguments *in, Reply *out);
+ void Mqtt(Arguments *in, Reply *out);
+ void Outbox(Arguments *in, Reply *out);
 
  RPCFunction rpcLoop(&MODESelect, "MODESelect");
+ RPCFunction rpcTraceRecord(&TraceRecord, "TraceRecord");
+ RPCFunction rpcTraceDump(&TraceDump, "TraceDump");
+ RPCFunction rpcGestureDecision(&GestureDecision, "GestureDecision");
+ RPCFunction rpcTiltSleep(&TiltSleep, "TiltSleep");
+ RPCFunction rpcCalibrate(&Calibrate, "Calibrate");
+ RPCFunction rpcTiltPublish(&TiltPublish, "TiltPublish");
+ RPCFunction rpcPower(&Power, "Power");
+ RPCFunction rpcBoot(&Boot, "Boot");
+ RPCFunction rpcWifi(&Wifi, "Wifi");
+ RPCFunction rpcMqtt(&Mqtt, "Mqtt");
+ RPCFunction rpcOutbox(&Outbox, "Outbox");
  BufferedSerial pc(USBTX, USBRX);
+ // printf of every thread goes to pc through here, muted during a trace dump
+ MutedConsole console(&pc);
+ FileHandle *mbed::mbed_override_console(int fd)
+ {
+   return &console;
+ }
 
  /* ---- THREAD ---- */
  Thread GUI_thread(osPriorityNormal, 8 * 1024);
@@ -104,46 +284,277 @@
  Thread WIFI_MQTT_thread(osPriorityHigh);
  Thread mqtt_thread(osPriorityHigh);
  EventQueue mqtt_queue;
+ Thread TRACE_thread(osPriorityBelowNormal);
+ EventQueue trace_queue;
+ Thread ORIENTATION_thread(osPriorityAboveNormal);
+ EventQueue orientation_queue;
+ Thread HANDLER_thread(osPriorityBelowNormal);
+ EventQueue handler_queue((kInboxSlots + 1) * EVENTS_EVENT_SIZE);
+ Thread DISPLAY_thread(osPriorityBelowNormal, 4 * 1024);
+
+ /* ---- ORIENTATION ---- */
+ // latest decimated result of the estimator, handed to the tilt thread
+ int16_t tilt_gravity[3] = {0};
+ int16_t tilt_accel[3] = {0};
+ Mutex tilt_mutex;
+ Semaphore tilt_sample(0, 1);
+ bool orientation_running = false;
+ int orientation_event = 0;
+
+ // sleep after the gravity estimate stayed within 3 degree for this long,
+ // the LSM6DSL wakes us up through INT1 (PD11) on motion, 0 never sleeps
+ int tilt_sleep_ms = 3000;
+ volatile bool tilt_sleep_request = false;
+ volatile uint32_t tilt_entered = 0; // bumped every time DETECTION mode starts
+ volatile bool orientation_sleeping = false;
+ InterruptIn tilt_int(PD_11);
 
  /* ---- FUNCTION ---- */
- // for predicting gesture
- int PredictGesture(float* output) {
-   // How many times the most recent gesture has been matched in a row
-   static int continuous_count = 0;
-   // The result of the last prediction
-   static int last_predict = -1;
+ // for trace recording
+ uint32_t trace_time_ms()
+ {
+   return duration_cast<milliseconds>(Kernel::Clock::now().time_since_epoch()).count();
+ }
+
+ // write the sealed page on the trace thread, so sensing never waits on flash
+ void trace_flush()
+ {
+   flush_mutex.lock();
+   if (recorder.flush() != 0)
+   {
+     printf("Trace flush failed\r\n");
+   }
+   flush_mutex.unlock();
+ }
+
+ void trace_accel(const int16_t *xyz)
+ {
+   if (!trace_enabled) return;
+   trace_mutex.lock();
+   bool sealed = recorder.append_accel(trace_time_ms(), xyz);
+   trace_mutex.unlock();
+   if (sealed) trace_queue.call(trace_flush);
+ }
+
+ void trace_gesture(int gesture_index)
+ {
+   if (!trace_enabled) return;
+   trace_mutex.lock();
+   bool sealed = recorder.append_gesture(trace_time_ms(), gesture_index, threshold);
+   trace_mutex.unlock();
+   if (sealed) trace_queue.call(trace_flush);
+ }
+
+ void trace_tilt(float tilt)
+ {
+   if (!trace_enabled) return;
+   trace_mutex.lock();
+   bool sealed = recorder.append_tilt(trace_time_ms(), tilt, threshold);
+   trace_mutex.unlock();
+   if (sealed) trace_queue.call(trace_flush);
+ }
+
+ // mount the QSPI flash and find the end of the trace log
+ void init_trace()
+ {
+   if (!trace_bd || trace_bd->init() != 0)
+   {
+     printf("Trace flash not available\r\n");
+     return;
+   }
+   flash_ready = true;
+   if (recorder.init() != 0)
+   {
+     printf("Trace flash not available\r\n");
+     return;
+   }
+   trace_ready = true;
+   TRACE_thread.start(callback(&trace_queue, &EventQueue::dispatch_forever));
+ }
+
+ // find the messages an earlier run could not send
+ void init_outbox()
+ {
+   if (!flash_ready || outbox.init() != 0)
+   {
+     printf("Outbox not available\r\n");
+     return;
+   }
+   outbox_ready = true;
+   if (outbox.pending() > 0)
+   {
+     printf("Outbox: %d messages to send\r\n", outbox.pending());
+   }
+ }
+
+ void orientation_update();
+ void orientation_wake();
+ bool enqueue_publish(const char *name, MQTT::QoS qos, const char *payload, int len);
+
+ // start from the calibration stored on the flash, if there is one
+ void init_calibration()
+ {
+   if (!flash_ready || !calibration_record.load(&calibration))
+   {
+     printf("No stored calibration\r\n");
+     return;
+   }
+   SetOrientationCalibration(calibration);
+   calibration_version++;
+   printf("Calibration loaded: gravity %d %d %d\r\n", calibration.gravity[0], calibration.gravity[1], calibration.gravity[2]);
+ }
+
+ // average the resting sensor and store the result, on the orientation thread
+ void calibrate()
+ {
+   orientation_wake();
+   OrientationCalibration result;
+   bool still = CalibrateOrientation(&result);
+   StopOrientation();
+   orientation_running = false;
+   if (!still)
+   {
+     printf("Calibration failed: keep the board still\r\n");
+     return;
+   }
+
+   SetOrientationCalibration(result);
+   tilt_mutex.lock();
+   calibration = result;
+   tilt_mutex.unlock();
+   calibration_version++;
+   printf("Calibrated: gravity %d %d %d\r\n", result.gravity[0], result.gravity[1], result.gravity[2]);
+
+   if (flash_ready && calibration_record.store(result) != 0)
+   {
+     printf("Calibration not stored\r\n");
+   }
+ }
 
-   // Find whichever output has a probability > 0.8 (they sum to 1)
-   int this_predict = -1;
-   for (int i = 0; i < label_num; i++) {
-     if (output[i] > 0.8) this_predict = i;
+ // hand motion detection to the LSM6DSL and stop the periodic updates
+ void orientation_sleep()
+ {
+   tilt_sleep_request = false;
+   orientation_queue.cancel(orientation_event);
+   orientation_event = 0;
+   SleepOrientation();
+   orientation_running = false;
+   orientation_sleeping = true;
+   printf("Tilt sleeping until motion\r\n");
+ }
+
+ // INT1 fired (or the mode changed): start the periodic updates again
+ void orientation_wake()
+ {
+   if (!orientation_sleeping)
+   {
+     return;
+   }
+   uint8_t events = WakeOrientation();
+   orientation_sleeping = false;
+   orientation_event = orientation_queue.call_every(milliseconds(1000 / kOrientationRateHz), orientation_update);
+   printf("Tilt wake-up, events 0x%02x\r\n", events);
+ }
+
+ void tilt_wake_isr()
+ {
+   orientation_queue.call(orientation_wake);
+ }
+
+ // DETECTION mode entered: start the periodic updates, on the orientation thread
+ void orientation_start()
+ {
+   if (orientation_sleeping)
+   {
+     orientation_wake();
    }
+   else if (orientation_event == 0)
+   {
+     orientation_event = orientation_queue.call_every(milliseconds(1000 / kOrientationRateHz), orientation_update);
+   }
+   if (calibration_version == 0)
+   {
+     calibrate();
+   }
+ }
 
-   // No gesture was detected above the threshold
-   if (this_predict == -1) {
-     continuous_count = 0;
-     last_predict = label_num;
-     return label_num;
+ // DETECTION mode left: no updates and the LSM6DSL back to its defaults
+ void orientation_stop()
+ {
+   if (orientation_sleeping)
+   {
+     WakeOrientation();
+     orientation_sleeping = false;
    }
+   if (orientation_event != 0)
+   {
+     orientation_queue.cancel(orientation_event);
+     orientation_event = 0;
+   }
+   if (orientation_running)
+   {
+     StopOrientation();
+     orientation_running = false;
+   }
+ }
 
-   if (last_predict == this_predict) {
-     continuous_count += 1;
-   } else {
-     continuous_count = 0;
+ // fused accel + gyro update at kOrientationRateHz, only in DETECTION mode
+ void orientation_update()
+ {
+   if (!orientation_running)
+   {
+     orientation_running = SetupOrientation();
+     return;
+   }
+   if (tilt_sleep_request)
+   {
+     orientation_sleep();
+     return;
    }
-   last_predict = this_predict;
 
-   // If we haven't yet had enough consecutive matches for this gesture,
-   // report a negative result
-   if (continuous_count < config.consecutiveInferenceThresholds[this_predict]) {
-     return label_num;
+   int16_t gravity[3], accel[3];
+   if (UpdateOrientation(gravity, accel))
+   {
+     tilt_mutex.lock();
+     memcpy(tilt_gravity, gravity, sizeof(gravity));
+     memcpy(tilt_accel, accel, sizeof(accel));
+     tilt_mutex.unlock();
+     tilt_sample.release();
    }
-   // Otherwise, we've seen a positive result, so clear all our variables
-   // and report it
-   continuous_count = 0;
-   last_predict = -1;
+ }
+
+ // mode hooks, run by modes.request() on the requesting thread
+ void enter_safe()
+ {
+   SetPowerMode(kModeSafe);
+ }
+
+ void enter_gesture()
+ {
+   SetPowerMode(kModeGesture);
+   // the model input is sampled at the 52 Hz BSP_ACCELERO_Init uses
+   SetPowerDemand(kPowerGesture, LSM6DSL_ODR_52Hz, false);
+   led1 = 1;
+ }
+
+ void exit_gesture()
+ {
+   led1 = 0;
+   SetPowerDemand(kPowerGesture, LSM6DSL_ODR_POWER_DOWN, false);
+ }
 
-   return this_predict;
+ void enter_tilt()
+ {
+   SetPowerMode(kModeTilt);
+   led2 = 1;
+   tilt_entered++;
+   orientation_queue.call(orientation_start);
+ }
+
+ void exit_tilt()
+ {
+   led2 = 0;
+   orientation_queue.call(orientation_stop);
  }
 
  // GUI mode
@@ -153,6 +564,8 @@
    // Whether we should clear the buffer next time we fetch data
    bool should_clear_buffer = false;
    bool got_data = false;
+   // Whether the last read went through the motion segmentation
+   bool segmenting = false;
 
    // The gesture index of the prediction
    int gesture_index;
@@ -161,78 +574,57 @@
    static tflite::MicroErrorReporter micro_error_reporter;
    tflite::ErrorReporter* error_reporter = &micro_error_reporter;
 
-   // Map the model into a usable data structure. This doesn't involve any
-   // copying or parsing, it's a very lightweight operation.
-   const tflite::Model* model = tflite::GetModel(g_magic_wand_model_data);
-   if (model->version() != TFLITE_SCHEMA_VERSION) {
-     error_reporter->Report(
-         "Model provided is schema version %d not equal "
-         "to supported version %d.",
-         model->version(), TFLITE_SCHEMA_VERSION);
+   // Build the interpreter and check the model's input tensor, while main
+   // brings up the sensors
+   tflite::MicroInterpreter* interpreter = SetupGestureModel(error_reporter);
+   if (interpreter == nullptr) {
+     boot.failed(kBootModel, trace_time_ms());
      return;
      //return -1;
    }
-
-   // Pull in only the operation implementations we need.
-   // This relies on a complete list of all the ops needed by this graph.
-   // An easier approach is to just use the AllOpsResolver, but this will
-   // incur some penalty in code space for op implementations that are not
-   // needed by this graph.
-   static tflite::MicroOpResolver<6> micro_op_resolver;
-   micro_op_resolver.AddBuiltin(
-       tflite::BuiltinOperator_DEPTHWISE_CONV_2D,
-       tflite::ops::micro::Register_DEPTHWISE_CONV_2D());
-   micro_op_resolver.AddBuiltin(tflite::BuiltinOperator_MAX_POOL_2D,
-                                tflite::ops::micro::Register_MAX_POOL_2D());
-   micro_op_resolver.AddBuiltin(tflite::BuiltinOperator_CONV_2D,
-                                tflite::ops::micro::Register_CONV_2D());
-   micro_op_resolver.AddBuiltin(tflite::BuiltinOperator_FULLY_CONNECTED,
-                                tflite::ops::micro::Register_FULLY_CONNECTED());
-   micro_op_resolver.AddBuiltin(tflite::BuiltinOperator_SOFTMAX,
-                                tflite::ops::micro::Register_SOFTMAX());
-   micro_op_resolver.AddBuiltin(tflite::BuiltinOperator_RESHAPE,
-                                tflite::ops::micro::Register_RESHAPE(), 1);
-
-   // Build an interpreter to run the model with
-   static tflite::MicroInterpreter static_interpreter(
-       model, micro_op_resolver, tensor_arena, kTensorArenaSize, error_reporter);
-   tflite::MicroInterpreter* interpreter = &static_interpreter;
-
-   // Allocate memory from the tensor_arena for the model's tensors
-   interpreter->AllocateTensors();
-
-   // Obtain pointer to the model's input tensor
    TfLiteTensor* model_input = interpreter->input(0);
-   if ((model_input->dims->size != 4) || (model_input->dims->data[0] != 1) ||
-       (model_input->dims->data[1] != config.seq_length) ||
-       (model_input->dims->data[2] != kChannelNumber) ||
-       (model_input->type != kTfLiteFloat32)) {
-     error_reporter->Report("Bad input tensor parameters in model");
-     return;
-     //return -1;
-   }
 
    int input_length = model_input->bytes / sizeof(float);
 
+   boot.wait(kBootSensors);
    TfLiteStatus setup_status = SetupAccelerometer(error_reporter);
    if (setup_status != kTfLiteOk) {
      error_reporter->Report("Set up failed\n");
+     boot.failed(kBootModel, trace_time_ms());
      return;
      //return -1;
    }
 
+   // BSP_ACCELERO_Init left the sensor at 52 Hz, power it down until a
+   // mode needs it
+   SetupPower();
+   boot.ready(kBootModel, trace_time_ms());
+
    error_reporter->Report("Start gesture\n");
 
    threshold = 30;
 
    while (true) {
-     if(MODE == 1)
+     // blocks while another mode is active
+     modes.wait_for(kModeGesture);
      {
-       led1 = 1;
-
        // Attempt to read new data from the accelerometer
-       got_data = ReadAccelerometer(error_reporter, model_input->data.f,
-                                   input_length, should_clear_buffer);
+       if (GetGestureDecision() == kDecisionSegment)
+       {
+         // one inference per motion segment, sample at the 52 Hz ODR
+         // and sleep in between instead of invoking the model every frame
+         got_data = ReadAccelerometerSegment(error_reporter, model_input->data.f,
+                                             input_length, !segmenting);
+         segmenting = true;
+         ThisThread::sleep_for(19ms);
+       }
+       else
+       {
+         got_data = ReadAccelerometer(error_reporter, model_input->data.f,
+                                     input_length, should_clear_buffer || segmenting);
+         segmenting = false;
+       }
+       trace_accel(pDataXYZ);
 
        // If there was no new data,
        // don't try to clear the buffer again and wait until next time
@@ -270,19 +662,22 @@
              threshold = threshold;
              break;
          }
+         trace_gesture(gesture_index);
+         uint8_t event[16];
+         int len = EncodeGesture(event, sizeof(event), gesture_index, threshold, trace_time_ms());
+         enqueue_publish(topic, MQTT::QOS0, (const char *)event, len);
          printf("Gesture index: %d\n", gesture_index); // 1 is the gesture_index we want to change tile
          printf("tile: %d\n", threshold);
          error_reporter->Report(config.output_message[gesture_index]);
 
          // Use uLCD to show the threshold
-         uLCD.locate(1, 3);
-         uLCD.printf("%d", threshold);
+         if (boot.is_ready(kBootDisplay))
+         {
+           uLCD.locate(1, 3);
+           uLCD.printf("%d", threshold);
+         }
        }
      }
-     else
-     {
-       led1 = 0;
-     }
    }
  }
 
@@ -300,100 +695,437 @@
    uLCD.printf("X\n");
  }
 
+ // reset the uLCD and draw the layout, on the display thread
+ void boot_display()
+ {
+   uLCD.begin();
+   init_uLCD_display();
+   boot.ready(kBootDisplay, trace_time_ms());
+ }
+
  // close MQTT
  void close_MQTT()
  {
    mqtt_flag = false;
  }
 
- // tilt angle
- void tilt_angle(MQTT::Client<MQTTNetwork, Countdown> *client)
+ // hand a message to the network thread from any thread, false (and
+ // counted as dropped) if the queue is full, or (counted as too long) if
+ // it does not fit in a slot
+ bool enqueue_publish(const char *name, MQTT::QoS qos, const char *payload, int len)
  {
-   BSP_ACCELERO_Init();
-   BSP_ACCELERO_AccGetXYZ(gDataXYZ);
+   OutboundMessage message;
+   if (len > (int)sizeof(message.payload))
+   {
+     core_util_atomic_incr_u32(&publish_stats.too_long, 1);
+     return false;
+   }
+   message.topic = name;
+   message.qos = qos;
+   message.len = len;
+   memcpy(message.payload, payload, len);
+   if (!publish_queue.push(message))
+   {
+     core_util_atomic_incr_u32(&publish_stats.dropped, 1);
+     return false;
+   }
+   core_util_atomic_incr_u32(&publish_stats.queued, 1);
+   publish_wake.set(kPublishWake);
+   return true;
+ }
 
-   // get init X Y Z as the base line
-   int Axis[3];
-   for (int i = 0; i < 3; i++)
+ // program the staged outbox messages, on mqtt_thread
+ void flush_outbox()
+ {
+   outbox_flush_pending = false;
+   outbox_mutex.lock();
+   int rc = outbox.flush();
+   outbox_mutex.unlock();
+   if (rc != 0)
    {
-     Axis[i] = gDataXYZ[i];
+     printf("Outbox flush failed: %d\r\n", rc);
    }
+ }
 
-   // start detection
-   while (1)
+ // a QoS 1 message that must not get lost, from mqtt_thread: queued while
+ // the broker is up, stored in the outbox while it is down or the queue is
+ // full. Staged messages are programmed after outbox_flush_ms at the latest.
+ bool publish_durable(const uint8_t *payload, int len)
+ {
+   if (!outbox_ready || (!mqtt_stats.down && !publish_queue.full()))
+   {
+     return enqueue_publish(topic, MQTT::QOS1, (const char *)payload, len);
+   }
+   outbox_mutex.lock();
+   bool stored = outbox.append(payload, len);
+   outbox_mutex.unlock();
+   if (stored && !outbox_flush_pending)
+   {
+     outbox_flush_pending = true;
+     mqtt_queue.call_in(milliseconds(outbox_flush_ms), flush_outbox);
+   }
+   return stored;
+ }
+
+ // send the stored messages, up to outbox_replay_batch in one QoS 1 publish
+ // (a telemetry batch), on WIFI_MQTT_thread. Live messages go first: a batch
+ // only goes out when nothing new waits in the queue, one at a time and at
+ // most outbox_replay_rate messages per second. Messages leave the flash
+ // once the broker acknowledged their batch.
+ void replay_outbox(MQTT::Client<MQTTNetwork, Countdown> &client)
+ {
+   if (!outbox_ready)
+   {
+     return;
+   }
+   if (replay_acked)
+   {
+     outbox_mutex.lock();
+     if (outbox.consume(replay_first, replay_last) != 0)
+     {
+       printf("Outbox update failed\r\n");
+     }
+     outbox_mutex.unlock();
+     replay_stats.batches++;
+     replay_stats.messages += replay_count;
+     replay_acked = false;
+     replay_id = 0;
+   }
+
+   // token bucket, holds one batch at most; a long gap is cut to the time
+   // that fills it before the multiply can overflow
+   uint32_t now = trace_time_ms();
+   uint32_t elapsed = now - replay_refill_ms;
+   uint32_t full_ms = outbox_replay_batch * 1000 / outbox_replay_rate + 1;
+   if (elapsed > full_ms)
+   {
+     elapsed = full_ms;
+   }
+   replay_tokens += elapsed * outbox_replay_rate;
+   replay_refill_ms = now;
+   if (replay_tokens > outbox_replay_batch * 1000)
+   {
+     replay_tokens = outbox_replay_batch * 1000;
+   }
+   int count = replay_tokens / 1000;
+   if (replay_id != 0 || count == 0 || publish_queue.size() > inflight.size())
+   {
+     return;
+   }
+
+   TelemetryBatch batch(replay_buffer, sizeof(replay_buffer));
+   outbox_mutex.lock();
+   if (outbox.pending() > 0 && outbox.flush() == 0)
    {
-     if (MODE == 2)
+     outbox.peek(count, [&batch](const uint8_t *payload, int len) { return batch.add(payload, len); }, &replay_first, &replay_last);
+   }
+   outbox_mutex.unlock();
+   if (batch.count() == 0)
+   {
+     return;
+   }
+
+   unsigned short id = 0;
+   if (client.publishNoWait(topic, replay_buffer, batch.length(), id, MQTT::QOS1) == 0)
+   {
+     replay_id = id;
+     replay_count = batch.count();
+     replay_tokens -= batch.count() * 1000;
+   }
+ }
+
+ // PUBACK, PUBREC or PUBCOMP, from yield on WIFI_MQTT_thread; the network
+ // thread then frees the slot and sends the next message without sleeping
+ void publish_acked(MQTT::pubackData &ack)
+ {
+   if (replay_id != 0 && ack.type == kInflightPuback && ack.id == replay_id)
+   {
+     // the flash is updated by replay_outbox, outside the client
+     replay_acked = true;
+     publish_wake.set(kPublishWake);
+   }
+   else if (inflight.ack(ack.type, ack.id))
+   {
+     publish_wake.set(kPublishWake);
+   }
+   else
+   {
+     publish_stats.unmatched++;
+   }
+ }
+
+ // the acknowledged messages at the front of the window leave the queue
+ void release_acked()
+ {
+   for (int n = inflight.release(); n > 0; n--)
+   {
+     publish_queue.pop();
+   }
+ }
+
+ // send what the other threads queued, on WIFI_MQTT_thread only. Up to
+ // mqtt_window messages are in flight, each payload goes out straight from
+ // its slot and the slot is freed once the broker acknowledged it.
+ void send_queued(MQTT::Client<MQTTNetwork, Countdown> &client)
+ {
+   release_acked();
+   int waiting = publish_queue.size();
+   if (waiting > (int)publish_stats.peak)
+   {
+     publish_stats.peak = waiting;
+   }
+   OutboundMessage *queued;
+   while (client.isConnected() && inflight.size() < mqtt_window && !inflight.full() &&
+          (queued = publish_queue.peek(inflight.size())) != nullptr)
+   {
+     unsigned short id = 0;
+     int rc = client.publishNoWait(queued->topic, queued->payload, queued->len, id, queued->qos);
+     if (rc != 0)
      {
-       led2 = 1;
+       publish_stats.failed++;
+       printf("rc:  %d\r\n", rc);
+       if (!client.isConnected())
+       {
+         // sent after the reconnect, behind the window
+         break;
+       }
+       // still connected: the client refused the message itself, drop it
+       inflight.push(0, MQTT::QOS0);
+       continue;
+     }
+     publish_stats.sent++;
+     inflight.push(id, queued->qos);
+   }
+   // QoS 0 messages are done once written
+   release_acked();
+ }
 
-       long int dotproduct = 0;
-       long int normA = 0;
-       long int normg = 0;
+ // after a reconnect: whatever the broker has not acknowledged goes out
+ // again in the original order and with the same ids, before anything new
+ void resend_inflight(MQTT::Client<MQTTNetwork, Countdown> &client)
+ {
+   for (int i = 0; i < inflight.size() && client.isConnected(); i++)
+   {
+     OutboundMessage *queued = publish_queue.peek(i);
+     unsigned short id = inflight.id(i);
+     if (inflight.state(i) == kInflightSent)
+     {
+       client.publishNoWait(queued->topic, queued->payload, queued->len, id, queued->qos, false, true);
+       publish_stats.resent++;
+     }
+ #if MQTTCLIENT_QOS2
+     else if (inflight.state(i) == kInflightReleased)
+     {
+       client.publishRelease(id);
+     }
+ #endif
+   }
+ }
 
-       // get XYZ data
-       BSP_ACCELERO_AccGetXYZ(gDataXYZ);
-       for (int i = 0; i < 3; i++)
+ // queue the buffered tilt events, tilt_max_batch per message, as one
+ // telemetry tilt batch (sequence, time and angle deltas)
+ void publish_tilt_events()
+ {
+   tilt_publish_pending = false;
+   while (!tilt_events.empty())
+   {
+     if (publish_queue.full() && !outbox_ready)
+     {
+       // backpressure: the events stay in tilt_events (which drops the
+       // oldest when it overflows) and are tried again later
+       publish_stats.deferred++;
+       if (!tilt_publish_pending)
        {
-         dotproduct += gDataXYZ[i] * Axis[i];
-         normA += Axis[i] * Axis[i];
-         normg += gDataXYZ[i] * gDataXYZ[i];
+         tilt_publish_pending = true;
+         mqtt_queue.call_in(milliseconds(tilt_max_latency_ms), publish_tilt_events);
        }
+       return;
+     }
+     TiltEvent events[kTiltEventCapacity];
+     int count = 0;
+     while (count < tilt_max_batch && tilt_events.pop(events[count]))
+     {
+       count++;
+     }
+
+     uint8_t buff[sizeof(OutboundMessage::payload)];
+     int len = EncodeTiltBatch(buff, sizeof(buff), events, count);
+
+     // QoS1: if the connection drops before the PUBACK, the client keeps
+     // the message and sends it again on reconnect; while the broker is
+     // down it waits in the outbox
+     publish_durable(buff, len);
+   }
+ }
 
-       // calculate the angle by dot
-       float cosvalue = dotproduct / sqrt(normg) / sqrt(normA);
-       angle = acos(cosvalue) * 180 / 3.1415926;
+ // buffer one tilt event on the sensing thread, the mqtt thread formats the
+ // batch once it is full or the oldest event is due
+ void post_tilt_event(float tilt)
+ {
+   TiltEvent event;
+   event.time_ms = trace_time_ms();
+   event.angle = (int16_t)(tilt * 10);
+   event.sequence = ++tilt_sequence;
+   if (tilt_events.full())
+   {
+     // the oldest event is overwritten
+     tilt_events_dropped++;
+   }
+   tilt_events.push(event);
+
+   if ((int)tilt_events.size() >= tilt_max_batch)
+   {
+     mqtt_queue.call(publish_tilt_events);
+   }
+   else if (!tilt_publish_pending)
+   {
+     tilt_publish_pending = true;
+     mqtt_queue.call_in(milliseconds(tilt_max_latency_ms), publish_tilt_events);
+   }
+ }
+
+ // tilt angle
+ void tilt_angle()
+ {
+   // without a calibration the first sample of detection mode is the base
+   // line: only then the power manager runs the sensor, at boot the GUI
+   // thread may still be setting it up or have powered it down
+   TiltComparator tilt;
+   bool have_reference = false;
+   uint32_t reference_version = 0;
+
+   // cos^2 of the limits, only recomputed when the threshold changes
+   const TiltLimit still_limit = MakeTiltLimit(5);
+   TiltLimit threshold_limit = MakeTiltLimit(threshold);
+
+   // gravity at the start of the current idle period, from the first
+   // sample after DETECTION mode was entered
+   TiltComparator idle;
+   bool have_idle_reference = false;
+   uint32_t idle_entered = 0;
+   const TiltLimit idle_limit = MakeTiltLimit(3);
+   uint32_t idle_since_ms = trace_time_ms();
+
+   // start detection
+   while (1)
+   {
+     // blocks while another mode is active
+     modes.wait_for(kModeTilt);
+     {
+       // wait for the next decimated gravity estimate
+       if (!tilt_sample.try_acquire_for(500ms))
+       {
+         continue;
+       }
+       int16_t gravity[3];
+       tilt_mutex.lock();
+       memcpy(gravity, tilt_gravity, sizeof(gravity));
+       memcpy(gDataXYZ, tilt_accel, sizeof(gDataXYZ));
+       if (reference_version != calibration_version)
+       {
+         tilt.set_reference(calibration.gravity);
+         reference_version = calibration_version;
+         have_reference = true;
+       }
+       else if (!have_reference)
+       {
+         tilt.set_reference(gDataXYZ);
+         have_reference = true;
+       }
+       tilt_mutex.unlock();
+       trace_accel(gDataXYZ);
+       if (threshold_limit.degrees != threshold)
+       {
+         threshold_limit = MakeTiltLimit(threshold);
+       }
+
+       // the angle itself is only needed for the display
+       angle = tilt.angle(gravity);
 
        // change uLCD display
-       uLCD.locate(1, 7);
-       uLCD.printf("%-4.1f", angle);
-       ThisThread::sleep_for(250ms);
+       if (boot.is_ready(kBootDisplay))
+       {
+         uLCD.locate(1, 7);
+         uLCD.printf("%-4.1f", angle);
+       }
 
        // difference as 5 degree
-       if (angle < 5)
+       if (!tilt.at_least(gravity, still_limit))
        {
          led3 = !led3; // led spark means still on table
        }
-       if (angle >= threshold && num < 5)
+
+       // nothing moved for tilt_sleep_ms: let the sensor watch for motion
+       if (idle_entered != tilt_entered)
+       {
+         idle_entered = tilt_entered;
+         have_idle_reference = false;
+       }
+       if (!have_idle_reference || idle.at_least(gravity, idle_limit))
+       {
+         have_idle_reference = true;
+         idle.set_reference(gravity);
+         idle_since_ms = trace_time_ms();
+       }
+       else if (tilt_sleep_ms > 0 && trace_time_ms() - idle_since_ms >= (uint32_t)tilt_sleep_ms)
+       {
+         tilt_sleep_request = true;
+         idle_since_ms = trace_time_ms();
+       }
+       if (tilt.at_least(gravity, threshold_limit) && num < 5)
        {
          num++;
-
-         MQTT::Message message;
-         char buff[100];
-         sprintf(buff, "The %d time(s)", num);
-         message.qos = MQTT::QOS0;
-         message.retained = false;
-         message.dup = false;
-         message.payload = (void *)buff;
-         message.payloadlen = strlen(buff) + 1;
-         int rc = client->publish(topic, message);
-
-         printf("rc:  %d\r\n", rc);
-         printf("Puslish message: %s\r\n", buff);
+         trace_tilt(angle);
+         post_tilt_event(angle);
          if (num >= 5)
          {
-             MODE = 0;
+             modes.request(kModeSafe);
          }
        }
      }
-     else
-     {
-       led2 = 0;
-     }
    }
  }
 
  // collect message
+ // runs on HANDLER_thread, one message at a time
+ void handle_message(InboundMessage *message)
+ {
+   uint32_t started_ms = trace_time_ms();
+   printf("Message arrived: QoS%d, retained %d, dup %d, packetID %d\r\n", message->qos, message->retained, message->dup, message->id);
+   int type = TelemetryMessageType(message->payload, message->length);
+   if (type > 0)
+   {
+     // our own telemetry echoed by the broker, telemetry_codec.py decodes it
+     printf("Telemetry type %d, %d bytes\r\n", type, (int)message->length);
+   }
+   else
+   {
+     printf("Payload %.*s\r\n", (int)message->length, (char *)message->payload);
+   }
+   ++arrivedcount;
+   inbox.finish(message, started_ms, trace_time_ms());
+ }
+
+ // runs inside client.yield() on the network thread: copy and hand over
  void messageArrived(MQTT::MessageData &md)
  {
-    MQTT::Message &message = md.message;
-    char msg[300];
-    sprintf(msg, "Message arrived: QoS%d, retained %d, dup %d, packetID %d\r\n", message.qos, message.retained, message.dup, message.id);
-    printf(msg);
-    ThisThread::sleep_for(1000ms);
-    char payload[300];
-    sprintf(payload, "Payload %.*s\r\n", message.payloadlen, (char *)message.payload);
-    printf(payload);
-    ++arrivedcount;
+   MQTT::Message &message = md.message;
+   MQTTString &name = md.topicName;
+   const char *topic_name = name.cstring ? name.cstring : name.lenstring.data;
+   int topic_len = name.cstring ? strlen(name.cstring) : name.lenstring.len;
+   InboundMessage *copy = inbox.store(topic_name, topic_len, message.payload, message.payloadlen, trace_time_ms());
+   if (copy == nullptr)
+   {
+     return;
+   }
+   copy->qos = message.qos;
+   copy->retained = message.retained;
+   copy->dup = message.dup;
+   copy->id = message.id;
+   if (handler_queue.call(handle_message, copy) == 0)
+   {
+     inbox.discard(copy);
+   }
  }
 
  // MODE selection
@@ -401,11 +1133,15 @@
  {
    int input_mode = in->getArg<int>();
    char buffer[200];
-   printf("PRESENT MODE = %d\n", MODE);
-   MODE = input_mode;
+   printf("PRESENT MODE = %d\n", modes.mode());
+   if (!modes.request(input_mode))
+   {
+     modes.request(kModeSafe);
+   }
    if (input_mode == 1)
    {
-     sprintf(buffer, "GESTURE_UI MODE");
+     // GUI_thread starts the mode as soon as the model is up
+     sprintf(buffer, boot.is_ready(kBootModel) ? "GESTURE_UI MODE" : "GESTURE_UI MODE (MODEL STARTING)");
    }
    else if (input_mode == 2)
    {
@@ -415,27 +1151,487 @@
    {
      sprintf(buffer, "Back to SAFE MODE");
    }
-   printf("NEW MODE = %d\n", MODE);
+   printf("NEW MODE = %d\n", modes.mode());
    out->putData(buffer);
  }
 
+ // time from boot to each stage [ms], -1 while pending
+ void Boot(Arguments *in, Reply *out)
+ {
+   for (int stage = 0; stage < kBootStageCount; stage++)
+   {
+     out->putData(boot_stage_names[stage]);
+     out->putData((int)boot.time_ms(stage));
+     if (boot.is_failed(stage) && !boot.is_ready(stage))
+     {
+       out->putData("FAILED");
+     }
+   }
+ }
+
+ // timing of the last WiFi connect [ms], 1 as argument drops the stored
+ // lease
+ void Wifi(Arguments *in, Reply *out)
+ {
+   int forget = (in->argc > 0) ? in->getArg<int>() : 0;
+   if (forget)
+   {
+     wifi_forget = true;
+   }
+   out->putData(wifi_stats.path == kWifiDirected ? "DIRECTED" : wifi_stats.path == kWifiScan ? "SCAN" : wifi_stats.path == kWifiConnect ? "CONNECT" : "FAILED");
+   out->putData(wifi_stats.directed_ms);
+   out->putData(wifi_stats.scan_ms);
+   out->putData(wifi_stats.scan_join_ms);
+   out->putData(wifi_stats.total_ms);
+   out->putData("BROKER");
+   out->putData(wifi_stats.broker_ms);
+   out->putData(wifi_stats.literal_broker ? "LITERAL" : wifi_stats.cached_broker ? "CACHED" : "RESOLVED");
+   out->putData(wifi_stats.static_ip ? "STATIC IP" : "DHCP");
+   out->putData(wifi_stats.directed_join ? "CHANNEL" : "NO CHANNEL");
+   out->putData((int)wifi_stats.directed_ok);
+   out->putData((int)wifi_stats.scan_fallbacks);
+ }
+
+ // broker connection: up or down, outages and their durations [ms], the
+ // publish queue and the window; an argument sets mqtt_window
+ void Mqtt(Arguments *in, Reply *out)
+ {
+   int window = (in->argc > 0) ? in->getArg<int>() : mqtt_window;
+   if (window < 1 || window > inflight.capacity())
+   {
+     out->putData("INVALID WINDOW");
+     return;
+   }
+   mqtt_window = window;
+   uint32_t down_ms = mqtt_stats.down ? trace_time_ms() - mqtt_stats.down_since_ms : 0;
+   out->putData(mqtt_stats.down ? "DOWN" : "UP");
+   out->putData((int)down_ms);
+   out->putData("OUTAGES");
+   out->putData((int)mqtt_stats.outages);
+   out->putData((int)mqtt_stats.last_ms);
+   out->putData((int)mqtt_stats.longest_ms);
+   out->putData((int)mqtt_stats.total_ms);
+   out->putData("ATTEMPTS");
+   out->putData((int)mqtt_stats.attempts);
+   out->putData("SESSIONS LOST");
+   out->putData((int)mqtt_stats.sessions_lost);
+   out->putData("QUEUE");
+   out->putData(publish_queue.size());
+   out->putData((int)publish_stats.peak);
+   out->putData((int)publish_stats.queued);
+   out->putData((int)publish_stats.sent);
+   out->putData((int)publish_stats.failed);
+   out->putData((int)publish_stats.dropped);
+   out->putData((int)publish_stats.deferred);
+   out->putData((int)publish_stats.too_long);
+   out->putData("WINDOW");
+   out->putData(inflight.size());
+   out->putData(mqtt_window);
+   out->putData((int)publish_stats.resent);
+   out->putData((int)publish_stats.unmatched);
+   const InboxStats &received = inbox.stats();
+   int handled = received.handled ? received.handled : 1;
+   out->putData("INBOX");
+   out->putData(inbox.waiting());
+   out->putData((int)received.peak);
+   out->putData((int)received.delivered);
+   out->putData((int)received.handled);
+   out->putData((int)received.dropped);
+   out->putData((int)received.too_long);
+   out->putData((int)received.wait_max_ms);
+   out->putData((int)(received.wait_total_ms / handled));
+   out->putData((int)received.run_max_ms);
+   out->putData((int)(received.run_total_ms / handled));
+ }
+
+ // store-and-forward queue: replay rate [messages/s] and messages per publish
+ void Outbox(Arguments *in, Reply *out)
+ {
+   int rate = (in->argc > 0) ? in->getArg<int>() : outbox_replay_rate;
+   int batch = (in->argc > 1) ? in->getArg<int>() : outbox_replay_batch;
+   if (rate < 1 || batch < 1 || batch > kTelemetryMaxBatch)
+   {
+     out->putData("INVALID REPLAY");
+     return;
+   }
+   outbox_replay_rate = rate;
+   outbox_replay_batch = batch;
+   if (!outbox_ready)
+   {
+     out->putData("OUTBOX NOT AVAILABLE");
+     return;
+   }
+   outbox_mutex.lock();
+   int pending = outbox.pending();
+   OutboxStats stats = outbox.stats();
+   outbox_mutex.unlock();
+   out->putData("OUTBOX");
+   out->putData(pending);
+   out->putData((int)stats.stored);
+   out->putData((int)stats.sent);
+   out->putData((int)stats.overwritten);
+   out->putData((int)stats.dropped);
+   out->putData((int)stats.corrupt);
+   out->putData("REPLAY");
+   out->putData(rate);
+   out->putData(batch);
+   out->putData((int)replay_stats.batches);
+   out->putData((int)replay_stats.messages);
+   out->putData((int)replay_stats.resent);
+ }
+
+ // store the lease when it changed (or was dropped), on WIFI_MQTT_thread
+ void store_wifi_lease()
+ {
+   if (wifi_forget)
+   {
+     wifi_forget = false;
+     ResetWifiLease(&wifi_lease);
+   }
+   if (!flash_ready || memcmp(&stored_lease, &wifi_lease, sizeof(wifi_lease)) == 0)
+   {
+     return;
+   }
+   if (wifi_record.store(wifi_lease) != 0)
+   {
+     printf("WiFi lease not stored\r\n");
+     return;
+   }
+   stored_lease = wifi_lease;
+ }
+
+ // time, CPU sleep and estimated current [uA] per mode since boot
+ void Power(Arguments *in, Reply *out)
+ {
+   PowerModeStats stats[kModeCount];
+   uint64_t total_us = 0;
+   for (int mode = 0; mode < kModeCount; mode++)
+   {
+     GetPowerStats(mode, &stats[mode]);
+     total_us += stats[mode].time_us;
+   }
+   for (int mode = 0; mode < kModeCount; mode++)
+   {
+     // duty cycle of the mode and CPU sleep within it, in per mille
+     uint64_t time_us = stats[mode].time_us;
+     int duty = total_us ? (int)(time_us * 1000 / total_us) : 0;
+     int sleep = time_us ? (int)((stats[mode].sleep_us + stats[mode].deep_sleep_us) * 1000 / time_us) : 0;
+     int deep = time_us ? (int)(stats[mode].deep_sleep_us * 1000 / time_us) : 0;
+     out->putData("MODE");
+     out->putData(mode);
+     out->putData(duty);
+     out->putData(sleep);
+     out->putData(deep);
+     out->putData((int)EstimatePowerCurrent(stats[mode]));
+   }
+   out->putData("ODR");
+   out->putData((int)PowerOdr());
+   out->putData(sleep_manager_can_deep_sleep() ? "DEEP SLEEP OK" : "DEEP SLEEP LOCKED");
+ }
+
+ // tilt event batching: max latency [ms] and max events per message
+ void TiltPublish(Arguments *in, Reply *out)
+ {
+   int latency = (in->argc > 0) ? in->getArg<int>() : 500;
+   int batch = (in->argc > 1) ? in->getArg<int>() : 5;
+   if (latency < 0 || batch < 1 || batch > kTiltMaxBatch)
+   {
+     out->putData("INVALID BATCHING");
+     return;
+   }
+   tilt_max_latency_ms = latency;
+   tilt_max_batch = batch;
+   out->putData("TILT PUBLISH");
+   out->putData(latency);
+   out->putData(batch);
+   out->putData("DROPPED");
+   out->putData((int)tilt_events_dropped);
+ }
+
+ // measure gravity and sensor biases again, the board must rest meanwhile
+ void Calibrate(Arguments *in, Reply *out)
+ {
+   orientation_queue.call(calibrate);
+   out->putData("CALIBRATING");
+ }
+
+ // sleep the tilt detection after this many idle seconds (0: never)
+ void TiltSleep(Arguments *in, Reply *out)
+ {
+   int seconds = (in->argc > 0) ? in->getArg<int>() : 3;
+   if (seconds < 0)
+   {
+     out->putData("INVALID SECONDS");
+     return;
+   }
+   tilt_sleep_ms = seconds * 1000;
+   out->putData("TILT SLEEP");
+   out->putData(seconds);
+ }
+
+ // select the gesture decision stage: 0 consecutive, 1 EMA, 2 hysteresis
+ void GestureDecision(Arguments *in, Reply *out)
+ {
+   int decision = (in->argc > 0) ? in->getArg<int>() : kDecisionConsecutive;
+   if (modes.active(kModeGesture))
+   {
+     // the GUI thread is running PredictGesture
+     out->putData("LEAVE GESTURE_UI MODE FIRST");
+     return;
+   }
+   if (!SetGestureDecision(decision))
+   {
+     out->putData("UNKNOWN DECISION");
+     return;
+   }
+   out->putData("GESTURE DECISION");
+   out->putData(decision);
+ }
+
+ // start (1) or stop (0) recording sensor traces to the QSPI flash
+ void TraceRecord(Arguments *in, Reply *out)
+ {
+   int enable = (in->argc > 0) ? in->getArg<int>() : 0;
+   if (!trace_ready)
+   {
+     out->putData("TRACE UNAVAILABLE");
+     return;
+   }
+   trace_enabled = enable != 0;
+   if (!trace_enabled)
+   {
+     // push out the partially filled page
+     trace_mutex.lock();
+     bool sealed = recorder.sync();
+     trace_mutex.unlock();
+     if (sealed) trace_queue.call(trace_flush);
+   }
+   out->putData(trace_enabled ? "TRACE ON" : "TRACE OFF");
+ }
+
+ // the trace log in frames of one page and its CRC-32, ended by an erased
+ // page and a trailer of the page count and its CRC-32 (all little endian)
+ static void trace_dump_frame(const uint8_t *data, int size)
+ {
+   uint8_t crc[4];
+   TracePut32(crc, RecordCrc32(data, size, 0));
+   pc.write(data, size);
+   pc.write(crc, sizeof(crc));
+ }
+
+ void TraceDump(Arguments *in, Reply *out)
+ {
+   int baud = (in->argc > 0) ? in->getArg<int>() : 0;
+   if (!trace_ready)
+   {
+     out->putData("TRACE UNAVAILABLE");
+     return;
+   }
+
+   // the page sealed last first, otherwise the partial one cannot be sealed
+   trace_enabled = false;
+   flush_mutex.lock();
+   int rc = recorder.flush();
+   trace_mutex.lock();
+   bool sealed = recorder.sync();
+   trace_mutex.unlock();
+   if (rc == 0 && sealed) rc = recorder.flush();
+   bool flushed = rc == 0 && !recorder.unsaved();
+
+   // nothing else may reach the port until the baud rate is back
+   fflush(stdout);
+   console.mute();
+   uint32_t dropped = console.dropped();
+
+   char header[32];
+   int len = sprintf(header, "TRACE %d\r\n", baud > 0 ? baud : 9600);
+   pc.write(header, len);
+   pc.sync();
+   if (baud > 0)
+   {
+     pc.set_baud(baud);
+     ThisThread::sleep_for(100ms); // let the PC switch as well
+   }
+
+   static uint8_t page[kTracePageSize];
+   int pages = 0;
+   bool read_failed = false;
+   for (uint32_t offset = 0; offset < recorder.size(); offset += kTracePageSize)
+   {
+     if (trace_bd->read(page, recorder.start() + offset, kTracePageSize) != 0)
+     {
+       // no trailer, the PC gives up on the dump
+       read_failed = true;
+       break;
+     }
+     if (TracePageSequence(page) == kTraceErasedSequence)
+     {
+       // the rest of a sector after an erased page is erased too
+       offset = (offset / kTraceSectorSize + 1) * kTraceSectorSize - kTracePageSize;
+       continue;
+     }
+     trace_dump_frame(page, kTracePageSize);
+     pages++;
+   }
+   if (!read_failed)
+   {
+     memset(page, 0xFF, kTracePageSize);
+     trace_dump_frame(page, kTracePageSize);
+     uint8_t count[4];
+     TracePut32(count, pages);
+     trace_dump_frame(count, sizeof(count));
+   }
+   pc.sync();
+   flush_mutex.unlock();
+
+   if (baud > 0)
+   {
+     ThisThread::sleep_for(100ms);
+     pc.set_baud(9600);
+   }
+   console.unmute();
+
+   if (read_failed)
+   {
+     out->putData("TRACE READ FAILED");
+     return;
+   }
+   out->putData("TRACE PAGES");
+   out->putData(pages);
+   // the newest records are missing from the dump when not
+   out->putData(flushed ? "FLUSHED" : "NOT FLUSHED");
+   out->putData("MUTED");
+   out->putData((int)(console.dropped() - dropped));
+ }
+
  // after interrupt
- void publish_message(MQTT::Client<MQTTNetwork, Countdown> *client)
+ void publish_message()
  {
     message_num++;
-    MQTT::Message message;
-    char buff[100];
-    sprintf(buff, "Angle threshold is %d", threshold);
-    message.qos = MQTT::QOS0;
-    message.retained = false;
-    message.dup = false;
-    message.payload = (void *)buff;
-    message.payloadlen = strlen(buff) + 1;
-    int rc = client->publish(topic, message);
+    uint8_t buff[16];
+    int len = EncodeThreshold(buff, sizeof(buff), threshold, message_num);
+    bool queued = publish_durable(buff, len);
 
-    printf("rc: %d\r\n", rc);
-    printf("Puslish message: %s\r\n", buff);
-    MODE = 0;
+    printf("queued: %d\r\n", queued);
+    modes.request(kModeSafe);
+ }
+
+ // TCP connection and MQTT CONNECT again after an outage; the broker kept the session (cleansession=false) unless it says
+ // otherwise, then the subscription is renewed
+ int mqtt_resume(MQTTNetwork &network, MQTT::Client<MQTTNetwork, Countdown> &client, MQTTPacket_connectData &data, const SocketAddress &address)
+ {
+   network.disconnect();
+   int rc = network.connect(address);
+   if (rc != 0)
+   {
+     return rc;
+   }
+   // the handler also serves a session the broker kept
+   client.setMessageHandler(topic, messageArrived);
+   MQTT::connackData connack;
+   if ((rc = client.connect(data, connack)) != 0)
+   {
+     return rc;
+   }
+   if (!connack.sessionPresent)
+   {
+     mqtt_stats.sessions_lost++;
+     rc = client.subscribe(topic, MQTT::QOS0, messageArrived);
+   }
+   return rc;
+ }
+
+ // keep the broker connection up: reconnect (WiFi first if it dropped too)
+ // with exponential backoff and random jitter. This is the network thread:
+ // it owns the client, sends the queued messages and runs the keepalive.
+ void mqtt_supervise(MQTTNetwork &network, MQTT::Client<MQTTNetwork, Countdown> &client, MQTTPacket_connectData &data, SocketAddress &address, const char *host)
+ {
+   int backoff_ms = 0;
+   while (mqtt_flag)
+   {
+     if (client.isConnected())
+     {
+       send_queued(client);
+       replay_outbox(client);
+       // handlers for what arrived; a failed read, write or keepalive ping
+       // drops the session here
+       client.yield(mqtt_cycle_ms);
+       // until the broker sends something, a message is queued or it is
+       // time to check the keepalive
+       publish_wake.wait_any(kPublishWake | MQTTNetwork::kSocketEvent, 400);
+       continue;
+     }
+
+     if (!mqtt_stats.down)
+     {
+       mqtt_stats.down = true;
+       mqtt_stats.down_since_ms = trace_time_ms();
+       mqtt_stats.outages++;
+       printf("MQTT connection lost\r\n");
+     }
+     if (backoff_ms > 0)
+     {
+       // anywhere in [backoff / 2, backoff], so clients do not retry in step
+       ThisThread::sleep_for(milliseconds(backoff_ms / 2 + rand() % (backoff_ms / 2 + 1)));
+     }
+     backoff_ms = (backoff_ms == 0) ? mqtt_backoff_min_ms : backoff_ms * 2;
+     if (backoff_ms > mqtt_backoff_max_ms)
+     {
+       backoff_ms = mqtt_backoff_max_ms;
+     }
+     mqtt_stats.attempts++;
+
+     if (wifi->get_connection_status() != NSAPI_STATUS_GLOBAL_UP &&
+         ConnectWifi(wifi, MBED_CONF_APP_WIFI_SSID, MBED_CONF_APP_WIFI_PASSWORD, NSAPI_SECURITY_WPA_WPA2, &wifi_lease) != 0)
+     {
+       continue;
+     }
+     if (!boot.is_ready(kBootWifi))
+     {
+       boot.ready(kBootWifi, trace_time_ms());
+     }
+     // not looked up yet when WiFi failed at boot
+     if (!address && ResolveBroker(wifi, host, 1883, &wifi_lease, &address) != 0)
+     {
+       continue;
+     }
+     int rc = mqtt_resume(network, client, data, address);
+     if (rc != 0)
+     {
+       continue;
+     }
+     resend_inflight(client);
+     if (replay_id != 0 && !replay_acked)
+     {
+       // the batch is read from the flash again
+       replay_id = 0;
+       replay_stats.resent++;
+     }
+     // the outage does not count as refill time
+     replay_refill_ms = trace_time_ms();
+
+     if (!boot.is_ready(kBootBroker))
+     {
+       boot.ready(kBootBroker, trace_time_ms());
+     }
+     store_wifi_lease();
+     mqtt_stats.down = false;
+     backoff_ms = 0;
+     if (mqtt_stats.outages == 0)
+     {
+       // the first connection, the one at boot had failed
+       printf("MQTT connected\r\n");
+       continue;
+     }
+     uint32_t outage_ms = trace_time_ms() - mqtt_stats.down_since_ms;
+     mqtt_stats.last_ms = outage_ms;
+     if (outage_ms > mqtt_stats.longest_ms)
+     {
+       mqtt_stats.longest_ms = outage_ms;
+     }
+     mqtt_stats.total_ms += outage_ms;
+     printf("MQTT reconnected after %lu ms\r\n", (unsigned long)outage_ms);
+   }
  }
 
  // WIFI model
@@ -449,78 +1645,99 @@
      return;
    }
 
+   // the lease from the last connection lives on the flash
+   boot.wait(kBootSensors);
+   ResetWifiLease(&wifi_lease);
+   if (flash_ready)
+   {
+     wifi_record.load(&wifi_lease);
+   }
+   stored_lease = wifi_lease;
+
    printf("\nConnecting to %s...\r\n", MBED_CONF_APP_WIFI_SSID);
-   int ret = wifi->connect(MBED_CONF_APP_WIFI_SSID, MBED_CONF_APP_WIFI_PASSWORD, NSAPI_SECURITY_WPA_WPA2);
+   int ret = ConnectWifi(wifi, MBED_CONF_APP_WIFI_SSID, MBED_CONF_APP_WIFI_PASSWORD, NSAPI_SECURITY_WPA_WPA2, &wifi_lease);
    if (ret != 0)
    {
+     // the supervisor below keeps trying, messages go to the outbox meanwhile
      printf("\nConnection error: %d\r\n", ret);
-     return;
+     boot.failed(kBootWifi, trace_time_ms());
+   }
+   else
+   {
+     boot.ready(kBootWifi, trace_time_ms());
+     printf("WiFi %s in %d ms\r\n", wifi_stats.path == kWifiDirected ? "directed" : wifi_stats.path == kWifiScan ? "scanned" : "connected", wifi_stats.total_ms);
    }
 
 
    /*---- MQTT ----*/
    NetworkInterface *net = wifi;
-   MQTTNetwork mqttNetwork(net);
+   MQTTNetwork mqttNetwork(net, &publish_wake);
    MQTT::Client<MQTTNetwork, Countdown> client(mqttNetwork);
 
    // TODO: revise host to your IP
    const char *host = "192.168.0.11";
    printf("Connecting to TCP network...\r\n");
 
+   // without WiFi the supervisor looks the broker up once it is associated
    SocketAddress sockAddr;
-   sockAddr.set_ip_address(host);
-   sockAddr.set_port(1883);
+   int rc = NSAPI_ERROR_NO_CONNECTION;
+   if (ret == 0)
+   {
+     ResolveBroker(net, host, 1883, &wifi_lease, &sockAddr);
 
-   printf("address is %s/%d\r\n", (sockAddr.get_ip_address() ? sockAddr.get_ip_address() : "None"), (sockAddr.get_port() ? sockAddr.get_port() : 0)); //check setting
+     printf("address is %s/%d\r\n", (sockAddr.get_ip_address() ? sockAddr.get_ip_address() : "None"), (sockAddr.get_port() ? sockAddr.get_port() : 0)); //check setting
 
-   int rc = mqttNetwork.connect(sockAddr); //(host, 1883);
+     rc = mqttNetwork.connect(sockAddr); //(host, 1883);
+     if (rc != 0 && wifi_stats.cached_broker)
+     {
+       // the broker moved, look it up again
+       mqttNetwork.disconnect();
+       wifi_lease.broker_host[0] = '\0';
+       ResolveBroker(net, host, 1883, &wifi_lease, &sockAddr);
+       rc = mqttNetwork.connect(sockAddr);
+     }
+   }
    if (rc != 0)
    {
+     // the supervisor below keeps trying
      printf("Connection error.");
-     return;
+     boot.failed(kBootBroker, trace_time_ms());
+   }
+   else
+   {
+     store_wifi_lease();
+     printf("Successfully connected!\r\n");
    }
-   printf("Successfully connected!\r\n");
 
    MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
    data.MQTTVersion = 3;
    data.clientID.cstring = "Mbed";
+   // keep the subscription and the unacknowledged publish over outages
+   data.cleansession = 0;
+   data.keepAliveInterval = mqtt_keepalive_s;
 
-   if ((rc = client.connect(data)) != 0)
+   if (rc != 0 || (rc = client.connect(data)) != 0)
    {
      printf("Fail to connect MQTT\r\n");
+     boot.failed(kBootBroker, trace_time_ms());
    }
-   if (client.subscribe(topic, MQTT::QOS0, messageArrived) != 0)
+   else
    {
-     printf("Fail to subscribe\r\n");
+     mqtt_stats.down = false;
+     boot.ready(kBootBroker, trace_time_ms());
    }
-
-   // MQTT thread
-   mqtt_thread.start(callback(&mqtt_queue, &EventQueue::dispatch_forever));
-
-   // button interrupt -> run publish_message to client
-   btn.rise(mqtt_queue.event(&publish_message, &client));
-
-   // detection mode thread
-   DETECTION_thread.start(callback(&tilt_angle, &client));
-
-   // 
-   int num = 0;
-   while (num != 5)
+   if (client.isConnected() && client.subscribe(topic, MQTT::QOS0, messageArrived) != 0)
    {
-     client.yield(100);
-     ++num;
+     printf("Fail to subscribe\r\n");
    }
 
-   // wifi main loop
-   while (1)
-   {
-     if (!mqtt_flag)
-     {
-       break;
-     } 
-     client.yield(500);
-     ThisThread::sleep_for(500ms);
-   }
+   // button interrupt -> run publish_message, queued for this thread
+   btn.rise(mqtt_queue.event(&publish_message));
+   client.setAckHandler(publish_acked);
+
+   // wifi main loop, until close_MQTT
+   srand(trace_time_ms());
+   mqtt_supervise(mqttNetwork, client, data, sockAddr, host);
 
    printf("Ready to close MQTT Network......\n");
 
@@ -544,18 +1761,32 @@
    FILE *devout = fdopen(&pc, "w");
 
 
-   // init uLCD display
-   init_uLCD_display();
+   // the slow stages first: WiFi association, the uLCD restart and the
+   // model setup run concurrently with the sensor bring-up below
+   WIFI_MQTT_thread.start(&WIFI_MQTT);
+   DISPLAY_thread.start(boot_display);
+   GUI_thread.start(GUI);
 
    // init Accelerometer
    BSP_ACCELERO_Init();
 
-   // start GUI thread
-   GUI_thread.start(GUI);
+   // init trace recorder and load the calibration behind it
+   init_trace();
+   init_calibration();
+   init_outbox();
+   boot.ready(kBootSensors, trace_time_ms());
 
-   // start WIFI thread
-   WIFI_MQTT_thread.start(&WIFI_MQTT);
+   // MQTT thread, publishes once the broker is up
+   mqtt_thread.start(callback(&mqtt_queue, &EventQueue::dispatch_forever));
+   // handlers of the incoming messages
+   HANDLER_thread.start(callback(&handler_queue, &EventQueue::dispatch_forever));
+
+   // detection mode thread, only needs the sensors
+   tilt_int.rise(tilt_wake_isr);
+   ORIENTATION_thread.start(callback(&orientation_queue, &EventQueue::dispatch_forever));
+   DETECTION_thread.start(tilt_angle);
 
+   // RPC is served from here on, modes start once their stage is up
 
    // main while
    while(1)
@@ -0,0 +1,125 @@
+#ifndef MESSAGE_INBOX_H_
+#define MESSAGE_INBOX_H_
+
+// Slots for the messages MQTT::Client delivers, so the application handlers
+// can run on a worker thread instead of inside yield().
+//
+// The client calls its message handler on the network thread, with the
+// packet still in its read buffer. store() copies topic, payload and time of
+// arrival into one of N fixed slots; the network thread posts the slot to the
+// worker and goes on, the worker gives it back with finish() once the
+// handler returned. When every slot is taken, or the message does not fit
+// a slot, it is dropped and counted instead of waiting, so the network loop
+// never blocks on application code and N bounds how far the worker may fall
+// behind.
+//
+// The free slots are a PublishQueue of slot numbers: only the network thread
+// takes one, any thread may give one back.
+
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+
+#include "publish_queue.h"
+
+constexpr int kInboxTopicSize = 32;     // including the terminating 0
+constexpr int kInboxPayloadSize = 100;  // MQTT::Client's read buffer
+
+struct InboundMessage {
+  char topic[kInboxTopicSize];
+  uint8_t payload[kInboxPayloadSize];
+  uint16_t length;
+  uint8_t qos;
+  bool retained;
+  bool dup;
+  uint16_t id;
+  uint32_t arrived_ms;
+};
+
+struct InboxStats {
+  uint32_t delivered;      // stored and posted to the worker
+  uint32_t dropped;        // no free slot, or the worker queue was full
+  uint32_t too_long;       // topic or payload larger than a slot
+  uint32_t peak;           // most slots taken at once
+  uint32_t handled;        // handlers that returned
+  uint32_t wait_max_ms;    // arrival until the handler started
+  uint32_t wait_total_ms;
+  uint32_t run_max_ms;     // handler run time
+  uint32_t run_total_ms;
+};
+
+template <int N>
+class MessageInbox {
+ public:
+  MessageInbox() {
+    for (int i = 0; i < N; ++i) free_.push((uint8_t)i);
+  }
+
+  // Network thread: copy a delivered message into a free slot, null if it
+  // was dropped. The caller fills in the flags and posts the slot, or gives
+  // it back with discard().
+  InboundMessage* store(const char* topic, int topic_length,
+                        const void* payload, int length, uint32_t now_ms) {
+    if (topic_length < 0 || topic_length >= kInboxTopicSize || length < 0 ||
+        length > kInboxPayloadSize) {
+      ++stats_.too_long;
+      return nullptr;
+    }
+    uint8_t index;
+    if (!free_.pop(&index)) {
+      ++stats_.dropped;
+      return nullptr;
+    }
+    InboundMessage* message = &slots_[index];
+    memcpy(message->topic, topic, topic_length);
+    message->topic[topic_length] = '\0';
+    memcpy(message->payload, payload, length);
+    message->length = (uint16_t)length;
+    message->arrived_ms = now_ms;
+    int used = used_.fetch_add(1, std::memory_order_relaxed) + 1;
+    if ((uint32_t)used > stats_.peak) stats_.peak = used;
+    ++stats_.delivered;
+    return message;
+  }
+
+  // Network thread: a stored message that could not be posted
+  void discard(InboundMessage* message) {
+    --stats_.delivered;
+    ++stats_.dropped;
+    release(message);
+  }
+
+  // Worker: the handler of message started at started_ms and returned at
+  // now_ms, the slot is free again
+  void finish(InboundMessage* message, uint32_t started_ms, uint32_t now_ms) {
+    uint32_t wait = started_ms - message->arrived_ms;
+    uint32_t run = now_ms - started_ms;
+    if (wait > stats_.wait_max_ms) stats_.wait_max_ms = wait;
+    if (run > stats_.run_max_ms) stats_.run_max_ms = run;
+    stats_.wait_total_ms += wait;
+    stats_.run_total_ms += run;
+    ++stats_.handled;
+    release(message);
+  }
+
+  // Slots taken: posted, waiting for the worker or in its handler
+  int waiting() const { return used_.load(std::memory_order_relaxed); }
+  static constexpr int capacity() { return N; }
+  // The network thread writes the delivery counters, the worker the
+  // handler ones
+  const InboxStats& stats() const { return stats_; }
+
+ private:
+  void release(InboundMessage* message) {
+    used_.fetch_sub(1, std::memory_order_relaxed);
+    free_.push((uint8_t)(message - slots_));
+  }
+
+  InboundMessage slots_[N];
+  PublishQueue<uint8_t, N> free_;
+  std::atomic<int> used_{0};
+  InboxStats stats_ = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+};
+
+#endif  // MESSAGE_INBOX_H_
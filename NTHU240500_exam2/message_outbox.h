@@ -0,0 +1,293 @@
+#ifndef MESSAGE_OUTBOX_H_
+#define MESSAGE_OUTBOX_H_
+
+// Store-and-forward queue of outbound messages on NOR flash.
+//
+// The region is a ring of erase sectors split into fixed 128 byte slots,
+// written in order of increasing sequence:
+//
+//   slot: magic u16 | length u16 | sequence u32 | crc32 u32 | sent u32 |
+//         payload | 0xFF...
+//
+// sent is left erased (0xFFFFFFFF) when the slot is programmed and cleared to
+// 0 once the message went out, which NOR flash allows without an erase. The
+// CRC covers sequence and payload, so a torn slot is skipped. init() finds
+// the oldest unsent slot and continues after the newest one, so a reboot
+// keeps the backlog.
+//
+// append() stages messages in RAM, StagingSlots of them, and flush() programs
+// the staged slots in one go, so a burst costs one flash write instead of
+// one per message. Staged messages are lost on a reset. When the ring is full
+// the sector the next slot goes into is erased anyway and its unsent
+// messages are dropped, the newest data survives as in TraceRecorder.
+//
+// Flash is any type with the mbed BlockDevice read/program/erase signatures.
+// Not thread safe, the caller serializes.
+
+#include <stdint.h>
+#include <string.h>
+
+#include "persistent_record.h"
+
+constexpr uint16_t kOutboxMagic = 0x424F;  // "OB"
+constexpr int kOutboxSlotSize = 128;
+constexpr int kOutboxHeaderSize = 16;
+constexpr int kOutboxMaxPayload = kOutboxSlotSize - kOutboxHeaderSize;
+constexpr int kOutboxSectorSize = 4096;
+
+struct OutboxStats {
+  uint32_t stored;       // accepted by append
+  uint32_t sent;         // marked by consume
+  uint32_t overwritten;  // unsent, erased when the ring was full
+  uint32_t dropped;      // rejected: too long, or the flash failed
+  uint32_t corrupt;      // slots init skipped for a bad CRC
+};
+
+template <typename Flash, int StagingSlots>
+class MessageOutbox {
+ public:
+  // The ring occupies [start, start + size) of the device, both must be
+  // multiples of kOutboxSectorSize, size at least two sectors
+  MessageOutbox(Flash* flash, uint32_t start, uint32_t size)
+      : flash_(flash), start_(start), size_(size) {}
+
+  // Find the unsent messages of an earlier run
+  int init() {
+    head_ = 0;
+    tail_ = 0;
+    pending_ = 0;
+    staged_ = 0;
+    sequence_ = 0;
+
+    bool found = false;
+    uint32_t newest = 0, oldest = 0;
+    uint32_t newest_sequence = 0, oldest_sequence = 0;
+    uint8_t slot[kOutboxSlotSize];
+    for (uint32_t offset = 0; offset < size_; offset += kOutboxSlotSize) {
+      int rc = flash_->read(slot, start_ + offset, kOutboxSlotSize);
+      if (rc != 0) return rc;
+      if (Blank(slot)) continue;
+      if (!Valid(slot)) {
+        ++stats_.corrupt;
+        continue;
+      }
+      uint32_t sequence = Get32(slot + 4);
+      if (!found || sequence > newest_sequence) {
+        newest_sequence = sequence;
+        newest = offset;
+      }
+      if (Unsent(slot)) {
+        if (pending_ == 0 || sequence < oldest_sequence) {
+          oldest_sequence = sequence;
+          oldest = offset;
+        }
+        ++pending_;
+      }
+      found = true;
+    }
+    if (!found) return 0;
+
+    sequence_ = newest_sequence + 1;
+    head_ = Next(newest);
+    // Skip what a torn write left behind the newest slot, programming over
+    // it would corrupt the next message. A new sector is erased first.
+    while (head_ % kOutboxSectorSize != 0) {
+      int rc = flash_->read(slot, start_ + head_, kOutboxSlotSize);
+      if (rc != 0) return rc;
+      if (Blank(slot)) break;
+      head_ = Next(head_);
+    }
+    tail_ = pending_ ? oldest : head_;
+    return 0;
+  }
+
+  // Stage one message, flushing first if the staging buffer is full. False
+  // if it is too long or the flush failed.
+  bool append(const void* payload, int length) {
+    if (length < 0 || length > kOutboxMaxPayload ||
+        (staged_ == StagingSlots && flush() != 0)) {
+      ++stats_.dropped;
+      return false;
+    }
+    uint8_t* slot = staging_[staged_++];
+    memset(slot, 0xFF, kOutboxSlotSize);
+    Put16(slot, kOutboxMagic);
+    Put16(slot + 2, (uint16_t)length);
+    Put32(slot + 4, sequence_++);
+    memcpy(slot + kOutboxHeaderSize, payload, length);
+    Put32(slot + 8, Crc(slot));
+    ++stats_.stored;
+    return true;
+  }
+
+  // Program the staged messages, returns the flash error or 0
+  int flush() {
+    int done = 0;
+    while (done < staged_) {
+      if (head_ % kOutboxSectorSize == 0) {
+        int rc = enter_sector();
+        if (rc != 0) return unstage(done, rc);
+      }
+      // the run ends at the sector boundary
+      int run = (kOutboxSectorSize - head_ % kOutboxSectorSize) /
+                kOutboxSlotSize;
+      if (run > staged_ - done) run = staged_ - done;
+      int rc = flash_->program(staging_[done], start_ + head_,
+                               run * kOutboxSlotSize);
+      if (rc != 0) return unstage(done, rc);
+      if (pending_ == 0) tail_ = head_;
+      pending_ += run;
+      done += run;
+      head_ = (head_ + run * kOutboxSlotSize) % size_;
+    }
+    staged_ = 0;
+    return 0;
+  }
+
+  // Call visit(const uint8_t* payload, int length) for the oldest unsent
+  // messages on the flash, up to max of them and until visit returns false.
+  // Returns the number visited or the flash error; they stay in the outbox
+  // until consume(), first and last (if given) get the sequence of the
+  // oldest and newest one for it. flush() first to include the staged ones.
+  template <typename Visitor>
+  int peek(int max, Visitor visit, uint32_t* first = nullptr,
+           uint32_t* last = nullptr) {
+    int count = 0;
+    uint32_t offset = tail_;
+    uint8_t slot[kOutboxSlotSize];
+    for (int n = 0; n < capacity() && count < pending_ && count < max;
+         ++n, offset = Next(offset)) {
+      int rc = flash_->read(slot, start_ + offset, kOutboxSlotSize);
+      if (rc != 0) return rc;
+      if (!Valid(slot) || !Unsent(slot)) continue;
+      if (!visit(slot + kOutboxHeaderSize, (int)Get16(slot + 2))) break;
+      if (count == 0 && first) *first = Get32(slot + 4);
+      if (last) *last = Get32(slot + 4);
+      ++count;
+    }
+    return count;
+  }
+
+  // Mark the unsent messages with a sequence in [first, last] as sent, as
+  // peek() reported them, returns the flash error or 0. Those the ring
+  // overwrote since, and the newer messages now in their slots, stay unsent.
+  int consume(uint32_t first, uint32_t last) {
+    uint8_t slot[kOutboxSlotSize];
+    const uint8_t sent[4] = {0, 0, 0, 0};
+    uint32_t offset = tail_;
+    bool behind = true;  // nothing unsent behind offset, tail_ follows it
+    for (int n = 0; n < capacity() && pending_ > 0;
+         ++n, offset = Next(offset)) {
+      int rc = flash_->read(slot, start_ + offset, kOutboxSlotSize);
+      if (rc != 0) return rc;
+      if (Valid(slot) && Unsent(slot)) {
+        // wrap safe comparison of sequences
+        uint32_t sequence = Get32(slot + 4);
+        if ((int32_t)(sequence - last) > 0) break;
+        if ((int32_t)(sequence - first) < 0) {
+          behind = false;
+        } else {
+          rc = flash_->program(sent, start_ + offset + 12, sizeof(sent));
+          if (rc != 0) return rc;
+          --pending_;
+          ++stats_.sent;
+        }
+      }
+      if (behind) tail_ = Next(offset);
+    }
+    if (pending_ == 0) tail_ = head_;
+    return 0;
+  }
+
+  // Messages waiting, on the flash and staged
+  int pending() const { return pending_ + staged_; }
+  int staged() const { return staged_; }
+  // Messages the ring holds when full
+  int capacity() const { return size_ / kOutboxSlotSize; }
+  const OutboxStats& stats() const { return stats_; }
+
+ private:
+  // Erase the sector at head_, dropping the unsent messages still in it
+  int enter_sector() {
+    uint32_t end = head_ + kOutboxSectorSize;
+    if (pending_ > 0 && tail_ >= head_ && tail_ < end) {
+      uint8_t slot[kOutboxSlotSize];
+      for (; tail_ < end && pending_ > 0; tail_ += kOutboxSlotSize) {
+        int rc = flash_->read(slot, start_ + tail_, kOutboxSlotSize);
+        if (rc != 0) return rc;
+        if (Valid(slot) && Unsent(slot)) {
+          --pending_;
+          ++stats_.overwritten;
+        }
+      }
+      tail_ %= size_;
+    }
+    return flash_->erase(start_ + head_, kOutboxSectorSize);
+  }
+
+  // Keep the staged messages that did not make it to the flash
+  int unstage(int done, int rc) {
+    memmove(staging_[0], staging_[done], (staged_ - done) * kOutboxSlotSize);
+    staged_ -= done;
+    return rc;
+  }
+
+  uint32_t Next(uint32_t offset) const {
+    return (offset + kOutboxSlotSize) % size_;
+  }
+
+  static bool Valid(const uint8_t* slot) {
+    return Get16(slot) == kOutboxMagic &&
+           Get16(slot + 2) <= kOutboxMaxPayload &&
+           Get32(slot + 8) == Crc(slot);
+  }
+
+  static bool Unsent(const uint8_t* slot) {
+    return Get32(slot + 12) == 0xFFFFFFFF;
+  }
+
+  static bool Blank(const uint8_t* slot) {
+    for (int i = 0; i < kOutboxSlotSize; ++i) {
+      if (slot[i] != 0xFF) return false;
+    }
+    return true;
+  }
+
+  // CRC of sequence and payload
+  static uint32_t Crc(const uint8_t* slot) {
+    uint32_t crc = RecordCrc32(slot + 4, 4, 0);
+    return RecordCrc32(slot + kOutboxHeaderSize, Get16(slot + 2), crc);
+  }
+
+  static void Put16(uint8_t* p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+  }
+  static void Put32(uint8_t* p, uint32_t v) {
+    Put16(p, v & 0xFFFF);
+    Put16(p + 2, v >> 16);
+  }
+  static uint16_t Get16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+  }
+  static uint32_t Get32(const uint8_t* p) {
+    return Get16(p) | ((uint32_t)Get16(p + 2) << 16);
+  }
+
+  Flash* flash_;
+  uint32_t start_;
+  uint32_t size_;
+
+  uint8_t staging_[StagingSlots][kOutboxSlotSize];
+  int staged_ = 0;
+
+  // next slot to program, oldest unsent slot (head_ when there is none)
+  uint32_t head_ = 0;
+  uint32_t tail_ = 0;
+  int pending_ = 0;  // unsent messages on the flash
+  uint32_t sequence_ = 0;
+
+  OutboxStats stats_ = {0, 0, 0, 0, 0};
+};
+
+#endif  // MESSAGE_OUTBOX_H_
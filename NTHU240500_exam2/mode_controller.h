@@ -0,0 +1,78 @@
+#ifndef MODE_CONTROLLER_H_
+#define MODE_CONTROLLER_H_
+
+// The application mode as an explicit state machine.
+//
+// Every mode owns one event flag that is set exactly while the mode is
+// active, so a worker thread blocks in wait_for() instead of polling the
+// mode. request() runs the whole transition under the lock: the old flag is
+// cleared, its exit hook runs, then the enter hook of the new mode, and only
+// then is the new flag set. Hooks run on the requesting thread and must not
+// call request() themselves.
+//
+// Flags is any type with the rtos::EventFlags set/clear/wait_any signatures
+// and Lock any type with lock/unlock, so the same code runs on the host.
+
+#include <stdint.h>
+
+enum AppMode {
+  kModeSafe = 0,     // RPC loop only
+  kModeGesture = 1,  // gesture UI
+  kModeTilt = 2,     // tilt angle detection
+  kModeCount = 3,
+};
+
+struct ModeHooks {
+  void (*enter)();
+  void (*exit)();
+};
+
+template <typename Flags, typename Lock>
+class ModeController {
+ public:
+  // hooks[mode] for every mode, null entries are skipped
+  explicit ModeController(const ModeHooks* hooks) : hooks_(hooks) {
+    flags_.set(Bit(kModeSafe));
+  }
+
+  // Switch to mode, false for an unknown mode. Asking for the active mode
+  // changes nothing.
+  bool request(int mode) {
+    if (mode < 0 || mode >= kModeCount) return false;
+    lock_.lock();
+    int old = mode_;
+    if (mode != old) {
+      flags_.clear(Bit(old));
+      if (hooks_[old].exit) hooks_[old].exit();
+      mode_ = mode;
+      ++transitions_;
+      if (hooks_[mode].enter) hooks_[mode].enter();
+      flags_.set(Bit(mode));
+    }
+    lock_.unlock();
+    return true;
+  }
+
+  int mode() const { return mode_; }
+  bool active(int mode) const { return mode_ == mode; }
+  uint32_t transitions() const { return transitions_; }
+
+  // Block until mode is active, returns at once if it already is
+  void wait_for(int mode) {
+    flags_.wait_any(Bit(mode), kWaitForever, false);
+  }
+
+ private:
+  // osWaitForever
+  static constexpr uint32_t kWaitForever = 0xFFFFFFFFu;
+
+  static uint32_t Bit(int mode) { return 1u << mode; }
+
+  const ModeHooks* hooks_;
+  Flags flags_;
+  Lock lock_;
+  volatile int mode_ = kModeSafe;
+  volatile uint32_t transitions_ = 0;
+};
+
+#endif  // MODE_CONTROLLER_H_
@@ -0,0 +1,59 @@
+#ifndef MUTED_CONSOLE_H_
+#define MUTED_CONSOLE_H_
+
+// stdin, stdout and stderr of every thread, passed through to the serial
+// port the RPC loop uses (mbed_override_console returns it).
+//
+// A binary stream on the same port, the trace dump, mutes it: a write that
+// is under way finishes first, and anything printed until unmute() is
+// dropped and counted, so no log line lands between the pages and nothing
+// goes out at the changed baud rate.
+
+#include <errno.h>
+#include <stdint.h>
+
+#include "mbed.h"
+
+class MutedConsole : public FileHandle {
+ public:
+  explicit MutedConsole(FileHandle* port) : port_(port) {}
+
+  ssize_t write(const void* buffer, size_t size) override {
+    ScopedLock<Mutex> lock(mutex_);
+    if (muted_) {
+      dropped_ += size;
+      return size;
+    }
+    return port_->write(buffer, size);
+  }
+
+  ssize_t read(void* buffer, size_t size) override {
+    return port_->read(buffer, size);
+  }
+
+  off_t seek(off_t, int) override { return -ESPIPE; }
+  int close() override { return 0; }
+  int isatty() override { return 1; }
+  int sync() override { return port_->sync(); }
+  short poll(short events) const override { return port_->poll(events); }
+
+  // Returns once no write is under way any more
+  void mute() {
+    ScopedLock<Mutex> lock(mutex_);
+    muted_ = true;
+  }
+  void unmute() {
+    ScopedLock<Mutex> lock(mutex_);
+    muted_ = false;
+  }
+  // Bytes dropped while muted, since boot
+  uint32_t dropped() const { return dropped_; }
+
+ private:
+  FileHandle* port_;
+  Mutex mutex_;
+  bool muted_ = false;
+  uint32_t dropped_ = 0;
+};
+
+#endif  // MUTED_CONSOLE_H_
@@ -2,6 +2,8 @@ import paho.mqtt.client as paho
 import serial
 import time
 
+import telemetry_codec
+
 serdev = '/dev/ttyACM0'
 s = serial.Serial(serdev, 9600)
 
@@ -19,30 +21,38 @@ topic = "Mbed"
 def on_connect(self, mosq, obj, rc):
     print("Connected rc: " + str(rc))
 
+def back_to_safe_mode():
+    s.write(bytes("\r", 'UTF-8'))
+    time.sleep(1)
+
+    s.write(bytes("/MODESelect/run 0\r", 'UTF-8'))
+    time.sleep(1)
+
 count = 1
 def on_message(mosq, obj, msg):
     global count
-    if len(str(msg.payload)) >= 21 and len(str(msg.payload)) < 30: # len(Angle threshold is %d)
-        count = 1
+    if telemetry_codec.message_type(msg.payload) is None:
+        # text, e.g. our own messages below
         print("[Received] Topic: " + msg.topic + ", Message: " + str(msg.payload) + "\n")
-        s.write(bytes("\r", 'UTF-8'))
-        time.sleep(1)
-        
-        s.write(bytes("/MODESelect/run 0\r", 'UTF-8'))
-        time.sleep(1)
-    elif len(str(msg.payload)) < 21:
-        if count >= 5:
-            print("[Received] Topic: " + msg.topic + ", Message: " + str(msg.payload) + "\n")
+        return
+    try:
+        data = telemetry_codec.decode(msg.payload)
+    except ValueError as e:
+        print("[Received] Topic: " + msg.topic + ", malformed telemetry " + msg.payload.hex() + ": " + str(e) + "\n")
+        return
+    print("[Received] Topic: " + msg.topic + ", " + telemetry_codec.describe(data) + "\n")
+    if data['type'] == 'batch':
+        # stored on the mbed while the broker was away: stale by now, shown
+        # but not acted on
+        print("%d stored messages replayed\n" % len(data['messages']))
+    elif data['type'] == 'tilt':
+        count = count + len(data['events'])
+        if count > 5:
             count = 1
-            
-            s.write(bytes("\r", 'UTF-8'))
-            time.sleep(1)
-            
-            s.write(bytes("/MODESelect/run 0\r", 'UTF-8'))
-            time.sleep(1)
-        else:
-            print("[Received] Topic: " + msg.topic + ", Message: " + str(msg.payload) + "\n")
-            count = count + 1
+            back_to_safe_mode()
+    elif data['type'] == 'threshold':
+        count = 1
+        back_to_safe_mode()
 
 def on_subscribe(mosq, obj, mid, granted_qos):
     print("Subscribed OK")
@@ -0,0 +1,240 @@
+#include "orientation_handler.h"
+
+#include <math.h>
+
+#include "mbed.h"
+#include "power_manager.h"
+#include "stm32l475e_iot01_accelero.h"
+#include "stm32l475e_iot01_gyro.h"
+
+// Filter gain, larger follows the accelerometer faster
+float orientation_beta = 0.05f;
+// Updates per published result, 10 gives 10 Hz at kOrientationRateHz
+int orientation_decimation = 10;
+// Wake-up slope threshold while sleeping, in 1/64 of the 2 g full scale
+int orientation_wake_threshold = 2;
+
+static OrientationFilter filter(orientation_beta);
+static int updates = 0;
+static OrientationCalibration active_calibration = {{0, 0, 1000}, {0}, {0}};
+
+// Calibration: samples averaged, and the largest standard deviation of an
+// accelerometer [mg] and gyro [dps] axis that still counts as resting
+constexpr int kCalibrationSamples = 64;
+constexpr float kStillAccelStd = 15.0f;
+constexpr float kStillGyroStd = 2.0f;
+
+// Sensitivities of the full scales set by BSP_ACCELERO_Init (2 g) and
+// BSP_GYRO_Init (2000 dps)
+constexpr float kAccelSensitivity = LSM6DSL_ACC_SENSITIVITY_2G;
+constexpr float kGyroSensitivity = LSM6DSL_GYRO_SENSITIVITY_2000DPS / 1000.0f;
+constexpr float kDegreesToRadians = 3.14159265f / 180;
+
+static float InvSqrt(float x) { return 1.0f / sqrtf(x); }
+
+void OrientationFilter::Reset(const float* accel) {
+  float roll = atan2f(accel[1], accel[2]);
+  float pitch =
+      atan2f(-accel[0], sqrtf(accel[1] * accel[1] + accel[2] * accel[2]));
+  float cr = cosf(roll / 2), sr = sinf(roll / 2);
+  float cp = cosf(pitch / 2), sp = sinf(pitch / 2);
+  q_[0] = cr * cp;
+  q_[1] = sr * cp;
+  q_[2] = cr * sp;
+  q_[3] = -sr * sp;
+}
+
+void OrientationFilter::Update(const float* gyro, const float* accel,
+                               float dt) {
+  float q0 = q_[0], q1 = q_[1], q2 = q_[2], q3 = q_[3];
+  float gx = gyro[0] * kDegreesToRadians;
+  float gy = gyro[1] * kDegreesToRadians;
+  float gz = gyro[2] * kDegreesToRadians;
+
+  // Rate of change of the quaternion from the gyro
+  float dq0 = 0.5f * (-q1 * gx - q2 * gy - q3 * gz);
+  float dq1 = 0.5f * (q0 * gx + q2 * gz - q3 * gy);
+  float dq2 = 0.5f * (q0 * gy - q1 * gz + q3 * gx);
+  float dq3 = 0.5f * (q0 * gz + q1 * gy - q2 * gx);
+
+  // Gradient descent step towards gravity, skipped in free fall
+  float norm2 = accel[0] * accel[0] + accel[1] * accel[1] + accel[2] * accel[2];
+  if (norm2 > 0) {
+    float inv = InvSqrt(norm2);
+    float ax = accel[0] * inv, ay = accel[1] * inv, az = accel[2] * inv;
+
+    float s0 = 4 * q0 * q2 * q2 + 2 * q2 * ax + 4 * q0 * q1 * q1 - 2 * q1 * ay;
+    float s1 = 4 * q1 * q3 * q3 - 2 * q3 * ax + 4 * q0 * q0 * q1 -
+               2 * q0 * ay - 4 * q1 + 8 * q1 * q1 * q1 + 8 * q1 * q2 * q2 +
+               4 * q1 * az;
+    float s2 = 4 * q0 * q0 * q2 + 2 * q0 * ax + 4 * q2 * q3 * q3 -
+               2 * q3 * ay - 4 * q2 + 8 * q2 * q1 * q1 + 8 * q2 * q2 * q2 +
+               4 * q2 * az;
+    float s3 = 4 * q1 * q1 * q3 - 2 * q1 * ax + 4 * q2 * q2 * q3 - 2 * q2 * ay;
+    float s_norm2 = s0 * s0 + s1 * s1 + s2 * s2 + s3 * s3;
+    if (s_norm2 > 0) {
+      inv = InvSqrt(s_norm2);
+      dq0 -= beta_ * s0 * inv;
+      dq1 -= beta_ * s1 * inv;
+      dq2 -= beta_ * s2 * inv;
+      dq3 -= beta_ * s3 * inv;
+    }
+  }
+
+  q0 += dq0 * dt;
+  q1 += dq1 * dt;
+  q2 += dq2 * dt;
+  q3 += dq3 * dt;
+  float inv = InvSqrt(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+  q_[0] = q0 * inv;
+  q_[1] = q1 * inv;
+  q_[2] = q2 * inv;
+  q_[3] = q3 * inv;
+}
+
+void OrientationFilter::Gravity(float* gravity) const {
+  gravity[0] = 2 * (q_[1] * q_[3] - q_[0] * q_[2]);
+  gravity[1] = 2 * (q_[0] * q_[1] + q_[2] * q_[3]);
+  gravity[2] = q_[0] * q_[0] - q_[1] * q_[1] - q_[2] * q_[2] + q_[3] * q_[3];
+}
+
+// Accelerometer [mg] and gyro [dps] from one burst read, accel keeps the
+// uncorrected reading
+static void ReadImu(int16_t* accel, float* accel_mg, float* gyro) {
+  int16_t raw[6];
+  LSM6DSL_AccGyroReadRaw(raw);
+  for (int i = 0; i < 3; ++i) {
+    accel[i] = (int16_t)(raw[3 + i] * kAccelSensitivity);
+    accel_mg[i] = accel[i] - active_calibration.accel_bias[i];
+    gyro[i] = raw[i] * kGyroSensitivity - active_calibration.gyro_bias[i];
+  }
+}
+
+// Accelerometer and gyro at 104 Hz. BSP_GYRO_Init writes its own gyro rate,
+// so the demand is written again even if it did not change.
+static bool StartImu() {
+  if (BSP_GYRO_Init() != GYRO_OK) {
+    return false;
+  }
+  SetPowerDemand(kPowerOrientation, LSM6DSL_ODR_104Hz, true);
+  SetupPower();
+  return true;
+}
+
+bool SetupOrientation() {
+  if (!StartImu()) {
+    return false;
+  }
+
+  int16_t accel[3];
+  float accel_mg[3], gyro[3];
+  ReadImu(accel, accel_mg, gyro);
+  filter = OrientationFilter(orientation_beta);
+  filter.Reset(accel_mg);
+  updates = 0;
+  return true;
+}
+
+void StopOrientation() {
+  SetPowerDemand(kPowerOrientation, LSM6DSL_ODR_POWER_DOWN, false);
+}
+
+void SleepOrientation() {
+  // The embedded tilt function needs at least 26 Hz, the gyro powers down
+  SetPowerDemand(kPowerOrientation, LSM6DSL_ODR_26Hz, false);
+  LSM6DSL_AccEnableEvents(
+      LSM6DSL_EVENT_WAKE_UP | LSM6DSL_EVENT_6D | LSM6DSL_EVENT_TILT,
+      orientation_wake_threshold, LSM6DSL_6D_THS_60DEG);
+}
+
+uint8_t WakeOrientation() {
+  uint8_t events = LSM6DSL_AccReadEvents();
+  LSM6DSL_AccDisableEvents();
+  SetPowerDemand(kPowerOrientation, LSM6DSL_ODR_POWER_DOWN, false);
+  return events;
+}
+
+bool CalibrateOrientation(OrientationCalibration* calibration) {
+  if (!StartImu()) {
+    return false;
+  }
+
+  // Raw readings, the biases are what we are after
+  static float samples[kCalibrationSamples][6];
+  for (int n = 0; n < kCalibrationSamples; ++n) {
+    int16_t raw[6];
+    ThisThread::sleep_for(10ms);
+    LSM6DSL_AccGyroReadRaw(raw);
+    for (int i = 0; i < 3; ++i) {
+      samples[n][i] = (int16_t)(raw[3 + i] * kAccelSensitivity);
+      samples[n][3 + i] = raw[i] * kGyroSensitivity;
+    }
+  }
+
+  float mean[6] = {0}, std[6] = {0};
+  for (int n = 0; n < kCalibrationSamples; ++n) {
+    for (int i = 0; i < 6; ++i) mean[i] += samples[n][i];
+  }
+  for (int i = 0; i < 6; ++i) mean[i] /= kCalibrationSamples;
+  for (int n = 0; n < kCalibrationSamples; ++n) {
+    for (int i = 0; i < 6; ++i) {
+      float d = samples[n][i] - mean[i];
+      std[i] += d * d;
+    }
+  }
+  for (int i = 0; i < 6; ++i) std[i] = sqrtf(std[i] / kCalibrationSamples);
+
+  // Drop outliers (a knock, an I2C glitch) and average the rest again
+  float sum[6] = {0};
+  int kept = 0;
+  for (int n = 0; n < kCalibrationSamples; ++n) {
+    bool outlier = false;
+    for (int i = 0; i < 6; ++i) {
+      float limit = 3 * std[i] + 1e-3f;
+      if (fabsf(samples[n][i] - mean[i]) > limit) outlier = true;
+    }
+    if (outlier) continue;
+    for (int i = 0; i < 6; ++i) sum[i] += samples[n][i];
+    ++kept;
+  }
+
+  // Still enough to trust, with most of the samples agreeing
+  for (int i = 0; i < 3; ++i) {
+    if (std[i] > kStillAccelStd || std[3 + i] > kStillGyroStd) return false;
+  }
+  if (kept < kCalibrationSamples / 2) return false;
+
+  float accel[3];
+  for (int i = 0; i < 3; ++i) accel[i] = sum[i] / kept;
+  float norm = sqrtf(accel[0] * accel[0] + accel[1] * accel[1] +
+                     accel[2] * accel[2]);
+  if (norm < 500) return false;
+  for (int i = 0; i < 3; ++i) {
+    calibration->gravity[i] = (int16_t)lrintf(accel[i] / norm * 1000);
+    calibration->accel_bias[i] = accel[i] - accel[i] / norm * 1000;
+    calibration->gyro_bias[i] = sum[3 + i] / kept;
+  }
+  return true;
+}
+
+void SetOrientationCalibration(const OrientationCalibration& calibration) {
+  active_calibration = calibration;
+}
+
+bool UpdateOrientation(int16_t* gravity, int16_t* accel) {
+  float accel_mg[3], gyro[3];
+  ReadImu(accel, accel_mg, gyro);
+  filter.Update(gyro, accel_mg, 1.0f / kOrientationRateHz);
+
+  if (++updates < orientation_decimation) {
+    return false;
+  }
+  updates = 0;
+
+  float unit[3];
+  filter.Gravity(unit);
+  for (int i = 0; i < 3; ++i) {
+    gravity[i] = (int16_t)lrintf(unit[i] * 1000);
+  }
+  return true;
+}
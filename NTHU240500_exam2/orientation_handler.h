@@ -0,0 +1,70 @@
+#ifndef ORIENTATION_HANDLER_H_
+#define ORIENTATION_HANDLER_H_
+
+#include <stdint.h>
+
+// Rate of the fused accelerometer + gyro updates, the LSM6DSL runs at the
+// matching 104 Hz ODR while the estimator is active. The rates go through
+// SetPowerDemand as the kPowerOrientation consumer.
+constexpr int kOrientationRateHz = 100;
+
+// Madgwick's gradient descent filter on the IMU (accelerometer + gyro) only.
+// The gyro is integrated every update and the accelerometer pulls the
+// estimate towards gravity with gain beta, so short linear accelerations
+// barely move the tilt while the gyro drift is still corrected.
+class OrientationFilter {
+ public:
+  explicit OrientationFilter(float beta) : beta_(beta) {}
+
+  // Start from the attitude that puts gravity along accel (yaw is 0)
+  void Reset(const float* accel);
+  // gyro in dps, accel in any unit, dt in seconds
+  void Update(const float* gyro, const float* accel, float dt);
+  // Unit gravity direction in the sensor frame, same sign as the
+  // accelerometer reading at rest
+  void Gravity(float* gravity) const;
+
+ private:
+  float beta_;
+  float q_[4] = {1, 0, 0, 0};
+};
+
+// Gravity reference and sensor biases from CalibrateOrientation, stored as
+// is in a PersistentRecord. Only the accelerometer bias along gravity can be
+// observed from one resting pose, accel_bias holds that component.
+struct OrientationCalibration {
+  int16_t gravity[3];   // [mg], unit vector * 1000
+  float accel_bias[3];  // [mg]
+  float gyro_bias[3];   // [dps]
+};
+
+extern float orientation_beta;
+extern int orientation_decimation;
+extern int orientation_wake_threshold;
+
+// Start the estimator: raise the LSM6DSL to 104 Hz and seed the filter from
+// the current accelerometer reading
+extern bool SetupOrientation();
+// Release the LSM6DSL, it drops to what the other consumers need
+extern void StopOrientation();
+// Stop the estimator and let the LSM6DSL watch for motion on its own: the
+// accelerometer drops to 26 Hz, the gyro powers down and wake-up, 6D and
+// tilt events are routed to INT1
+extern void SleepOrientation();
+// Disarm the events after INT1 fired, returns the LSM6DSL_EVENT_xxx mask
+// that woke us, and release the LSM6DSL. SetupOrientation starts the
+// estimator again.
+extern uint8_t WakeOrientation();
+// Average kCalibrationSamples samples at rest: samples further than 3 sigma
+// from the mean are dropped, and the board must be still (accelerometer and
+// gyro standard deviation below the limits). Returns false if it moved. The
+// LSM6DSL is left at 104 Hz, call SetupOrientation or StopOrientation next.
+extern bool CalibrateOrientation(OrientationCalibration* calibration);
+// Biases subtracted from every sample from now on
+extern void SetOrientationCalibration(const OrientationCalibration& calibration);
+// One fused update, call at kOrientationRateHz. Returns true on every
+// orientation_decimation-th update, when gravity [mg, unit vector * 1000]
+// and the raw accelerometer sample [mg] hold a result for the consumers.
+extern bool UpdateOrientation(int16_t* gravity, int16_t* accel);
+
+#endif  // ORIENTATION_HANDLER_H_
@@ -0,0 +1,170 @@
+#ifndef PERSISTENT_RECORD_H_
+#define PERSISTENT_RECORD_H_
+
+// A small value that survives reboots, kept on NOR flash.
+//
+// Two erase sectors hold a log of fixed size slots, every store() programs
+// the next slot and only erases a sector when the log moves into it, so the
+// previous value stays readable until the new one is complete:
+//
+//   slot: magic u16 | size u16 | sequence u32 | crc32 u32 | value | 0xFF...
+//
+// load() returns the valid slot with the highest sequence; a torn write fails
+// its CRC and the value before it is used instead. T must be trivially
+// copyable, it is stored as its in-memory bytes.
+//
+// Flash is any type with the mbed BlockDevice read/program/erase signatures,
+// as for TraceRecorder.
+
+#include <stdint.h>
+#include <string.h>
+
+constexpr uint16_t kRecordMagic = 0x5250;  // "PR"
+constexpr int kRecordHeaderSize = 12;
+
+inline uint32_t RecordCrc32(const uint8_t* data, int size, uint32_t crc) {
+  crc = ~crc;
+  for (int i = 0; i < size; ++i) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+template <typename Flash, typename T>
+class PersistentRecord {
+ public:
+  // Slot header plus value, rounded up to 16 bytes
+  static constexpr int kSlotSize = (kRecordHeaderSize + sizeof(T) + 15) & ~15;
+
+  // The record occupies [start, start + 2 * sector_size) of the device
+  PersistentRecord(Flash* flash, uint32_t start, uint32_t sector_size)
+      : flash_(flash), start_(start), sector_size_(sector_size) {}
+
+  // Read the newest valid value, false if there is none
+  bool load(T* value) {
+    scan();
+    if (!found_) return false;
+    memcpy(value, &newest_, sizeof(T));
+    return true;
+  }
+
+  // Program value into the next slot, returns the flash error or 0
+  int store(const T& value) {
+    if (!scanned_) scan();
+
+    uint8_t slot[kSlotSize];
+    memset(slot, 0xFF, sizeof(slot));
+    Put16(slot, kRecordMagic);
+    Put16(slot + 2, sizeof(T));
+    Put32(slot + 4, sequence_);
+    memcpy(slot + kRecordHeaderSize, &value, sizeof(T));
+    Put32(slot + 8, Crc(slot));
+
+    uint32_t address = start_ + next_offset_;
+    if (next_offset_ % sector_size_ == 0) {
+      int rc = flash_->erase(address, sector_size_);
+      if (rc != 0) return rc;
+    }
+    int rc = flash_->program(slot, address, kSlotSize);
+    if (rc != 0) return rc;
+
+    memcpy(&newest_, &value, sizeof(T));
+    found_ = true;
+    ++sequence_;
+    next_offset_ = Next(next_offset_);
+    return 0;
+  }
+
+  uint32_t sequence() const { return sequence_; }
+
+ private:
+  // Find the newest valid slot and where the next store() goes
+  void scan() {
+    scanned_ = true;
+    found_ = false;
+    sequence_ = 0;
+    next_offset_ = 0;
+
+    uint32_t newest_offset = 0;
+    uint8_t slot[kSlotSize];
+    const uint32_t slots = sector_size_ / kSlotSize;
+    for (uint32_t i = 0; i < 2 * slots; ++i) {
+      uint32_t offset = (i / slots) * sector_size_ + (i % slots) * kSlotSize;
+      if (flash_->read(slot, start_ + offset, kSlotSize) != 0) continue;
+      if (!Valid(slot)) continue;
+      uint32_t sequence = Get32(slot + 4);
+      if (found_ && sequence < sequence_) continue;
+      found_ = true;
+      sequence_ = sequence;
+      newest_offset = offset;
+      memcpy(&newest_, slot + kRecordHeaderSize, sizeof(T));
+    }
+    if (!found_) return;
+    ++sequence_;
+
+    // Continue after the newest slot if it is still blank, otherwise (torn
+    // write, garbage) start over in the other sector
+    next_offset_ = Next(newest_offset);
+    if (next_offset_ % sector_size_ != 0 &&
+        (flash_->read(slot, start_ + next_offset_, kSlotSize) != 0 ||
+         !Blank(slot))) {
+      next_offset_ = (newest_offset < sector_size_) ? sector_size_ : 0;
+    }
+  }
+
+  // Slots never straddle the sector boundary
+  uint32_t Next(uint32_t offset) const {
+    offset += kSlotSize;
+    uint32_t in_sector = offset % sector_size_;
+    if (in_sector + kSlotSize > sector_size_) offset += sector_size_ - in_sector;
+    return offset % (2 * sector_size_);
+  }
+
+  bool Valid(const uint8_t* slot) const {
+    return Get16(slot) == kRecordMagic && Get16(slot + 2) == sizeof(T) &&
+           Get32(slot + 8) == Crc(slot);
+  }
+
+  static bool Blank(const uint8_t* slot) {
+    for (int i = 0; i < kSlotSize; ++i) {
+      if (slot[i] != 0xFF) return false;
+    }
+    return true;
+  }
+
+  // CRC of sequence and value
+  static uint32_t Crc(const uint8_t* slot) {
+    uint32_t crc = RecordCrc32(slot + 4, 4, 0);
+    return RecordCrc32(slot + kRecordHeaderSize, sizeof(T), crc);
+  }
+
+  static void Put16(uint8_t* p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+  }
+  static void Put32(uint8_t* p, uint32_t v) {
+    Put16(p, v & 0xFFFF);
+    Put16(p + 2, v >> 16);
+  }
+  static uint16_t Get16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+  }
+  static uint32_t Get32(const uint8_t* p) {
+    return Get16(p) | ((uint32_t)Get16(p + 2) << 16);
+  }
+
+  Flash* flash_;
+  uint32_t start_;
+  uint32_t sector_size_;
+
+  bool scanned_ = false;
+  bool found_ = false;
+  T newest_;
+  uint32_t sequence_ = 0;
+  uint32_t next_offset_ = 0;
+};
+
+#endif  // PERSISTENT_RECORD_H_
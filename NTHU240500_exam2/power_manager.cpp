@@ -0,0 +1,137 @@
+#include "power_manager.h"
+
+#include "mbed.h"
+#include "mbed_stats.h"
+#include "mode_controller.h"
+#include "stm32l475e_iot01_accelero.h"
+#include "stm32l475e_iot01_gyro.h"
+
+// Current model [uA], typical figures from the STM32L4S5 and LSM6DSL
+// datasheets. The MCU runs at 120 MHz; sleep keeps the clocks running,
+// deep sleep is stop 2. The accelerometer runs in high performance mode
+// except at 26 Hz and below, where it is switched to low power mode.
+constexpr float kCpuRunUa = 13000;
+constexpr float kCpuSleepUa = 4000;
+constexpr float kCpuDeepSleepUa = 10;
+constexpr float kAccelPowerDownUa = 3;
+constexpr float kAccelLowPowerUa = 26;
+constexpr float kAccelHighPerformanceUa = 150;
+constexpr float kGyroUa = 450;
+
+// Highest rate that still runs in low power mode
+constexpr uint8_t kLowPowerOdr = LSM6DSL_ODR_26Hz;
+
+static Mutex power_mutex;
+
+static uint8_t demand_odr[kPowerConsumerCount] = {0};
+static bool demand_gyro[kPowerConsumerCount] = {false};
+static uint8_t applied_odr = LSM6DSL_ODR_POWER_DOWN;
+static bool applied_gyro = false;
+
+static PowerModeStats mode_stats[kModeCount];
+static int active_mode = kModeSafe;
+static uint64_t last_time_us = 0;
+static uint64_t last_sleep_us = 0;
+static uint64_t last_deep_sleep_us = 0;
+
+static float SensorCurrent() {
+  float current = kAccelPowerDownUa;
+  if (applied_odr > kLowPowerOdr) {
+    current = kAccelHighPerformanceUa;
+  } else if (applied_odr != LSM6DSL_ODR_POWER_DOWN) {
+    current = kAccelLowPowerUa;
+  }
+  if (applied_gyro) current += kGyroUa;
+  return current;
+}
+
+// Close the interval since the last call, with power_mutex held
+static void Account() {
+  mbed_stats_cpu_t cpu;
+  mbed_stats_cpu_get(&cpu);
+  uint64_t now_us = Kernel::Clock::now().time_since_epoch().count() * 1000ull;
+
+  PowerModeStats& stats = mode_stats[active_mode];
+  uint64_t elapsed_us = now_us - last_time_us;
+  stats.time_us += elapsed_us;
+  stats.sleep_us += cpu.sleep_time - last_sleep_us;
+  stats.deep_sleep_us += cpu.deep_sleep_time - last_deep_sleep_us;
+  stats.sensor_uas += SensorCurrent() * elapsed_us / 1e6f;
+
+  last_time_us = now_us;
+  last_sleep_us = cpu.sleep_time;
+  last_deep_sleep_us = cpu.deep_sleep_time;
+}
+
+// Write the combined demand, with power_mutex held
+static void Apply(bool force) {
+  uint8_t odr = LSM6DSL_ODR_POWER_DOWN;
+  bool gyro = false;
+  for (int i = 0; i < kPowerConsumerCount; ++i) {
+    if (demand_odr[i] > odr) odr = demand_odr[i];
+    gyro = gyro || (demand_gyro[i] && demand_odr[i] != LSM6DSL_ODR_POWER_DOWN);
+  }
+  if (!force && odr == applied_odr && gyro == applied_gyro) {
+    return;
+  }
+  Account();
+
+  // Gyro and accelerometer share the rate so burst reads stay in step
+  LSM6DSL_AccGyroSetOdr(odr);
+  if (!gyro) {
+    LSM6DSL_GyroDeInit();
+  }
+  BSP_ACCELERO_LowPower(odr <= kLowPowerOdr);
+  applied_odr = odr;
+  applied_gyro = gyro;
+}
+
+void SetPowerDemand(int consumer, uint8_t odr, bool gyro) {
+  if (consumer < 0 || consumer >= kPowerConsumerCount) {
+    return;
+  }
+  power_mutex.lock();
+  demand_odr[consumer] = odr;
+  demand_gyro[consumer] = gyro;
+  Apply(false);
+  power_mutex.unlock();
+}
+
+void SetupPower() {
+  power_mutex.lock();
+  Apply(true);
+  power_mutex.unlock();
+}
+
+uint8_t PowerOdr() { return applied_odr; }
+
+void SetPowerMode(int mode) {
+  if (mode < 0 || mode >= kModeCount) {
+    return;
+  }
+  power_mutex.lock();
+  Account();
+  active_mode = mode;
+  power_mutex.unlock();
+}
+
+void GetPowerStats(int mode, PowerModeStats* stats) {
+  power_mutex.lock();
+  Account();
+  *stats = mode_stats[(mode >= 0 && mode < kModeCount) ? mode : kModeSafe];
+  power_mutex.unlock();
+}
+
+float EstimatePowerCurrent(const PowerModeStats& stats) {
+  if (stats.time_us == 0) {
+    return 0;
+  }
+  float time = stats.time_us;
+  float sleep = stats.sleep_us;
+  float deep_sleep = stats.deep_sleep_us;
+  float run = time - sleep - deep_sleep;
+  if (run < 0) run = 0;
+  float cpu = (run * kCpuRunUa + sleep * kCpuSleepUa +
+               deep_sleep * kCpuDeepSleepUa) / time;
+  return cpu + stats.sensor_uas * 1e6f / time;
+}
@@ -0,0 +1,41 @@
+#ifndef POWER_MANAGER_H_
+#define POWER_MANAGER_H_
+
+#include <stdint.h>
+
+// Parts of the app that need the LSM6DSL running
+enum PowerConsumer {
+  kPowerGesture = 0,      // gesture model input, accelerometer only
+  kPowerOrientation = 1,  // fused tilt, calibration and the wake-up watch
+  kPowerConsumerCount = 2,
+};
+
+// Time spent in one application mode since boot, and where it went
+struct PowerModeStats {
+  uint64_t time_us;        // in the mode
+  uint64_t sleep_us;       // of which the CPU slept (tickless idle)
+  uint64_t deep_sleep_us;  // of which in deep sleep (stop mode)
+  float sensor_uas;        // LSM6DSL charge [uA * s]
+};
+
+// Set what a consumer needs: an LSM6DSL_ODR_xxx rate and whether the gyro
+// must run too. LSM6DSL_ODR_POWER_DOWN drops the consumer. The sensor runs
+// at the highest rate any consumer asks for, the gyro only while a consumer
+// needs it, and everything is powered down when nobody does.
+extern void SetPowerDemand(int consumer, uint8_t odr, bool gyro);
+// Write the current demand to the sensor again, after BSP_ACCELERO_Init
+// (or anything else) changed the configuration behind our back
+extern void SetupPower();
+// The rate the sensor runs at, LSM6DSL_ODR_POWER_DOWN when off
+extern uint8_t PowerOdr();
+
+// Charge the time since the last change to the mode that was active
+extern void SetPowerMode(int mode);
+// Totals for mode, up to now
+extern void GetPowerStats(int mode, PowerModeStats* stats);
+// Average current of the MCU and the LSM6DSL while in the mode [uA], from
+// the sleep time and the current model in power_manager.cpp. The WiFi
+// module is not included.
+extern float EstimatePowerCurrent(const PowerModeStats& stats);
+
+#endif  // POWER_MANAGER_H_
@@ -0,0 +1,114 @@
+#ifndef PUBLISH_QUEUE_H_
+#define PUBLISH_QUEUE_H_
+
+// Bounded multi-producer, single-consumer queue without locks.
+//
+// Any thread (or interrupt) may push(); only the network thread pops. Every
+// cell carries a sequence number that tells whose turn it is: a producer
+// claims a cell by advancing head_ with a compare-and-swap, copies the
+// value in and then publishes it by bumping the cell's sequence, the
+// consumer only takes cells whose sequence says they are complete
+// (D. Vyukov's bounded queue). push() fails instead of waiting when the
+// queue is full, so the caller decides whether to drop or retry later.
+
+#include <stdint.h>
+
+#include <atomic>
+
+template <typename T, int N>
+class PublishQueue {
+  static_assert(N >= 2 && (N & (N - 1)) == 0, "N must be a power of two");
+
+ public:
+  PublishQueue() {
+    for (int i = 0; i < N; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // Copy value in, false if the queue is full
+  bool push(const T& value) {
+    uint32_t position = head_.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell& cell = cells_[position & (N - 1)];
+      uint32_t sequence = cell.sequence.load(std::memory_order_acquire);
+      int32_t diff = (int32_t)(sequence - position);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(position, position + 1,
+                                        std::memory_order_relaxed)) {
+          cell.value = value;
+          cell.sequence.store(position + 1, std::memory_order_release);
+          return true;
+        }
+        // position was reloaded by the failed exchange
+      } else if (diff < 0) {
+        return false;
+      } else {
+        position = head_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Oldest complete value, false if there is none. Consumer thread only.
+  bool pop(T* value) {
+    T* oldest = front();
+    if (oldest == nullptr) {
+      return false;
+    }
+    *value = *oldest;
+    pop();
+    return true;
+  }
+
+  // The oldest complete value in place, null if there is none. Consumer
+  // thread only, the value stays valid until pop().
+  T* front() {
+    uint32_t position = tail_.load(std::memory_order_relaxed);
+    Cell& cell = cells_[position & (N - 1)];
+    uint32_t sequence = cell.sequence.load(std::memory_order_acquire);
+    if ((int32_t)(sequence - (position + 1)) < 0) {
+      return nullptr;
+    }
+    return &cell.value;
+  }
+
+  // The index-th oldest complete value in place, null if it is not there
+  // (yet). Consumer thread only, like front().
+  T* peek(int index) {
+    uint32_t position = tail_.load(std::memory_order_relaxed) + index;
+    Cell& cell = cells_[position & (N - 1)];
+    uint32_t sequence = cell.sequence.load(std::memory_order_acquire);
+    if (index >= N || sequence != position + 1) {
+      return nullptr;
+    }
+    return &cell.value;
+  }
+
+  // Release the value front() returned to the producers
+  void pop() {
+    uint32_t position = tail_.load(std::memory_order_relaxed);
+    cells_[position & (N - 1)].sequence.store(position + N,
+                                              std::memory_order_release);
+    tail_.store(position + 1, std::memory_order_relaxed);
+  }
+
+  // Claimed cells, including ones still being written
+  int size() const {
+    return (int)(head_.load(std::memory_order_relaxed) -
+                 tail_.load(std::memory_order_relaxed));
+  }
+  bool full() const { return size() >= N; }
+  static constexpr int capacity() { return N; }
+
+ private:
+  struct Cell {
+    std::atomic<uint32_t> sequence;
+    T value;
+  };
+
+  Cell cells_[N];
+  std::atomic<uint32_t> head_{0};
+  std::atomic<uint32_t> tail_{0};
+};
+
+#endif  // PUBLISH_QUEUE_H_
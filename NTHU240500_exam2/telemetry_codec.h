@@ -0,0 +1,174 @@
+#ifndef TELEMETRY_CODEC_H_
+#define TELEMETRY_CODEC_H_
+
+// Binary MQTT payloads of the device messages, decoded by telemetry_codec.py.
+//
+// Every message starts with one byte, the format version in the high nibble
+// and the message type in the low one. The fields follow as unsigned LEB128
+// varints (7 bits per byte, least significant group first, high bit set on
+// all but the last byte); signed fields are zigzag mapped first (0, -1, 1,
+// -2, ... -> 0, 1, 2, 3, ...), so small magnitudes take one byte either way.
+//
+//   threshold (1):  threshold [deg] | count of threshold messages
+//   tilt batch (2): first sequence | first time [ms] | event count, then per
+//                   event: sequence - previous sequence - 1 | zigzag angle
+//                   [0.1 deg] - previous angle | time - previous time [ms]
+//                   (the first event's deltas are against itself: 0, its
+//                   angle, 0)
+//   gesture (3):    gesture index | threshold [deg] | time [ms]
+//   batch (4):      message count (1 to 127, one byte), then per message:
+//                   length | message (of the other types); the outbox
+//                   replays stored messages this way
+//
+// A version 1 decoder rejects other versions, unknown types, varints longer
+// than 5 bytes, truncated messages and trailing bytes. The encoders write
+// into the caller's buffer and return the length, or 0 if it is too small.
+
+#include <stdint.h>
+
+constexpr int kTelemetryVersion = 1;
+
+enum TelemetryType {
+  kTelemetryThreshold = 1,
+  kTelemetryTiltBatch = 2,
+  kTelemetryGesture = 3,
+  kTelemetryBatch = 4,
+};
+
+// Longest varint of a 32 bit value
+constexpr int kTelemetryMaxVarint = 5;
+
+// One over-threshold sample of the tilt detection
+struct TiltEvent {
+  uint32_t time_ms;
+  int16_t angle;  // [0.1 degree]
+  uint16_t sequence;
+};
+
+class TelemetryWriter {
+ public:
+  TelemetryWriter(uint8_t* buffer, int size) : buffer_(buffer), size_(size) {}
+
+  void header(TelemetryType type) {
+    byte((uint8_t)((kTelemetryVersion << 4) | type));
+  }
+
+  void varint(uint32_t value) {
+    while (value >= 0x80) {
+      byte((uint8_t)(value | 0x80));
+      value >>= 7;
+    }
+    byte((uint8_t)value);
+  }
+
+  void zigzag(int32_t value) {
+    varint(((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+  }
+
+  void bytes(const uint8_t* data, int size) {
+    for (int i = 0; i < size; ++i) byte(data[i]);
+  }
+
+  // Bytes written, 0 once anything did not fit
+  int length() const { return overflow_ ? 0 : length_; }
+  int remaining() const { return overflow_ ? 0 : size_ - length_; }
+
+ private:
+  void byte(uint8_t value) {
+    if (length_ >= size_) {
+      overflow_ = true;
+      return;
+    }
+    buffer_[length_++] = value;
+  }
+
+  uint8_t* buffer_;
+  int size_;
+  int length_ = 0;
+  bool overflow_ = false;
+};
+
+inline int EncodeThreshold(uint8_t* buffer, int size, int threshold,
+                           uint32_t count) {
+  TelemetryWriter writer(buffer, size);
+  writer.header(kTelemetryThreshold);
+  writer.varint(threshold);
+  writer.varint(count);
+  return writer.length();
+}
+
+inline int EncodeTiltBatch(uint8_t* buffer, int size, const TiltEvent* events,
+                           int count) {
+  if (count <= 0) return 0;
+  TelemetryWriter writer(buffer, size);
+  writer.header(kTelemetryTiltBatch);
+  writer.varint(events[0].sequence);
+  writer.varint(events[0].time_ms);
+  writer.varint(count);
+  const TiltEvent* previous = &events[0];
+  for (int i = 0; i < count; ++i) {
+    // sequences wrap at 16 bits, skipped ones are dropped events
+    uint16_t skipped = events[i].sequence - previous->sequence - 1;
+    writer.varint(i == 0 ? 0 : skipped);
+    writer.zigzag(events[i].angle - ((i == 0) ? 0 : previous->angle));
+    writer.varint(events[i].time_ms - previous->time_ms);
+    previous = &events[i];
+  }
+  return writer.length();
+}
+
+inline int EncodeGesture(uint8_t* buffer, int size, int gesture,
+                         int threshold, uint32_t time_ms) {
+  TelemetryWriter writer(buffer, size);
+  writer.header(kTelemetryGesture);
+  writer.varint(gesture);
+  writer.varint(threshold);
+  writer.varint(time_ms);
+  return writer.length();
+}
+
+// Most messages in one batch, the count is a one byte varint
+constexpr int kTelemetryMaxBatch = 127;
+
+// Whole messages packed into one batch message
+class TelemetryBatch {
+ public:
+  TelemetryBatch(uint8_t* buffer, int size)
+      : buffer_(buffer), writer_(buffer, size) {
+    writer_.header(kTelemetryBatch);
+    writer_.varint(0);  // the count, set by add
+  }
+
+  // Append an encoded message, false (and the batch unchanged) if it does
+  // not fit
+  bool add(const uint8_t* message, int length) {
+    int prefix = 1;
+    for (uint32_t rest = length; rest >= 0x80; rest >>= 7) ++prefix;
+    if (length <= 0 || count_ == kTelemetryMaxBatch ||
+        prefix + length > writer_.remaining()) {
+      return false;
+    }
+    writer_.varint(length);
+    writer_.bytes(message, length);
+    buffer_[1] = (uint8_t)++count_;
+    return true;
+  }
+
+  int count() const { return count_; }
+  // Bytes of the batch, 0 while it is empty
+  int length() const { return count_ ? writer_.length() : 0; }
+
+ private:
+  uint8_t* buffer_;
+  TelemetryWriter writer_;
+  int count_ = 0;
+};
+
+// Type of a payload in this format, -1 for anything else (text messages)
+inline int TelemetryMessageType(const uint8_t* payload, int length) {
+  if (length < 1 || (payload[0] >> 4) != kTelemetryVersion) return -1;
+  int type = payload[0] & 0x0F;
+  return (type >= kTelemetryThreshold && type <= kTelemetryBatch) ? type : -1;
+}
+
+#endif  // TELEMETRY_CODEC_H_
@@ -0,0 +1,147 @@
+import sys
+
+# Decoder of the binary telemetry messages encoded by telemetry_codec.h,
+# the format is described there.
+#
+# usage: import telemetry_codec; telemetry_codec.decode(msg.payload)
+#        host/build/telemetry_check | python3 telemetry_codec.py --check
+
+VERSION = 1
+THRESHOLD = 1
+TILT_BATCH = 2
+GESTURE = 3
+BATCH = 4
+MAX_VARINT = 5 # bytes of a 32 bit value
+
+class Reader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def varint(self):
+        value = 0
+        for shift in range(0, 7 * MAX_VARINT, 7):
+            if self.pos >= len(self.data):
+                raise ValueError("truncated message")
+            b = self.data[self.pos]
+            self.pos += 1
+            value |= (b & 0x7F) << shift
+            if b < 0x80:
+                if value >= 1 << 32:
+                    raise ValueError("varint out of range")
+                return value
+        raise ValueError("varint too long")
+
+    def zigzag(self):
+        value = self.varint()
+        return (value >> 1) ^ -(value & 1)
+
+def message_type(payload):
+    # type of a telemetry payload, None for anything else (text messages)
+    if len(payload) < 1 or payload[0] >> 4 != VERSION:
+        return None
+    t = payload[0] & 0x0F
+    return t if THRESHOLD <= t <= BATCH else None
+
+def decode(payload, nested=False):
+    # dict with 'type' and the fields, raises ValueError on a malformed message
+    payload = bytes(payload)
+    t = message_type(payload)
+    if t is None:
+        raise ValueError("not a telemetry message")
+    r = Reader(payload)
+    r.pos = 1
+    if t == BATCH:
+        if nested:
+            raise ValueError("batch inside a batch")
+        count = r.varint()
+        if count < 1:
+            raise ValueError("empty batch")
+        messages = []
+        for i in range(count):
+            n = r.varint()
+            if n < 1 or r.pos + n > len(payload):
+                raise ValueError("truncated message")
+            messages.append(decode(payload[r.pos:r.pos + n], True))
+            r.pos += n
+        msg = {'type': 'batch', 'messages': messages}
+    elif t == THRESHOLD:
+        msg = {'type': 'threshold', 'threshold': r.varint(), 'count': r.varint()}
+    elif t == GESTURE:
+        msg = {'type': 'gesture', 'gesture': r.varint(), 'threshold': r.varint(),
+               'time_ms': r.varint()}
+    else:
+        sequence = r.varint()
+        time_ms = r.varint()
+        count = r.varint()
+        if count < 1:
+            raise ValueError("empty tilt batch")
+        events = []
+        angle = 0
+        for i in range(count):
+            skipped = r.varint()
+            angle += r.zigzag()
+            time_ms += r.varint()
+            if i > 0:
+                sequence += skipped + 1
+            elif skipped != 0:
+                raise ValueError("bad first event")
+            events.append({'sequence': sequence & 0xFFFF,
+                           'time_ms': time_ms & 0xFFFFFFFF,
+                           'angle': angle / 10})
+        msg = {'type': 'tilt', 'events': events}
+    if r.pos != len(payload):
+        raise ValueError("trailing bytes")
+    return msg
+
+def describe(msg):
+    # one line per message, the same text host/telemetry_check prints
+    if msg['type'] == 'batch':
+        return "batch [" + ", ".join(describe(m) for m in msg['messages']) + "]"
+    if msg['type'] == 'threshold':
+        return "threshold %d %d" % (msg['threshold'], msg['count'])
+    if msg['type'] == 'gesture':
+        return "gesture %d %d %d" % (msg['gesture'], msg['threshold'], msg['time_ms'])
+    return "tilt" + "".join(" %d@%d:%.1f" % (e['sequence'], e['time_ms'], e['angle'])
+                            for e in msg['events'])
+
+def check(lines):
+    # "<hex>\t<description>" lines: every message must decode to the
+    # description, every truncation of it must be rejected and a corrupted
+    # byte may only ever raise ValueError
+    messages = 0
+    failed = 0
+    for line in lines:
+        data, expected = line.rstrip('\n').split('\t')
+        payload = bytes.fromhex(data)
+        messages += 1
+        try:
+            got = describe(decode(payload))
+        except ValueError as e:
+            got = "error: %s" % e
+        if got != expected:
+            print("MISMATCH %s: %s != %s" % (data, got, expected))
+            failed += 1
+            continue
+        for n in range(len(payload)):
+            try:
+                decode(payload[:n])
+                print("ACCEPTED truncation %s to %d bytes" % (data, n))
+                failed += 1
+            except ValueError:
+                pass
+        for n in range(len(payload)):
+            corrupt = bytearray(payload)
+            corrupt[n] ^= 0x80
+            try:
+                decode(corrupt)
+            except ValueError:
+                pass
+    print("%d messages, %d failed" % (messages, failed))
+    return failed == 0
+
+if __name__ == '__main__':
+    if len(sys.argv) > 1 and sys.argv[1] == '--check':
+        sys.exit(0 if check(sys.stdin) else 1)
+    for arg in sys.argv[1:]:
+        print(describe(decode(bytes.fromhex(arg))))
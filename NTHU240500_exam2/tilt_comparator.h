@@ -0,0 +1,96 @@
+#ifndef TILT_COMPARATOR_H_
+#define TILT_COMPARATOR_H_
+
+// Integer tilt decisions without acos.
+//
+// The tilt angle phi between a sample a and the reference g satisfies
+// cos(phi) = d / sqrt(n) with d = a.g and n = |a|^2 |g|^2, so for a limit
+// theta with c = cos(theta):
+//
+//   phi >= theta  <=>  d <= 0 or d^2 <= c^2 n     (theta <= 90)
+//   phi >= theta  <=>  d < 0 and d^2 >= c^2 n     (theta > 90)
+//
+// c^2 is kept in Q31 and only recomputed when the limit changes. For int16
+// inputs d^2 and n stay below 2^64 and c^2 n is formed from 32 bit halves,
+// so the comparison is exact up to the rounding of c^2 and needs neither
+// floating point nor 128 bit arithmetic. angle() is only for display.
+
+#include <math.h>
+#include <stdint.h>
+
+struct TiltLimit {
+  uint32_t cos2_q31 = 1u << 31;  // cos^2(theta) * 2^31
+  bool obtuse = false;           // theta > 90
+  int degrees = 0;
+};
+
+inline TiltLimit MakeTiltLimit(int degrees) {
+  TiltLimit limit;
+  double c = cos(degrees * 3.14159265358979323846 / 180);
+  limit.cos2_q31 = (uint32_t)(c * c * 2147483648.0 + 0.5);
+  limit.obtuse = c < 0;
+  limit.degrees = degrees;
+  return limit;
+}
+
+// floor (or ceil) of n * q / 2^31 for q <= 2^31, never larger than n
+inline uint64_t TiltMulQ31(uint64_t n, uint32_t q, bool round_up) {
+  uint64_t hi = (n >> 32) * q;
+  uint64_t lo = (n & 0xFFFFFFFF) * q;
+  if (round_up) lo += (1u << 31) - 1;
+  return (hi << 1) + (lo >> 31);
+}
+
+class TiltComparator {
+ public:
+  // The orientation angles are measured against
+  void set_reference(const int16_t* g) {
+    for (int i = 0; i < 3; ++i) reference_[i] = g[i];
+    reference_norm2_ = Norm2(g);
+  }
+
+  // True if the angle between a and the reference is at least the limit.
+  // A zero vector has no direction and never counts as tilted.
+  bool at_least(const int16_t* a, const TiltLimit& limit) const {
+    int64_t d = Dot(a);
+    uint64_t n = (uint64_t)Norm2(a) * reference_norm2_;
+    if (n == 0) return false;
+
+    uint64_t magnitude = (uint64_t)(d < 0 ? -d : d);
+    uint64_t d2 = magnitude * magnitude;
+    // d^2 is an integer, so comparing with the floor (ceil) of c^2 n is
+    // the same as comparing with c^2 n itself
+    if (!limit.obtuse) {
+      return d <= 0 || d2 <= TiltMulQ31(n, limit.cos2_q31, false);
+    }
+    return d < 0 && d2 >= TiltMulQ31(n, limit.cos2_q31, true);
+  }
+
+  // Angle in degrees, NAN for a zero vector
+  float angle(const int16_t* a) const {
+    float ax = a[0], ay = a[1], az = a[2];
+    float gx = reference_[0], gy = reference_[1], gz = reference_[2];
+    float cx = ay * gz - az * gy;
+    float cy = az * gx - ax * gz;
+    float cz = ax * gy - ay * gx;
+    if ((uint64_t)Norm2(a) * reference_norm2_ == 0) return NAN;
+    return atan2f(sqrtf(cx * cx + cy * cy + cz * cz), (float)Dot(a)) *
+           (180 / 3.14159265f);
+  }
+
+ private:
+  int64_t Dot(const int16_t* a) const {
+    return (int64_t)a[0] * reference_[0] + (int64_t)a[1] * reference_[1] +
+           (int64_t)a[2] * reference_[2];
+  }
+
+  static uint32_t Norm2(const int16_t* v) {
+    return (uint32_t)(v[0] * v[0]) + (uint32_t)(v[1] * v[1]) +
+           (uint32_t)(v[2] * v[2]);
+  }
+
+  int16_t reference_[3] = {0, 0, 0};
+  uint32_t reference_norm2_ = 0;
+};
+
+#endif  // TILT_COMPARATOR_H_
@@ -0,0 +1,63 @@
+import serial
+import struct
+import sys
+import time
+import zlib
+
+serdev = '/dev/ttyACM0'
+s = serial.Serial(serdev, 9600, timeout=3)
+
+# usage: python3 trace_dump.py [output file] [baud]
+# Pages arrive in flash order, host/trace_tool sorts them by sequence.
+# Every page is followed by its CRC-32; an erased page ends the dump, then
+# the page count and its CRC-32.
+out_path = sys.argv[1] if len(sys.argv) > 1 else 'trace.bin'
+baud = int(sys.argv[2]) if len(sys.argv) > 2 else 921600
+PAGE_SIZE = 256
+ERASED = b'\xff' * PAGE_SIZE
+
+def read_frame(size):
+    frame = s.read(size + 4)
+    if len(frame) < size + 4:
+        sys.exit("timed out after %d of %d bytes" % (len(frame), size + 4))
+    data = frame[:size]
+    if struct.unpack('<I', frame[size:])[0] != zlib.crc32(data):
+        return None
+    return data
+
+s.write(bytes("\r", 'UTF-8'))
+line=s.readline() # Read an echo string from mbed terminated with '\n' (putc())
+line=s.readline() # Read an echo string from mbed terminated with '\n' (RPC reply)
+time.sleep(1)
+
+s.write(bytes("/TraceDump/run %d\r" % baud, 'UTF-8'))
+line=s.readline() # Read an echo string from mbed terminated with '\n' (putc())
+line=s.readline() # "TRACE <baud>" before the mbed switches the baud rate
+print(line)
+if not line.startswith(b"TRACE"):
+    sys.exit("unexpected reply")
+s.baudrate = int(line.split()[1])
+
+pages = 0
+start = time.time()
+with open(out_path, 'wb') as f:
+    while True:
+        page = read_frame(PAGE_SIZE)
+        if page is None:
+            sys.exit("CRC error in page %d" % pages)
+        if page == ERASED: # erased page ends the dump
+            break
+        f.write(page)
+        pages = pages + 1
+count = read_frame(4)
+if count is None or struct.unpack('<I', count)[0] != pages:
+    sys.exit("%d pages received, the trailer does not match" % pages)
+elapsed = time.time() - start
+print("%d pages (%d bytes) in %.1f s" % (pages, pages * PAGE_SIZE, elapsed))
+
+s.baudrate = 9600
+line=s.readline() # Read an echo string from mbed terminated with '\n' (RPC reply)
+print(line)
+if b"NOT FLUSHED" in line:
+    print("warning: the newest records were not on the flash and are missing")
+s.close()
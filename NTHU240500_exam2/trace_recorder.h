@@ -0,0 +1,279 @@
+#ifndef TRACE_RECORDER_H_
+#define TRACE_RECORDER_H_
+
+// Log-structured sensor trace on NOR flash.
+//
+// The log region is split into erase sectors, sectors into 256 B pages. Every
+// programmed page starts with a 12 byte header followed by packed records:
+//
+//   page:   magic u16 | used u16 | sequence u32 | base_ms u32 | records...
+//   record: type u8 | delta_ms u16 | payload (size fixed by type)
+//
+// All fields are little endian. delta_ms is relative to base_ms of the page,
+// unused page bytes keep the erased 0xFF value. Pages are written in order of
+// increasing sequence and the log wraps around, erasing a sector right before
+// its first page is programmed, so the newest data always survives.
+//
+// Flash is any type with the mbed BlockDevice signatures used below
+// (read, program, erase), so the same code runs against QSPIFBlockDevice on
+// the board and a file-backed stand-in on the host.
+
+#include <stdint.h>
+#include <string.h>
+
+constexpr uint16_t kTraceMagic = 0x5254;  // "TR"
+constexpr int kTracePageSize = 256;
+constexpr int kTraceSectorSize = 4096;
+constexpr int kTracePageHeaderSize = 12;
+constexpr uint32_t kTraceErasedSequence = 0xFFFFFFFF;
+
+enum TraceRecordType {
+  kTraceAccel = 1,    // int16 x, y, z [mg]
+  kTraceGesture = 2,  // uint8 gesture index, uint8 threshold
+  kTraceTilt = 3,     // int16 angle [0.1 deg], uint8 threshold
+};
+
+// Payload size of each record type, 0 for unknown types
+inline int TracePayloadSize(uint8_t type) {
+  switch (type) {
+    case kTraceAccel:
+      return 6;
+    case kTraceGesture:
+      return 2;
+    case kTraceTilt:
+      return 3;
+    default:
+      return 0;
+  }
+}
+
+struct TraceRecord {
+  uint8_t type;
+  uint32_t time_ms;
+  uint8_t payload[6];
+};
+
+inline void TracePut16(uint8_t* p, uint16_t v) {
+  p[0] = v & 0xFF;
+  p[1] = v >> 8;
+}
+
+inline void TracePut32(uint8_t* p, uint32_t v) {
+  TracePut16(p, v & 0xFFFF);
+  TracePut16(p + 2, v >> 16);
+}
+
+inline uint16_t TraceGet16(const uint8_t* p) {
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+inline uint32_t TraceGet32(const uint8_t* p) {
+  return TraceGet16(p) | ((uint32_t)TraceGet16(p + 2) << 16);
+}
+
+// Sequence number of a page, kTraceErasedSequence if it holds no trace data
+inline uint32_t TracePageSequence(const uint8_t* page) {
+  if (TraceGet16(page) != kTraceMagic) return kTraceErasedSequence;
+  return TraceGet32(page + 4);
+}
+
+// Call visit(const TraceRecord&) for every record of a programmed page,
+// returns the number of records or -1 if the page is not a valid trace page
+template <typename Visitor>
+int TraceParsePage(const uint8_t* page, Visitor visit) {
+  if (TracePageSequence(page) == kTraceErasedSequence) return -1;
+  int used = TraceGet16(page + 2);
+  if (used > kTracePageSize - kTracePageHeaderSize) return -1;
+  uint32_t base_ms = TraceGet32(page + 8);
+
+  int count = 0;
+  const uint8_t* p = page + kTracePageHeaderSize;
+  const uint8_t* end = p + used;
+  while (p + 3 <= end) {
+    TraceRecord record;
+    record.type = p[0];
+    record.time_ms = base_ms + TraceGet16(p + 1);
+    int size = TracePayloadSize(record.type);
+    if (size == 0 || p + 3 + size > end) return -1;
+    memcpy(record.payload, p + 3, size);
+    visit(record);
+    ++count;
+    p += 3 + size;
+  }
+  return count;
+}
+
+template <typename Flash>
+class TraceRecorder {
+ public:
+  // The log occupies [start, start + size) of the device, both must be
+  // multiples of kTraceSectorSize
+  TraceRecorder(Flash* flash, uint32_t start, uint32_t size)
+      : flash_(flash), start_(start), size_(size) {}
+
+  // Find the end of an existing log so recording continues after it
+  int init() {
+    uint8_t header[kTracePageHeaderSize];
+    uint32_t newest = kTraceErasedSequence;
+    uint32_t newest_sector = 0;
+
+    // The first page of every sector tells how recent the sector is
+    for (uint32_t sector = 0; sector < size_; sector += kTraceSectorSize) {
+      int rc = flash_->read(header, start_ + sector, sizeof(header));
+      if (rc != 0) return rc;
+      uint32_t sequence = TracePageSequence(header);
+      if (sequence == kTraceErasedSequence) continue;
+      if (newest == kTraceErasedSequence || sequence > newest) {
+        newest = sequence;
+        newest_sector = sector;
+      }
+    }
+
+    sequence_ = 0;
+    write_offset_ = 0;
+    if (newest != kTraceErasedSequence) {
+      // Continue after the last programmed page of the newest sector
+      uint32_t offset = newest_sector;
+      for (; offset < newest_sector + kTraceSectorSize;
+           offset += kTracePageSize) {
+        int rc = flash_->read(header, start_ + offset, sizeof(header));
+        if (rc != 0) return rc;
+        uint32_t sequence = TracePageSequence(header);
+        if (sequence == kTraceErasedSequence) break;
+        newest = sequence;
+      }
+      sequence_ = newest + 1;
+      write_offset_ = offset % size_;
+      // A partially used sector cannot be erased again without losing the
+      // pages already in it, keep filling it
+      sector_ready_ = (write_offset_ % kTraceSectorSize) != 0;
+    }
+
+    active_ = 0;
+    pending_ = -1;
+    fill_ = kTracePageHeaderSize;
+    return 0;
+  }
+
+  // Append one record, called from the acquisition side. Never touches the
+  // flash; returns true when a page was sealed and flush() should run.
+  bool append(uint8_t type, uint32_t time_ms, const uint8_t* payload) {
+    int size = TracePayloadSize(type);
+    if (size == 0) return false;
+
+    bool sealed = false;
+    if (fill_ > kTracePageHeaderSize &&
+        (fill_ + 3 + size > kTracePageSize ||
+         time_ms - base_ms_ > 0xFFFF)) {
+      sealed = seal();
+      if (!sealed) {
+        ++dropped_;
+        return false;
+      }
+    }
+
+    uint8_t* page = pages_[active_];
+    if (fill_ == kTracePageHeaderSize) base_ms_ = time_ms;
+    page[fill_] = type;
+    TracePut16(page + fill_ + 1, (uint16_t)(time_ms - base_ms_));
+    memcpy(page + fill_ + 3, payload, size);
+    fill_ += 3 + size;
+    ++records_;
+    return sealed;
+  }
+
+  bool append_accel(uint32_t time_ms, const int16_t* xyz) {
+    uint8_t payload[6];
+    for (int i = 0; i < 3; ++i) TracePut16(payload + 2 * i, (uint16_t)xyz[i]);
+    return append(kTraceAccel, time_ms, payload);
+  }
+
+  bool append_gesture(uint32_t time_ms, int gesture_index, int threshold) {
+    uint8_t payload[2] = {(uint8_t)gesture_index, (uint8_t)threshold};
+    return append(kTraceGesture, time_ms, payload);
+  }
+
+  bool append_tilt(uint32_t time_ms, float angle, int threshold) {
+    uint8_t payload[3];
+    TracePut16(payload, (uint16_t)(int16_t)(angle * 10));
+    payload[2] = (uint8_t)threshold;
+    return append(kTraceTilt, time_ms, payload);
+  }
+
+  // Seal the partially filled page so the next flush() writes it out
+  bool sync() {
+    if (fill_ == kTracePageHeaderSize) return false;
+    return seal();
+  }
+
+  // Program the sealed page, called from the writer side
+  int flush() {
+    if (pending_ < 0) return 0;
+
+    uint32_t address = start_ + write_offset_;
+    if (write_offset_ % kTraceSectorSize == 0 && !sector_ready_) {
+      int rc = flash_->erase(address, kTraceSectorSize);
+      if (rc != 0) return rc;
+    }
+    int rc = flash_->program(pages_[pending_], address, kTracePageSize);
+    if (rc != 0) return rc;
+
+    write_offset_ = (write_offset_ + kTracePageSize) % size_;
+    sector_ready_ = false;
+    ++pages_written_;
+    pending_ = -1;
+    return 0;
+  }
+
+  // Records not on the flash yet: a sealed page waiting for flush() or a
+  // partially filled one
+  bool unsaved() const {
+    return pending_ >= 0 || fill_ > kTracePageHeaderSize;
+  }
+
+  uint32_t start() const { return start_; }
+  uint32_t size() const { return size_; }
+  uint32_t records() const { return records_; }
+  uint32_t dropped() const { return dropped_; }
+  uint32_t pages_written() const { return pages_written_; }
+
+ private:
+  // Finish the active page and swap buffers, fails while the other buffer
+  // is still waiting for flush()
+  bool seal() {
+    if (pending_ >= 0) return false;
+    uint8_t* page = pages_[active_];
+    memset(page + fill_, 0xFF, kTracePageSize - fill_);
+    TracePut16(page, kTraceMagic);
+    TracePut16(page + 2, (uint16_t)(fill_ - kTracePageHeaderSize));
+    TracePut32(page + 4, sequence_++);
+    TracePut32(page + 8, base_ms_);
+
+    pending_ = active_;
+    active_ ^= 1;
+    fill_ = kTracePageHeaderSize;
+    return true;
+  }
+
+  Flash* flash_;
+  uint32_t start_;
+  uint32_t size_;
+
+  // Double buffer, records go to pages_[active_] while pages_[pending_]
+  // waits for flush()
+  uint8_t pages_[2][kTracePageSize];
+  int active_ = 0;
+  volatile int pending_ = -1;
+  int fill_ = kTracePageHeaderSize;
+  uint32_t base_ms_ = 0;
+
+  uint32_t sequence_ = 0;
+  uint32_t write_offset_ = 0;
+  bool sector_ready_ = false;
+
+  uint32_t records_ = 0;
+  volatile uint32_t dropped_ = 0;
+  uint32_t pages_written_ = 0;
+};
+
+#endif  // TRACE_RECORDER_H_
@@ -17,97 +17,91 @@
 #if !defined(MQTTASYNC_H)
 #define MQTTASYNC_H
 
-#include "FP.h"
-#include "MQTTPacket.h"
-#include "stdio.h"
+#include "MQTTClient.h"     // QoS, Message, MessageData, PacketId, the topic trie and the stream decoder
 
 namespace MQTT
 {
 
 
-enum QoS { QOS0, QOS1, QOS2 };
-
-
-struct Message
-{
-    enum QoS qos;
-    bool retained;
-    bool dup;
-    unsigned short id;
-    void *payload;
-    size_t payloadlen;
-};
-
-
-class PacketId
-{
-public:
-    PacketId();
-    
-    int getNext();
-   
-private:
-    static const int MAX_PACKET_ID = 65535;
-    int next;
-};
-
-typedef void (*messageHandler)(Message*);
-
-typedef struct limits
-{
-	int MAX_MQTT_PACKET_SIZE; // 
-	int MAX_MESSAGE_HANDLERS;  // each subscription requires a message handler
-	int MAX_CONCURRENT_OPERATIONS;  // each command which runs concurrently can have a result handler, when we are in multi-threaded mode
-	int command_timeout_ms;
-		
-	limits()
-	{
-		MAX_MQTT_PACKET_SIZE = 100;
-		MAX_MESSAGE_HANDLERS = 5;
-		MAX_CONCURRENT_OPERATIONS = 1; // 1 indicates single-threaded mode - set to >1 for multithreaded mode
-		command_timeout_ms = 30000;
-	}
-} Limits;
-  
-
 /**
  * @class Async
  * @brief non-blocking, threaded MQTT client API
- * @param Network a network class which supports send, receive
- * @param Timer a timer class with the methods: 
- */ 
-template<class Network, class Timer, class Thread, class Mutex> class Async
+ *
+ * subscribe, unsubscribe and publish send their packet and return without waiting for the broker,
+ * so up to MAX_CONCURRENT_OPERATIONS of them may wait for their acknowledgement at once, pipelined
+ * on the connection. connect() starts a receive thread that reads what the broker sends: it calls
+ * the result handler of an operation once it completes or fails (refused, no answer within the
+ * command timeout, or the connection was lost), delivers incoming messages to the message handlers
+ * and sends the keepalive pings.
+ *
+ * The handlers run on the receive thread with no lock held, so they may start new operations. They
+ * must not call connect() or disconnect(), which wait for that thread to end; call those from one
+ * thread. A mutex serializes the calling threads and the receive thread on the socket writes and
+ * the tables.
+ *
+ * @param Network a network class with read, readSome and write (MQTTNetwork)
+ * @param Timer a countdown timer class (Countdown)
+ * @param Thread a thread class with start(callback) and join() (rtos::Thread)
+ * @param Mutex a mutex class with lock() and unlock() (rtos::Mutex)
+ * @param MAX_MQTT_PACKET_SIZE the send and read buffers
+ * @param MAX_MESSAGE_HANDLERS subscriptions with a message handler
+ * @param MAX_CONCURRENT_OPERATIONS the operation table: connects, subscribes, unsubscribes and
+ *     QoS 1 and 2 publishes waiting for the broker
+ */
+template<class Network, class Timer, class Thread, class Mutex, int MAX_MQTT_PACKET_SIZE = 100,
+         int MAX_MESSAGE_HANDLERS = 5, int MAX_CONCURRENT_OPERATIONS = 8>
+class Async
 {
-    
-public:    
-
-	struct Result
-	{
-    	/* success or failure result data */
-    	Async<Network, Timer, Thread, Mutex>* client;
-		int rc;
-	};
-
-	typedef void (*resultHandler)(Result*);	
-   
-    Async(Network* network, const Limits limits = Limits()); 
-        
-    typedef struct
+public:
+
+    struct Result
     {
         Async* client;
-        Network* network;
-    } connectionLostInfo;
-    
-    typedef int (*connectionLostHandlers)(connectionLostInfo*);
-    
-    /** Set the connection lost callback - called whenever the connection is lost and we should be connected
+        int rc;                 // SUCCESS, or FAILURE if refused, timed out or the connection was lost
+        int type;               // the packet that completed the operation, 0 if it failed without one
+        unsigned short id;      // packet id of the operation, 0 for connect and QoS 0 publishes
+        int returnCode;         // the connack return code, or the QoS a subscribe was granted (0x80 refused)
+        bool sessionPresent;    // of a connect
+    };
+
+    typedef void (*resultHandler)(Result&);
+    typedef void (*messageHandler)(MessageData&);
+    typedef void (*connectionLostHandler)(Async&);
+
+    Async(Network& network, unsigned int command_timeout_ms = 30000)  : ipstack(network), packetid()
+    {
+        this->command_timeout_ms = command_timeout_ms;
+        receiver = 0;
+        running = false;
+        connected = false;
+        keepAliveInterval = 0;
+        ping_outstanding = false;
+        operationCount = 0;
+        for (int i = 0; i < MAX_CONCURRENT_OPERATIONS; ++i)
+        {
+            operations[i].type = 0;
+            incomingQoS2[i] = 0;
+        }
+        for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+            messageHandlers[i].topicFilter = 0;
+    }
+
+    ~Async()
+    {
+        disconnect();
+        stopReceiver();
+    }
+
+    /** Set the connection lost callback - called on the receive thread when the connection fails
+     *  after the CONNACK, after the result handlers of the operations it took with it. Reconnect
+     *  from another thread.
      *  @param clh - pointer to the callback function
      */
-    void setConnectionLostHandler(connectionLostHandlers clh)
+    void setConnectionLostHandler(connectionLostHandler clh)
     {
-        connectionLostHandler.attach(clh);
+        connectionLost.attach(clh);
     }
-    
+
     /** Set the default message handling callback - used for any message which does not match a subscription message handler
      *  @param mh - pointer to the callback function
      */
@@ -115,493 +109,649 @@ public:
     {
         defaultMessageHandler.attach(mh);
     }
-           
-    int connect(resultHandler fn, MQTTPacket_connectData* options = 0);
-    
-     template<class T>
-    int connect(void(T::*method)(Result *), MQTTPacket_connectData* options = 0, T *item = 0);  // alternative to pass in pointer to member function
-        
-    int publish(resultHandler rh, const char* topic, Message* message);
-    
-    int subscribe(resultHandler rh, const char* topicFilter, enum QoS qos, messageHandler mh);
-    
-    int unsubscribe(resultHandler rh, const char* topicFilter);
-    
-    int disconnect(resultHandler rh);
-    
-private:
 
-    void run(void const *argument);
-    int cycle(int timeout);
-    int waitfor(int packet_type, Timer& atimer);
-	int keepalive();
-	int findFreeOperation();
-
-    int decodePacket(int* value, int timeout);
-    int readPacket(int timeout);
-    int sendPacket(int length, int timeout);
-	int deliverMessage(MQTTString* topic, Message* message);
-    
-    Thread* thread;
-    Network* ipstack;
-    
-    Limits limits;
-    
-    char* buf;  
-    char* readbuf;
-
-    Timer ping_timer, connect_timer;
-    unsigned int keepAliveInterval;
-	bool ping_outstanding;
-    
-    PacketId packetid;
-    
-    typedef FP<void, Result*> resultHandlerFP;    
-    resultHandlerFP connectHandler; 
-    
-    typedef FP<void, Message*> messageHandlerFP;
-    struct MessageHandlers
-    {
-    	const char* topic;
-    	messageHandlerFP fp;
-    } *messageHandlers;      // Message handlers are indexed by subscription topic
-    
-    // how many concurrent operations should we allow?  Each one will require a function pointer
-    struct Operations
+    /** Send the CONNECT and start the receive thread; the result handler gets the CONNACK
+     *  @param rh - called with the CONNACK, may be 0
+     *  @param options - connect options, 0 for the defaults
+     *  @return success code, FAILURE if the client is connected already or the CONNECT failed
+     */
+    int connect(resultHandler rh, MQTTPacket_connectData* options = 0)
     {
-    	unsigned short id;
-    	resultHandlerFP fp;
-    	const char* topic;         // if this is a publish, store topic name in case republishing is required
-    	Message* message;    // for publish, 
-    	Timer timer;         // to check if the command has timed out
-    } *operations;           // result handlers are indexed by packet ids
-
-	static void threadfn(void* arg);
-	
-	messageHandlerFP defaultMessageHandler;
-    
-    typedef FP<int, connectionLostInfo*> connectionLostFP;
-    
-    connectionLostFP connectionLostHandler;
-    
-};
+        MQTTPacket_connectData default_options = MQTTPacket_connectData_initializer;
+        if (options == 0)
+            options = &default_options; // set default options if none were supplied
+
+        mutex.lock();
+        bool busy = running;
+        mutex.unlock();
+        if (busy)
+            return FAILURE;
+        stopReceiver();                 // what is left of the last connection
+
+        mutex.lock();
+        int rc = FAILURE;
+        int len = 0;
+        keepAliveInterval = options->keepAliveInterval;
+        ping_outstanding = false;
+        decoder.reset();
+        if (options->cleansession)
+        {
+            for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+                messageHandlers[i].topicFilter = 0;
+            topics.clear();
+        }
+        if ((len = MQTTSerialize_connect(sendbuf, MAX_MQTT_PACKET_SIZE, options)) <= 0)
+            goto exit;
+        if (startOperation(CONNACK, 0, rh) < 0)
+            goto exit;
+        if ((rc = sendPacket(len)) != SUCCESS)
+        {
+            endOperation(CONNACK, 0);
+            goto exit;
+        }
+        if (keepAliveInterval > 0)
+            last_received.countdown(keepAliveInterval);
+        running = true;
+        receiver = new Thread();
+        receiver->start(callback(this, &Async::run));
+    exit:
+        mutex.unlock();
+        return rc;
+    }
 
-}
+    /** Publish a message; QoS 1 and 2 complete with the PUBACK or PUBCOMP
+     *  @param rh - called when the message was acknowledged (right away for QoS 0), may be 0
+     *  @param topicName - the topic to publish to
+     *  @param message - the message, copied before publish returns; its id is set for QoS 1 and 2
+     *  @return success code, FAILURE if not connected or the operation table is full,
+     *      BUFFER_OVERFLOW if the message does not fit the send buffer
+     */
+    int publish(resultHandler rh, const char* topicName, Message* message)
+    {
+        MQTTString topic = MQTTString_initializer;
+        topic.cstring = (char*)topicName;
+        int type = (message->qos == QOS2) ? PUBCOMP : PUBACK;
+        int rc = FAILURE;
+        int len = 0;
+
+        mutex.lock();
+        if (!running)
+            goto exit;
+        message->id = (message->qos == QOS0) ? 0 : packetid.getNext();
+        len = MQTTSerialize_publish(sendbuf, MAX_MQTT_PACKET_SIZE, 0, message->qos, message->retained, message->id,
+              topic, (unsigned char*)message->payload, message->payloadlen);
+        if (len <= 0)
+        {
+            rc = (len == MQTTPACKET_BUFFER_TOO_SHORT) ? BUFFER_OVERFLOW : FAILURE;
+            goto exit;
+        }
+        if (message->qos != QOS0 && startOperation(type, message->id, rh) < 0)
+            goto exit;
+        if ((rc = sendPacket(len)) != SUCCESS && message->qos != QOS0)
+            endOperation(type, message->id);
+    exit:
+        mutex.unlock();
+        if (rc == SUCCESS && message->qos == QOS0 && rh != 0)
+        {
+            Result result = {this, SUCCESS, 0, 0, 0, false};
+            rh(result);
+        }
+        return rc;
+    }
 
+    /** Subscribe; the message handler is set once the SUBACK grants the subscription
+     *  @param rh - called with the SUBACK, may be 0
+     *  @param topicFilter - the filter, kept by pointer until unsubscribed
+     *  @param qos - the maximum QoS to receive at
+     *  @param mh - called for every message matching the filter, on the receive thread
+     *  @return success code, FAILURE if not connected or the operation table is full
+     */
+    int subscribe(resultHandler rh, const char* topicFilter, enum QoS qos, messageHandler mh)
+    {
+        MQTTString topic = MQTTString_initializer;
+        topic.cstring = (char*)topicFilter;
+        int requestedQoS = qos;
+        int rc = FAILURE;
+        int len = 0;
+        int index = -1;
+        unsigned short id = 0;
+
+        mutex.lock();
+        if (!running)
+            goto exit;
+        id = packetid.getNext();
+        if ((len = MQTTSerialize_subscribe(sendbuf, MAX_MQTT_PACKET_SIZE, 0, id, 1, &topic, &requestedQoS)) <= 0)
+            goto exit;
+        if ((index = startOperation(SUBACK, id, rh)) < 0)
+            goto exit;
+        operations[index].topicFilter = topicFilter;
+        operations[index].mh.attach(mh);
+        if ((rc = sendPacket(len)) != SUCCESS)
+            endOperation(SUBACK, id);
+    exit:
+        mutex.unlock();
+        return rc;
+    }
 
-template<class Network, class Timer, class Thread, class Mutex> void MQTT::Async<Network, Timer, Thread, Mutex>::threadfn(void* arg)
-{
-    ((Async<Network, Timer, Thread, Mutex>*) arg)->run(NULL);
-}
+    /** Unsubscribe; the message handler is removed with the UNSUBACK
+     *  @param rh - called with the UNSUBACK, may be 0
+     *  @param topicFilter - the filter given to subscribe
+     *  @return success code, FAILURE if not connected or the operation table is full
+     */
+    int unsubscribe(resultHandler rh, const char* topicFilter)
+    {
+        MQTTString topic = MQTTString_initializer;
+        topic.cstring = (char*)topicFilter;
+        int rc = FAILURE;
+        int len = 0;
+        int index = -1;
+        unsigned short id = 0;
+
+        mutex.lock();
+        if (!running)
+            goto exit;
+        id = packetid.getNext();
+        if ((len = MQTTSerialize_unsubscribe(sendbuf, MAX_MQTT_PACKET_SIZE, 0, id, 1, &topic)) <= 0)
+            goto exit;
+        if ((index = startOperation(UNSUBACK, id, rh)) < 0)
+            goto exit;
+        operations[index].topicFilter = topicFilter;
+        if ((rc = sendPacket(len)) != SUCCESS)
+            endOperation(UNSUBACK, id);
+    exit:
+        mutex.unlock();
+        return rc;
+    }
 
+    /** Send the DISCONNECT and wait for the receive thread to end; the operations still waiting
+     *  fail. Not from a handler.
+     *  @return success code, FAILURE if not connected
+     */
+    int disconnect()
+    {
+        int rc = FAILURE;
+        mutex.lock();
+        if (running)
+        {
+            int len = MQTTSerialize_disconnect(sendbuf, MAX_MQTT_PACKET_SIZE);
+            if (len > 0)
+                rc = sendPacket(len);
+            running = false;    // the receive thread ends after its current read
+            connected = false;
+        }
+        mutex.unlock();
+        stopReceiver();
+        return rc;
+    }
 
-template<class Network, class Timer, class Thread, class Mutex> MQTT::Async<Network, Timer, Thread, Mutex>::Async(Network* network, Limits limits)  : limits(limits), packetid()
-{
-	this->thread = 0;
-	this->ipstack = network;
-	this->ping_timer = Timer();
-	this->ping_outstanding = 0;
-	   
-	// How to make these memory allocations portable?  I was hoping to avoid the heap
-	buf = new char[limits.MAX_MQTT_PACKET_SIZE];
-	readbuf = new char[limits.MAX_MQTT_PACKET_SIZE];
-	this->operations = new struct Operations[limits.MAX_CONCURRENT_OPERATIONS];
-	for (int i = 0; i < limits.MAX_CONCURRENT_OPERATIONS; ++i)
-		operations[i].id = 0;
-	this->messageHandlers = new struct MessageHandlers[limits.MAX_MESSAGE_HANDLERS];
-	for (int i = 0; i < limits.MAX_MESSAGE_HANDLERS; ++i)
-		messageHandlers[i].topic = 0;
-}
+    bool isConnected()
+    {
+        return connected;
+    }
 
+    /** Operations waiting for the broker */
+    int pending()
+    {
+        int count = 0;
+        mutex.lock();
+        for (int i = 0; i < MAX_CONCURRENT_OPERATIONS; ++i)
+        {
+            if (operations[i].type != 0)
+                ++count;
+        }
+        mutex.unlock();
+        return count;
+    }
 
-template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::sendPacket(int length, int timeout)
-{
-    int sent = 0;
-    
-    while (sent < length)
-        sent += ipstack->write(&buf[sent], length, timeout);
-	if (sent == length)
-	    ping_timer.countdown(this->keepAliveInterval); // record the fact that we have successfully sent the packet    
-    return sent;
-}
+private:
 
+    // longest wait for the socket between two looks at the timeouts and the keepalive
+    static const int RECEIVE_MS = 100;
 
-template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::decodePacket(int* value, int timeout)
-{
-    char c;
-    int multiplier = 1;
-    int len = 0;
-	const int MAX_NO_OF_REMAINING_LENGTH_BYTES = 4;
+    typedef FP<void, Result&> resultHandlerFP;
+    typedef FP<void, MessageData&> messageHandlerFP;
 
-    *value = 0;
-    do
+    // the receive thread
+    void run()
     {
-        int rc = MQTTPACKET_READ_ERROR;
-
-        if (++len > MAX_NO_OF_REMAINING_LENGTH_BYTES)
+        while (running)
         {
-            rc = MQTTPACKET_READ_ERROR; /* bad data */
-            goto exit;
+            if (cycle() != SUCCESS)
+                break;
         }
-        rc = ipstack->read(&c, 1, timeout);
-        if (rc != 1)
-            goto exit;
-        *value += (c & 127) * multiplier;
-        multiplier *= 128;
-    } while ((c & 128) != 0);
-exit:
-    return len;
-}
 
+        mutex.lock();
+        bool lost = running && connected;
+        running = false;
+        connected = false;
+        mutex.unlock();
+
+        // the operations still waiting fail, oldest first
+        Result result = {this, FAILURE, 0, 0, 0, false};
+        resultHandlerFP fp;
+        while (takeOperation(false, result, fp))
+            fp(result);
+        if (lost)
+            connectionLost(*this);
+    }
 
-/**
- * If any read fails in this method, then we should disconnect from the network, as on reconnect
- * the packets can be retried. 
- * @param timeout the max time to wait for the packet read to complete, in milliseconds
- * @return the MQTT packet type, or -1 if none
- */
-template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::readPacket(int timeout) 
-{
-    int rc = -1;
-    MQTTHeader header = {0};
-    int len = 0;
-    int rem_len = 0;
-
-    /* 1. read the header byte.  This has the packet type in it */
-    if (ipstack->read(readbuf, 1, timeout) != 1)
-        goto exit;
-
-    len = 1;
-    /* 2. read the remaining length.  This is variable in itself */
-    decodePacket(&rem_len, timeout);
-    len += MQTTPacket_encode(readbuf + 1, rem_len); /* put the original remaining length back into the buffer */
-
-    /* 3. read the rest of the buffer using a callback to supply the rest of the data */
-    if (ipstack->read(readbuf + len, rem_len, timeout) != rem_len)
-        goto exit;
-
-    header.byte = readbuf[0];
-    rc = header.bits.type;
-exit:
-    return rc;
-}
+    void stopReceiver()
+    {
+        if (receiver != 0)
+        {
+            receiver->join();
+            delete receiver;
+            receiver = 0;
+        }
+    }
+
+    // read a packet and act on it; FAILURE ends the connection
+    int cycle()
+    {
+        int rc = SUCCESS;
+        int packet_type = readPacket();
+        Result result = {this, SUCCESS, packet_type, 0, 0, false};
 
+        switch (packet_type)
+        {
+            default:        // a read error, or a packet too long for readbuf
+                return FAILURE;
+            case 0:         // nothing complete yet
+                break;
+            case CONNACK:
+            {
+                unsigned char sessionPresent = 0, connack_rc = 255;
+                if (MQTTDeserialize_connack(&sessionPresent, &connack_rc, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
+                    return FAILURE;
+                result.returnCode = connack_rc;
+                result.sessionPresent = sessionPresent;
+                result.rc = (connack_rc == 0) ? SUCCESS : FAILURE;
+                connected = (connack_rc == 0);
+                complete(result);
+                if (!connected)
+                    return FAILURE;     // refused, the broker closes the connection
+                break;
+            }
+            case SUBACK:
+            {
+                int count = 0, grantedQoS = -1;
+                if (MQTTDeserialize_suback(&result.id, 1, &count, &grantedQoS, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
+                    return FAILURE;
+                result.returnCode = grantedQoS & 0xFF; // read as a char, which may be signed
+                result.rc = (result.returnCode == 0x80) ? FAILURE : SUCCESS;
+                complete(result);
+                break;
+            }
+            case UNSUBACK:
+                if (MQTTDeserialize_unsuback(&result.id, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
+                    return FAILURE;
+                complete(result);
+                break;
+            case PUBACK:
+            case PUBCOMP:
+            case PUBREC:
+            case PUBREL:
+            {
+                unsigned char type, dup;
+                if (MQTTDeserialize_ack(&type, &dup, &result.id, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
+                    return FAILURE;
+                if (packet_type == PUBACK || packet_type == PUBCOMP)
+                    complete(result);
+                else if (packet_type == PUBREC)
+                    rc = sendAck(PUBREL, result.id);    // the operation waits on for the PUBCOMP
+                else
+                {
+                    releaseQoS2(result.id);
+                    rc = sendAck(PUBCOMP, result.id);
+                }
+                break;
+            }
+            case PUBLISH:
+                rc = receive();
+                break;
+            case PINGRESP:
+                ping_outstanding = false;
+                break;
+        }
 
-template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::deliverMessage(MQTTString* topic, Message* message)
-{
-	int rc = -1;
-
-	// we have to find the right message handler - indexed by topic
-	for (int i = 0; i < limits.MAX_MESSAGE_HANDLERS; ++i)
-	{
-		if (messageHandlers[i].topic != 0 && MQTTPacket_equals(topic, (char*)messageHandlers[i].topic))
-		{
-			messageHandlers[i].fp(message);
-			rc = 0;
-			break;
-		}
-	}
-	
-	return rc;
-}
+        // operations the broker did not answer in time
+        Result expired = {this, FAILURE, 0, 0, 0, false};
+        resultHandlerFP fp;
+        while (takeOperation(true, expired, fp))
+            fp(expired);
+
+        // no CONNACK in time: the broker never accepted the connection
+        mutex.lock();
+        bool alive = connected || findOperation(CONNACK, 0) >= 0;  // accepted, or still waiting
+        mutex.unlock();
+        if (!alive)
+            return FAILURE;
+
+        if (rc == SUCCESS)
+            rc = keepalive();
+        return rc;
+    }
 
+    // the same as MQTT::Client::readPacket, up to RECEIVE_MS for a packet
+    int readPacket()
+    {
+        Timer timer(RECEIVE_MS);
+        MQTTHeader header = {0};
+        int len = 0;
 
+        while ((len = decoder.next(readbuf, MAX_MQTT_PACKET_SIZE)) == 0)
+        {
+            int room = 0;
+            unsigned char* to = decoder.space(&room);
+            int got = ipstack.readSome(to, room, timer.left_ms());
+            if (got <= 0)
+                return (got < 0) ? FAILURE : 0;
+            decoder.commit(got);
+        }
+        if (len < 0)
+            return (len == MQTTPACKET_BUFFER_TOO_SHORT) ? BUFFER_OVERFLOW : FAILURE;
 
-template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::cycle(int timeout)
-{
-    /* get one piece of work off the wire and one pass through */
+        header.byte = readbuf[0];
+        if (keepAliveInterval > 0)
+            last_received.countdown(keepAliveInterval);
+        return header.bits.type;
+    }
 
-    // read the socket, see what work is due
-    int packet_type = readPacket(timeout);
-    
-	int len, rc;
-    switch (packet_type)
+    // an incoming PUBLISH: deliver it, then acknowledge it
+    int receive()
     {
-        case CONNACK:
-			if (this->thread)
-			{
-				Result res = {this, 0};
-            	if (MQTTDeserialize_connack(&res.rc, readbuf, limits.MAX_MQTT_PACKET_SIZE) == 1)
-                	;
-				connectHandler(&res);
-				connectHandler.detach(); // only invoke the callback once
-			}
-			break;
-        case PUBACK:
-        	if (this->thread)
-        		; //call resultHandler
-        case SUBACK:
-            break;
-        case PUBLISH:
-			MQTTString topicName;
-			Message msg;
-			rc = MQTTDeserialize_publish((int*)&msg.dup, (int*)&msg.qos, (int*)&msg.retained, (int*)&msg.id, &topicName,
-								 (char**)&msg.payload, (int*)&msg.payloadlen, readbuf, limits.MAX_MQTT_PACKET_SIZE);;
-			if (msg.qos == QOS0)
-				deliverMessage(&topicName, &msg);
-            break;
-        case PUBREC:
-   	        int type, dup, mypacketid;
-   	        if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, limits.MAX_MQTT_PACKET_SIZE) == 1)
-   	            ; 
-   	        // must lock this access against the application thread, if we are multi-threaded
-			len = MQTTSerialize_ack(buf, limits.MAX_MQTT_PACKET_SIZE, PUBREL, 0, mypacketid);
-		    rc = sendPacket(len, timeout); // send the PUBREL packet
-			if (rc != len) 
-				goto exit; // there was a problem
-
-            break;
-        case PUBCOMP:
-            break;
-        case PINGRESP:
-			ping_outstanding = false;
-            break;
+        MQTTString topicName = MQTTString_initializer;
+        Message msg;
+        int intQoS;
+        msg.payloadlen = 0;
+        if (MQTTDeserialize_publish((unsigned char*)&msg.dup, &intQoS, (unsigned char*)&msg.retained, (unsigned short*)&msg.id, &topicName,
+                                    (unsigned char**)&msg.payload, (int*)&msg.payloadlen, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
+            return FAILURE;
+        msg.qos = (enum QoS)intQoS;
+
+        // a QoS 2 message is delivered once, the copies the broker sends before our PUBREC arrived are not
+        if (msg.qos != QOS2 || acceptQoS2(msg.id))
+            deliverMessage(topicName, msg);
+        if (msg.qos == QOS1)
+            return sendAck(PUBACK, msg.id);
+        if (msg.qos == QOS2)
+            return sendAck(PUBREC, msg.id);
+        return SUCCESS;
     }
-	keepalive();
-exit:
-    return packet_type;
-}
 
+    // call the handlers of the matching subscriptions, in slot order, or the default handler
+    void deliverMessage(MQTTString& topicName, Message& message)
+    {
+        messageHandlerFP matching[MAX_MESSAGE_HANDLERS];
+        bool matched[MAX_MESSAGE_HANDLERS] = {};
+        int found = 0;
 
-template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::keepalive()
-{
-	int rc = 0;
-
-	if (keepAliveInterval == 0)
-		goto exit;
-
-	if (ping_timer.expired())
-	{
-		if (ping_outstanding)
-			rc = -1;
-		else
-		{
-			int len = MQTTSerialize_pingreq(buf, limits.MAX_MQTT_PACKET_SIZE);
-			rc = sendPacket(len, 1000); // send the ping packet
-			if (rc != len) 
-				rc = -1; // indicate there's a problem
-			else
-				ping_outstanding = true;
-		}
-	}
-
-exit:
-	return rc;
-}
+        mutex.lock();
+        topics.match(topicName.lenstring.data, topicName.lenstring.len, matched);
+        for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+        {
+            if (matched[i] && messageHandlers[i].fp.attached())
+                matching[found++] = messageHandlers[i].fp;
+        }
+        mutex.unlock();
 
+        MessageData md(topicName, message);
+        for (int i = 0; i < found; ++i)
+            matching[i](md);
+        if (found == 0 && defaultMessageHandler.attached())
+            defaultMessageHandler(md);
+    }
 
-template<class Network, class Timer, class Thread, class Mutex> void MQTT::Async<Network, Timer, Thread, Mutex>::run(void const *argument)
-{
-	while (true)
-		cycle(ping_timer.left_ms());
-}
+    int keepalive()
+    {
+        int rc = SUCCESS;
+        if (keepAliveInterval == 0)
+            return rc;
 
+        mutex.lock();
+        if (ping_outstanding)
+        {
+            if (ping_sent.expired())
+                rc = FAILURE;   // no PINGRESP within the keepalive interval
+        }
+        else if (last_sent.expired() || last_received.expired())
+        {
+            int len = MQTTSerialize_pingreq(sendbuf, MAX_MQTT_PACKET_SIZE);
+            if (len > 0 && (rc = sendPacket(len)) == SUCCESS)
+            {
+                ping_outstanding = true;
+                ping_sent.countdown(keepAliveInterval);
+            }
+        }
+        mutex.unlock();
+        return rc;
+    }
 
-// only used in single-threaded mode where one command at a time is in process
-template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::waitfor(int packet_type, Timer& atimer)
-{
-	int rc = -1;
-	
-	do
+    int sendAck(int type, unsigned short id)
     {
-		if (atimer.expired()) 
-			break; // we timed out
-	}
-	while ((rc = cycle(atimer.left_ms())) != packet_type);	
-	
-	return rc;
-}
+        mutex.lock();
+        int len = MQTTSerialize_ack(sendbuf, MAX_MQTT_PACKET_SIZE, type, 0, id);
+        int rc = (len > 0) ? sendPacket(len) : FAILURE;
+        mutex.unlock();
+        return rc;
+    }
 
+    // with the mutex held
+    int sendPacket(int length)
+    {
+        Timer timer(command_timeout_ms);
+        int sent = 0;
 
-template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::connect(resultHandler resultHandler, MQTTPacket_connectData* options)
-{
-	connect_timer.countdown(limits.command_timeout_ms);
-
-    MQTTPacket_connectData default_options = MQTTPacket_connectData_initializer;
-    if (options == 0)
-        options = &default_options; // set default options if none were supplied
-    
-    this->keepAliveInterval = options->keepAliveInterval;
-	ping_timer.countdown(this->keepAliveInterval);
-    int len = MQTTSerialize_connect(buf, limits.MAX_MQTT_PACKET_SIZE, options);
-    int rc = sendPacket(len, connect_timer.left_ms()); // send the connect packet
-	if (rc != len) 
-		goto exit; // there was a problem
-    
-    if (resultHandler == 0)     // wait until the connack is received 
+        while (sent < length && !timer.expired())
+        {
+            int rc = ipstack.write(&sendbuf[sent], length - sent, timer.left_ms());
+            if (rc < 0)
+                break;
+            sent += rc;
+        }
+        if (sent != length)
+            return FAILURE;
+        if (keepAliveInterval > 0)
+            last_sent.countdown(keepAliveInterval);
+        return SUCCESS;
+    }
+
+    // with the mutex held: a free slot of the operation table waiting for a packet of type and id,
+    // -1 if the table is full
+    int startOperation(int type, unsigned short id, resultHandler rh)
     {
-        // this will be a blocking call, wait for the connack
-		if (waitfor(CONNACK, connect_timer) == CONNACK)
-		{
-        	int connack_rc = -1;
-        	if (MQTTDeserialize_connack(&connack_rc, readbuf, limits.MAX_MQTT_PACKET_SIZE) == 1)
-	        	rc = connack_rc;
-	    }
+        for (int i = 0; i < MAX_CONCURRENT_OPERATIONS; ++i)
+        {
+            if (operations[i].type == 0)
+            {
+                operations[i].type = type;
+                operations[i].id = id;
+                operations[i].sequence = ++operationCount;
+                operations[i].fp.detach();
+                if (rh != 0)
+                    operations[i].fp.attach(rh);
+                operations[i].topicFilter = 0;
+                operations[i].mh.detach();
+                operations[i].timer.countdown_ms(command_timeout_ms);
+                return i;
+            }
+        }
+        return -1;
     }
-    else
+
+    // with the mutex held: an operation whose packet could not be sent
+    void endOperation(int type, unsigned short id)
     {
-        // set connect response callback function
-        connectHandler.attach(resultHandler);
-        
-        // start background thread            
-        this->thread = new Thread((void (*)(void const *argument))&MQTT::Async<Network, Timer, Thread, Mutex>::threadfn, (void*)this);
+        int i = findOperation(type, id);
+        if (i >= 0)
+            operations[i].type = 0;
     }
-    
-exit:
-    return rc;
-}
 
+    int findOperation(int type, unsigned short id)
+    {
+        for (int i = 0; i < MAX_CONCURRENT_OPERATIONS; ++i)
+        {
+            if (operations[i].type == type && operations[i].id == id)
+                return i;
+        }
+        return -1;
+    }
 
-template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::findFreeOperation()
-{
-	int found = -1;
-	for (int i = 0; i < limits.MAX_CONCURRENT_OPERATIONS; ++i)
-	{
-		if (operations[i].id == 0)
-		{
-			found = i;
-			break;
-		}
-	}
-	return found;
-}
+    // the operation a packet completes: update the subscriptions, then call its result handler
+    void complete(Result& result)
+    {
+        mutex.lock();
+        int i = findOperation(result.type, result.id);
+        if (i < 0)
+        {
+            mutex.unlock();
+            return;     // an answer after the operation timed out
+        }
+        Operation& op = operations[i];
+        if (result.type == SUBACK && result.rc == SUCCESS && !setMessageHandler(op.topicFilter, op.mh))
+            result.rc = FAILURE;    // subscribed, but no handler slot left
+        else if (result.type == UNSUBACK)
+            setMessageHandler(op.topicFilter, messageHandlerFP());
+        resultHandlerFP fp = op.fp;
+        op.type = 0;
+        mutex.unlock();
+        if (fp.attached())
+            fp(result);
+    }
 
+    // remove the oldest operation (only an expired one if expired), false if there is none
+    bool takeOperation(bool expired, Result& result, resultHandlerFP& fp)
+    {
+        int oldest = -1;
+        mutex.lock();
+        for (int i = 0; i < MAX_CONCURRENT_OPERATIONS; ++i)
+        {
+            if (operations[i].type != 0 && (!expired || operations[i].timer.expired()) &&
+                    (oldest < 0 || (int)(operations[i].sequence - operations[oldest].sequence) < 0))
+                oldest = i;
+        }
+        if (oldest >= 0)
+        {
+            result.id = operations[oldest].id;
+            fp = operations[oldest].fp;
+            operations[oldest].type = 0;
+        }
+        mutex.unlock();
+        return oldest >= 0 && (fp.attached() || takeOperation(expired, result, fp));
+    }
 
-template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::subscribe(resultHandler resultHandler, const char* topicFilter, enum QoS qos, messageHandler messageHandler)
-{
-	int index = 0;
-	if (this->thread)
-		index = findFreeOperation();	
-	Timer& atimer = operations[index].timer;
-	
-	atimer.countdown(limits.command_timeout_ms);
-    MQTTString topic = {(char*)topicFilter, 0, 0};
-    
-    int len = MQTTSerialize_subscribe(buf, limits.MAX_MQTT_PACKET_SIZE, 0, packetid.getNext(), 1, &topic, (int*)&qos);
-    int rc = sendPacket(len, atimer.left_ms()); // send the subscribe packet
-	if (rc != len) 
-		goto exit; // there was a problem
-    
-    /* wait for suback */
-    if (resultHandler == 0)
+    // with the mutex held: set (or with an unattached fp remove) the handler of a filter and
+    // rebuild the topic trie, false if it does not fit
+    bool setMessageHandler(const char* topicFilter, messageHandlerFP fp)
     {
-        // this will block
-        if (waitfor(SUBACK, atimer) == SUBACK)
+        int free = -1;
+        for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
         {
-            int count = 0, grantedQoS = -1, mypacketid;
-            if (MQTTDeserialize_suback(&mypacketid, 1, &count, &grantedQoS, readbuf, limits.MAX_MQTT_PACKET_SIZE) == 1)
-                rc = grantedQoS; // 0, 1, 2 or 0x80 
-            if (rc != 0x80)
+            if (messageHandlers[i].topicFilter != 0 && strcmp(messageHandlers[i].topicFilter, topicFilter) == 0)
             {
-            	for (int i = 0; i < limits.MAX_MESSAGE_HANDLERS; ++i)
-				{
-					if (messageHandlers[i].topic == 0)
-					{
-						messageHandlers[i].topic = topicFilter;
-						messageHandlers[i].fp.attach(messageHandler);
-						rc = 0;
-						break;
-					}
-				}
+                free = i;
+                break;
             }
+            if (free < 0 && messageHandlers[i].topicFilter == 0)
+                free = i;
+        }
+        if (!fp.attached())
+        {
+            if (free >= 0 && messageHandlers[free].topicFilter != 0)
+                messageHandlers[free].topicFilter = 0;
+        }
+        else if (free >= 0)
+        {
+            messageHandlers[free].topicFilter = topicFilter;
+            messageHandlers[free].fp = fp;
+        }
+        else
+            return false;
+
+        bool rc = true;
+        topics.clear();
+        for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+        {
+            if (messageHandlers[i].topicFilter != 0 && !topics.insert(messageHandlers[i].topicFilter, i))
+                rc = false;
+        }
+        if (!rc && fp.attached())   // malformed, or more levels than the trie holds
+        {
+            messageHandlers[free].topicFilter = 0;
+            setMessageHandler(topicFilter, messageHandlerFP());
         }
+        return rc;
     }
-    else
+
+    // a QoS 2 message id not seen since its PUBREL, remembered until then; a full table takes it
+    // without remembering
+    bool acceptQoS2(unsigned short id)
     {
-        // set subscribe response callback function
-        
+        int free = -1;
+        for (int i = 0; i < MAX_CONCURRENT_OPERATIONS; ++i)
+        {
+            if (incomingQoS2[i] == id)
+                return false;
+            if (free < 0 && incomingQoS2[i] == 0)
+                free = i;
+        }
+        if (free >= 0)
+            incomingQoS2[free] = id;
+        return true;
     }
-    
-exit:
-    return rc;
-}
 
+    void releaseQoS2(unsigned short id)
+    {
+        for (int i = 0; i < MAX_CONCURRENT_OPERATIONS; ++i)
+        {
+            if (incomingQoS2[i] == id)
+                incomingQoS2[i] = 0;
+        }
+    }
 
-template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::unsubscribe(resultHandler resultHandler, const char* topicFilter)
-{
-	int index = 0;
-	if (this->thread)
-		index = findFreeOperation();	
-	Timer& atimer = operations[index].timer;
-
-	atimer.countdown(limits.command_timeout_ms);
-    MQTTString topic = {(char*)topicFilter, 0, 0};
-    
-    int len = MQTTSerialize_unsubscribe(buf, limits.MAX_MQTT_PACKET_SIZE, 0, packetid.getNext(), 1, &topic);
-    int rc = sendPacket(len, atimer.left_ms()); // send the subscribe packet
-	if (rc != len) 
-		goto exit; // there was a problem
-    
-    // set unsubscribe response callback function
-        
-    
-exit:
-    return rc;
-}
+    Network& ipstack;
+    unsigned long command_timeout_ms;
 
+    Mutex mutex;
+    Thread* receiver;
+    volatile bool running;      // the receive thread is (to be) reading
+    volatile bool connected;    // the broker accepted the CONNECT
 
-   
-template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::publish(resultHandler resultHandler, const char* topicName, Message* message)
-{
-	int index = 0;
-	if (this->thread)
-		index = findFreeOperation();	
-	Timer& atimer = operations[index].timer;
-
-	atimer.countdown(limits.command_timeout_ms);
-    MQTTString topic = {(char*)topicName, 0, 0};
-
-	if (message->qos == QOS1 || message->qos == QOS2)
-		message->id = packetid.getNext();
-    
-	int len = MQTTSerialize_publish(buf, limits.MAX_MQTT_PACKET_SIZE, 0, message->qos, message->retained, message->id, topic, (char*)message->payload, message->payloadlen);
-    int rc = sendPacket(len, atimer.left_ms()); // send the subscribe packet
-	if (rc != len) 
-		goto exit; // there was a problem
-    
-    /* wait for acks */
-    if (resultHandler == 0)
-    {
- 		if (message->qos == QOS1)
-		{
-	        if (waitfor(PUBACK, atimer) == PUBACK)
-    	    {
-    	        int type, dup, mypacketid;
-    	        if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, limits.MAX_MQTT_PACKET_SIZE) == 1)
-    	            rc = 0; 
-    	    }
-		}
-		else if (message->qos == QOS2)
-		{
-	        if (waitfor(PUBCOMP, atimer) == PUBCOMP)
-	   	    {
-	   	    	int type, dup, mypacketid;
-            	if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, limits.MAX_MQTT_PACKET_SIZE) == 1)
-    	           	rc = 0; 
-			}
-
-		}
-    }
-    else
+    unsigned char sendbuf[MAX_MQTT_PACKET_SIZE];
+    unsigned char readbuf[MAX_MQTT_PACKET_SIZE];
+    StreamDecoder<2 * MAX_MQTT_PACKET_SIZE> decoder;
+
+    Timer last_sent, last_received, ping_sent;
+    unsigned int keepAliveInterval;
+    bool ping_outstanding;
+
+    PacketId packetid;
+
+    struct Operation
     {
-        // set publish response callback function
-        
-    }
-    
-exit:
-    return rc;
-}
+        int type;                   // the packet that completes it, 0 for a free slot
+        unsigned short id;
+        unsigned int sequence;      // order of the operations, the oldest fails first
+        resultHandlerFP fp;
+        const char* topicFilter;    // of a subscribe or unsubscribe
+        messageHandlerFP mh;        // of a subscribe, set with the SUBACK
+        Timer timer;                // fails when it expires
+    } operations[MAX_CONCURRENT_OPERATIONS];
+    unsigned int operationCount;
 
+    struct MessageHandlers
+    {
+        const char* topicFilter;
+        messageHandlerFP fp;
+    } messageHandlers[MAX_MESSAGE_HANDLERS];      // Message handlers are indexed by subscription topic
+    TopicTrie<MAX_MESSAGE_HANDLERS * MQTTCLIENT_TOPIC_LEVELS + 1, MAX_MESSAGE_HANDLERS> topics;  // their filters, by level
 
-template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::disconnect(resultHandler resultHandler)
-{  
-    Timer timer = Timer(limits.command_timeout_ms);     // we might wait for incomplete incoming publishes to complete
-    int len = MQTTSerialize_disconnect(buf, limits.MAX_MQTT_PACKET_SIZE);
-    int rc = sendPacket(len, timer.left_ms());   // send the disconnect packet
-    
-    return (rc == len) ? 0 : -1;
-}
+    messageHandlerFP defaultMessageHandler;
+    FP<void, Async&> connectionLost;
 
+    unsigned short incomingQoS2[MAX_CONCURRENT_OPERATIONS];     // received, PUBREL not yet
+};
 
+}
 
-#endif
\ No newline at end of file
+#endif
@@ -28,6 +28,8 @@
 #include "MQTTPacket.h"
 #include <stdio.h>
 #include "MQTTLogging.h"
+#include "MQTTTopicTrie.h"
+#include "MQTTStreamDecoder.h"
 
 #if !defined(MQTTCLIENT_QOS1)
     #define MQTTCLIENT_QOS1 1
@@ -35,6 +37,9 @@
 #if !defined(MQTTCLIENT_QOS2)
     #define MQTTCLIENT_QOS2 0
 #endif
+#if !defined(MQTTCLIENT_TOPIC_LEVELS)
+    #define MQTTCLIENT_TOPIC_LEVELS 8   // topic trie nodes per message handler, shared by all handlers
+#endif
 
 namespace MQTT
 {
@@ -80,6 +85,13 @@ struct subackData
 };
 
 
+struct pubackData
+{
+    int type;           // PUBACK, PUBREC or PUBCOMP
+    unsigned short id;
+};
+
+
 class PacketId
 {
 public:
@@ -115,6 +127,7 @@ class Client
 public:
 
     typedef void (*messageHandler)(MessageData&);
+    typedef void (*ackHandler)(pubackData&);
 
     /** Construct the client
      *  @param network - pointer to an instance of the Network class - must be connected to the endpoint
@@ -140,6 +153,18 @@ public:
      */
     int setMessageHandler(const char* topicFilter, messageHandler mh);
 
+    /** Set the callback for the acknowledgements of publishes sent with publishNoWait - called from
+     *  yield (or any other call that reads the network) with every PUBACK, PUBREC and PUBCOMP
+     *  @param ah - pointer to the callback function.  Set to 0 to remove.
+     */
+    void setAckHandler(ackHandler ah)
+    {
+        if (ah != 0)
+            publishAckHandler.attach(ah);
+        else
+            publishAckHandler.detach();
+    }
+
     /** MQTT Connect - send an MQTT connect packet down the network and wait for a Connack
      *  The nework object must be connected to the network endpoint before calling this
      *  Default connect options are used
@@ -190,6 +215,44 @@ public:
      */
     int publish(const char* topicName, void* payload, size_t payloadlen, unsigned short& id, enum QoS qos = QOS1, bool retained = false);
 
+    /** MQTT Publish without copying the payload - only the fixed header, topic and packet id go through
+     *  sendbuf, the payload is written to the network straight from the caller's memory.  The payload is
+     *  therefore not limited by MAX_MQTT_PACKET_SIZE.
+     *  @param topic - the topic to publish to
+     *  @param payload - the data to send, must stay valid until publishDirect returns
+     *  @param payloadlen - the length of the data
+     *  @param qos - the QoS to send the publish at
+     *  @param retained - whether the message should be retained
+     *  @return success code - a QoS 1 or 2 message is not kept for sending on reconnect, the caller
+     *      publishes it again after a failure
+     */
+    int publishDirect(const char* topicName, const void* payload, size_t payloadlen, enum QoS qos = QOS0, bool retained = false);
+
+    /** MQTT Publish without waiting for the acknowledgement, so several QoS 1 or 2 publishes can be
+     *  in flight.  The payload is written as by publishDirect; the PUBACK (or PUBREC and PUBCOMP)
+     *  is reported to the ack handler later.  The caller keeps the payload until then and, after a
+     *  reconnect, publishes every unacknowledged message again in the original order with the same
+     *  id and dup set.
+     *  @param topic - the topic to publish to
+     *  @param payload - the data to send
+     *  @param payloadlen - the length of the data
+     *  @param id - the packet id to use, 0 takes the next one - returned
+     *  @param qos - the QoS to send the publish at
+     *  @param retained - whether the message should be retained
+     *  @param dup - whether this is a retransmission
+     *  @return success code -
+     */
+    int publishNoWait(const char* topicName, const void* payload, size_t payloadlen, unsigned short& id, enum QoS qos, bool retained = false, bool dup = false);
+
+#if MQTTCLIENT_QOS2
+    /** Send the PUBREL of a QoS 2 publish again after a reconnect, for a message whose PUBREC
+     *  arrived before the connection dropped
+     *  @param id - the packet id of the publish
+     *  @return success code -
+     */
+    int publishRelease(unsigned short id);
+#endif
+
     /** MQTT Subscribe - send an MQTT subscribe packet and wait for the suback
      *  @param topicFilter - a topic pattern which can include wildcards
      *  @param qos - the MQTT QoS to subscribe at
@@ -241,19 +304,23 @@ private:
     int cycle(Timer& timer);
     int waitfor(int packet_type, Timer& timer);
     int keepalive();
-    int publish(int len, Timer& timer, enum QoS qos);
+    int publish(int len, Timer& timer, enum QoS qos, const unsigned char* payload = 0, int payloadlen = 0);
+
+    int serializePublishHeader(const char* topicName, size_t payloadlen, unsigned short id, enum QoS qos, bool retained, bool dup);
+    void notifyAck(int packet_type);
 
-    int decodePacket(int* value, int timeout);
     int readPacket(Timer& timer);
-    int sendPacket(int length, Timer& timer);
+    int sendBuffer(const unsigned char* buf, int length, Timer& timer);
+    int sendPacket(int length, Timer& timer, const unsigned char* payload = 0, int payloadlen = 0);
     int deliverMessage(MQTTString& topicName, Message& message);
-    bool isTopicMatched(char* topicFilter, MQTTString& topicName);
+    bool indexTopics();
 
     Network& ipstack;
     unsigned long command_timeout_ms;
 
     unsigned char sendbuf[MAX_MQTT_PACKET_SIZE];
     unsigned char readbuf[MAX_MQTT_PACKET_SIZE];
+    StreamDecoder<2 * MAX_MQTT_PACKET_SIZE> decoder;  // what the socket delivered, split into packets for readbuf
 
     Timer last_sent, last_received;
     unsigned int keepAliveInterval;
@@ -267,8 +334,10 @@ private:
         const char* topicFilter;
         FP<void, MessageData&> fp;
     } messageHandlers[MAX_MESSAGE_HANDLERS];      // Message handlers are indexed by subscription topic
+    TopicTrie<MAX_MESSAGE_HANDLERS * MQTTCLIENT_TOPIC_LEVELS + 1, MAX_MESSAGE_HANDLERS> topics;  // their filters, by level
 
     FP<void, MessageData&> defaultMessageHandler;
+    FP<void, pubackData&> publishAckHandler;
 
     bool isconnected;
 
@@ -300,6 +369,7 @@ void MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::cleanSession()
 {
     for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
         messageHandlers[i].topicFilter = 0;
+    topics.clear();
 
 #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
     inflightMsgid = 0;
@@ -377,21 +447,32 @@ void MQTT::Client<Network, Timer, a, b>::freeQoS2msgid(unsigned short id)
 
 
 template<class Network, class Timer, int a, int b>
-int MQTT::Client<Network, Timer, a, b>::sendPacket(int length, Timer& timer)
+int MQTT::Client<Network, Timer, a, b>::sendBuffer(const unsigned char* buf, int length, Timer& timer)
 {
-    int rc = FAILURE,
+    int rc,
         sent = 0;
 
     while (sent < length)
     {
-        rc = ipstack.write(&sendbuf[sent], length - sent, timer.left_ms());
+        rc = ipstack.write((unsigned char*)&buf[sent], length - sent, timer.left_ms());
         if (rc < 0)  // there was an error writing the data
             break;
         sent += rc;
         if (timer.expired()) // only check expiry after at least one attempt to write
             break;
     }
-    if (sent == length)
+    return sent;
+}
+
+
+// the packet in sendbuf, followed by a payload from elsewhere if there is one
+template<class Network, class Timer, int a, int b>
+int MQTT::Client<Network, Timer, a, b>::sendPacket(int length, Timer& timer, const unsigned char* payload, int payloadlen)
+{
+    int rc = FAILURE;
+
+    if (sendBuffer(sendbuf, length, timer) == length &&
+        (payloadlen == 0 || sendBuffer(payload, payloadlen, timer) == payloadlen))
     {
         if (this->keepAliveInterval > 0)
             last_sent.countdown(this->keepAliveInterval); // record the fact that we have successfully sent the packet
@@ -409,68 +490,39 @@ int MQTT::Client<Network, Timer, a, b>::sendPacket(int length, Timer& timer)
 }
 
 
-template<class Network, class Timer, int a, int b>
-int MQTT::Client<Network, Timer, a, b>::decodePacket(int* value, int timeout)
-{
-    unsigned char c;
-    int multiplier = 1;
-    int len = 0;
-    const int MAX_NO_OF_REMAINING_LENGTH_BYTES = 4;
-
-    *value = 0;
-    do
-    {
-        int rc = MQTTPACKET_READ_ERROR;
-
-        if (++len > MAX_NO_OF_REMAINING_LENGTH_BYTES)
-        {
-            rc = MQTTPACKET_READ_ERROR; /* bad data */
-            goto exit;
-        }
-        rc = ipstack.read(&c, 1, timeout);
-        if (rc != 1)
-            goto exit;
-        *value += (c & 127) * multiplier;
-        multiplier *= 128;
-    } while ((c & 128) != 0);
-exit:
-    return len;
-}
-
-
 /**
  * If any read fails in this method, then we should disconnect from the network, as on reconnect
  * the packets can be retried.
- * @param timeout the max time to wait for the packet read to complete, in milliseconds
+ * A packet already in the decoder comes first. Otherwise the socket is read, whatever it has in
+ * one go, until a packet is complete or the timer expires; the bytes of a packet cut off by the
+ * timer stay in the decoder for the next call.
+ * @param timer when to give up waiting for a packet
  * @return the MQTT packet type, 0 if none, -1 if error
  */
 template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
 int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::readPacket(Timer& timer)
 {
-    int rc = FAILURE;
+    int rc = 0;
     MQTTHeader header = {0};
     int len = 0;
-    int rem_len = 0;
-
-    /* 1. read the header byte.  This has the packet type in it */
-    rc = ipstack.read(readbuf, 1, timer.left_ms());
-    if (rc != 1)
-        goto exit;
-
-    len = 1;
-    /* 2. read the remaining length.  This is variable in itself */
-    decodePacket(&rem_len, timer.left_ms());
-    len += MQTTPacket_encode(readbuf + 1, rem_len); /* put the original remaining length into the buffer */
 
-    if (rem_len > (MAX_MQTT_PACKET_SIZE - len))
+    while ((len = decoder.next(readbuf, MAX_MQTT_PACKET_SIZE)) == 0)
     {
-        rc = BUFFER_OVERFLOW;
-        goto exit;
+        int room = 0;
+        unsigned char* to = decoder.space(&room);
+        int got = ipstack.readSome(to, room, timer.left_ms());
+        if (got <= 0)
+        {
+            rc = (got < 0) ? FAILURE : 0;
+            goto exit;
+        }
+        decoder.commit(got);
     }
-
-    /* 3. read the rest of the buffer using a callback to supply the rest of the data */
-    if (rem_len > 0 && (ipstack.read(readbuf + len, rem_len, timer.left_ms()) != rem_len))
+    if (len < 0)
+    {
+        rc = (len == MQTTPACKET_BUFFER_TOO_SHORT) ? BUFFER_OVERFLOW : FAILURE;
         goto exit;
+    }
 
     header.byte = readbuf[0];
     rc = header.bits.type;
@@ -490,35 +542,18 @@ exit:
 }
 
 
-// assume topic filter and name is in correct format
-// # can only be at end
-// + and # can only be next to separator
-template<class Network, class Timer, int a, int b>
-bool MQTT::Client<Network, Timer, a, b>::isTopicMatched(char* topicFilter, MQTTString& topicName)
+// rebuild the topic trie from the message handlers, false if a filter did not fit in or is malformed
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
+bool MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::indexTopics()
 {
-    char* curf = topicFilter;
-    char* curn = topicName.lenstring.data;
-    char* curn_end = curn + topicName.lenstring.len;
-
-    while (*curf && curn < curn_end)
+    bool rc = true;
+    topics.clear();
+    for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
     {
-        if (*curn == '/' && *curf != '/')
-            break;
-        if (*curf != '+' && *curf != '#' && *curf != *curn)
-            break;
-        if (*curf == '+')
-        {   // skip until we meet the next separator, or end of string
-            char* nextpos = curn + 1;
-            while (nextpos < curn_end && *nextpos != '/')
-                nextpos = ++curn + 1;
-        }
-        else if (*curf == '#')
-            curn = curn_end - 1;    // skip until end of string
-        curf++;
-        curn++;
-    };
-
-    return (curn == curn_end) && (*curf == '\0');
+        if (messageHandlers[i].topicFilter != 0 && !topics.insert(messageHandlers[i].topicFilter, i))
+            rc = false;
+    }
+    return rc;
 }
 
 
@@ -527,13 +562,17 @@ template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
 int MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::deliverMessage(MQTTString& topicName, Message& message)
 {
     int rc = FAILURE;
+    const char* name = topicName.cstring ? topicName.cstring : topicName.lenstring.data;
+    int len = topicName.cstring ? strlen(topicName.cstring) : topicName.lenstring.len;
 
-    // we have to find the right message handler - indexed by topic
-    for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    // one walk over the topic levels finds the handlers, which then run in slot order
+    bool matched[MAX_MESSAGE_HANDLERS] = {};
+    int found = topics.match(name, len, matched);
+    for (int i = 0; found > 0 && i < MAX_MESSAGE_HANDLERS; ++i)
     {
-        if (messageHandlers[i].topicFilter != 0 && (MQTTPacket_equals(&topicName, (char*)messageHandlers[i].topicFilter) ||
-                isTopicMatched((char*)messageHandlers[i].topicFilter, topicName)))
+        if (matched[i])
         {
+            --found;
             if (messageHandlers[i].fp.attached())
             {
                 MessageData md(topicName, message);
@@ -562,7 +601,8 @@ int MQTT::Client<Network, Timer, a, b>::yield(unsigned long timeout_ms)
     Timer timer;
 
     timer.countdown_ms(timeout_ms);
-    while (!timer.expired())
+    // packets that came in with the last read are handled now, the socket will not signal them again
+    while (!timer.expired() || decoder.ready())
     {
         if (cycle(timer) < 0)
         {
@@ -593,8 +633,11 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
         case 0: // timed out reading packet
             break;
         case CONNACK:
-        case PUBACK:
         case SUBACK:
+        case UNSUBACK:
+            break;
+        case PUBACK:
+            notifyAck(packet_type);
             break;
         case PUBLISH:
         {
@@ -652,9 +695,12 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
                 goto exit; // there was a problem
             if (packet_type == PUBREL)
                 freeQoS2msgid(mypacketid);
+            else
+                notifyAck(packet_type);
             break;
 
         case PUBCOMP:
+            notifyAck(packet_type);
             break;
 #endif
         case PINGRESP:
@@ -739,6 +785,7 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_co
 
     this->keepAliveInterval = options.keepAliveInterval;
     this->cleansession = options.cleansession;
+    decoder.reset();    // a new connection, nothing left of the last one
     if ((len = MQTTSerialize_connect(sendbuf, MAX_MQTT_PACKET_SIZE, &options)) <= 0)
         goto exit;
     if ((rc = sendPacket(len, connect_timer)) != SUCCESS)  // send the connect packet
@@ -760,6 +807,9 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_co
     else
         rc = FAILURE;
 
+    if (rc != SUCCESS)
+        goto exit; // no session to resend into
+
 #if MQTTCLIENT_QOS2
     // resend any inflight publish
     if (inflightMsgid > 0 && inflightQoS == QOS2 && pubrel)
@@ -775,6 +825,7 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_co
     if (inflightMsgid > 0)
     {
         memcpy(sendbuf, pubbuf, MAX_MQTT_PACKET_SIZE);
+        sendbuf[0] |= 0x08; // DUP: the broker may have seen it before
         rc = publish(inflightLen, connect_timer, inflightQoS);
     }
 #endif
@@ -820,6 +871,7 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::se
             {
                 messageHandlers[i].topicFilter = 0;
                 messageHandlers[i].fp.detach();
+                indexTopics();
             }
             rc = SUCCESS; // return i when adding new subscription
             break;
@@ -842,6 +894,13 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::se
         {
             messageHandlers[i].topicFilter = topicFilter;
             messageHandlers[i].fp.attach(messageHandler);
+            if (!indexTopics()) // malformed, or more levels than the trie holds
+            {
+                messageHandlers[i].topicFilter = 0;
+                messageHandlers[i].fp.detach();
+                indexTopics();
+                rc = FAILURE;
+            }
         }
     }
     return rc;
@@ -931,11 +990,11 @@ exit:
 
 
 template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(int len, Timer& timer, enum QoS qos)
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(int len, Timer& timer, enum QoS qos, const unsigned char* payload, int payloadlen)
 {
     int rc;
 
-    if ((rc = sendPacket(len, timer)) != SUCCESS) // send the publish packet
+    if ((rc = sendPacket(len, timer, payload, payloadlen)) != SUCCESS) // send the publish packet
         goto exit; // there was a problem
 
 #if MQTTCLIENT_QOS1
@@ -1021,6 +1080,124 @@ exit:
 }
 
 
+// the fixed header, topic and packet id of a publish into sendbuf, the payload follows separately
+// @return the length, or FAILURE if the header does not fit
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::serializePublishHeader(const char* topicName, size_t payloadlen, unsigned short id, enum QoS qos, bool retained, bool dup)
+{
+    MQTTString topicString = MQTTString_initializer;
+    MQTTHeader header = {0};
+    unsigned char* ptr = sendbuf;
+    size_t rem_len = 0;
+
+    topicString.cstring = (char*)topicName;
+    rem_len = 2 + MQTTstrlen(topicString) + payloadlen;
+    if (qos > 0)
+        rem_len += 2;
+    // the header has to fit into sendbuf, the payload only into an MQTT remaining length
+    if (rem_len > 268435455 || 5 + rem_len - payloadlen > MAX_MQTT_PACKET_SIZE)
+        return FAILURE;
+
+    header.bits.type = PUBLISH;
+    header.bits.dup = dup;
+    header.bits.qos = qos;
+    header.bits.retain = retained;
+    writeChar(&ptr, header.byte);
+    ptr += MQTTPacket_encode(ptr, rem_len);
+    writeMQTTString(&ptr, topicString);
+    if (qos > 0)
+        writeInt(&ptr, id);
+    return ptr - sendbuf;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+void MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::notifyAck(int packet_type)
+{
+    pubackData data;
+    unsigned char dup, type;
+
+    if (publishAckHandler.attached() &&
+        MQTTDeserialize_ack(&type, &dup, &data.id, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
+    {
+        data.type = packet_type;
+        publishAckHandler(data);
+    }
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publishDirect(const char* topicName, const void* payload, size_t payloadlen, enum QoS qos, bool retained)
+{
+    int rc = FAILURE;
+    Timer timer(command_timeout_ms);
+    unsigned short id = 0;
+    int len = 0;
+
+    if (!isconnected)
+        goto exit;
+
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    if (qos == QOS1 || qos == QOS2)
+        id = packetid.getNext();
+#endif
+
+    if ((len = serializePublishHeader(topicName, payloadlen, id, qos, retained, false)) <= 0)
+        goto exit;
+
+    rc = publish(len, timer, qos, (const unsigned char*)payload, payloadlen);
+exit:
+    return rc;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publishNoWait(const char* topicName, const void* payload, size_t payloadlen, unsigned short& id, enum QoS qos, bool retained, bool dup)
+{
+    int rc = FAILURE;
+    Timer timer(command_timeout_ms);
+    int len = 0;
+
+    if (!isconnected)
+        goto exit;
+
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    if (id == 0 && (qos == QOS1 || qos == QOS2))
+        id = packetid.getNext();
+#endif
+
+    if ((len = serializePublishHeader(topicName, payloadlen, id, qos, retained, dup)) <= 0)
+        goto exit;
+
+    if ((rc = sendPacket(len, timer, (const unsigned char*)payload, payloadlen)) != SUCCESS)
+        closeSession();
+exit:
+    return rc;
+}
+
+
+#if MQTTCLIENT_QOS2
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publishRelease(unsigned short id)
+{
+    int rc = FAILURE;
+    Timer timer(command_timeout_ms);
+    int len = 0;
+
+    if (!isconnected)
+        goto exit;
+
+    if ((len = MQTTSerialize_ack(sendbuf, MAX_MQTT_PACKET_SIZE, PUBREL, 0, id)) <= 0)
+        goto exit;
+
+    if ((rc = sendPacket(len, timer)) != SUCCESS)
+        closeSession();
+exit:
+    return rc;
+}
+#endif
+
+
 template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
 int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(const char* topicName, void* payload, size_t payloadlen, enum QoS qos, bool retained)
 {
@@ -0,0 +1,191 @@
+#if !defined(MQTTSTREAMDECODER_H)
+#define MQTTSTREAMDECODER_H
+
+#include <string.h>
+#include "MQTTPacket.h"
+
+namespace MQTT
+{
+
+/**
+ * @class StreamDecoder
+ * @brief splits the bytes of an MQTT connection into packets, however the socket delivers them
+ *
+ * The bytes go into a ring of RING_SIZE, straight from the socket through space() and commit(), or
+ * copied in with feed(). next() hands out one complete packet at a time. The fixed header is
+ * decoded as its bytes come in and remembered between calls, so a packet may arrive in any
+ * number of pieces and the bytes of the next packet may follow in the same piece.
+ *
+ * A packet longer than the caller's buffer (or the ring) is reported once and its bytes are
+ * dropped as they arrive, the packets after it are decoded as usual. A remaining length of more
+ * than 4 bytes breaks the stream: next() keeps failing until reset().
+ *
+ * @param RING_SIZE bytes buffered, at least the longest packet to be decoded
+ */
+template<int RING_SIZE>
+class StreamDecoder
+{
+public:
+
+    StreamDecoder()
+    {
+        reset();
+    }
+
+    /** Forget the buffered bytes, for a new connection */
+    void reset()
+    {
+        start = count = 0;
+        skip = 0;
+        restart();
+        broken = false;
+    }
+
+    /** Where the next bytes from the socket go
+     *  @param len - set to the free bytes there, 0 if the ring is full
+     *  @return the first free byte
+     */
+    unsigned char* space(int* len)
+    {
+        int end = (start + count) % RING_SIZE;
+        *len = (end >= start && count < RING_SIZE) ? RING_SIZE - end : RING_SIZE - count;
+        return ring + end;
+    }
+
+    /** Take len bytes written into space() */
+    void commit(int len)
+    {
+        count += len;
+    }
+
+    /** Copy bytes in
+     *  @return the number taken, less than len if the ring is full
+     */
+    int feed(const unsigned char* data, int len)
+    {
+        int done = 0;
+        while (done < len)
+        {
+            int room;
+            unsigned char* to = space(&room);
+            if (room == 0)
+                break;
+            if (room > len - done)
+                room = len - done;
+            memcpy(to, data + done, room);
+            commit(room);
+            done += room;
+        }
+        return done;
+    }
+
+    /** The next complete packet
+     *  @param buf - where to copy it
+     *  @param buflen - its size
+     *  @return the packet length, 0 if it has not arrived completely,
+     *      MQTTPACKET_BUFFER_TOO_SHORT if it is longer than buflen (it is skipped),
+     *      MQTTPACKET_READ_ERROR if the remaining length is malformed
+     */
+    int next(unsigned char* buf, int buflen)
+    {
+        int rc = parse();
+        if (rc <= 0)
+            return rc;
+        if (total > buflen || total > RING_SIZE)
+        {
+            skip = total;
+            restart();
+            drop();
+            return MQTTPACKET_BUFFER_TOO_SHORT;
+        }
+        if (count < total)
+            return 0;
+        int first = RING_SIZE - start;
+        if (first >= total)
+            memcpy(buf, ring + start, total);
+        else
+        {
+            memcpy(buf, ring + start, first);
+            memcpy(buf + first, ring, total - first);
+        }
+        rc = total;
+        consume(total);
+        restart();
+        return rc;
+    }
+
+    /** Whether next() has something to say without more bytes: a packet, or an error */
+    bool ready()
+    {
+        int rc = parse();
+        return rc < 0 || (rc > 0 && (count >= total || total > RING_SIZE));
+    }
+
+    /** Bytes in the ring */
+    int buffered() const
+    {
+        return count;
+    }
+
+private:
+
+    // decode the fixed header as far as the bytes go: 1 once the length of
+    // the packet is known, 0 for more bytes, or MQTTPACKET_READ_ERROR
+    int parse()
+    {
+        if (broken)
+            return MQTTPACKET_READ_ERROR;
+        drop();
+        while (total == 0 && parsed < count)
+        {
+            unsigned char c = ring[(start + parsed++) % RING_SIZE];
+            if (parsed == 1)
+                continue;               // the packet type
+            length += (c & 127) * multiplier;
+            multiplier *= 128;
+            if ((c & 128) == 0)
+                total = parsed + length;
+            else if (parsed == 5)       // more than 4 bytes of remaining length
+            {
+                broken = true;
+                return MQTTPACKET_READ_ERROR;
+            }
+        }
+        return (total > 0) ? 1 : 0;
+    }
+
+    // throw away what arrived of a skipped packet
+    void drop()
+    {
+        int n = (skip < count) ? skip : count;
+        consume(n);
+        skip -= n;
+    }
+
+    void consume(int len)
+    {
+        count -= len;
+        start = (count == 0) ? 0 : (start + len) % RING_SIZE;   // an empty ring takes the longest piece
+    }
+
+    // header state for the next packet
+    void restart()
+    {
+        parsed = length = total = 0;
+        multiplier = 1;
+    }
+
+    unsigned char ring[RING_SIZE];
+    int start;          // the oldest byte
+    int count;          // bytes buffered
+    int parsed;         // header bytes of the current packet decoded
+    int length;         // its remaining length so far
+    int multiplier;
+    int total;          // header and remaining length, 0 until known
+    int skip;           // bytes of a too long packet still to drop
+    bool broken;
+};
+
+}
+
+#endif
@@ -0,0 +1,210 @@
+#if !defined(MQTTTOPICTRIE_H)
+#define MQTTTOPICTRIE_H
+
+#include <string.h>
+
+namespace MQTT
+{
+
+/**
+ * @class TopicTrie
+ * @brief subscription topic filters indexed by topic level, for matching a topic name in one pass
+ *
+ * Every node stands for one level of a filter: a literal level, or a '+' that matches any one level.
+ * A node remembers the filter that ends there and the filter that continues with '#' there, so a
+ * topic name is matched by walking its levels once, following the literal child and the '+' child
+ * of every node still in the race. Filters are stored by pointer and must outlive the trie.
+ *
+ * Matching follows the MQTT 3.1.1 rules: "a/#" also matches "a", and a topic name starting with '$'
+ * is not matched by a filter starting with a wildcard.
+ *
+ * @param MAX_NODES the node pool, the levels of all filters together (plus one for the root)
+ * @param MAX_FILTERS the largest filter id + 1
+ */
+template<int MAX_NODES, int MAX_FILTERS>
+class TopicTrie
+{
+public:
+
+    TopicTrie()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        used = 1;
+        reset(0, 0, 0);
+    }
+
+    /** Add a filter
+     *  @param filter - the topic filter, with wildcards, kept by pointer
+     *  @param id - what match reports for it, 0 to MAX_FILTERS - 1
+     *  @return false if the filter is malformed or the node pool is used up; the trie may keep
+     *      nodes for a prefix of the filter then, clear() and insert again to reclaim them
+     */
+    bool insert(const char* filter, int id)
+    {
+        if (id < 0 || id >= MAX_FILTERS || filter == 0 || *filter == '\0')
+            return false;
+        short node = 0;
+        const char* level = filter;
+        while (true)
+        {
+            const char* end = level;
+            while (*end && *end != '/')
+                ++end;
+            int len = end - level;
+            if (len == 1 && *level == '#')
+            {
+                if (*end != '\0') // '#' only as the last level
+                    return false;
+                nodes[node].hash = id;
+                return true;
+            }
+            if (memchr(level, '#', len) || (len > 1 && memchr(level, '+', len)))
+                return false;     // wildcards only as a whole level
+            short next;
+            if (len == 1 && *level == '+')
+            {
+                if (nodes[node].plus < 0 && (nodes[node].plus = add(level, 1)) < 0)
+                    return false;
+                next = nodes[node].plus;
+            }
+            else
+            {
+                next = literal(node, level, len);
+                if (next < 0)
+                {
+                    if ((next = add(level, len)) < 0)
+                        return false;
+                    nodes[next].sibling = nodes[node].child;
+                    nodes[node].child = next;
+                }
+            }
+            node = next;
+            if (*end == '\0')
+                break;
+            level = end + 1;
+        }
+        nodes[node].end = id;
+        return true;
+    }
+
+    /** Find the filters that match a topic name
+     *  @param topic - the topic name, no wildcards
+     *  @param len - its length
+     *  @param matched - set to true for the id of every matching filter, the rest is left alone
+     *  @return the number of matching filters
+     */
+    int match(const char* topic, int len, bool* matched) const
+    {
+        short active[2][MAX_NODES];
+        int count = 1, found = 0;
+        int current = 0;
+        active[0][0] = 0;
+        // a '$' topic is not matched by a wildcard in the first level
+        bool system = len > 0 && topic[0] == '$';
+
+        const char* level = topic;
+        const char* topic_end = topic + len;
+        for (int depth = 0; count > 0; ++depth)
+        {
+            const char* end = level;
+            while (end < topic_end && *end != '/')
+                ++end;
+            int level_len = end - level;
+            bool wildcards = !(system && depth == 0);
+
+            int next_count = 0;
+            short* next = active[current ^ 1];
+            for (int i = 0; i < count; ++i)
+            {
+                const Node& node = nodes[active[current][i]];
+                if (node.hash >= 0 && wildcards)
+                    found += hit(node.hash, matched);
+                short child = literal(active[current][i], level, level_len);
+                if (child >= 0)
+                    next[next_count++] = child;
+                if (node.plus >= 0 && wildcards)
+                    next[next_count++] = node.plus;
+            }
+            current ^= 1;
+            count = next_count;
+            if (end == topic_end)
+                break;
+            level = end + 1;
+        }
+
+        // the nodes that took the last level: filters ending there, and "<filter>/#"
+        for (int i = 0; i < count; ++i)
+        {
+            const Node& node = nodes[active[current][i]];
+            if (node.end >= 0)
+                found += hit(node.end, matched);
+            if (node.hash >= 0)
+                found += hit(node.hash, matched);
+        }
+        return found;
+    }
+
+    /** Nodes in use, the root included */
+    int size() const
+    {
+        return used;
+    }
+
+private:
+
+    struct Node
+    {
+        const char* level;      // into the filter string, not terminated
+        unsigned short len;
+        short child;            // first literal child, -1 for none
+        short sibling;          // next literal child of the parent
+        short plus;             // the '+' child
+        short end;              // filter ending at this node, -1 for none
+        short hash;             // filter ending with '#' after this node
+    };
+
+    void reset(short n, const char* level, int len)
+    {
+        Node& node = nodes[n];
+        node.level = level;
+        node.len = len;
+        node.child = node.sibling = node.plus = node.end = node.hash = -1;
+    }
+
+    short add(const char* level, int len)
+    {
+        if (used == MAX_NODES)
+            return -1;
+        reset(used, level, len);
+        return used++;
+    }
+
+    short literal(short parent, const char* level, int len) const
+    {
+        for (short c = nodes[parent].child; c >= 0; c = nodes[c].sibling)
+        {
+            if (nodes[c].len == len && memcmp(nodes[c].level, level, len) == 0)
+                return c;
+        }
+        return -1;
+    }
+
+    static int hit(short id, bool* matched)
+    {
+        if (matched[id])
+            return 0;
+        matched[id] = true;
+        return 1;
+    }
+
+    Node nodes[MAX_NODES];
+    short used;
+};
+
+}
+
+#endif
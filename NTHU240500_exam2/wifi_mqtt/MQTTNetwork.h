@@ -3,9 +3,21 @@
 
 #include "NetworkInterface.h"
 
+// TCP transport for MQTT::Client on a non-blocking socket.
+//
+// The socket's sigio callback sets kSocketEvent, so a read or write that
+// would block sleeps on the event flags until the socket changes or the
+// timeout passes instead of polling. The flags may be shared with the
+// caller (events in the constructor): the network thread then sleeps on
+// kSocketEvent together with its own bits and wakes on whichever comes
+// first.
 class MQTTNetwork {
 public:
-    MQTTNetwork(NetworkInterface* aNetwork) : network(aNetwork) {
+    // Set by sigio, leaves bits 0-7 to the owner of shared flags
+    static constexpr uint32_t kSocketEvent = 1u << 8;
+
+    MQTTNetwork(NetworkInterface* aNetwork, EventFlags* aEvents = nullptr)
+        : network(aNetwork), events(aEvents ? aEvents : &own_events) {
         printf("MQTTNetwork: Constuct MQTTNetwork\n");
         socket = new TCPSocket();
     }
@@ -14,19 +26,32 @@ public:
         delete socket;
     }
 
+    // The client expects both to give up after timeout ms: 0 bytes is a
+    // timeout it retries, -1 a connection it has to drop
     int read(unsigned char* buffer, int len, int timeout) {
-        return socket->recv(buffer, len);
+        return transfer(buffer, len, timeout, true, false);
+    }
+
+    // Up to len bytes, returns as soon as any arrived: the count, 0 on a
+    // timeout, -1 for a connection to drop
+    int readSome(unsigned char* buffer, int len, int timeout) {
+        return transfer(buffer, len, timeout, true, true);
     }
 
     int write(unsigned char* buffer, int len, int timeout) {
-        return socket->send(buffer, len);
+        return transfer(buffer, len, timeout, false, false);
     }
 
     int connect(const SocketAddress &address)  {//, int port) {
         //printf("TCP open flag\n");
         socket->open(network);
+        socket->sigio(callback(this, &MQTTNetwork::signal));
+        // blocking until the broker accepts, non-blocking from then on
+        socket->set_timeout(kConnectTimeoutMs);
         //printf("TCP connect flag\n");
-        return socket->connect(address); //, port);
+        int rc = socket->connect(address); //, port);
+        socket->set_blocking(false);
+        return rc;
     }
 
     int disconnect() {
@@ -34,8 +59,43 @@ public:
     }
 
 private:
+    static constexpr int kConnectTimeoutMs = 10000;
+    // Longest sleep between two attempts, in case a driver misses a sigio
+    static constexpr int kMaxWaitMs = 100;
+
+    // Socket readable, writable or closed; from the driver's context
+    void signal() {
+        events->set(kSocketEvent);
+    }
+
+    // Move up to len bytes before the timeout (or the first ones, partial),
+    // returns the count or -1
+    int transfer(unsigned char* buffer, int len, int timeout, bool read, bool partial) {
+        Timer timer;
+        timer.start();
+        int done = 0;
+        while (done < len && !(partial && done > 0)) {
+            int rc = read ? socket->recv(buffer + done, len - done)
+                          : socket->send(buffer + done, len - done);
+            // a send that took nothing waits for room like one that would block
+            if (rc == NSAPI_ERROR_WOULD_BLOCK || (!read && rc == 0)) {
+                int left = timeout - (int)timer.read_ms();
+                if (left <= 0)
+                    break;
+                events->wait_any(kSocketEvent, left < kMaxWaitMs ? left : kMaxWaitMs);
+                continue;
+            }
+            if (rc < 0 || (read && rc == 0)) // error, or closed by the broker
+                return -1;
+            done += rc;
+        }
+        return done;
+    }
+
     NetworkInterface* network;
     TCPSocket* socket;
+    EventFlags own_events;
+    EventFlags* events;
 };
 
-#endif // _MQTTNETWORK_H_
\ No newline at end of file
+#endif // _MQTTNETWORK_H_